@@ -0,0 +1,71 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPLv2
+# Copyright(c) 2020 Itsuro Oda
+#
+# compare results of run.sh with a baseline.
+#
+#	usage: compare.sh baseline.json results.json [threshold-percent]
+#
+# fails if the tput of a metric is lower, or its p99 higher, than the
+# baseline by more than the threshold (default 10%). metrics only in
+# one of the files are reported but do not fail.
+
+set -u
+
+base=${1:?usage: compare.sh baseline.json results.json [threshold]}
+cur=${2:?usage: compare.sh baseline.json results.json [threshold]}
+th=${3:-10}
+
+if [ ! -f "$base" ]; then
+	echo "compare.sh: no baseline $base (make baseline)" >&2
+	exit 1
+fi
+
+awk -v th="$th" '
+# "key": {"tput": X, "p99": Y}
+function parse(line, r) {
+	if (match(line, /"[^"]+": \{"tput": [-0-9.e+]+, "p99": [-0-9.e+]+\}/) == 0)
+		return 0
+	line = substr(line, RSTART, RLENGTH)
+	gsub(/[{}":,]/, " ", line)
+	split(line, r, " ")
+	return 1
+}
+FNR == 1 { file++ }
+{
+	if (!parse($0, r))
+		next
+	if (file == 1) {
+		bt[r[1]] = r[3]; bp[r[1]] = r[5]; order[++n] = r[1]
+	} else {
+		ct[r[1]] = r[3]; cp[r[1]] = r[5]
+	}
+}
+END {
+	printf "%-28s %12s %12s %7s %10s %10s %7s\n", "metric", "tput base",
+		"tput now", "diff", "p99 base", "p99 now", "diff"
+	for (i = 1; i <= n; i++) {
+		k = order[i]
+		if (!(k in ct)) {
+			printf "%-28s missing\n", k
+			continue
+		}
+		dt = bt[k] > 0 ? (ct[k] - bt[k]) * 100 / bt[k] : 0
+		dp = bp[k] > 0 ? (cp[k] - bp[k]) * 100 / bp[k] : 0
+		mark = ""
+		if (dt < -th || dp > th) {
+			mark = "  REGRESSION"
+			bad++
+		}
+		printf "%-28s %12.2f %12.2f %+6.1f%% %10.2f %10.2f %+6.1f%%%s\n",
+			k, bt[k], ct[k], dt, bp[k], cp[k], dp, mark
+	}
+	for (k in ct) {
+		if (!(k in bt))
+			printf "%-28s new\n", k
+	}
+	if (bad > 0) {
+		printf "%d regression(s) beyond %s%%\n", bad, th
+		exit 1
+	}
+}' "$base" "$cur"
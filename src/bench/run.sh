@@ -0,0 +1,214 @@
+#!/bin/sh
+# SPDX-License-Identifier: GPLv2
+# Copyright(c) 2020 Itsuro Oda
+#
+# run the standard benchmark matrix of rpp, rpp_e and rpp_h over a
+# software RDMA device and write the results to a JSON file.
+#
+#	usage: run.sh results.json
+#
+# environment:
+#	NETDEV	network device for rxe (the first rxe link if not set)
+#	QUICK	1: fewer operations, for a smoke test
+#
+# every metric is one line {"tput": ..., "p99": ...} so that compare.sh
+# can read it with awk. tput is higher-is-better, p99 (usec) is
+# lower-is-better.
+
+set -u
+
+out=${1:?usage: run.sh results.json}
+top=$(cd "$(dirname "$0")/.." && pwd)
+rpp=$top/rpp/rpp
+rpp_e=$top/rpp_e/rpp_e
+rpp_h=$top/rpp_h/rpp_h
+port=18515
+tmp=$(mktemp -d /tmp/rpp_bench.XXXXXX)
+metrics=$tmp/metrics
+failed=0
+server=
+
+if [ "${QUICK:-0}" = 1 ]; then
+	n_lat=2000; n_bw=500; n_conn=100; n_scale=2000; runs=5
+else
+	n_lat=20000; n_bw=5000; n_conn=1000; n_scale=20000; runs=20
+fi
+
+cleanup() {
+	if [ -n "$server" ]; then
+		kill -INT "$server" 2>/dev/null
+		wait "$server" 2>/dev/null
+	fi
+	rm -rf "$tmp"
+}
+trap cleanup EXIT
+trap 'exit 1' INT TERM
+
+# the rxe link to use, made on NETDEV if there is none
+setup_rxe() {
+	if [ -z "${NETDEV:-}" ]; then
+		NETDEV=$(rdma link show 2>/dev/null |
+			sed -n 's/.* netdev \([^ ]*\).*/\1/p' | head -1)
+	elif ! rdma link show 2>/dev/null | grep -qw "netdev $NETDEV"; then
+		echo "run.sh: adding rxe link on $NETDEV" >&2
+		rdma link add rpp_rxe type rxe netdev "$NETDEV" || return 1
+	fi
+	if [ -z "$NETDEV" ]; then
+		echo "run.sh: no RDMA link, set NETDEV" >&2
+		return 1
+	fi
+	addr=$(ip -4 -o addr show dev "$NETDEV" |
+		awk '{ sub("/.*", "", $4); print $4; exit }')
+	if [ -z "$addr" ]; then
+		echo "run.sh: no IPv4 address on $NETDEV" >&2
+		return 1
+	fi
+}
+
+# metric key tput p99
+metric() {
+	if [ -z "$2" ] || [ -z "$3" ]; then
+		echo "run.sh: $1: no result" >&2
+		failed=1
+		return
+	fi
+	echo "$1 $2 $3" >> "$metrics"
+}
+
+now_ns() {
+	date +%s%N
+}
+
+# rate (per sec) and p99 of a list of usec, one a line
+summarize() {
+	sort -n | awk '{ v[NR] = $1; sum += $1 }
+	END {
+		if (NR == 0) exit
+		i = int(NR * 0.99) + 1; if (i > NR) i = NR
+		printf "%.1f %.2f\n", 1e6 / (sum / NR), v[i]
+	}'
+}
+
+# rpp and rpp_e: one READ/WRITE exchange a run, timed at the client
+bench_exchange() {
+	name=$1 bin=$2
+	: > "$tmp/$name.us"
+	i=0
+	while [ $i -lt $runs ]; do
+		$bin -s "$addr" > /dev/null 2>&1 &
+		pid=$!
+		sleep 0.2
+		t=$(now_ns)
+		if ! $bin -c "$addr" > /dev/null 2>&1; then
+			echo "run.sh: $name client failed" >&2
+			kill "$pid" 2>/dev/null
+			wait "$pid" 2>/dev/null
+			failed=1
+			return
+		fi
+		echo $(( ($(now_ns) - t) / 1000 )) >> "$tmp/$name.us"
+		wait "$pid"
+		i=$((i + 1))
+	done
+	set -- $(summarize < "$tmp/$name.us")
+	metric "$name.exchange" "${1:-}" "${2:-}"
+}
+
+# p99 of the "label usec: ..." line of a log
+lat_p99() {
+	sed -n "s/^$1 usec: .* p99 \([0-9.]*\) p99\.9 .*/\1/p" "$2" | head -1
+}
+
+# rpp_h client run, log to $tmp/log
+client() {
+	if ! "$rpp_h" -c "$@" "$addr:$port" > "$tmp/log" 2>&1; then
+		echo "run.sh: rpp_h -c $*: failed" >&2
+		cat "$tmp/log" >&2
+		failed=1
+		return 1
+	fi
+}
+
+# latency per size: one thread, one READ or WRITE at a time
+bench_latency() {
+	for op in read write; do
+		for size in 64 512 4096 65536; do
+			echo "$op 1 fixed $size" > "$tmp/wl"
+			client -m workload -w "$tmp/wl" -T 1 -n $n_lat ||
+				continue
+			metric "rpp_h.${op}_lat.$size" \
+				"$(sed -n 's/.*, \([0-9.]*\) Kops\/s$/\1/p' \
+					"$tmp/log")" \
+				"$(lat_p99 $op "$tmp/log")"
+		done
+	done
+}
+
+# bandwidth per size: four threads of WRITEs (MB/s)
+bench_bandwidth() {
+	for size in 4096 65536 262144 1048576; do
+		echo "write 1 fixed $size" > "$tmp/wl"
+		client -m workload -w "$tmp/wl" -T 4 -n $n_bw || continue
+		metric "rpp_h.write_bw.$size" \
+			"$(sed -n 's/^write: .*, \([0-9.]*\) MB\/s$/\1/p' \
+				"$tmp/log")" \
+			"$(lat_p99 write "$tmp/log")"
+	done
+}
+
+# connect rate (accepts/s)
+bench_connect() {
+	client -m storm -T 4 -n $n_conn || return
+	metric "rpp_h.connect" \
+		"$(sed -n 's/.* \([0-9.]*\) accepts\/s$/\1/p' "$tmp/log")" \
+		"$(lat_p99 connect "$tmp/log")"
+}
+
+# session scaling: Kops/s and p99 of the median session per step
+bench_scale() {
+	client -m scale -T 4 -q 4 -k 1024 -n $n_scale || return
+	sed -n 's/^sessions *\([0-9]*\): *\([0-9.]*\) Kops\/s .* p99 *\([0-9.]*\) us (median.*/\1 \2 \3/p' \
+		"$tmp/log" > "$tmp/scale"
+	while read -r sessions kops p99; do
+		metric "rpp_h.scale.$sessions" "$kops" "$p99"
+	done < "$tmp/scale"
+}
+
+write_json() {
+	{
+		echo "{"
+		echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+		echo "  \"host\": \"$(uname -n)\","
+		echo "  \"netdev\": \"$NETDEV\","
+		echo "  \"metrics\": {"
+		awk '{ printf "%s    \"%s\": {\"tput\": %s, \"p99\": %s}",
+			(NR > 1 ? ",\n" : ""), $1, $2, $3 }
+			END { if (NR > 0) printf "\n" }' "$metrics"
+		echo "  }"
+		echo "}"
+	} > "$out"
+}
+
+for bin in "$rpp" "$rpp_e" "$rpp_h"; do
+	if [ ! -x "$bin" ]; then
+		echo "run.sh: $bin not built" >&2
+		exit 1
+	fi
+done
+setup_rxe || exit 1
+: > "$metrics"
+
+bench_exchange rpp "$rpp"
+bench_exchange rpp_e "$rpp_e"
+
+"$rpp_h" -s -S /rpp_bench_stat "$addr:$port" > "$tmp/server.log" 2>&1 &
+server=$!
+sleep 0.5
+bench_latency
+bench_bandwidth
+bench_connect
+bench_scale
+
+write_json
+echo "run.sh: $(wc -l < "$metrics") metrics in $out"
+exit $failed
@@ -0,0 +1,112 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "rpp_h.h"
+
+/* rpp_admit: admission control of the server.
+ *
+ * without it the server accepts every connection request and runs a
+ * thread for it, so under overload all the sessions get slow and the
+ * clients time out. here a connection request is rejected at once,
+ * before any resource is made for it, when
+ *  - -M: the admitted sessions reach the limit, or
+ *  - -B: the bytes of RDMA READ/WRITE in flight (rpp_rdma_read and
+ *    rpp_rdma_write) reach the limit.
+ * the private data of the reject (struct rpp_reject) tells the client
+ * why and how long to wait before it tries again.
+ *
+ * the retry hint is the time one session slot takes to free on
+ * average: the mean session time divided by the limit. for bytes it
+ * is RPP_RETRY_MIN_MS, RDMA operations are short.
+ */
+
+#define RPP_RETRY_MIN_MS 1
+#define RPP_RETRY_MAX_MS 1000
+
+static unsigned int max_sessions;	/* 0: no limit */
+static uint64_t max_bytes;		/* 0: no limit */
+static unsigned int admitted;
+static uint64_t inflight;
+static uint64_t session_avg;		/* nsec, EWMA 1/8 */
+
+void
+rpp_admit_init(unsigned int sessions, uint64_t bytes)
+{
+	max_sessions = sessions;
+	max_bytes = bytes;
+}
+
+static uint32_t
+retry_ms(int reason)
+{
+	uint64_t ms = RPP_RETRY_MIN_MS;
+
+	if (reason == RPP_REJ_SESSIONS) {
+		ms = __atomic_load_n(&session_avg, __ATOMIC_RELAXED) /
+			max_sessions / 1000000;
+	}
+	if (ms < RPP_RETRY_MIN_MS) {
+		ms = RPP_RETRY_MIN_MS;
+	} else if (ms > RPP_RETRY_MAX_MS) {
+		ms = RPP_RETRY_MAX_MS;
+	}
+
+	return ms;
+}
+
+/* admit a session, or fill rej and return 1 */
+int
+rpp_admit(struct rpp_reject *rej)
+{
+	unsigned int n;
+	int reason = RPP_REJ_NONE;
+
+	n = __atomic_add_fetch(&admitted, 1, __ATOMIC_RELAXED);
+	if (max_sessions != 0 && n > max_sessions) {
+		reason = RPP_REJ_SESSIONS;
+	} else if (max_bytes != 0 &&
+		   __atomic_load_n(&inflight, __ATOMIC_RELAXED) >= max_bytes) {
+		reason = RPP_REJ_BYTES;
+	}
+	if (reason == RPP_REJ_NONE) {
+		return 0;
+	}
+	__atomic_sub_fetch(&admitted, 1, __ATOMIC_RELAXED);
+
+	memset(rej, 0, sizeof(*rej));
+	rej->magic = RPP_REJECT_MAGIC;
+	rej->reason = reason;
+	rej->retry_ms = retry_ms(reason);
+	rej->sessions = n - 1;
+	DEBUG_LOG("reject reason %u retry %u ms\n", rej->reason,
+		rej->retry_ms);
+
+	return 1;
+}
+
+/* the admitted session is over, it took ns. 0: it never ran (accept
+ * failed), so the average is kept. */
+void
+rpp_admit_done(uint64_t ns)
+{
+	uint64_t avg;
+
+	if (ns != 0) {
+		avg = __atomic_load_n(&session_avg, __ATOMIC_RELAXED);
+		/* NOTE: racy, an update lost now and then does not matter */
+		avg = avg ? avg - avg / 8 + ns / 8 : ns;
+		__atomic_store_n(&session_avg, avg, __ATOMIC_RELAXED);
+	}
+	__atomic_sub_fetch(&admitted, 1, __ATOMIC_RELAXED);
+}
+
+void
+rpp_admit_bytes(int64_t delta)
+{
+	__atomic_fetch_add(&inflight, (uint64_t)delta, __ATOMIC_RELAXED);
+}
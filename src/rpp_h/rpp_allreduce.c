@@ -0,0 +1,633 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rpp_h.h"
+
+/* allreduce mode: ring allreduce (sum) of N processes.
+ *
+ * rank r (-k) of N (-T) listens on port RPP_AR_PORT + r, accepts its
+ * previous rank and connects to the next rank at the address given on
+ * the command line (port RPP_AR_PORT + (r + 1) % N). so N processes on
+ * one host (rxe/siw) only need the address of that host.
+ *
+ * the vector is split in N segments and each segment in chunks of
+ * RPP_AR_CHUNK bytes.
+ * 	reduce-scatter: N-1 steps. in step s, rank r sends segment r-s
+ * 	to the next rank, which adds it to its own. a chunk is WRITTEN
+ * 	(with immediate) to an inbox slot of the next rank, which returns
+ * 	credits by WRITing its count of consumed chunks to our 'credit'.
+ * 	allgather: N-1 steps. in step s, rank r sends segment r+1-s. the
+ * 	data is final, so it is WRITTEN to the same place of the next
+ * 	rank's vector.
+ * the steps are pipelined per chunk: a chunk is sent as soon as the
+ * chunk it depends on has arrived (and been added), and the immediate
+ * tells which chunk arrived.
+ */
+
+#define RPP_AR_PORT 8000
+#define RPP_AR_CHUNK (128U << 10)
+#define RPP_AR_SLOTS 8		/* inbox slots (credits) */
+#define RPP_AR_SQ 64		/* WRITEs in flight to the next rank */
+#define RPP_AR_RECVS (RPP_AR_SQ * 2)
+#define RPP_AR_MIN (4UL << 10)
+#define RPP_AR_MAX (64UL << 20)
+#define RPP_AR_BYTES (1UL << 30)	/* per size, caps -n */
+#define RPP_AR_RETRY 300	/* connect retries of 100ms */
+
+#define AR_IMM_AG 0x80000000U	/* allgather, otherwise reduce-scatter */
+
+struct ar_info {
+	uint64_t vec;
+	uint64_t inbox;
+	uint64_t credit;
+	uint32_t vec_rkey;
+	uint32_t inbox_rkey;
+	uint32_t credit_rkey;
+	uint32_t pad;
+};
+
+struct ar_ctx {
+	unsigned int rank;
+	unsigned int nranks;
+	size_t esize;		/* float or double */
+	char *vec;
+	struct ibv_mr *vec_mr;
+	char *inbox;
+	struct ibv_mr *inbox_mr;
+	/* [0]: consumed count of the next rank, WRITTEN by it.
+	 * [1]: our consumed count, source of our WRITE to the prev rank */
+	uint64_t *credit;
+	struct ibv_mr *credit_mr;
+	struct rdma_cm_id *listen;
+	struct rdma_cm_id *next;
+	struct rdma_cm_id *prev;
+	struct ar_info rnext;	/* of the next rank */
+	struct ar_info rprev;	/* of the previous rank */
+	uint64_t sent;		/* reduce-scatter chunks sent, total */
+	uint64_t consumed;	/* reduce-scatter chunks added, total */
+	uint64_t credit_posted;
+	int credit_inflight;
+	unsigned int inflight;	/* WRITEs to the next rank */
+};
+
+#if defined(__x86_64__)
+#define AR_CLONES __attribute__((target_clones("avx512f", "avx2", "default")))
+#else
+#define AR_CLONES
+#endif
+
+typedef float ar_vf __attribute__((vector_size(64)));
+typedef double ar_vd __attribute__((vector_size(64)));
+
+/* dst += src. one vector is 64 bytes; the compiler makes it one
+ * AVX-512, two AVX2 or four SSE operations depending on the clone. */
+AR_CLONES static void
+ar_sum_float(float *restrict dst, const float *restrict src, size_t n)
+{
+	ar_vf a, b;
+	size_t i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		memcpy(&a, dst + i, sizeof(a));
+		memcpy(&b, src + i, sizeof(b));
+		a += b;
+		memcpy(dst + i, &a, sizeof(a));
+	}
+	for (; i < n; i++) {
+		dst[i] += src[i];
+	}
+}
+
+AR_CLONES static void
+ar_sum_double(double *restrict dst, const double *restrict src, size_t n)
+{
+	ar_vd a, b;
+	size_t i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		memcpy(&a, dst + i, sizeof(a));
+		memcpy(&b, src + i, sizeof(b));
+		a += b;
+		memcpy(dst + i, &a, sizeof(a));
+	}
+	for (; i < n; i++) {
+		dst[i] += src[i];
+	}
+}
+
+/* element range (off, len) of chunk k of segment seg */
+static void
+ar_chunk(struct ar_ctx *c, size_t n, unsigned int seg, size_t k,
+	size_t *off, size_t *len)
+{
+	size_t begin = seg * n / c->nranks;
+	size_t end = (seg + 1) * n / c->nranks;
+	size_t ch = RPP_AR_CHUNK / c->esize;
+
+	*off = begin + k * ch;
+	if (*off >= end) {
+		*off = end;
+		*len = 0;	/* NOTE: a zero length WRITE still notifies */
+	} else {
+		*len = end - *off < ch ? end - *off : ch;
+	}
+}
+
+static int
+ar_post_write(struct rdma_cm_id *id, void *buf, size_t len, uint32_t lkey,
+	uint64_t raddr, uint32_t rkey, int imm, uint32_t imm_data)
+{
+	struct ibv_send_wr wr, *bad;
+	struct ibv_sge sge;
+
+	memset(&wr, 0, sizeof(wr));
+	sge.addr = (uint64_t)buf;
+	sge.length = len;
+	sge.lkey = lkey;
+	wr.opcode = imm ? IBV_WR_RDMA_WRITE_WITH_IMM : IBV_WR_RDMA_WRITE;
+	wr.imm_data = htonl(imm_data);
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.wr.rdma.remote_addr = raddr;
+	wr.wr.rdma.rkey = rkey;
+
+	if (ibv_post_send(id->qp, &wr, &bad) != 0) {
+		perror("ibv_post_send allreduce");
+		return 1;
+	}
+
+	return 0;
+}
+
+/* a WRITE with immediate consumes a receive. no buffer is needed. */
+static int
+ar_post_recv(struct rdma_cm_id *id)
+{
+	struct ibv_recv_wr wr, *bad;
+
+	memset(&wr, 0, sizeof(wr));
+	if (ibv_post_recv(id->qp, &wr, &bad) != 0) {
+		perror("ibv_post_recv allreduce");
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+ar_reap(struct ibv_cq *cq)
+{
+	struct ibv_wc wc[16];
+	int n, i;
+
+	n = ibv_poll_cq(cq, 16, wc);
+	if (n < 0) {
+		perror("ibv_poll_cq allreduce");
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if (wc[i].status != IBV_WC_SUCCESS) {
+			fprintf(stderr, "allreduce: WRITE %s\n",
+				ibv_wc_status_str(wc[i].status));
+			return -1;
+		}
+	}
+
+	return n;
+}
+
+/* one allreduce of n elements in c->vec */
+static int
+ar_allreduce(struct ar_ctx *c, size_t n)
+{
+	unsigned int N = c->nranks, r = c->rank, seg;
+	size_t ch = RPP_AR_CHUNK / c->esize;
+	size_t nch = ((n + N - 1) / N + ch - 1) / ch;
+	uint64_t total;
+	uint64_t rs_sent = 0, rs_recvd = 0, ag_sent = 0, ag_recvd = 0;
+	uint32_t imm;
+	size_t off, len;
+	struct ibv_wc wc;
+	int k;
+
+	if (nch == 0) {
+		nch = 1;
+	}
+	total = (uint64_t)(N - 1) * nch;
+	while (rs_recvd < total || ag_recvd < total || rs_sent < total ||
+	       ag_sent < total || c->inflight > 0 || c->credit_inflight ||
+	       c->credit_posted != c->consumed) {
+		/* reduce-scatter: step 0 is our data, step s the chunk
+		 * added in step s-1. needs a free inbox slot. */
+		while (rs_sent < total && c->inflight < RPP_AR_SQ &&
+		       c->sent - __atomic_load_n(&c->credit[0],
+				__ATOMIC_ACQUIRE) < RPP_AR_SLOTS &&
+		       (rs_sent < nch || rs_recvd + nch > rs_sent)) {
+			seg = (r + N - rs_sent / nch % N) % N;
+			ar_chunk(c, n, seg, rs_sent % nch, &off, &len);
+			if (ar_post_write(c->next, c->vec + off * c->esize,
+					len * c->esize, c->vec_mr->lkey,
+					c->rnext.inbox +
+					c->sent % RPP_AR_SLOTS * RPP_AR_CHUNK,
+					c->rnext.inbox_rkey, 1, rs_sent) != 0) {
+				return 1;
+			}
+			c->inflight++;
+			c->sent++;
+			rs_sent++;
+		}
+
+		/* allgather: step 0 is the segment completed by the last
+		 * reduce-scatter step, step s the chunk of step s-1. */
+		while (ag_sent < total && c->inflight < RPP_AR_SQ &&
+		       (ag_sent < nch ? rs_recvd > (N - 2) * nch + ag_sent :
+				ag_recvd + nch > ag_sent)) {
+			seg = (r + 1 + N - ag_sent / nch % N) % N;
+			ar_chunk(c, n, seg, ag_sent % nch, &off, &len);
+			if (ar_post_write(c->next, c->vec + off * c->esize,
+					len * c->esize, c->vec_mr->lkey,
+					c->rnext.vec + off * c->esize,
+					c->rnext.vec_rkey, 1,
+					AR_IMM_AG | ag_sent) != 0) {
+				return 1;
+			}
+			c->inflight++;
+			ag_sent++;
+		}
+
+		k = ar_reap(c->next->send_cq);
+		if (k < 0) {
+			return 1;
+		}
+		c->inflight -= k;
+
+		/* NOTE: one by one, so that nothing of the next allreduce
+		 * is taken from the CQ. */
+		while (rs_recvd < total || ag_recvd < total) {
+			k = ibv_poll_cq(c->prev->recv_cq, 1, &wc);
+			if (k < 0) {
+				perror("ibv_poll_cq allreduce");
+				return 1;
+			} else if (k == 0) {
+				break;
+			}
+			if (wc.status != IBV_WC_SUCCESS ||
+			    wc.opcode != IBV_WC_RECV_RDMA_WITH_IMM) {
+				fprintf(stderr, "allreduce: recv %s opcode %d\n",
+					ibv_wc_status_str(wc.status),
+					wc.opcode);
+				return 1;
+			}
+			imm = ntohl(wc.imm_data);
+			if (imm & AR_IMM_AG) {
+				if ((imm & ~AR_IMM_AG) != (uint32_t)ag_recvd) {
+					goto order;
+				}
+				ag_recvd++;
+			} else {
+				if (imm != (uint32_t)rs_recvd) {
+					goto order;
+				}
+				seg = (r + 2 * N - 1 - rs_recvd / nch % N) % N;
+				ar_chunk(c, n, seg, rs_recvd % nch, &off,
+					&len);
+				if (c->esize == sizeof(float)) {
+					ar_sum_float((float *)c->vec + off,
+						(float *)(c->inbox +
+						c->consumed % RPP_AR_SLOTS *
+						RPP_AR_CHUNK), len);
+				} else {
+					ar_sum_double((double *)c->vec + off,
+						(double *)(c->inbox +
+						c->consumed % RPP_AR_SLOTS *
+						RPP_AR_CHUNK), len);
+				}
+				c->consumed++;
+				rs_recvd++;
+			}
+			if (ar_post_recv(c->prev) != 0) {
+				return 1;
+			}
+		}
+
+		/* return credits to the previous rank */
+		k = ar_reap(c->prev->send_cq);
+		if (k < 0) {
+			return 1;
+		} else if (k > 0) {
+			c->credit_inflight = 0;
+		}
+		if (!c->credit_inflight && c->credit_posted != c->consumed) {
+			c->credit[1] = c->consumed;
+			if (ar_post_write(c->prev, &c->credit[1],
+					sizeof(uint64_t), c->credit_mr->lkey,
+					c->rprev.credit, c->rprev.credit_rkey,
+					0, 0) != 0) {
+				return 1;
+			}
+			c->credit_posted = c->consumed;
+			c->credit_inflight = 1;
+		}
+	}
+
+	return 0;
+
+order:
+	fprintf(stderr, "allreduce: immediate %x out of order\n", imm);
+	return 1;
+}
+
+/* element i of rank r is (r + i) % 16 */
+static void
+ar_fill(struct ar_ctx *c, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (c->esize == sizeof(float)) {
+			((float *)c->vec)[i] = (c->rank + i) % 16;
+		} else {
+			((double *)c->vec)[i] = (c->rank + i) % 16;
+		}
+	}
+}
+
+static size_t
+ar_check(struct ar_ctx *c, size_t n)
+{
+	double expect, v;
+	size_t i, bad = 0;
+	unsigned int q;
+
+	for (i = 0; i < n; i++) {
+		expect = 0;
+		for (q = 0; q < c->nranks; q++) {
+			expect += (q + i) % 16;
+		}
+		v = c->esize == sizeof(float) ? ((float *)c->vec)[i] :
+			((double *)c->vec)[i];
+		if (v != expect) {
+			bad++;
+		}
+	}
+
+	return bad;
+}
+
+static void *
+ar_accept(void *arg)
+{
+	struct ar_ctx *c = (struct ar_ctx *)arg;
+	struct rdma_cm_id *id;
+	struct rpp_context *ct;
+
+	DEBUG_LOG("rdma_get_request\n");
+	if (rdma_get_request(c->listen, &id) != 0) {
+		perror("rdma_get_request");
+		return NULL;
+	}
+	ct = rpp_init_context();
+	if (ct == NULL) {
+		rdma_destroy_id(id);
+		return NULL;
+	}
+	id->context = ct;
+	if (rpp_create_qp_cap(id, 4, RPP_AR_RECVS + 2) != 0 ||
+	    rpp_setup_buffers(id) != 0) {
+		goto err;
+	}
+	DEBUG_LOG("rdma_post_recv\n");
+	if (rdma_post_recv(id, NULL, ct->recv_msg, sizeof(ct->recv_msg),
+			ct->recv_mr) != 0) {
+		perror("rdma_post_recv");
+		goto err;
+	}
+	DEBUG_LOG("rdma_accept\n");
+	if (rdma_accept(id, NULL) != 0) {
+		perror("rdma_accept");
+		goto err;
+	}
+	c->prev = id;
+
+	return NULL;
+
+err:
+	rpp_client_close(id);
+	return NULL;
+}
+
+static int
+ar_setup(struct ar_ctx *c, struct sockaddr *addr)
+{
+	struct sockaddr_in local, next;
+	struct ar_info info;
+	pthread_t th;
+	int i;
+
+	if (posix_memalign((void **)&c->vec, 4096, RPP_AR_MAX) != 0 ||
+	    posix_memalign((void **)&c->inbox, 4096,
+			RPP_AR_SLOTS * RPP_AR_CHUNK) != 0 ||
+	    posix_memalign((void **)&c->credit, 4096, 4096) != 0) {
+		perror("posix_memalign allreduce");
+		return 1;
+	}
+	memset(c->credit, 0, 4096);
+
+	memset(&local, 0, sizeof(local));
+	local.sin_family = AF_INET;
+	local.sin_addr.s_addr = htonl(INADDR_ANY);
+	local.sin_port = htons(RPP_AR_PORT + c->rank);
+	DEBUG_LOG("rdma_create_id listen\n");
+	if (rdma_create_id(NULL, &c->listen, NULL, RDMA_PS_TCP) != 0) {
+		perror("rdma_create_id listen");
+		return 1;
+	}
+	DEBUG_LOG("rdma_bind_addr\n");
+	if (rdma_bind_addr(c->listen, (struct sockaddr *)&local) != 0) {
+		perror("rdma_bind_addr");
+		return 1;
+	}
+	DEBUG_LOG("rdma_listen\n");
+	if (rdma_listen(c->listen, 1) != 0) {
+		perror("rdma_listen");
+		return 1;
+	}
+
+	/* NOTE: every rank connects before it accepts, so accept in
+	 * another thread. rdma_connect returns only after the next rank
+	 * accepted. */
+	if (pthread_create(&th, NULL, ar_accept, c) != 0) {
+		perror("pthread_create");
+		return 1;
+	}
+	memcpy(&next, addr, sizeof(next));
+	next.sin_port = htons(RPP_AR_PORT + (c->rank + 1) % c->nranks);
+	for (i = 0; i < RPP_AR_RETRY; i++) {
+		c->next = rpp_client_connect((struct sockaddr *)&next,
+			RPP_MODE_ALLREDUCE, RPP_AR_SQ + 2, 2);
+		if (c->next != NULL) {
+			break;
+		}
+		/* the next rank may not listen yet */
+		usleep(100000);
+	}
+	pthread_join(th, NULL);
+	if (c->next == NULL || c->prev == NULL) {
+		fprintf(stderr, "allreduce: ring not connected\n");
+		return 1;
+	}
+
+	/* NOTE: rdma_cm allocates one PD per device. both ids are on the
+	 * device of the ring, registered with next's PD. */
+	if (c->prev->pd != c->next->pd) {
+		fprintf(stderr, "allreduce: prev and next on other devices\n");
+		return 1;
+	}
+	c->vec_mr = rdma_reg_write(c->next, c->vec, RPP_AR_MAX);
+	c->inbox_mr = rdma_reg_write(c->next, c->inbox,
+		RPP_AR_SLOTS * RPP_AR_CHUNK);
+	c->credit_mr = rdma_reg_write(c->next, c->credit, 4096);
+	if (c->vec_mr == NULL || c->inbox_mr == NULL || c->credit_mr == NULL) {
+		perror("rdma_reg_write allreduce");
+		return 1;
+	}
+
+	/* NOTE: the previous rank starts WRITing as soon as it has our
+	 * info, so the receives are posted first. its info message takes
+	 * recv_msg, which was posted before these. */
+	for (i = 0; i < RPP_AR_RECVS; i++) {
+		if (ar_post_recv(c->prev) != 0) {
+			return 1;
+		}
+	}
+
+	memset(&info, 0, sizeof(info));
+	info.vec = (uint64_t)c->vec;
+	info.vec_rkey = c->vec_mr->rkey;
+	info.inbox = (uint64_t)c->inbox;
+	info.inbox_rkey = c->inbox_mr->rkey;
+	info.credit = (uint64_t)c->credit;
+	info.credit_rkey = c->credit_mr->rkey;
+	if (rpp_send_msg(c->next, &info, sizeof(info)) != 0 ||
+	    rpp_send_msg(c->prev, &info, sizeof(info)) != 0 ||
+	    rpp_recv_msg(c->next, &c->rnext, sizeof(c->rnext)) != 0 ||
+	    rpp_recv_msg(c->prev, &c->rprev, sizeof(c->rprev)) != 0) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+ar_close(struct ar_ctx *c)
+{
+	if (c->vec_mr) {
+		rdma_dereg_mr(c->vec_mr);
+	}
+	if (c->inbox_mr) {
+		rdma_dereg_mr(c->inbox_mr);
+	}
+	if (c->credit_mr) {
+		rdma_dereg_mr(c->credit_mr);
+	}
+	if (c->next) {
+		rpp_client_close(c->next);
+	}
+	if (c->prev) {
+		rpp_client_close(c->prev);
+	}
+	if (c->listen) {
+		rdma_destroy_id(c->listen);
+	}
+	free(c->vec);
+	free(c->inbox);
+	free(c->credit);
+}
+
+int
+rpp_allreduce_client(struct sockaddr *addr)
+{
+	struct ar_ctx c;
+	size_t size, n, bad;
+	unsigned long iters, i;
+	uint64_t t, ns;
+	double algbw;
+	int ret = 1;
+
+	memset(&c, 0, sizeof(c));
+	c.rank = opts.range;
+	c.nranks = opts.threads;
+	c.esize = sizeof(float);
+	if (opts.op != NULL && strcmp(opts.op, "double") == 0) {
+		c.esize = sizeof(double);
+	} else if (opts.op != NULL && strcmp(opts.op, "float") != 0) {
+		fprintf(stderr, "allreduce: op must be float or double\n");
+		return 1;
+	}
+	if (c.nranks < 2 || c.rank >= c.nranks || opts.count == 0) {
+		fprintf(stderr, "allreduce: -T ranks (>= 2), "
+			"-k rank (< ranks), -n > 0\n");
+		return 1;
+	}
+	if (opts.recv_depth != 0) {
+		fprintf(stderr, "allreduce: -R is not supported\n");
+		return 1;
+	}
+
+	if (ar_setup(&c, addr) != 0) {
+		goto out;
+	}
+
+	if (c.rank == 0) {
+		printf("allreduce: %u ranks, %s, chunk %u bytes\n", c.nranks,
+			c.esize == sizeof(float) ? "float" : "double",
+			RPP_AR_CHUNK);
+	}
+	/* NOTE: every rank has to run the same sizes and iterations */
+	for (size = RPP_AR_MIN; size <= RPP_AR_MAX; size <<= 2) {
+		n = size / c.esize;
+		iters = RPP_AR_BYTES / size;
+		if (iters > opts.count) {
+			iters = opts.count;
+		}
+		ns = 0;
+		for (i = 0; i < iters; i++) {
+			ar_fill(&c, n);
+			t = rpp_stat_now();
+			if (ar_allreduce(&c, n) != 0) {
+				goto out;
+			}
+			ns += rpp_stat_now() - t;
+		}
+		bad = ar_check(&c, n);
+		if (bad > 0) {
+			fprintf(stderr, "allreduce: rank %u size %zu: "
+				"%zu bad elements\n", c.rank, size, bad);
+			goto out;
+		}
+		if (c.rank == 0) {
+			algbw = size / ((double)ns / iters);
+			printf("%9zu bytes: %10.1f us, algbw %6.2f GB/s, "
+				"busbw %6.2f GB/s\n", size,
+				ns / 1e3 / iters, algbw,
+				algbw * 2 * (c.nranks - 1) / c.nranks);
+		}
+	}
+	ret = 0;
+
+out:
+	ar_close(&c);
+
+	return ret;
+}
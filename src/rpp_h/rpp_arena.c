@@ -0,0 +1,327 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "rpp_h.h"
+
+/* rpp_arena: compact contexts of the server sessions.
+ *
+ * rpp_init_context costs three mallocs (the context and two DATA_SIZE
+ * buffers) and rpp_setup_buffers four MRs per session, though an idle
+ * session uses none of the data buffers. here:
+ *  - the context (with recv_msg/send_msg in it) is a 64 byte aligned
+ *    record of a per-cpu arena. the chunks of the arena are
+ *    registered once per PD, so the messages need no MR of their own.
+ *  - read_data/write_data are taken by rpp_ctx_data when a mode needs
+ *    them, in the size the transfer needs (power of 2 classes), from
+ *    arenas registered the same way.
+ *
+ * a chunk is RPP_ARENA_CHUNK bytes, aligned to its size, with its
+ * header at the start, so the chunk of a record is found by masking
+ * the address. records are never given back to the system; a freed
+ * record goes back to the free list of the cpu of its chunk.
+ *
+ * NOTE: the rkey of a data buffer covers its whole chunk, that is the
+ * buffers of other sessions too. modes which hand rkeys to clients
+ * (scale) get them like that, which is fine for a benchmark only.
+ */
+
+#define RPP_ARENA_CHUNK (2UL << 20)
+#define RPP_ARENA_PDS 8			/* devices */
+#define RPP_DATA_MIN 256
+#define RPP_DATA_CLASSES 9		/* 256 .. 64KB */
+
+struct rpp_arena;
+
+struct rpp_arena_chunk {
+	struct rpp_arena *arena;
+	unsigned int cpu;
+	pthread_mutex_t lock;		/* reg */
+	unsigned int nreg;
+	struct {
+		struct ibv_pd *pd;
+		struct ibv_mr *mr;
+	} reg[RPP_ARENA_PDS];
+};
+
+struct rpp_arena_cpu {
+	pthread_mutex_t lock;
+	void *free;		/* linked through the first word */
+} __attribute__((aligned(64)));
+
+struct rpp_arena {
+	size_t size;		/* of a record, multiple of 64 */
+	size_t off;		/* of the first record in a chunk */
+	int access;
+	struct rpp_arena_cpu *cpu;
+};
+
+static struct rpp_arena ctx_arena;
+static struct rpp_arena data_arena[RPP_DATA_CLASSES];
+static unsigned int ncpu;
+static pthread_once_t arena_once = PTHREAD_ONCE_INIT;
+static int arena_err;
+
+static int
+arena_init_one(struct rpp_arena *a, size_t size, int access)
+{
+	unsigned int i;
+
+	a->size = (size + 63) & ~(size_t)63;
+	a->off = (sizeof(struct rpp_arena_chunk) + a->size - 1) /
+		a->size * a->size;
+	a->access = access;
+	a->cpu = (struct rpp_arena_cpu *)calloc(ncpu, sizeof(*a->cpu));
+	if (a->cpu == NULL) {
+		perror("calloc rpp_arena_cpu");
+		return 1;
+	}
+	for (i = 0; i < ncpu; i++) {
+		pthread_mutex_init(&a->cpu[i].lock, NULL);
+	}
+
+	return 0;
+}
+
+static void
+arena_init(void)
+{
+	unsigned int i;
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_CONF);
+	ncpu = n > 0 ? n : 1;
+
+	arena_err = arena_init_one(&ctx_arena, sizeof(struct rpp_context),
+		IBV_ACCESS_LOCAL_WRITE);
+	for (i = 0; i < RPP_DATA_CLASSES && arena_err == 0; i++) {
+		arena_err = arena_init_one(&data_arena[i], RPP_DATA_MIN << i,
+			IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+			IBV_ACCESS_REMOTE_WRITE);
+	}
+}
+
+static inline struct rpp_arena_chunk *
+arena_chunk(void *p)
+{
+	return (struct rpp_arena_chunk *)((uintptr_t)p &
+		~(RPP_ARENA_CHUNK - 1));
+}
+
+/* called with the lock of the cpu held */
+static int
+arena_grow(struct rpp_arena *a, unsigned int cpu)
+{
+	struct rpp_arena_chunk *c;
+	char *p;
+	size_t off;
+
+	if (posix_memalign((void **)&c, RPP_ARENA_CHUNK,
+			RPP_ARENA_CHUNK) != 0) {
+		perror("posix_memalign arena chunk");
+		return 1;
+	}
+	memset(c, 0, sizeof(*c));
+	c->arena = a;
+	c->cpu = cpu;
+	pthread_mutex_init(&c->lock, NULL);
+
+	/* NOTE: last record first, so the list goes up in memory */
+	for (off = (RPP_ARENA_CHUNK - a->off) / a->size * a->size + a->off;
+			off > a->off; ) {
+		off -= a->size;
+		p = (char *)c + off;
+		*(void **)p = a->cpu[cpu].free;
+		a->cpu[cpu].free = p;
+	}
+
+	return 0;
+}
+
+static void *
+arena_alloc(struct rpp_arena *a)
+{
+	struct rpp_arena_cpu *ac;
+	unsigned int cpu;
+	int n;
+	void *p = NULL;
+
+	n = sched_getcpu();
+	cpu = n >= 0 ? (unsigned int)n % ncpu : 0;
+	ac = &a->cpu[cpu];
+
+	pthread_mutex_lock(&ac->lock);
+	if (ac->free == NULL && arena_grow(a, cpu) != 0) {
+		pthread_mutex_unlock(&ac->lock);
+		return NULL;
+	}
+	p = ac->free;
+	ac->free = *(void **)p;
+	pthread_mutex_unlock(&ac->lock);
+
+	return p;
+}
+
+static void
+arena_free(void *p)
+{
+	struct rpp_arena_chunk *c = arena_chunk(p);
+	struct rpp_arena_cpu *ac = &c->arena->cpu[c->cpu];
+
+	pthread_mutex_lock(&ac->lock);
+	*(void **)p = ac->free;
+	ac->free = p;
+	pthread_mutex_unlock(&ac->lock);
+}
+
+/* MR of the chunk of p in pd, registered on first use */
+static struct ibv_mr *
+arena_mr(void *p, struct ibv_pd *pd)
+{
+	struct rpp_arena_chunk *c = arena_chunk(p);
+	struct rpp_arena *a = c->arena;
+	struct ibv_mr *mr = NULL;
+	unsigned int i;
+
+	pthread_mutex_lock(&c->lock);
+	for (i = 0; i < c->nreg; i++) {
+		if (c->reg[i].pd == pd) {
+			mr = c->reg[i].mr;
+			goto out;
+		}
+	}
+	if (c->nreg == RPP_ARENA_PDS) {
+		fprintf(stderr, "arena: too many devices\n");
+		goto out;
+	}
+	/* NOTE: the header is not part of the MR */
+	DEBUG_LOG("ibv_reg_mr arena chunk\n");
+	mr = ibv_reg_mr(pd, (char *)c + a->off, RPP_ARENA_CHUNK - a->off,
+		a->access);
+	if (mr == NULL) {
+		perror("ibv_reg_mr arena chunk");
+		goto out;
+	}
+	rpp_stat_mr(1);
+	c->reg[c->nreg].pd = pd;
+	c->reg[c->nreg].mr = mr;
+	c->nreg++;
+
+out:
+	pthread_mutex_unlock(&c->lock);
+	return mr;
+}
+
+/* a context of a server session. the buffers are registered in pd by
+ * rpp_ctx_bind. */
+struct rpp_context *
+rpp_ctx_alloc(void)
+{
+	struct rpp_context *ct;
+
+	pthread_once(&arena_once, arena_init);
+	if (arena_err) {
+		return NULL;
+	}
+	ct = (struct rpp_context *)arena_alloc(&ctx_arena);
+	if (ct == NULL) {
+		return NULL;
+	}
+	memset(ct, 0, sizeof(*ct));
+	ct->st = rpp_stat_slot();
+	ct->target = -1;
+	ct->flags = RPP_CT_ARENA;
+
+	return ct;
+}
+
+int
+rpp_ctx_bind(struct rpp_context *ct, struct ibv_pd *pd)
+{
+	ct->recv_mr = arena_mr(ct, pd);
+	if (ct->recv_mr == NULL) {
+		return 1;
+	}
+	ct->send_mr = ct->recv_mr;
+	ct->pd = pd;
+
+	return 0;
+}
+
+/* make read_data/write_data at least len bytes (at least the
+ * smallest class, also for len 0). contexts of rpp_init_context have
+ * DATA_SIZE. */
+int
+rpp_ctx_data(struct rdma_cm_id *id, size_t len)
+{
+	struct rpp_context *ct = id->context;
+	struct ibv_mr *rd_mr, *wr_mr;
+	char *rd, *wr;
+	unsigned int i;
+
+	if (!(ct->flags & RPP_CT_ARENA)) {
+		return len > DATA_SIZE;
+	}
+	if (ct->read_data != NULL && len <= ct->data_len) {
+		return 0;
+	}
+	for (i = 0; i < RPP_DATA_CLASSES; i++) {
+		if (len <= (size_t)RPP_DATA_MIN << i) {
+			break;
+		}
+	}
+	if (i == RPP_DATA_CLASSES) {
+		fprintf(stderr, "arena: data size %zu too large\n", len);
+		return 1;
+	}
+
+	rd = (char *)arena_alloc(&data_arena[i]);
+	wr = (char *)arena_alloc(&data_arena[i]);
+	if (rd == NULL || wr == NULL) {
+		goto err;
+	}
+	rd_mr = arena_mr(rd, ct->pd);
+	wr_mr = arena_mr(wr, ct->pd);
+	if (rd_mr == NULL || wr_mr == NULL) {
+		goto err;
+	}
+	if (ct->read_data != NULL) {
+		arena_free(ct->read_data);
+		arena_free(ct->write_data);
+	}
+	ct->read_data = rd;
+	ct->write_data = wr;
+	ct->read_mr = rd_mr;
+	ct->write_mr = wr_mr;
+	ct->data_len = (size_t)RPP_DATA_MIN << i;
+
+	return 0;
+
+err:
+	if (rd != NULL) {
+		arena_free(rd);
+	}
+	if (wr != NULL) {
+		arena_free(wr);
+	}
+	return 1;
+}
+
+void
+rpp_ctx_free(struct rpp_context *ct)
+{
+	if (ct->read_data != NULL) {
+		arena_free(ct->read_data);
+		arena_free(ct->write_data);
+	}
+	arena_free(ct);
+}
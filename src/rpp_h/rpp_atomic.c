@@ -0,0 +1,449 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "rpp_h.h"
+#include "rpp_bench.h"
+
+/* atomic mode: remote fetch-and-add / compare-and-swap.
+ *
+ * the server exports one array of 64 bit counters, registered once
+ * with remote atomic access and shared by all atomic sessions.
+ * 	server sends counters addr/rkey/len on accept
+ * 	client issues atomics on counters[0..range) (-k)
+ * 	client sends "done"
+ * the server CPU is not involved between the two messages.
+ *
+ * the counters are never reset, so the client reads them before the
+ * start gate and reports what its run added.
+ *
+ * -k 1 makes every operation hit one hot counter. larger -k spreads
+ * operations uniformly, so contention goes down.
+ *
+ * NOTE: rdma_verbs.h has no helper for atomics, so ibv_post_send and
+ * ibv_reg_mr are used here.
+ */
+
+#define RPP_ATOMIC_COUNTERS 65536
+
+static uint64_t *counters;
+static struct ibv_mr *counters_mr;
+static pthread_mutex_t counters_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+atomic_export(struct rdma_cm_id *id)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&counters_lock);
+	if (counters_mr != NULL) {
+		goto out;
+	}
+	if (posix_memalign((void **)&counters, 64,
+			RPP_ATOMIC_COUNTERS * sizeof(uint64_t)) != 0) {
+		perror("posix_memalign counters");
+		ret = 1;
+		goto out;
+	}
+	memset(counters, 0, RPP_ATOMIC_COUNTERS * sizeof(uint64_t));
+
+	DEBUG_LOG("ibv_reg_mr counters\n");
+	counters_mr = ibv_reg_mr(id->pd, counters,
+		RPP_ATOMIC_COUNTERS * sizeof(uint64_t),
+		IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+		IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_ATOMIC);
+	if (counters_mr == NULL) {
+		perror("ibv_reg_mr counters");
+		free(counters);
+		counters = NULL;
+		ret = 1;
+	} else {
+		rpp_stat_mr(1);
+	}
+out:
+	pthread_mutex_unlock(&counters_lock);
+
+	return ret;
+}
+
+int
+rpp_atomic_server(struct rdma_cm_id *id)
+{
+	struct rpp_context *ct = id->context;
+	int ret;
+
+	ret = atomic_export(id);
+	if (ret != 0) {
+		return ret;
+	}
+	/* NOTE: rdma_cm allocates one PD per device. */
+	if (counters_mr->pd != id->pd) {
+		fprintf(stderr, "atomic: counters are on another device\n");
+		return 1;
+	}
+
+	/* send counters info to client */
+	ct->send_buf.buf = (uint64_t)counters;
+	ct->send_buf.rkey = counters_mr->rkey;
+	ct->send_buf.size = RPP_ATOMIC_COUNTERS * sizeof(uint64_t);
+	ret = rpp_rdma_send(id);
+	if (ret != 0) {
+		return ret;
+	}
+
+	/* recieve done from client */
+	return rpp_rdma_recv(id);
+}
+
+struct atomic_worker {
+	pthread_t th;
+	unsigned int index;
+	struct sockaddr *addr;
+	int cas;
+	struct rpp_lat lat;
+	uint64_t ops;
+	uint64_t cas_fail;
+	uint64_t base;		/* sum before the run, thread 0 only */
+	uint64_t sum;		/* thread 0 only */
+	uint64_t end;
+	int ret;
+};
+
+/* start gate. every worker counts up 'ready' and then waits for 'go',
+ * so connection setup is not measured. workers count up 'finished'
+ * when they stop issuing operations, even on error. */
+static unsigned int nstarted;
+static unsigned int ready;
+static unsigned int finished;
+static unsigned int go;
+
+/* per outstanding operation */
+struct atomic_slot {
+	uint64_t posted;
+	uint32_t idx;
+	uint64_t expect;
+};
+
+static int
+atomic_post(struct rdma_cm_id *id, struct ibv_mr *res_mr, uint64_t *res,
+	struct atomic_slot *sl, int slot, int cas, uint64_t raddr,
+	uint32_t rkey)
+{
+	struct ibv_sge sge;
+	struct ibv_send_wr wr, *bad;
+
+	sge.addr = (uint64_t)&res[slot];
+	sge.length = sizeof(uint64_t);
+	sge.lkey = res_mr->lkey;
+
+	memset(&wr, 0, sizeof(wr));
+	wr.wr_id = slot;
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.send_flags = IBV_SEND_SIGNALED;
+	wr.wr.atomic.remote_addr = raddr + sl->idx * sizeof(uint64_t);
+	wr.wr.atomic.rkey = rkey;
+	if (cas) {
+		wr.opcode = IBV_WR_ATOMIC_CMP_AND_SWP;
+		wr.wr.atomic.compare_add = sl->expect;
+		wr.wr.atomic.swap = sl->expect + 1;
+	} else {
+		wr.opcode = IBV_WR_ATOMIC_FETCH_AND_ADD;
+		wr.wr.atomic.compare_add = 1;
+	}
+
+	sl->posted = rpp_stat_now();
+	if (ibv_post_send(id->qp, &wr, &bad) != 0) {
+		perror("ibv_post_send atomic");
+		return 1;
+	}
+
+	return 0;
+}
+
+/* READ counters[0..range) into vals (if not NULL) and sum them */
+static int
+atomic_sum(struct rdma_cm_id *id, uint64_t raddr, uint32_t rkey,
+	uint64_t *vals, uint64_t *sum)
+{
+	uint64_t *buf;
+	struct ibv_mr *mr;
+	unsigned int i;
+	int ret = 1;
+
+	buf = (uint64_t *)malloc(opts.range * sizeof(uint64_t));
+	if (buf == NULL) {
+		perror("malloc sum");
+		return 1;
+	}
+	mr = rdma_reg_msgs(id, buf, opts.range * sizeof(uint64_t));
+	if (mr == NULL) {
+		perror("rdma_reg_msgs sum");
+		goto out;
+	}
+	if (rdma_post_read(id, NULL, buf, opts.range * sizeof(uint64_t), mr,
+			0, raddr, rkey) != 0) {
+		perror("rdma_post_read sum");
+		goto dereg;
+	}
+	if (rpp_wait_send_comp(id) != 0) {
+		goto dereg;
+	}
+	for (*sum = 0, i = 0; i < opts.range; i++) {
+		*sum += buf[i];
+	}
+	if (vals != NULL) {
+		memcpy(vals, buf, opts.range * sizeof(uint64_t));
+	}
+	ret = 0;
+dereg:
+	rdma_dereg_mr(mr);
+out:
+	free(buf);
+
+	return ret;
+}
+
+static int
+atomic_run(struct atomic_worker *w, struct rdma_cm_id *id)
+{
+	struct rpp_rdma_info info;
+	uint64_t raddr;
+	uint32_t rkey;
+	uint64_t *res = NULL;
+	uint64_t *seen = NULL;
+	struct atomic_slot *sl = NULL;
+	struct ibv_mr *res_mr = NULL;
+	struct ibv_wc wc[16];
+	uint64_t seed = 88172645463325252ULL + w->index;
+	uint64_t posted = 0;
+	uint64_t now;
+	struct atomic_slot *s;
+	int i, n, inflight = 0;
+	int ret = 1;
+
+	/* recieve counters info from server */
+	if (rpp_recv_msg(id, &info, sizeof(info)) != 0) {
+		goto out;
+	}
+	raddr = info.buf;
+	rkey = info.rkey;
+	if ((uint64_t)opts.range * sizeof(uint64_t) > info.size) {
+		fprintf(stderr, "atomic: range %u > %lu counters\n",
+			opts.range, info.size / sizeof(uint64_t));
+		goto out;
+	}
+
+	res = (uint64_t *)calloc(opts.depth, sizeof(uint64_t));
+	sl = (struct atomic_slot *)calloc(opts.depth, sizeof(*sl));
+	seen = (uint64_t *)calloc(opts.range, sizeof(uint64_t));
+	if (res == NULL || sl == NULL || seen == NULL) {
+		perror("calloc atomic");
+		goto out;
+	}
+	res_mr = rdma_reg_msgs(id, res, opts.depth * sizeof(uint64_t));
+	if (res_mr == NULL) {
+		perror("rdma_reg_msgs atomic");
+		goto out;
+	}
+	/* NOTE: no thread of this run has started yet. cas also expects
+	 * what is left from earlier runs. */
+	if (atomic_sum(id, raddr, rkey, seen, &w->base) != 0) {
+		goto out;
+	}
+
+	__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+	rpp_wait_until(&go, 1);
+
+	while (w->ops < opts.count) {
+		while (inflight < (int)opts.depth && posted < opts.count) {
+			s = &sl[posted % opts.depth];
+			s->idx = opts.range == 1 ? 0 :
+				rpp_xorshift64(&seed) % opts.range;
+			s->expect = seen[s->idx];
+			if (atomic_post(id, res_mr, res, s,
+					posted % opts.depth, w->cas,
+					raddr, rkey) != 0) {
+				goto out;
+			}
+			posted++;
+			inflight++;
+		}
+
+		n = ibv_poll_cq(id->send_cq, 16, wc);
+		if (n < 0) {
+			perror("ibv_poll_cq");
+			goto out;
+		}
+		now = rpp_stat_now();
+		for (i = 0; i < n; i++) {
+			if (wc[i].status != IBV_WC_SUCCESS) {
+				fprintf(stderr, "atomic: %s\n",
+					ibv_wc_status_str(wc[i].status));
+				goto out;
+			}
+			s = &sl[wc[i].wr_id];
+			rpp_lat_add(&w->lat, now - s->posted);
+			if (w->cas) {
+				if (res[wc[i].wr_id] == s->expect) {
+					seen[s->idx] = s->expect + 1;
+				} else {
+					seen[s->idx] = res[wc[i].wr_id];
+					w->cas_fail++;
+				}
+			}
+			w->ops++;
+			inflight--;
+		}
+	}
+	ret = 0;
+
+out:
+	w->end = rpp_stat_now();
+	if (ret != 0 && !__atomic_load_n(&go, __ATOMIC_ACQUIRE)) {
+		/* failed before the start gate */
+		__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+	}
+	__atomic_add_fetch(&finished, 1, __ATOMIC_RELEASE);
+	if (ret == 0 && w->index == 0) {
+		/* sum after every thread finished */
+		rpp_wait_until(&finished, nstarted);
+		ret = atomic_sum(id, raddr, rkey, NULL, &w->sum);
+	}
+	if (res_mr) {
+		rdma_dereg_mr(res_mr);
+	}
+	free(res);
+	free(sl);
+	free(seen);
+
+	return ret;
+}
+
+static void *
+atomic_worker(void *arg)
+{
+	struct atomic_worker *w = (struct atomic_worker *)arg;
+	struct rdma_cm_id *id;
+	struct rpp_context *ct;
+
+	w->ret = 1;
+	id = rpp_client_connect(w->addr, RPP_MODE_ATOMIC, opts.depth + 1, 2);
+	if (id == NULL) {
+		__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&finished, 1, __ATOMIC_RELEASE);
+		return NULL;
+	}
+	ct = id->context;
+
+	w->ret = atomic_run(w, id);
+
+	/* send done to server */
+	ct->send_buf.buf = w->ops;
+	ct->send_buf.rkey = 0;
+	ct->send_buf.size = 0;
+	if (rpp_rdma_send(id) != 0) {
+		w->ret = 1;
+	}
+
+	rpp_client_close(id);
+
+	return NULL;
+}
+
+int
+rpp_atomic_client(struct sockaddr *addr)
+{
+	struct atomic_worker *w;
+	struct rpp_lat lat;
+	uint64_t ops = 0, cas_fail = 0;
+	uint64_t start, end = 0;
+	double sec;
+	unsigned int i;
+	int cas;
+	int ret = 0;
+
+	if (opts.op == NULL || strcmp(opts.op, "faa") == 0) {
+		opts.op = "faa";
+		cas = 0;
+	} else if (strcmp(opts.op, "cas") == 0) {
+		cas = 1;
+	} else {
+		fprintf(stderr, "atomic: op must be faa or cas\n");
+		return 1;
+	}
+	if (opts.threads == 0 || opts.depth == 0 || opts.range == 0) {
+		fprintf(stderr, "atomic: threads, depth and range must be > 0\n");
+		return 1;
+	}
+
+	w = (struct atomic_worker *)calloc(opts.threads, sizeof(*w));
+	if (w == NULL) {
+		perror("calloc atomic_worker");
+		return 1;
+	}
+
+	for (i = 0; i < opts.threads; i++) {
+		w[i].index = i;
+		w[i].addr = addr;
+		w[i].cas = cas;
+		if (rpp_lat_init(&w[i].lat, opts.count) != 0) {
+			ret = 1;
+			break;
+		}
+		if (pthread_create(&w[i].th, NULL, atomic_worker, &w[i]) != 0) {
+			perror("pthread_create");
+			rpp_lat_free(&w[i].lat);
+			ret = 1;
+			break;
+		}
+	}
+	opts.threads = i;
+	nstarted = i;
+
+	rpp_wait_until(&ready, nstarted);
+	start = rpp_stat_now();
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+
+	rpp_lat_init(&lat, 0);
+	for (i = 0; i < opts.threads; i++) {
+		pthread_join(w[i].th, NULL);
+		if (w[i].end > end) {
+			end = w[i].end;
+		}
+		if (w[i].ret != 0) {
+			ret = 1;
+		}
+		ops += w[i].ops;
+		cas_fail += w[i].cas_fail;
+		rpp_lat_merge(&lat, &w[i].lat);
+		rpp_lat_free(&w[i].lat);
+	}
+
+	sec = end > start ? (end - start) / 1e9 : 0;
+	printf("atomic %s: threads %u, range %u, depth %u: "
+		"%lu ops in %.3f sec, %.3f Mops/s\n", opts.op, opts.threads,
+		opts.range, opts.depth, ops, sec, sec > 0 ? ops / sec / 1e6 : 0);
+	rpp_lat_report("latency", &lat);
+	if (cas) {
+		printf("cas failed: %lu (%.1f%%)\n", cas_fail,
+			ops ? 100.0 * cas_fail / ops : 0);
+	}
+	if (opts.threads > 0 && w[0].ret == 0) {
+		printf("counters[0..%u) sum: %lu (%lu by this run)\n",
+			opts.range, w[0].sum, w[0].sum - w[0].base);
+	}
+
+	rpp_lat_free(&lat);
+	free(w);
+
+	return ret;
+}
@@ -0,0 +1,495 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "rpp_h.h"
+#include "rpp_bench.h"
+
+/* autotune mode: search the parameters of a WRITE stream.
+ *
+ *	size	bytes of a WRITE
+ *	depth	WRITEs in flight on a QP
+ *	signal	every n-th WRITE is signaled (the QPs have no sq_sig_all)
+ *	threads	QPs, one thread each
+ *
+ * a trial runs a configuration for RPP_AT_TRIAL msec. the search goes
+ * over the parameters one by one (coordinate ascent), doubling (then
+ * halving) one while the objective gains more than RPP_AT_GAIN, and
+ * repeats until a pass moves nothing. it starts from -T, -q and the
+ * size and signal of -C.
+ *
+ * the objective (-o) is "tput" (MB/s, default) or "lat:USEC", the
+ * MB/s of the configurations whose p99 of a signaled WRITE is within
+ * USEC. the best one goes to the config file of -W, which the other
+ * modes load with -C.
+ *
+ * the server side is the workload server, the WRITEs go to its region.
+ */
+
+#define RPP_AT_QPS 16		/* max threads */
+#define RPP_AT_DEPTH 128	/* max depth, send queue of a QP */
+#define RPP_AT_SIZE_MIN 256
+#define RPP_AT_TRIAL 200	/* msec */
+#define RPP_AT_GAIN 0.03	/* a smaller gain is a plateau */
+#define RPP_AT_PASSES 4
+#define RPP_AT_LINE 256
+
+enum at_param {
+	AT_SIZE,
+	AT_DEPTH,
+	AT_SIGNAL,
+	AT_THREADS,
+	AT_NR
+};
+
+static const char *at_name[AT_NR] = {
+	[AT_SIZE] = "size",
+	[AT_DEPTH] = "depth",
+	[AT_SIGNAL] = "signal",
+	[AT_THREADS] = "threads",
+};
+
+struct at_conf {
+	unsigned int v[AT_NR];
+};
+
+struct at_result {
+	double mbps;
+	double kops;
+	double p99;	/* usec */
+	double score;
+};
+
+struct at_conn {
+	pthread_t th;
+	struct rdma_cm_id *id;
+	struct ibv_mr *mr;
+	char *local;
+	struct rpp_rdma_info info;
+	/* trial */
+	struct at_conf *conf;
+	struct rpp_lat lat;
+	uint64_t bytes;
+	uint64_t ops;
+	uint64_t end;
+	int ret;
+};
+
+static double lat_bound;	/* usec, 0: objective tput */
+static uint64_t deadline;
+static unsigned int ready;
+static unsigned int go;
+static unsigned int trials;
+
+/* configuration file: "key value" lines of threads, depth, size and
+ * signal. '#' starts a comment. */
+int
+rpp_config_load(const char *path)
+{
+	char line[RPP_AT_LINE];
+	char *p, *key, *val, *save;
+	unsigned long v;
+	FILE *fp;
+	int n = 0, ret = 0;
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror(path);
+		return 1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		n++;
+		p = strchr(line, '#');
+		if (p != NULL) {
+			*p = '\0';
+		}
+		key = strtok_r(line, " \t\n", &save);
+		if (key == NULL) {
+			continue;
+		}
+		val = strtok_r(NULL, " \t\n", &save);
+		if (val == NULL) {
+			ret = 1;
+			break;
+		}
+		v = strtoul(val, NULL, 0);
+		if (strcmp(key, "threads") == 0) {
+			opts.threads = v;
+		} else if (strcmp(key, "depth") == 0) {
+			opts.depth = v;
+		} else if (strcmp(key, "size") == 0) {
+			opts.size = v;
+		} else if (strcmp(key, "signal") == 0 && v > 0) {
+			opts.signal = v;
+		} else {
+			ret = 1;
+			break;
+		}
+	}
+	fclose(fp);
+	if (ret != 0) {
+		fprintf(stderr, "config: %s:%d: bad line\n", path, n);
+	}
+
+	return ret;
+}
+
+static int
+at_save(const char *path, struct at_conf *conf, struct at_result *r)
+{
+	FILE *fp;
+	int p;
+
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		perror(path);
+		return 1;
+	}
+	fprintf(fp, "# rpp_h autotune, objective %s\n",
+		opts.op ? opts.op : "tput");
+	fprintf(fp, "# %.2f MB/s, %.1f Kops/s, p99 %.2f us\n", r->mbps,
+		r->kops, r->p99);
+	for (p = AT_NR - 1; p >= 0; p--) {
+		fprintf(fp, "%s %u\n", at_name[p], conf->v[p]);
+	}
+	if (fclose(fp) != 0) {
+		perror(path);
+		return 1;
+	}
+
+	return 0;
+}
+
+static unsigned int
+at_max(struct at_conf *conf, int p)
+{
+	switch (p) {
+	case AT_SIZE:
+		return RPP_WL_REGION;
+	case AT_DEPTH:
+		return RPP_AT_DEPTH;
+	case AT_SIGNAL:
+		/* NOTE: the last WRITE of a full queue must be signaled */
+		return conf->v[AT_DEPTH];
+	default:
+		return RPP_AT_QPS;
+	}
+}
+
+static unsigned int
+at_min(int p)
+{
+	return p == AT_SIZE ? RPP_AT_SIZE_MIN : 1;
+}
+
+/* the power of 2 not above v, within the limits of p */
+static unsigned int
+at_clamp(struct at_conf *conf, int p, unsigned long v)
+{
+	unsigned int x = at_min(p);
+
+	while ((unsigned long)x * 2 <= v && x * 2 <= at_max(conf, p)) {
+		x *= 2;
+	}
+
+	return x;
+}
+
+static void *
+at_worker(void *arg)
+{
+	struct at_conn *c = (struct at_conn *)arg;
+	struct ibv_wc wc[RPP_AT_DEPTH];
+	uint64_t posted = 0, done = 0, now, end;
+	uint64_t post_t[RPP_AT_DEPTH];
+	uint32_t size = c->conf->v[AT_SIZE];
+	unsigned int depth = c->conf->v[AT_DEPTH];
+	unsigned int signal = c->conf->v[AT_SIGNAL];
+	unsigned int slots = RPP_WL_REGION / size;
+	int flags, i, n;
+
+	c->ret = 1;
+	c->lat.n = 0;
+	__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+	rpp_wait_until(&go, 1);
+	end = deadline;
+
+	/* NOTE: posting stops at a signaled WRITE, the unsignaled ones
+	 * before it complete with it */
+	now = rpp_stat_now();
+	while (now < end || posted % signal != 0 || done < posted) {
+		while (posted - done < depth &&
+		       (now < end || posted % signal != 0)) {
+			flags = posted % signal == signal - 1 ?
+				IBV_SEND_SIGNALED : 0;
+			if (rdma_post_write(c->id, NULL, c->local, size, c->mr,
+					flags, c->info.buf +
+					(posted % slots) * size,
+					c->info.rkey) != 0) {
+				perror("rdma_post_write");
+				goto out;
+			}
+			post_t[posted % RPP_AT_DEPTH] = now;
+			posted++;
+			now = rpp_stat_now();
+		}
+		n = ibv_poll_cq(c->id->send_cq, RPP_AT_DEPTH, wc);
+		if (n < 0) {
+			perror("ibv_poll_cq");
+			goto out;
+		}
+		now = rpp_stat_now();
+		for (i = 0; i < n; i++) {
+			if (wc[i].status != IBV_WC_SUCCESS) {
+				fprintf(stderr, "autotune: %s\n",
+					ibv_wc_status_str(wc[i].status));
+				goto out;
+			}
+			done += signal;
+			rpp_lat_add(&c->lat,
+				now - post_t[(done - 1) % RPP_AT_DEPTH]);
+		}
+	}
+	c->ops = done;
+	c->bytes = done * size;
+	c->end = now;
+	c->ret = 0;
+out:
+	return NULL;
+}
+
+/* run conf for RPP_AT_TRIAL msec */
+static int
+at_trial(struct at_conn *c, struct at_conf *conf, struct at_result *r)
+{
+	struct rpp_lat lat;
+	uint64_t start, end = 0, bytes = 0, ops = 0;
+	double sec;
+	unsigned int i, n = conf->v[AT_THREADS];
+	int ret = 0;
+
+	ready = 0;
+	go = 0;
+	for (i = 0; i < n; i++) {
+		c[i].conf = conf;
+		if (pthread_create(&c[i].th, NULL, at_worker, &c[i]) != 0) {
+			perror("pthread_create");
+			ret = 1;
+			break;
+		}
+	}
+	n = i;
+	rpp_wait_until(&ready, n);
+	start = rpp_stat_now();
+	deadline = start + RPP_AT_TRIAL * 1000000ULL;
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+
+	rpp_lat_init(&lat, 0);
+	for (i = 0; i < n; i++) {
+		pthread_join(c[i].th, NULL);
+		if (c[i].ret != 0) {
+			ret = 1;
+			continue;
+		}
+		if (c[i].end > end) {
+			end = c[i].end;
+		}
+		bytes += c[i].bytes;
+		ops += c[i].ops;
+		rpp_lat_merge(&lat, &c[i].lat);
+	}
+	if (ret != 0) {
+		rpp_lat_free(&lat);
+		return ret;
+	}
+
+	sec = (end - start) / 1e9;
+	rpp_lat_sort(&lat);
+	r->mbps = bytes / sec / 1e6;
+	r->kops = ops / sec / 1e3;
+	r->p99 = rpp_lat_pct(&lat, 99) / 1000.0;
+	rpp_lat_free(&lat);
+	if (lat_bound == 0 || r->p99 <= lat_bound) {
+		r->score = r->mbps;
+	} else {
+		/* NOTE: out of the bound, closer is better */
+		r->score = -r->p99;
+	}
+	trials++;
+
+	printf("size %7u depth %3u signal %3u threads %2u: %10.2f MB/s "
+		"%9.1f Kops/s p99 %8.2f us\n", conf->v[AT_SIZE],
+		conf->v[AT_DEPTH], conf->v[AT_SIGNAL], conf->v[AT_THREADS],
+		r->mbps, r->kops, r->p99);
+
+	return 0;
+}
+
+/* move parameter p up, or down if up gains nothing, while it gains.
+ * 1 if best changed, -1 on error. */
+static int
+at_tune(struct at_conn *c, int p, struct at_conf *best, struct at_result *br)
+{
+	struct at_conf t;
+	struct at_result r;
+	unsigned int v;
+	int dir, moved = 0;
+
+	for (dir = 1; dir >= -1 && !moved; dir -= 2) {
+		t = *best;
+		for (;;) {
+			v = dir > 0 ? t.v[p] * 2 : t.v[p] / 2;
+			if (v < at_min(p) || v > at_max(&t, p)) {
+				break;
+			}
+			t.v[p] = v;
+			if (t.v[AT_SIGNAL] > t.v[AT_DEPTH]) {
+				t.v[AT_SIGNAL] = t.v[AT_DEPTH];
+			}
+			if (at_trial(c, &t, &r) != 0) {
+				return -1;
+			}
+			if (r.score <= br->score + fabs(br->score) * RPP_AT_GAIN) {
+				break;
+			}
+			*best = t;
+			*br = r;
+			moved = 1;
+		}
+	}
+
+	return moved;
+}
+
+static int
+at_connect(struct sockaddr *addr, struct at_conn *c)
+{
+	c->id = rpp_client_connect_sig(addr, RPP_MODE_AUTOTUNE,
+		RPP_AT_DEPTH, 2, 0);
+	if (c->id == NULL) {
+		return 1;
+	}
+	if (rpp_recv_msg(c->id, &c->info, sizeof(c->info)) != 0) {
+		return 1;
+	}
+	if (c->info.size < RPP_WL_REGION) {
+		fprintf(stderr, "autotune: server region too small\n");
+		return 1;
+	}
+	if (posix_memalign((void **)&c->local, 64, RPP_WL_REGION) != 0) {
+		perror("posix_memalign autotune");
+		c->local = NULL;
+		return 1;
+	}
+	memset(c->local, 'a', RPP_WL_REGION);
+	DEBUG_LOG("rdma_reg_msgs autotune local\n");
+	c->mr = rdma_reg_msgs(c->id, c->local, RPP_WL_REGION);
+	if (c->mr == NULL) {
+		perror("rdma_reg_msgs autotune local");
+		return 1;
+	}
+
+	/* NOTE: a signaled WRITE a trial, RPP_AT_TRIAL msec at 1 usec */
+	return rpp_lat_init(&c->lat, RPP_AT_TRIAL * 1000);
+}
+
+static void
+at_close(struct at_conn *c)
+{
+	if (c->id == NULL) {
+		return;
+	}
+	rpp_workload_close(c->id);
+	if (c->mr != NULL) {
+		rdma_dereg_mr(c->mr);
+	}
+	rpp_client_close(c->id);
+	free(c->local);
+	rpp_lat_free(&c->lat);
+}
+
+int
+rpp_autotune_client(struct sockaddr *addr)
+{
+	struct at_conn *c;
+	struct at_conf best;
+	struct at_result br;
+	char *end;
+	unsigned int i;
+	int p, pass, moved, ret = 0;
+
+	if (opts.op != NULL && strcmp(opts.op, "tput") != 0) {
+		if (strncmp(opts.op, "lat:", 4) != 0 ||
+		    (lat_bound = strtod(opts.op + 4, &end)) <= 0 ||
+		    *end != '\0') {
+			fprintf(stderr, "autotune: -o tput|lat:USEC\n");
+			return 1;
+		}
+	}
+
+	c = (struct at_conn *)calloc(RPP_AT_QPS, sizeof(*c));
+	if (c == NULL) {
+		perror("calloc at_conn");
+		return 1;
+	}
+	for (i = 0; i < RPP_AT_QPS; i++) {
+		if (at_connect(addr, &c[i]) != 0) {
+			ret = 1;
+			goto out;
+		}
+	}
+
+	memset(&best, 0, sizeof(best));
+	best.v[AT_DEPTH] = at_clamp(&best, AT_DEPTH, opts.depth);
+	best.v[AT_SIZE] = at_clamp(&best, AT_SIZE,
+		opts.size ? opts.size : DATA_SIZE);
+	best.v[AT_SIGNAL] = at_clamp(&best, AT_SIGNAL, opts.signal);
+	best.v[AT_THREADS] = at_clamp(&best, AT_THREADS, opts.threads);
+	if (at_trial(c, &best, &br) != 0) {
+		ret = 1;
+		goto out;
+	}
+	for (pass = 0; pass < RPP_AT_PASSES; pass++) {
+		moved = 0;
+		for (p = 0; p < AT_NR; p++) {
+			ret = at_tune(c, p, &best, &br);
+			if (ret < 0) {
+				ret = 1;
+				goto out;
+			}
+			moved |= ret;
+		}
+		ret = 0;
+		if (!moved) {
+			break;
+		}
+	}
+
+	printf("autotune %s: %u trials, size %u depth %u signal %u "
+		"threads %u: %.2f MB/s %.1f Kops/s p99 %.2f us\n",
+		opts.op ? opts.op : "tput", trials, best.v[AT_SIZE],
+		best.v[AT_DEPTH], best.v[AT_SIGNAL], best.v[AT_THREADS],
+		br.mbps, br.kops, br.p99);
+	if (lat_bound > 0 && br.p99 > lat_bound) {
+		printf("autotune: no configuration within p99 %.2f us\n",
+			lat_bound);
+	}
+	ret = at_save(opts.tuned, &best, &br);
+
+out:
+	for (i = 0; i < RPP_AT_QPS; i++) {
+		at_close(&c[i]);
+	}
+	free(c);
+
+	return ret;
+}
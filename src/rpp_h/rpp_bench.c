@@ -0,0 +1,106 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rpp_bench.h"
+
+int
+rpp_lat_init(struct rpp_lat *l, size_t cap)
+{
+	l->n = 0;
+	l->cap = cap;
+	l->v = (uint64_t *)malloc(cap * sizeof(uint64_t));
+	if (l->v == NULL && cap != 0) {
+		perror("malloc rpp_lat");
+		l->cap = 0;
+		return 1;
+	}
+
+	return 0;
+}
+
+void
+rpp_lat_free(struct rpp_lat *l)
+{
+	free(l->v);
+	l->v = NULL;
+	l->n = l->cap = 0;
+}
+
+int
+rpp_lat_merge(struct rpp_lat *dst, struct rpp_lat *src)
+{
+	uint64_t *v;
+
+	if (dst->n + src->n > dst->cap) {
+		v = (uint64_t *)realloc(dst->v,
+			(dst->n + src->n) * sizeof(uint64_t));
+		if (v == NULL) {
+			perror("realloc rpp_lat");
+			return 1;
+		}
+		dst->v = v;
+		dst->cap = dst->n + src->n;
+	}
+	memcpy(dst->v + dst->n, src->v, src->n * sizeof(uint64_t));
+	dst->n += src->n;
+
+	return 0;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+void
+rpp_lat_sort(struct rpp_lat *l)
+{
+	qsort(l->v, l->n, sizeof(uint64_t), cmp_u64);
+}
+
+/* l must be sorted */
+uint64_t
+rpp_lat_pct(struct rpp_lat *l, double pct)
+{
+	size_t i;
+
+	if (l->n == 0) {
+		return 0;
+	}
+	i = (size_t)(l->n * pct / 100.0);
+	if (i >= l->n) {
+		i = l->n - 1;
+	}
+
+	return l->v[i];
+}
+
+void
+rpp_lat_report(const char *label, struct rpp_lat *l)
+{
+	double sum = 0;
+	size_t i;
+
+	if (l->n == 0) {
+		printf("%s: no samples\n", label);
+		return;
+	}
+	rpp_lat_sort(l);
+	for (i = 0; i < l->n; i++) {
+		sum += l->v[i];
+	}
+	printf("%s usec: avg %.2f p50 %.2f p99 %.2f p99.9 %.2f max %.2f "
+		"(%zu samples)\n", label, sum / l->n / 1000.0,
+		rpp_lat_pct(l, 50) / 1000.0, rpp_lat_pct(l, 99) / 1000.0,
+		rpp_lat_pct(l, 99.9) / 1000.0, l->v[l->n - 1] / 1000.0, l->n);
+}
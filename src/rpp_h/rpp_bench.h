@@ -0,0 +1,62 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#ifndef RPP_BENCH_H
+#define RPP_BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/* latency samples of the benchmark modes.
+ *
+ * each worker thread records into its own rpp_lat, and the results are
+ * merged after the run. samples beyond 'cap' are not recorded.
+ */
+struct rpp_lat {
+	uint64_t *v;	/* nsec */
+	size_t n;
+	size_t cap;
+};
+
+int rpp_lat_init(struct rpp_lat *l, size_t cap);
+void rpp_lat_free(struct rpp_lat *l);
+int rpp_lat_merge(struct rpp_lat *dst, struct rpp_lat *src);
+void rpp_lat_sort(struct rpp_lat *l);
+uint64_t rpp_lat_pct(struct rpp_lat *l, double pct);
+void rpp_lat_report(const char *label, struct rpp_lat *l);
+
+static inline void
+rpp_lat_add(struct rpp_lat *l, uint64_t ns)
+{
+	if (l->n < l->cap) {
+		l->v[l->n++] = ns;
+	}
+}
+
+/* start gate of the worker threads: spin (with a short sleep) until
+ * *var reaches val. */
+static inline void
+rpp_wait_until(unsigned int *var, unsigned int val)
+{
+	while (__atomic_load_n(var, __ATOMIC_ACQUIRE) < val) {
+		usleep(10);
+	}
+}
+
+/* cheap per-thread PRNG of the benchmark modes */
+static inline uint64_t
+rpp_xorshift64(uint64_t *s)
+{
+	uint64_t x = *s;
+
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*s = x;
+
+	return x;
+}
+
+#endif /* RPP_BENCH_H */
@@ -0,0 +1,307 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "rpp_h.h"
+#include "rpp_bench.h"
+
+/* burst mode: the client sends messages in bursts of -q sends without
+ * waiting for the server, the server handles them one by one with
+ * rpp_recv_msg. run it with and without -R to see what the receive
+ * ring does to RNR NAKs and the message rate.
+ *
+ * RNR counts come from the hw_counters of the port in sysfs: RNR
+ * NAKs the sender got on the client (burst_rnr_counter, the name is
+ * device specific) and out_of_buffer (messages which found no
+ * receive) on the server. they are counters of the port, not of the
+ * session.
+ *
+ * NOTE: rnr_nak_retry_err is not one, it counts RNR retries exceeded,
+ * which never happens with rnr_retry_count 7.
+ */
+
+enum burst_op {
+	BURST_OP_DATA = 1,
+	BURST_OP_END,
+};
+
+struct burst_msg {
+	uint32_t op;
+	uint32_t pad;
+	uint64_t count;		/* END reply: messages received */
+	uint64_t oob;		/* END reply: out_of_buffer of the server */
+};
+
+/* value of a port counter, or -1 if the device has no such counter */
+static int64_t
+burst_hw_counter(struct rdma_cm_id *id, const char *name)
+{
+	char path[256];
+	unsigned long long val;
+	FILE *fp;
+	int n;
+
+	snprintf(path, sizeof(path),
+		"/sys/class/infiniband/%s/ports/%u/hw_counters/%s",
+		ibv_get_device_name(id->verbs->device), id->port_num, name);
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		return -1;
+	}
+	n = fscanf(fp, "%llu", &val);
+	fclose(fp);
+
+	return n == 1 ? (int64_t)val : -1;
+}
+
+/* counters of RNR NAKs received by the requester */
+static const char *burst_rnr_counter[] = {
+	"rcvd_rnr_err",		/* rxe */
+	NULL,
+};
+
+/* RNR NAKs the port got, or -1 if the device has no counter of them */
+static int64_t
+burst_rnr_naks(struct rdma_cm_id *id)
+{
+	int64_t val;
+	int i;
+
+	for (i = 0; burst_rnr_counter[i] != NULL; i++) {
+		val = burst_hw_counter(id, burst_rnr_counter[i]);
+		if (val >= 0) {
+			return val;
+		}
+	}
+
+	return -1;
+}
+
+int
+rpp_burst_server(struct rdma_cm_id *id)
+{
+	struct burst_msg msg;
+	uint64_t count = 0;
+	int64_t oob;
+	int ret;
+
+	oob = burst_hw_counter(id, "out_of_buffer");
+	for (;;) {
+		ret = rpp_recv_msg(id, &msg, sizeof(msg));
+		if (ret != 0) {
+			return ret;
+		}
+		if (msg.op != BURST_OP_DATA) {
+			break;
+		}
+		count++;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = BURST_OP_END;
+	msg.count = count;
+	msg.oob = (uint64_t)-1;
+	if (oob >= 0) {
+		msg.oob = burst_hw_counter(id, "out_of_buffer") - oob;
+	}
+	rpp_log("burst: %lu messages, out_of_buffer %ld\n", count,
+		(int64_t)msg.oob);
+
+	return rpp_send_msg(id, &msg, sizeof(msg));
+}
+
+struct burst_worker {
+	pthread_t th;
+	struct sockaddr *addr;
+	struct rdma_cm_id *id;
+	struct rpp_lat lat;	/* per burst */
+	uint64_t sent;
+	uint64_t received;
+	uint64_t oob;
+	uint64_t start;
+	uint64_t end;
+	int ret;
+};
+
+static unsigned int nstarted;
+static unsigned int ready;
+static unsigned int go;
+
+static void *
+burst_worker(void *arg)
+{
+	struct burst_worker *w = (struct burst_worker *)arg;
+	struct rdma_cm_id *id;
+	struct rpp_context *ct;
+	struct burst_msg msg;
+	unsigned int i, n, signaled;
+	uint64_t t;
+	int flags;
+
+	w->ret = 1;
+	id = rpp_client_connect_sig(w->addr, RPP_MODE_BURST, opts.depth, 2,
+		opts.signal <= 1);
+	w->id = id;
+	__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+	if (id == NULL) {
+		return NULL;
+	}
+	ct = id->context;
+	rpp_wait_until(&go, 1);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = BURST_OP_DATA;
+	memcpy(ct->send_msg, &msg, sizeof(msg));
+
+	/* NOTE: every send of a burst reads the same send_msg */
+	w->start = rpp_stat_now();
+	while (w->sent < opts.count) {
+		n = opts.count - w->sent < opts.depth ?
+			opts.count - w->sent : opts.depth;
+		t = rpp_stat_now();
+		/* NOTE: with -C signal n, every n-th and the last send of
+		 * a burst complete */
+		signaled = 0;
+		for (i = 0; i < n; i++) {
+			flags = 0;
+			if (opts.signal <= 1 || i % opts.signal ==
+			    opts.signal - 1 || i == n - 1) {
+				flags = IBV_SEND_SIGNALED;
+				signaled++;
+			}
+			if (rdma_post_send(id, NULL, ct->send_msg, sizeof(msg),
+					ct->send_mr, flags) != 0) {
+				perror("rdma_post_send");
+				goto close;
+			}
+		}
+		if (rpp_poll_send_comp(id, signaled) != 0) {
+			goto close;
+		}
+		rpp_lat_add(&w->lat, rpp_stat_now() - t);
+		w->sent += n;
+	}
+
+	msg.op = BURST_OP_END;
+	if (rpp_send_msg(id, &msg, sizeof(msg)) != 0 ||
+	    rpp_recv_msg(id, &msg, sizeof(msg)) != 0) {
+		goto close;
+	}
+	w->end = rpp_stat_now();
+	w->received = msg.count;
+	w->oob = msg.oob;
+	w->ret = 0;
+
+close:
+	/* NOTE: the id is closed by the main thread after it read the
+	 * port counters */
+	return NULL;
+}
+
+int
+rpp_burst_client(struct sockaddr *addr)
+{
+	struct burst_worker *w;
+	struct rpp_lat lat;
+	uint64_t sent = 0, received = 0, oob = 0;
+	int64_t rnr = -1, rnr_end;
+	double rate = 0;
+	unsigned int i;
+	int ret = 0;
+
+	if (opts.threads == 0 || opts.depth == 0) {
+		fprintf(stderr, "burst: threads and depth must be > 0\n");
+		return 1;
+	}
+
+	w = (struct burst_worker *)calloc(opts.threads, sizeof(*w));
+	if (w == NULL) {
+		perror("calloc burst_worker");
+		return 1;
+	}
+
+	for (i = 0; i < opts.threads; i++) {
+		w[i].addr = addr;
+		if (rpp_lat_init(&w[i].lat,
+				opts.count / opts.depth + 1) != 0) {
+			ret = 1;
+			break;
+		}
+		if (pthread_create(&w[i].th, NULL, burst_worker,
+				&w[i]) != 0) {
+			perror("pthread_create");
+			rpp_lat_free(&w[i].lat);
+			ret = 1;
+			break;
+		}
+	}
+	opts.threads = i;
+	nstarted = i;
+
+	rpp_wait_until(&ready, nstarted);
+	for (i = 0; i < opts.threads; i++) {
+		if (w[i].id != NULL) {
+			rnr = burst_rnr_naks(w[i].id);
+			break;
+		}
+	}
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+
+	rpp_lat_init(&lat, 0);
+	for (i = 0; i < opts.threads; i++) {
+		pthread_join(w[i].th, NULL);
+	}
+	for (i = 0; i < opts.threads; i++) {
+		if (w[i].id != NULL && rnr >= 0) {
+			rnr_end = burst_rnr_naks(w[i].id);
+			rnr = rnr_end >= 0 ? rnr_end - rnr : -1;
+			break;
+		}
+	}
+	for (i = 0; i < opts.threads; i++) {
+		if (w[i].ret != 0) {
+			ret = 1;
+		} else if (w[i].end > w[i].start) {
+			rate += w[i].received /
+				((w[i].end - w[i].start) / 1e9);
+		}
+		sent += w[i].sent;
+		received += w[i].received;
+		/* NOTE: a port counter. every session reports the same. */
+		if (w[i].oob != (uint64_t)-1 && w[i].oob > oob) {
+			oob = w[i].oob;
+		}
+		rpp_lat_merge(&lat, &w[i].lat);
+		rpp_lat_free(&w[i].lat);
+		if (w[i].id != NULL) {
+			rpp_client_close(w[i].id);
+		}
+	}
+
+	printf("burst: threads %u, burst %u, recv depth %u: "
+		"%lu sent, %lu received, %.3f Kmsg/s\n", opts.threads,
+		opts.depth, opts.recv_depth, sent, received, rate / 1e3);
+	if (rnr >= 0) {
+		printf("rnr naks %ld, ", rnr);
+	} else {
+		printf("rnr naks n/a, ");
+	}
+	printf("server out_of_buffer %lu\n", oob);
+	rpp_lat_report("burst", &lat);
+	if (received != sent) {
+		ret = 1;
+	}
+
+	rpp_lat_free(&lat);
+	free(w);
+
+	return ret;
+}
@@ -0,0 +1,259 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <poll.h>
+
+#include "rpp_h.h"
+#include "rpp_cpool.h"
+
+/* called by the background thread (or create) only */
+static int
+cpool_connect(struct rpp_cpool *p, struct rpp_cpool_conn *c)
+{
+	struct rdma_cm_id *id;
+
+	id = rpp_client_connect((struct sockaddr *)&p->addr, p->mode,
+		p->send_wr, p->recv_wr);
+	if (id == NULL) {
+		return 1;
+	}
+	if (p->init != NULL && p->init(id) != 0) {
+		rpp_client_close(id);
+		return 1;
+	}
+
+	/* NOTE: CM events of the connection (DISCONNECTED etc.) come to
+	 * the pool's channel from now on. */
+	DEBUG_LOG("rdma_migrate_id cpool\n");
+	if (rdma_migrate_id(id, p->ch) != 0) {
+		perror("rdma_migrate_id");
+		rpp_client_close(id);
+		return 1;
+	}
+
+	c->id = id;
+	__atomic_store_n(&c->dead, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&c->state, RPP_CP_READY, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+static void
+cpool_mark_dead(struct rpp_cpool_conn *c)
+{
+	unsigned int ready = RPP_CP_READY;
+
+	__atomic_store_n(&c->dead, 1, __ATOMIC_RELEASE);
+	/* if lent, rpp_cpool_put sees 'dead' */
+	__atomic_compare_exchange_n(&c->state, &ready, RPP_CP_DEAD, 0,
+		__ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+static void
+cpool_event(struct rpp_cpool *p)
+{
+	struct rdma_cm_event *event;
+	unsigned int i;
+
+	if (rdma_get_cm_event(p->ch, &event) != 0) {
+		perror("rdma_get_cm_event cpool");
+		return;
+	}
+	DEBUG_LOG("cpool event %s\n", rdma_event_str(event->event));
+	switch (event->event) {
+	case RDMA_CM_EVENT_DISCONNECTED:
+	case RDMA_CM_EVENT_DEVICE_REMOVAL:
+	case RDMA_CM_EVENT_ADDR_CHANGE:
+		for (i = 0; i < p->n; i++) {
+			if (p->conn[i].id == event->id) {
+				cpool_mark_dead(&p->conn[i]);
+				break;
+			}
+		}
+		break;
+	default:
+		break;
+	}
+	rdma_ack_cm_event(event);
+}
+
+static void *
+cpool_thread(void *arg)
+{
+	struct rpp_cpool *p = (struct rpp_cpool *)arg;
+	struct rpp_cpool_conn *c;
+	struct pollfd pfd;
+	unsigned int i;
+
+	pfd.fd = p->ch->fd;
+	pfd.events = POLLIN;
+	while (!__atomic_load_n(&p->stop, __ATOMIC_ACQUIRE)) {
+		/* NOTE: the timeout paces reconnect attempts */
+		if (poll(&pfd, 1, 100) > 0) {
+			cpool_event(p);
+		}
+
+		for (i = 0; i < p->n; i++) {
+			c = &p->conn[i];
+			if (__atomic_load_n(&c->state, __ATOMIC_ACQUIRE) !=
+					RPP_CP_DEAD) {
+				continue;
+			}
+			if (c->id != NULL) {
+				rpp_client_close(c->id);
+				c->id = NULL;
+			}
+			if (cpool_connect(p, c) == 0) {
+				__atomic_add_fetch(&p->reconnects, 1,
+					__ATOMIC_RELAXED);
+				rpp_log("cpool: connection %u reconnected\n",
+					i);
+			}
+		}
+	}
+
+	return NULL;
+}
+
+struct rpp_cpool *
+rpp_cpool_create(struct sockaddr *addr, int mode, unsigned int n,
+	uint32_t send_wr, uint32_t recv_wr,
+	int (*init)(struct rdma_cm_id *id),
+	void (*fini)(struct rdma_cm_id *id))
+{
+	struct rpp_cpool *p;
+	unsigned int i, nready = 0;
+
+	p = (struct rpp_cpool *)calloc(1, sizeof(*p) +
+		n * sizeof(struct rpp_cpool_conn));
+	if (p == NULL) {
+		perror("calloc rpp_cpool");
+		return NULL;
+	}
+	memcpy(&p->addr, addr, addr->sa_family == AF_INET6 ?
+		sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+	p->mode = mode;
+	p->n = n;
+	p->send_wr = send_wr;
+	p->recv_wr = recv_wr;
+	p->init = init;
+	p->fini = fini;
+
+	p->ch = rdma_create_event_channel();
+	if (p->ch == NULL) {
+		perror("rdma_create_event_channel");
+		free(p);
+		return NULL;
+	}
+
+	/* warm up. failed ones are retried by the background thread. */
+	for (i = 0; i < n; i++) {
+		if (cpool_connect(p, &p->conn[i]) == 0) {
+			nready++;
+		} else {
+			p->conn[i].state = RPP_CP_DEAD;
+		}
+	}
+	if (nready == 0) {
+		fprintf(stderr, "cpool: no connection\n");
+		rpp_cpool_destroy(p);
+		return NULL;
+	}
+
+	if (pthread_create(&p->th, NULL, cpool_thread, p) != 0) {
+		perror("pthread_create cpool");
+		rpp_cpool_destroy(p);
+		return NULL;
+	}
+	p->started = 1;
+
+	return p;
+}
+
+/* never blocks. NULL if every connection is lent or dead. */
+struct rpp_cpool_conn *
+rpp_cpool_get(struct rpp_cpool *p)
+{
+	struct rpp_cpool_conn *c;
+	unsigned int start, i;
+	unsigned int ready;
+
+	start = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED);
+	for (i = 0; i < p->n; i++) {
+		c = &p->conn[(start + i) % p->n];
+		ready = RPP_CP_READY;
+		if (__atomic_load_n(&c->state, __ATOMIC_RELAXED) ==
+				RPP_CP_READY &&
+		    __atomic_compare_exchange_n(&c->state, &ready,
+				RPP_CP_BUSY, 0, __ATOMIC_ACQUIRE,
+				__ATOMIC_RELAXED)) {
+			return c;
+		}
+	}
+	__atomic_add_fetch(&p->misses, 1, __ATOMIC_RELAXED);
+
+	return NULL;
+}
+
+/* connections which are not dead (ready or lent) */
+unsigned int
+rpp_cpool_live(struct rpp_cpool *p)
+{
+	unsigned int i, n = 0;
+
+	for (i = 0; i < p->n; i++) {
+		if (__atomic_load_n(&p->conn[i].state, __ATOMIC_ACQUIRE) !=
+				RPP_CP_DEAD) {
+			n++;
+		}
+	}
+
+	return n;
+}
+
+/* broken: the caller saw an error on the connection */
+void
+rpp_cpool_put(struct rpp_cpool *p, struct rpp_cpool_conn *c, int broken)
+{
+	if (broken) {
+		__atomic_store_n(&c->dead, 1, __ATOMIC_RELAXED);
+	}
+	if (__atomic_load_n(&c->dead, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&c->state, RPP_CP_DEAD, __ATOMIC_RELEASE);
+	} else {
+		__atomic_store_n(&c->state, RPP_CP_READY, __ATOMIC_RELEASE);
+	}
+}
+
+/* every connection must have been put back */
+void
+rpp_cpool_destroy(struct rpp_cpool *p)
+{
+	struct rpp_cpool_conn *c;
+	unsigned int i;
+
+	__atomic_store_n(&p->stop, 1, __ATOMIC_RELEASE);
+	if (p->started) {
+		pthread_join(p->th, NULL);
+	}
+
+	for (i = 0; i < p->n; i++) {
+		c = &p->conn[i];
+		if (c->id == NULL) {
+			continue;
+		}
+		if (c->state == RPP_CP_READY && !c->dead && p->fini != NULL) {
+			p->fini(c->id);
+		}
+		rpp_client_close(c->id);
+	}
+	rdma_destroy_event_channel(p->ch);
+	free(p);
+}
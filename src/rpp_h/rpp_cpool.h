@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#ifndef RPP_CPOOL_H
+#define RPP_CPOOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <rdma/rdma_cma.h>
+
+/* rpp_cpool: client side connection pool.
+ *
+ * the pool keeps n connections to one server, each with its QP and
+ * buffers (rpp_client_connect) ready. rpp_cpool_get lends a connection
+ * without blocking and without calling rdma_cm; it returns NULL if all
+ * are in use. a background thread watches CM events of the connections
+ * (they are migrated to the pool's event channel) and reconnects the
+ * ones which are disconnected or returned as broken.
+ *
+ * init (if not NULL) is called on every new connection before it is
+ * lent, fini (if not NULL) on every healthy connection before it is
+ * closed by rpp_cpool_destroy.
+ */
+
+enum {
+	RPP_CP_READY,		/* can be lent */
+	RPP_CP_BUSY,		/* lent */
+	RPP_CP_DEAD,		/* the background thread reconnects it */
+};
+
+struct rpp_cpool_conn {
+	struct rdma_cm_id *id;
+	unsigned int state;
+	unsigned int dead;	/* disconnected while lent */
+} __attribute__((aligned(64)));
+
+struct rpp_cpool {
+	struct sockaddr_storage addr;
+	int mode;
+	uint32_t send_wr;
+	uint32_t recv_wr;
+	int (*init)(struct rdma_cm_id *id);
+	void (*fini)(struct rdma_cm_id *id);
+	struct rdma_event_channel *ch;
+	pthread_t th;
+	int started;
+	unsigned int stop;
+	unsigned int next;	/* where rpp_cpool_get starts to look */
+	uint64_t reconnects;
+	uint64_t misses;	/* rpp_cpool_get found nothing */
+	unsigned int n;
+	struct rpp_cpool_conn conn[];
+};
+
+struct rpp_cpool *rpp_cpool_create(struct sockaddr *addr, int mode,
+	unsigned int n, uint32_t send_wr, uint32_t recv_wr,
+	int (*init)(struct rdma_cm_id *id),
+	void (*fini)(struct rdma_cm_id *id));
+struct rpp_cpool_conn *rpp_cpool_get(struct rpp_cpool *p);
+unsigned int rpp_cpool_live(struct rpp_cpool *p);
+void rpp_cpool_put(struct rpp_cpool *p, struct rpp_cpool_conn *c,
+	int broken);
+void rpp_cpool_destroy(struct rpp_cpool *p);
+
+#endif /* RPP_CPOOL_H */
@@ -0,0 +1,389 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "rpp_h.h"
+#include "rpp_bench.h"
+
+/* crc mode: end-to-end integrity of bulk RDMA READ.
+ *
+ * the server (the sender of the data) has a region of RPP_CRC_REGION
+ * bytes. for a chunk size the client asks for, it stores the CRC32C
+ * of each chunk in the last 4 bytes of the chunk. the client READs the
+ * region chunk by chunk with -q READs in flight and verifies a chunk
+ * as soon as its READ completes, while the following READs are still
+ * on the wire. each chunk size is run without and with verification,
+ * so the output shows what the check costs.
+ */
+
+#ifndef RPP_CRC_REGION
+#define RPP_CRC_REGION (64UL << 20)
+#endif
+#define RPP_CRC_LOOPS 8		/* READs of the region per pass */
+#define RPP_CRC_MIN (4U << 10)
+#define RPP_CRC_MAX (4U << 20)
+
+enum crc_op {
+	CRC_OP_PREP = 1,
+	CRC_OP_DONE,
+};
+
+struct crc_msg {
+	uint32_t op;
+	uint32_t status;
+	uint32_t size;		/* PREP: chunk size */
+	uint32_t rkey;
+	uint64_t addr;
+	uint64_t len;
+	uint64_t prep_ns;	/* time to checksum the region */
+};
+
+/* checksum every chunk of size into its last 4 bytes */
+static void
+crc_seal(char *buf, uint64_t len, uint32_t size)
+{
+	uint64_t off;
+	uint32_t crc;
+
+	for (off = 0; off + size <= len; off += size) {
+		crc = rpp_crc32c(0, buf + off, size - 4);
+		memcpy(buf + off + size - 4, &crc, 4);
+	}
+}
+
+static int
+crc_check(const char *chunk, uint32_t size)
+{
+	uint32_t crc;
+
+	memcpy(&crc, chunk + size - 4, 4);
+
+	return rpp_crc32c(0, chunk, size - 4) == crc;
+}
+
+static char *
+crc_alloc(uint64_t len)
+{
+	char *buf;
+	uint64_t s = 0x9e3779b97f4a7c15ULL, i;
+
+	if (posix_memalign((void **)&buf, 4096, len) != 0) {
+		perror("posix_memalign crc region");
+		return NULL;
+	}
+	for (i = 0; i + 8 <= len; i += 8) {
+		*(uint64_t *)(buf + i) = rpp_xorshift64(&s);
+	}
+
+	return buf;
+}
+
+int
+rpp_crc_server(struct rdma_cm_id *id)
+{
+	struct crc_msg msg;
+	struct ibv_mr *mr;
+	char *region;
+	uint64_t t;
+	int ret = 1;
+
+	region = crc_alloc(RPP_CRC_REGION);
+	if (region == NULL) {
+		return 1;
+	}
+	DEBUG_LOG("rdma_reg_read crc region\n");
+	mr = rdma_reg_read(id, region, RPP_CRC_REGION);
+	if (mr == NULL) {
+		perror("rdma_reg_read crc region");
+		free(region);
+		return 1;
+	}
+	rpp_stat_mr(1);
+
+	for (;;) {
+		if (rpp_recv_msg(id, &msg, sizeof(msg)) != 0) {
+			goto out;
+		}
+		if (msg.op != CRC_OP_PREP) {
+			break;
+		}
+		msg.status = 0;
+		if (msg.size < RPP_CRC_MIN || msg.size > RPP_CRC_MAX ||
+		    RPP_CRC_REGION % msg.size != 0) {
+			msg.status = 1;
+		} else {
+			t = rpp_stat_now();
+			crc_seal(region, RPP_CRC_REGION, msg.size);
+			msg.prep_ns = rpp_stat_now() - t;
+			msg.addr = (uint64_t)region;
+			msg.rkey = mr->rkey;
+			msg.len = RPP_CRC_REGION;
+		}
+		if (rpp_send_msg(id, &msg, sizeof(msg)) != 0) {
+			goto out;
+		}
+	}
+	ret = 0;
+
+out:
+	DEBUG_LOG("rdma_dereg_mr crc region\n");
+	if (rdma_dereg_mr(mr) != 0) {
+		perror("rdma_dereg_mr crc region");
+	}
+	rpp_stat_mr(-1);
+	free(region);
+
+	return ret;
+}
+
+#define CRC_NSIZE 6	/* 4KB .. 4MB */
+
+struct crc_result {
+	uint64_t plain_ns;
+	uint64_t verify_ns;
+	uint64_t bytes;
+	uint64_t errors;
+	uint64_t crc_ns;	/* local verification only */
+	uint64_t prep_ns;
+};
+
+struct crc_worker {
+	pthread_t th;
+	struct sockaddr *addr;
+	struct crc_result r[CRC_NSIZE];
+	int ret;
+};
+
+static pthread_barrier_t crc_barrier;
+static unsigned int go;
+
+/* READ the remote region RPP_CRC_LOOPS times, verifying each chunk if
+ * 'verify'. returns the number of bad chunks, or -1 on error. */
+static int64_t
+crc_pass(struct rdma_cm_id *id, struct ibv_mr *mr, char *local,
+	struct crc_msg *info, uint32_t size, unsigned int depth, int verify)
+{
+	struct ibv_wc wc[16];
+	uint64_t nchunks = info->len / size;
+	uint64_t total = nchunks * RPP_CRC_LOOPS;
+	uint64_t posted = 0, done = 0, i;
+	int64_t bad = 0;
+	int n, k;
+
+	/* NOTE: the chunks in flight must not wrap around the region */
+	if (depth > nchunks) {
+		depth = nchunks;
+	}
+	while (done < total) {
+		while (posted < total && posted - done < depth) {
+			i = posted % nchunks;
+			if (rdma_post_read(id, (void *)(uintptr_t)i,
+					local + i * size, size, mr, 0,
+					info->addr + i * size,
+					info->rkey) != 0) {
+				perror("rdma_post_read");
+				return -1;
+			}
+			posted++;
+		}
+		n = ibv_poll_cq(id->send_cq, 16, wc);
+		if (n < 0) {
+			perror("ibv_poll_cq");
+			return -1;
+		}
+		for (k = 0; k < n; k++) {
+			if (wc[k].status != IBV_WC_SUCCESS) {
+				fprintf(stderr, "crc: READ %s\n",
+					ibv_wc_status_str(wc[k].status));
+				return -1;
+			}
+			/* NOTE: the next READs are in flight meanwhile */
+			if (verify && !crc_check(local + wc[k].wr_id * size,
+					size)) {
+				bad++;
+			}
+			done++;
+		}
+	}
+
+	return bad;
+}
+
+static void *
+crc_worker(void *arg)
+{
+	struct crc_worker *w = (struct crc_worker *)arg;
+	struct rdma_cm_id *id;
+	struct ibv_mr *mr = NULL;
+	struct crc_result *r;
+	struct crc_msg msg;
+	char *local;
+	uint32_t size;
+	uint64_t t, off;
+	int64_t bad;
+	int i, failed = 0;
+
+	w->ret = 1;
+	rpp_wait_until(&go, 1);
+	local = crc_alloc(RPP_CRC_REGION);
+	id = rpp_client_connect(w->addr, RPP_MODE_CRC, opts.depth, 2);
+	if (id != NULL && local != NULL) {
+		DEBUG_LOG("rdma_reg_msgs crc local\n");
+		mr = rdma_reg_msgs(id, local, RPP_CRC_REGION);
+		if (mr == NULL) {
+			perror("rdma_reg_msgs crc local");
+		}
+	}
+	if (mr == NULL) {
+		failed = 1;
+	}
+
+	for (i = 0, size = RPP_CRC_MIN; i < CRC_NSIZE; i++, size <<= 2) {
+		/* NOTE: a failed worker still goes through the barriers */
+		pthread_barrier_wait(&crc_barrier);
+		if (failed) {
+			pthread_barrier_wait(&crc_barrier);
+			continue;
+		}
+		r = &w->r[i];
+		memset(&msg, 0, sizeof(msg));
+		msg.op = CRC_OP_PREP;
+		msg.size = size;
+		if (rpp_send_msg(id, &msg, sizeof(msg)) != 0 ||
+		    rpp_recv_msg(id, &msg, sizeof(msg)) != 0 ||
+		    msg.status != 0) {
+			failed = 1;
+		}
+		r->prep_ns = msg.prep_ns;
+		r->bytes = msg.len / size * size * RPP_CRC_LOOPS;
+
+		/* all servers sealed before anyone READs */
+		pthread_barrier_wait(&crc_barrier);
+		if (failed) {
+			continue;
+		}
+		t = rpp_stat_now();
+		bad = crc_pass(id, mr, local, &msg, size, opts.depth, 0);
+		r->plain_ns = rpp_stat_now() - t;
+		if (bad < 0) {
+			failed = 1;
+			continue;
+		}
+
+		t = rpp_stat_now();
+		bad = crc_pass(id, mr, local, &msg, size, opts.depth, 1);
+		r->verify_ns = rpp_stat_now() - t;
+		if (bad < 0) {
+			failed = 1;
+			continue;
+		}
+		r->errors = bad;
+
+		/* verification alone, on data already here */
+		t = rpp_stat_now();
+		for (off = 0; off + size <= msg.len; off += size) {
+			crc_check(local + off, size);
+		}
+		r->crc_ns = rpp_stat_now() - t;
+	}
+	if (!failed) {
+		w->ret = 0;
+	}
+
+	if (id != NULL) {
+		memset(&msg, 0, sizeof(msg));
+		msg.op = CRC_OP_DONE;
+		rpp_send_msg(id, &msg, sizeof(msg));
+		if (mr != NULL) {
+			rdma_dereg_mr(mr);
+		}
+		rpp_client_close(id);
+	}
+	free(local);
+
+	return NULL;
+}
+
+int
+rpp_crc_client(struct sockaddr *addr)
+{
+	struct crc_worker *w;
+	struct crc_result *r;
+	double plain, verify, crc, prep;
+	uint64_t errors;
+	unsigned int i, n;
+	uint32_t size;
+	int j, ret = 0;
+
+	if (opts.threads == 0 || opts.depth == 0) {
+		fprintf(stderr, "crc: threads and depth must be > 0\n");
+		return 1;
+	}
+
+	w = (struct crc_worker *)calloc(opts.threads, sizeof(*w));
+	if (w == NULL) {
+		perror("calloc crc_worker");
+		return 1;
+	}
+
+	for (n = 0; n < opts.threads; n++) {
+		w[n].addr = addr;
+		if (pthread_create(&w[n].th, NULL, crc_worker, &w[n]) != 0) {
+			perror("pthread_create");
+			ret = 1;
+			break;
+		}
+	}
+	/* NOTE: the barrier counts the workers which started */
+	if (n > 0) {
+		pthread_barrier_init(&crc_barrier, NULL, n);
+	}
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+	for (i = 0; i < n; i++) {
+		pthread_join(w[i].th, NULL);
+		if (w[i].ret != 0) {
+			ret = 1;
+		}
+	}
+	if (n > 0) {
+		pthread_barrier_destroy(&crc_barrier);
+	}
+
+	printf("crc: threads %u, depth %u, region %lu MB\n", opts.threads,
+		opts.depth, RPP_CRC_REGION >> 20);
+	for (j = 0, size = RPP_CRC_MIN; j < CRC_NSIZE; j++, size <<= 2) {
+		plain = verify = crc = prep = 0;
+		errors = 0;
+		for (i = 0; i < n; i++) {
+			r = &w[i].r[j];
+			if (r->plain_ns == 0 || r->verify_ns == 0) {
+				continue;
+			}
+			plain += r->bytes * 8.0 / r->plain_ns;
+			verify += r->bytes * 8.0 / r->verify_ns;
+			crc += (double)r->bytes / RPP_CRC_LOOPS / r->crc_ns;
+			prep += (double)r->bytes / RPP_CRC_LOOPS / r->prep_ns;
+			errors += r->errors;
+		}
+		printf("%7u: read %.2f Gb/s, verified %.2f Gb/s (%+.1f%%), "
+			"crc %.2f GB/s/core, sender %.2f GB/s/core, "
+			"errors %lu\n", size, plain, verify,
+			plain > 0 ? (verify - plain) * 100 / plain : 0,
+			n ? crc / n : 0, n ? prep / n : 0, errors);
+		if (errors > 0) {
+			ret = 1;
+		}
+	}
+
+	free(w);
+
+	return ret;
+}
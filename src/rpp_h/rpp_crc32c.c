@@ -0,0 +1,246 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "rpp_h.h"
+
+/* CRC32C (Castagnoli) of the data integrity check.
+ *
+ * on x86_64 with SSE4.2 the crc32 instruction is used. one crc32
+ * takes 3 cycles but a new one can start every cycle, so the buffer
+ * is split in three streams which are checksummed in parallel and
+ * combined by "shifting" the first two over the length of the others
+ * (multiplication by x^(8*len) mod P, done by table lookup).
+ * elsewhere, slicing-by-8 tables are used.
+ *
+ * the method is the one of Mark Adler's crc32c.c.
+ */
+
+#define CRC32C_POLY 0x82f63b78	/* reflected */
+#define CRC32C_LONG 8192
+#define CRC32C_SHORT 256
+
+static uint32_t crc32c_table[8][256];
+static uint32_t crc32c_long[4][256];
+static uint32_t crc32c_short[4][256];
+static int crc32c_hw;
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+
+static uint32_t
+gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	while (vec) {
+		if (vec & 1) {
+			sum ^= *mat;
+		}
+		vec >>= 1;
+		mat++;
+	}
+
+	return sum;
+}
+
+static void
+gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+	int n;
+
+	for (n = 0; n < 32; n++) {
+		square[n] = gf2_matrix_times(mat, mat[n]);
+	}
+}
+
+/* operator which appends len (a power of 2) zero bytes to a crc */
+static void
+crc32c_zeros_op(uint32_t *even, size_t len)
+{
+	uint32_t odd[32];
+	uint32_t row = 1;
+	int n;
+
+	/* one zero bit */
+	odd[0] = CRC32C_POLY;
+	for (n = 1; n < 32; n++) {
+		odd[n] = row;
+		row <<= 1;
+	}
+	gf2_matrix_square(even, odd);	/* two bits */
+	gf2_matrix_square(odd, even);	/* four bits */
+
+	/* the first square gives one byte in even, the next two bytes
+	 * in odd, ... */
+	do {
+		gf2_matrix_square(even, odd);
+		len >>= 1;
+		if (len == 0) {
+			return;
+		}
+		gf2_matrix_square(odd, even);
+		len >>= 1;
+	} while (len);
+
+	memcpy(even, odd, sizeof(odd));
+}
+
+static void
+crc32c_zeros(uint32_t zeros[][256], size_t len)
+{
+	uint32_t op[32];
+	uint32_t n;
+
+	crc32c_zeros_op(op, len);
+	for (n = 0; n < 256; n++) {
+		zeros[0][n] = gf2_matrix_times(op, n);
+		zeros[1][n] = gf2_matrix_times(op, n << 8);
+		zeros[2][n] = gf2_matrix_times(op, n << 16);
+		zeros[3][n] = gf2_matrix_times(op, n << 24);
+	}
+}
+
+static inline uint32_t
+crc32c_shift(uint32_t zeros[][256], uint32_t crc)
+{
+	return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+		zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static void
+crc32c_init(void)
+{
+	uint32_t n, crc, k;
+
+	for (n = 0; n < 256; n++) {
+		crc = n;
+		for (k = 0; k < 8; k++) {
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		}
+		crc32c_table[0][n] = crc;
+	}
+	for (n = 0; n < 256; n++) {
+		crc = crc32c_table[0][n];
+		for (k = 1; k < 8; k++) {
+			crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+			crc32c_table[k][n] = crc;
+		}
+	}
+
+	crc32c_zeros(crc32c_long, CRC32C_LONG);
+	crc32c_zeros(crc32c_short, CRC32C_SHORT);
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+/* NOTE: little endian only, as the rest of rpp_h */
+static uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *next, size_t len)
+{
+	uint64_t w;
+
+	while (len && ((uintptr_t)next & 7) != 0) {
+		crc = crc32c_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	while (len >= 8) {
+		memcpy(&w, next, 8);
+		w ^= crc;
+		crc = crc32c_table[7][w & 0xff] ^
+			crc32c_table[6][(w >> 8) & 0xff] ^
+			crc32c_table[5][(w >> 16) & 0xff] ^
+			crc32c_table[4][(w >> 24) & 0xff] ^
+			crc32c_table[3][(w >> 32) & 0xff] ^
+			crc32c_table[2][(w >> 40) & 0xff] ^
+			crc32c_table[1][(w >> 48) & 0xff] ^
+			crc32c_table[0][w >> 56];
+		next += 8;
+		len -= 8;
+	}
+	while (len) {
+		crc = crc32c_table[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+static inline __attribute__((target("sse4.2"))) uint64_t
+crc32c_hw_streams(uint64_t crc0, const unsigned char **nextp, size_t *lenp,
+	size_t blk, uint32_t zeros[][256])
+{
+	const unsigned char *next = *nextp;
+	const unsigned char *end;
+	uint64_t crc1, crc2;
+
+	while (*lenp >= blk * 3) {
+		crc1 = 0;
+		crc2 = 0;
+		end = next + blk;
+		do {
+			crc0 = __builtin_ia32_crc32di(crc0,
+				*(const uint64_t *)next);
+			crc1 = __builtin_ia32_crc32di(crc1,
+				*(const uint64_t *)(next + blk));
+			crc2 = __builtin_ia32_crc32di(crc2,
+				*(const uint64_t *)(next + blk * 2));
+			next += 8;
+		} while (next < end);
+		crc0 = crc32c_shift(zeros, crc0) ^ crc1;
+		crc0 = crc32c_shift(zeros, crc0) ^ crc2;
+		next += blk * 2;
+		*lenp -= blk * 3;
+	}
+	*nextp = next;
+
+	return crc0;
+}
+
+static __attribute__((target("sse4.2"))) uint32_t
+crc32c_sse42(uint32_t crc, const unsigned char *next, size_t len)
+{
+	uint64_t crc0 = crc;
+
+	while (len && ((uintptr_t)next & 7) != 0) {
+		crc0 = __builtin_ia32_crc32qi(crc0, *next++);
+		len--;
+	}
+	crc0 = crc32c_hw_streams(crc0, &next, &len, CRC32C_LONG,
+		crc32c_long);
+	crc0 = crc32c_hw_streams(crc0, &next, &len, CRC32C_SHORT,
+		crc32c_short);
+	while (len >= 8) {
+		crc0 = __builtin_ia32_crc32di(crc0, *(const uint64_t *)next);
+		next += 8;
+		len -= 8;
+	}
+	while (len) {
+		crc0 = __builtin_ia32_crc32qi(crc0, *next++);
+		len--;
+	}
+
+	return (uint32_t)crc0;
+}
+#endif
+
+/* crc of buf appended to crc (0 for a new one) */
+uint32_t
+rpp_crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	pthread_once(&crc32c_once, crc32c_init);
+
+	crc = ~crc;
+#if defined(__x86_64__)
+	if (crc32c_hw) {
+		return ~crc32c_sse42(crc, buf, len);
+	}
+#endif
+	return ~crc32c_sw(crc, buf, len);
+}
@@ -0,0 +1,557 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <arpa/inet.h>
+
+#include "rpp_h.h"
+#include "rpp_bench.h"
+
+/* fanout mode: one source buffer WRITten to every subscriber.
+ *
+ * the server has one source buffer of RPP_FANOUT_SIZE bytes, registered
+ * once and shared by all subscribers (the model/config to distribute).
+ * 	client sends SUB {sink addr/rkey, slots}
+ * 	server replies {chunk size, number of chunks}
+ * 	server WRITEs chunk after chunk (WRITE with immediate = sequence
+ * 	number) to sink slot seq % slots
+ * 	client returns credits (CREDIT) as it consumes the slots
+ * 	...
+ * 	client sends UNSUB
+ * one publisher thread posts the WRITEs of all subscribers round robin.
+ * a subscriber without credit is skipped, so a slow subscriber does not
+ * stall the others. the session thread of each subscriber only
+ * receives its credits.
+ */
+
+#ifndef RPP_FANOUT_SIZE
+#define RPP_FANOUT_SIZE (16UL << 20)
+#endif
+#define RPP_FANOUT_CHUNK (64U << 10)
+#define RPP_FANOUT_MAX 1024	/* subscribers */
+
+enum fanout_op {
+	FANOUT_OP_SUB = 1,
+	FANOUT_OP_CREDIT,
+	FANOUT_OP_UNSUB,
+};
+
+struct fanout_msg {
+	uint32_t op;
+	uint32_t status;
+	uint64_t addr;
+	uint32_t rkey;
+	uint32_t n;		/* SUB: slots, CREDIT: credits */
+	uint32_t chunk;		/* reply */
+	uint32_t nchunks;	/* reply */
+};
+
+struct fanout_sub {
+	struct rdma_cm_id *id;
+	uint64_t addr;
+	uint32_t rkey;
+	uint32_t slots;
+	unsigned int credits;	/* added by the session thread */
+	unsigned int inflight;
+	unsigned int closing;
+	uint64_t seq;
+};
+
+static char *source;
+static struct ibv_mr *source_mr;
+static struct fanout_sub *subs[RPP_FANOUT_MAX];
+static unsigned int nsubs;
+static unsigned int nreserved;	/* nsubs + those sending the reply */
+static pthread_t publisher;
+static int publisher_running;
+static pthread_mutex_t fanout_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fanout_cond = PTHREAD_COND_INITIALIZER;
+
+static int
+fanout_reap(struct fanout_sub *s)
+{
+	struct ibv_wc wc[16];
+	int n, i;
+
+	n = ibv_poll_cq(s->id->send_cq, 16, wc);
+	if (n < 0) {
+		perror("ibv_poll_cq fanout");
+		s->closing = 1;
+		return 0;
+	}
+	for (i = 0; i < n; i++) {
+		if (wc[i].status != IBV_WC_SUCCESS) {
+			/* NOTE: the rest are flushed */
+			s->closing = 1;
+		}
+		s->inflight--;
+	}
+
+	return n;
+}
+
+static int
+fanout_post(struct fanout_sub *s)
+{
+	struct ibv_send_wr wr, *bad;
+	struct ibv_sge sge;
+	uint64_t chunk = s->seq % (RPP_FANOUT_SIZE / RPP_FANOUT_CHUNK);
+
+	memset(&wr, 0, sizeof(wr));
+	sge.addr = (uint64_t)(source + chunk * RPP_FANOUT_CHUNK);
+	sge.length = RPP_FANOUT_CHUNK;
+	sge.lkey = source_mr->lkey;
+	wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+	wr.imm_data = htonl((uint32_t)s->seq);
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.wr.rdma.remote_addr = s->addr +
+		(s->seq % s->slots) * RPP_FANOUT_CHUNK;
+	wr.wr.rdma.rkey = s->rkey;
+
+	if (ibv_post_send(s->id->qp, &wr, &bad) != 0) {
+		perror("ibv_post_send fanout");
+		return 1;
+	}
+	s->inflight++;
+	s->seq++;
+
+	return 0;
+}
+
+static void *
+fanout_publisher(void *arg)
+{
+	struct fanout_sub *s;
+	unsigned int i;
+	int progress;
+
+	pthread_mutex_lock(&fanout_lock);
+	for (;;) {
+		while (nsubs == 0) {
+			pthread_cond_wait(&fanout_cond, &fanout_lock);
+		}
+		/* NOTE: session threads take the lock only to add or
+		 * remove a subscriber. */
+		progress = 0;
+		for (i = 0; i < nsubs; i++) {
+			s = subs[i];
+			progress += fanout_reap(s);
+			if (s->closing) {
+				continue;
+			}
+			while (s->inflight < s->slots &&
+			       __atomic_load_n(&s->credits, __ATOMIC_ACQUIRE)) {
+				if (fanout_post(s) != 0) {
+					s->closing = 1;
+					break;
+				}
+				__atomic_sub_fetch(&s->credits, 1,
+					__ATOMIC_RELEASE);
+				progress++;
+			}
+		}
+		pthread_mutex_unlock(&fanout_lock);
+		if (!progress) {
+			sched_yield();
+		}
+		pthread_mutex_lock(&fanout_lock);
+	}
+
+	return NULL;
+}
+
+static int
+fanout_export(struct rdma_cm_id *id)
+{
+	uint64_t i;
+	int ret = 0;
+
+	pthread_mutex_lock(&fanout_lock);
+	if (source_mr != NULL) {
+		goto out;
+	}
+	if (posix_memalign((void **)&source, 4096, RPP_FANOUT_SIZE) != 0) {
+		perror("posix_memalign fanout source");
+		ret = 1;
+		goto out;
+	}
+	memset(source, 0, RPP_FANOUT_SIZE);
+	/* chunk number at the head of each chunk for the subscribers */
+	for (i = 0; i < RPP_FANOUT_SIZE / RPP_FANOUT_CHUNK; i++) {
+		*(uint64_t *)(source + i * RPP_FANOUT_CHUNK) = i;
+	}
+
+	DEBUG_LOG("rdma_reg_msgs fanout source\n");
+	source_mr = rdma_reg_msgs(id, source, RPP_FANOUT_SIZE);
+	if (source_mr == NULL) {
+		perror("rdma_reg_msgs fanout source");
+		free(source);
+		source = NULL;
+		ret = 1;
+		goto out;
+	}
+	rpp_stat_mr(1);
+
+	if (pthread_create(&publisher, NULL, fanout_publisher, NULL) != 0) {
+		perror("pthread_create fanout publisher");
+		ret = 1;
+		goto out;
+	}
+	publisher_running = 1;
+out:
+	pthread_mutex_unlock(&fanout_lock);
+
+	return ret;
+}
+
+static void
+fanout_remove(struct fanout_sub *s)
+{
+	unsigned int i, inflight;
+
+	pthread_mutex_lock(&fanout_lock);
+	s->closing = 1;
+	pthread_mutex_unlock(&fanout_lock);
+
+	/* the publisher reaps the WRITEs in flight. they complete (or
+	 * are flushed) before the QP is destroyed. */
+	for (;;) {
+		pthread_mutex_lock(&fanout_lock);
+		inflight = s->inflight;
+		if (inflight == 0) {
+			for (i = 0; i < nsubs; i++) {
+				if (subs[i] == s) {
+					subs[i] = subs[--nsubs];
+					nreserved--;
+					break;
+				}
+			}
+		}
+		pthread_mutex_unlock(&fanout_lock);
+		if (inflight == 0) {
+			break;
+		}
+		usleep(100);
+	}
+}
+
+int
+rpp_fanout_server(struct rdma_cm_id *id)
+{
+	struct fanout_sub *s;
+	struct fanout_msg msg;
+	int ret;
+
+	if (fanout_export(id) != 0 || !publisher_running) {
+		return 1;
+	}
+	/* NOTE: rdma_cm allocates one PD per device. */
+	if (source_mr->pd != id->pd) {
+		fprintf(stderr, "fanout: source is on another device\n");
+		return 1;
+	}
+
+	ret = rpp_recv_msg(id, &msg, sizeof(msg));
+	if (ret != 0) {
+		return ret;
+	}
+	if (msg.op != FANOUT_OP_SUB || msg.n == 0 ||
+	    msg.n > RPP_FANOUT_SLOTS) {
+		fprintf(stderr, "fanout: bad SUB\n");
+		return 1;
+	}
+
+	s = (struct fanout_sub *)calloc(1, sizeof(*s));
+	if (s == NULL) {
+		perror("calloc fanout_sub");
+		return 1;
+	}
+	s->id = id;
+	s->addr = msg.addr;
+	s->rkey = msg.rkey;
+	s->slots = msg.n;
+	s->credits = msg.n;
+
+	msg.status = 0;
+	msg.chunk = RPP_FANOUT_CHUNK;
+	msg.nchunks = RPP_FANOUT_SIZE / RPP_FANOUT_CHUNK;
+	pthread_mutex_lock(&fanout_lock);
+	if (nreserved == RPP_FANOUT_MAX) {
+		msg.status = 1;
+	} else {
+		nreserved++;
+	}
+	pthread_mutex_unlock(&fanout_lock);
+	/* NOTE: the send CQ belongs to the publisher from now on */
+	ret = rpp_send_msg(id, &msg, sizeof(msg));
+	if (ret != 0 || msg.status != 0) {
+		if (msg.status == 0) {
+			pthread_mutex_lock(&fanout_lock);
+			nreserved--;
+			pthread_mutex_unlock(&fanout_lock);
+		}
+		free(s);
+		return 1;
+	}
+
+	pthread_mutex_lock(&fanout_lock);
+	subs[nsubs++] = s;
+	pthread_cond_signal(&fanout_cond);
+	pthread_mutex_unlock(&fanout_lock);
+
+	for (;;) {
+		ret = rpp_recv_msg(id, &msg, sizeof(msg));
+		if (ret != 0 || msg.op != FANOUT_OP_CREDIT) {
+			break;
+		}
+		__atomic_add_fetch(&s->credits, msg.n, __ATOMIC_RELEASE);
+	}
+	fanout_remove(s);
+	rpp_log("fanout: %lu chunks sent\n", s->seq);
+	free(s);
+
+	return ret;
+}
+
+struct fanout_worker {
+	pthread_t th;
+	struct sockaddr *addr;
+	uint64_t chunks;
+	uint64_t bad;
+	uint64_t start;
+	uint64_t end;
+	int ret;
+};
+
+static unsigned int nstarted;
+static unsigned int ready;
+static unsigned int go;
+
+static int
+fanout_credit(struct rdma_cm_id *id, uint32_t n)
+{
+	struct fanout_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = FANOUT_OP_CREDIT;
+	msg.n = n;
+
+	return rpp_send_msg(id, &msg, sizeof(msg));
+}
+
+static void *
+fanout_worker(void *arg)
+{
+	struct fanout_worker *w = (struct fanout_worker *)arg;
+	struct rdma_cm_id *id;
+	struct rpp_context *ct;
+	struct ibv_mr *mr = NULL;
+	struct fanout_msg msg;
+	struct ibv_wc wc;
+	char *sink = NULL;
+	uint32_t slots = opts.depth, pending = 0, seq, i;
+	int n, failed = 1;
+
+	w->ret = 1;
+	id = rpp_client_connect(w->addr, RPP_MODE_FANOUT, 2, slots + 2);
+	if (id == NULL) {
+		goto ready;
+	}
+	ct = id->context;
+	if (posix_memalign((void **)&sink, 4096,
+			slots * RPP_FANOUT_CHUNK) != 0) {
+		perror("posix_memalign fanout sink");
+		sink = NULL;
+		goto ready;
+	}
+	DEBUG_LOG("rdma_reg_write fanout sink\n");
+	mr = rdma_reg_write(id, sink, slots * RPP_FANOUT_CHUNK);
+	if (mr == NULL) {
+		perror("rdma_reg_write fanout sink");
+		goto ready;
+	}
+
+	/* NOTE: a WRITE with immediate consumes a receive. recv_msg is
+	 * posted again for each, its content is not used. */
+	for (i = 0; i < slots; i++) {
+		if (rdma_post_recv(id, NULL, ct->recv_msg,
+				sizeof(ct->recv_msg), ct->recv_mr) != 0) {
+			perror("rdma_post_recv");
+			goto ready;
+		}
+	}
+	failed = 0;
+ready:
+	__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+	if (failed) {
+		goto close;
+	}
+	rpp_wait_until(&go, 1);
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = FANOUT_OP_SUB;
+	msg.addr = (uint64_t)sink;
+	msg.rkey = mr->rkey;
+	msg.n = slots;
+	w->start = rpp_stat_now();
+	if (rpp_send_msg(id, &msg, sizeof(msg)) != 0 ||
+	    rpp_recv_msg(id, &msg, sizeof(msg)) != 0 || msg.status != 0) {
+		fprintf(stderr, "fanout: SUB failed\n");
+		goto close;
+	}
+
+	while (w->chunks < opts.count) {
+		n = ibv_poll_cq(id->recv_cq, 1, &wc);
+		if (n < 0) {
+			perror("ibv_poll_cq");
+			goto close;
+		} else if (n == 0) {
+			continue;
+		}
+		if (wc.status != IBV_WC_SUCCESS ||
+		    wc.opcode != IBV_WC_RECV_RDMA_WITH_IMM) {
+			fprintf(stderr, "fanout: recv %s opcode %d\n",
+				ibv_wc_status_str(wc.status), wc.opcode);
+			goto close;
+		}
+		seq = ntohl(wc.imm_data);
+		if (*(uint64_t *)(sink + (seq % slots) * RPP_FANOUT_CHUNK) !=
+				seq % msg.nchunks) {
+			w->bad++;
+		}
+		w->chunks++;
+		if (rdma_post_recv(id, NULL, ct->recv_msg,
+				sizeof(ct->recv_msg), ct->recv_mr) != 0) {
+			perror("rdma_post_recv");
+			goto close;
+		}
+		/* return credits in batches of half the slots */
+		if (++pending >= (slots + 1) / 2) {
+			if (fanout_credit(id, pending) != 0) {
+				goto close;
+			}
+			pending = 0;
+		}
+	}
+	w->end = rpp_stat_now();
+	w->ret = 0;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = FANOUT_OP_UNSUB;
+	rpp_send_msg(id, &msg, sizeof(msg));
+close:
+	if (mr != NULL) {
+		rdma_dereg_mr(mr);
+	}
+	free(sink);
+	if (id != NULL) {
+		rpp_client_close(id);
+	}
+
+	return NULL;
+}
+
+/* one step: n subscribers. returns delivered bytes/sec of all. */
+static int
+fanout_step(struct sockaddr *addr, unsigned int n, double *bw, uint64_t *bad)
+{
+	struct fanout_worker *w;
+	uint64_t start = UINT64_MAX, end = 0, chunks = 0;
+	unsigned int i;
+	int ret = 0;
+
+	*bw = 0;
+	w = (struct fanout_worker *)calloc(n, sizeof(*w));
+	if (w == NULL) {
+		perror("calloc fanout_worker");
+		return 1;
+	}
+	nstarted = 0;
+	__atomic_store_n(&ready, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&go, 0, __ATOMIC_RELEASE);
+
+	for (i = 0; i < n; i++) {
+		w[i].addr = addr;
+		if (pthread_create(&w[i].th, NULL, fanout_worker,
+				&w[i]) != 0) {
+			perror("pthread_create");
+			ret = 1;
+			break;
+		}
+	}
+	n = i;
+	nstarted = i;
+
+	rpp_wait_until(&ready, nstarted);
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+
+	for (i = 0; i < n; i++) {
+		pthread_join(w[i].th, NULL);
+		if (w[i].ret != 0) {
+			ret = 1;
+			continue;
+		}
+		if (w[i].start < start) {
+			start = w[i].start;
+		}
+		if (w[i].end > end) {
+			end = w[i].end;
+		}
+		chunks += w[i].chunks;
+		*bad += w[i].bad;
+	}
+	*bw = end > start ?
+		chunks * (double)RPP_FANOUT_CHUNK / ((end - start) / 1e9) : 0;
+	free(w);
+
+	return ret;
+}
+
+int
+rpp_fanout_client(struct sockaddr *addr)
+{
+	unsigned int n;
+	uint64_t bad = 0;
+	double bw;
+	int ret = 0;
+
+	if (opts.threads == 0 || opts.depth == 0 ||
+	    opts.depth > RPP_FANOUT_SLOTS) {
+		fprintf(stderr, "fanout: threads must be > 0, "
+			"depth 1..%d\n", RPP_FANOUT_SLOTS);
+		return 1;
+	}
+	if (opts.recv_depth != 0) {
+		fprintf(stderr, "fanout: -R is not supported\n");
+		return 1;
+	}
+
+	printf("fanout: chunk %u bytes, slots %u, %lu chunks/subscriber\n",
+		RPP_FANOUT_CHUNK, opts.depth, opts.count);
+	/* 1, 2, 4, ... subscribers up to -T */
+	for (n = 1; ; n = n * 2 < opts.threads ? n * 2 : opts.threads) {
+		if (fanout_step(addr, n, &bw, &bad) != 0) {
+			ret = 1;
+		}
+		printf("subscribers %5u: delivered %.2f Gb/s (%.2f Gb/s "
+			"each)\n", n, bw * 8 / 1e9, bw * 8 / 1e9 / n);
+		if (n == opts.threads) {
+			break;
+		}
+	}
+	if (bad > 0) {
+		printf("bad chunks: %lu\n", bad);
+		ret = 1;
+	}
+
+	return ret;
+}
@@ -4,52 +4,126 @@
 
 #define _GNU_SOURCE
 #include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
-#include <rdma/rdma_cma.h>
-#include <rdma/rdma_verbs.h>
 #include <pthread.h>
 #include <signal.h>
 
+#include "rpp_h.h"
+
 /* rpp_h: multi client version of rpp. */
 
-static int server = -1;
+int server = -1;
+int debug;
 static int terminate = 0;
+static const char *trace_file;
+static unsigned int log_rate;
+static const char *stat_name = RPP_STAT_SHM;
+static const char *stat_endpoint;
+static unsigned int qpool_size = 16;
+static unsigned int shards = 1;
+static int backlog = 128;
+static unsigned int max_sessions;	/* -M, 0: no limit */
+static uint64_t max_bytes;		/* -B, 0: no limit */
+static __thread struct rpp_reject last_reject;	/* rpp_client_connect */
+
+struct rpp_opts opts = {
+	.mode = RPP_MODE_PING,
+	.threads = 1,
+	.count = 100000,
+	.depth = 1,
+	.range = 1,
+	.op = NULL,
+	.recv_depth = 0,
+	.workload = NULL,
+	.size = 0,
+	.signal = 1,
+	.tuned = "rpp_h.conf",
+};
 
-static int debug;
-#define DEBUG_LOG if (debug) printf
-
-struct rpp_rdma_info {
-	uint64_t buf;
-	uint32_t rkey;
-	uint32_t size;
+static const char *mode_name[RPP_MODE_NR] = {
+	[RPP_MODE_PING] = "ping",
+	[RPP_MODE_ATOMIC] = "atomic",
+	[RPP_MODE_KV] = "kv",
+	[RPP_MODE_POOL] = "pool",
+	[RPP_MODE_UD] = "ud",
+	[RPP_MODE_SCALE] = "scale",
+	[RPP_MODE_SESSION] = "session",
+	[RPP_MODE_CPOOL] = "cpool",
+	[RPP_MODE_BURST] = "burst",
+	[RPP_MODE_CRC] = "crc",
+	[RPP_MODE_FANOUT] = "fanout",
+	[RPP_MODE_ALLREDUCE] = "allreduce",
+	[RPP_MODE_STORM] = "storm",
+	[RPP_MODE_MCONNECT] = "mconnect",
+	[RPP_MODE_MW] = "mw",
+	[RPP_MODE_WORKLOAD] = "workload",
+	[RPP_MODE_AUTOTUNE] = "autotune",
+	[RPP_MODE_REPL] = "repl",
 };
 
-#define DATA_SIZE 4096
-struct rpp_context {
-	struct rpp_rdma_info recv_buf;
-	struct ibv_mr *recv_mr;
+/* send queue depth of the server side of a session */
+static uint32_t
+mode_send_wr(int mode)
+{
+	switch (mode) {
+	case RPP_MODE_FANOUT:
+		/* WRITEs of the publisher */
+		return RPP_FANOUT_SLOTS + 2;
+	default:
+		return 2;
+	}
+}
 
-	struct rpp_rdma_info send_buf;
-	struct ibv_mr *send_mr;
+/* connect request handed to a session thread */
+struct rpp_request {
+	struct rdma_cm_id *id;
+	struct rpp_hello hello;
+	uint64_t start;		/* when CONNECT_REQUEST arrived */
+	int pooled;		/* id has a QP of the pool */
+};
 
-	char *read_data;
-	char *write_data;
+/* an address the server listens on (-s) or connects to (-c).
+ * with -A n, shard k of an address is its port + k. up to
+ * RPP_ADDR_MAX addresses, shards included. */
+#define RPP_ADDR_MAX 64
 
-	struct ibv_mr *read_mr;
-	struct ibv_mr *write_mr;
+struct rpp_addr {
+	struct sockaddr_in sin;
+	/* server: one listen id, event channel and QP pool each */
+	pthread_t th;
+	int ret;
+	uint64_t sessions;
+	/* client */
+	unsigned int conns;	/* connections open now */
+	uint64_t total;
+};
+
+static struct rpp_addr addrs[RPP_ADDR_MAX];
+static unsigned int naddrs;
 
-	uint32_t rkey;
-	uint64_t raddr;
-	uint32_t rlen;
+enum {
+	RPP_BAL_RR,		/* round-robin */
+	RPP_BAL_LOAD,		/* fewest connections open */
 };
+static int balance = RPP_BAL_RR;
+static unsigned int balance_next;
+static pthread_t server_thread;	/* run_servers */
 
-static struct rpp_context *
+/* NOTE: the default stack (8MB, RLIMIT_STACK) is mostly virtual, but
+ * its guard page and the touched pages are not. sessions need little. */
+#define RPP_SESSION_STACK (256 * 1024)
+static pthread_attr_t session_attr;
+
+struct rpp_context *
 rpp_init_context(void)
 {
 	struct rpp_context *ct;
@@ -60,6 +134,8 @@ rpp_init_context(void)
 		return NULL;
 	}
 	memset(ct, 0, sizeof(*ct));
+	ct->st = rpp_stat_slot();
+	ct->target = -1;
 	ct->read_data = (char *)malloc(DATA_SIZE);
 	if (ct->read_data == NULL) {
 		perror("malloc read_data");
@@ -77,7 +153,7 @@ rpp_init_context(void)
 	return ct;
 }
 
-static void
+void
 rpp_free_context(struct rpp_context *ct)
 {
 	free(ct->read_data);
@@ -85,22 +161,24 @@ rpp_free_context(struct rpp_context *ct)
 	free(ct);
 }
 
-static int
-rpp_create_qp(struct rdma_cm_id *id)
+/* sig_all 0: only sends posted with IBV_SEND_SIGNALED complete */
+int
+rpp_create_qp_sig(struct rdma_cm_id *id, uint32_t send_wr, uint32_t recv_wr,
+	int sig_all)
 {
 	struct ibv_qp_init_attr init_attr;
 	int ret;
 
 	memset(&init_attr, 0, sizeof(init_attr));
-	init_attr.cap.max_send_wr = 2;
-	init_attr.cap.max_recv_wr = 2;
+	init_attr.cap.max_send_wr = send_wr;
+	init_attr.cap.max_recv_wr = recv_wr;
 	init_attr.cap.max_recv_sge = 1;
 	init_attr.cap.max_send_sge = 1;
 	init_attr.qp_type = IBV_QPT_RC;
 	/* NOTE: when sq_sig_all == 0, set IBV_SEND_SIGNALED to
 	 * 'flags' of rdma_post_* if you want to get send completion
 	 */
-	init_attr.sq_sig_all = 1;
+	init_attr.sq_sig_all = sig_all;
 
 	DEBUG_LOG("rdma_create_qp\n");
 	ret = rdma_create_qp(id, NULL, &init_attr);
@@ -111,48 +189,96 @@ rpp_create_qp(struct rdma_cm_id *id)
 	return ret;
 }
 
-static int
-rpp_setup_buffers(struct rdma_cm_id *id)
+int
+rpp_create_qp_cap(struct rdma_cm_id *id, uint32_t send_wr, uint32_t recv_wr)
 {
-	struct rpp_context *ct = id->context;
+	return rpp_create_qp_sig(id, send_wr, recv_wr, 1);
+}
+
+int
+rpp_create_qp(struct rdma_cm_id *id)
+{
+	return rpp_create_qp_cap(id, 2, 2);
+}
 
-	DEBUG_LOG("rdma_reg_msgs recv_buf\n");
-	ct->recv_mr = rdma_reg_msgs(id, &ct->recv_buf, sizeof(ct->recv_buf));
+/* register the buffers of ct in pd. rdma_reg_* are ibv_reg_mr in
+ * id->pd, this is the same for a context which has no id yet. */
+int
+rpp_reg_buffers(struct rpp_context *ct, struct ibv_pd *pd)
+{
+	DEBUG_LOG("ibv_reg_mr recv_buf\n");
+	ct->recv_mr = ibv_reg_mr(pd, ct->recv_msg, sizeof(ct->recv_msg),
+		IBV_ACCESS_LOCAL_WRITE);
 	if (ct->recv_mr == NULL) {
-		perror("rdma_reg_msgs recv_buf");
+		perror("ibv_reg_mr recv_buf");
 		return 1;
 	}
+	rpp_stat_mr(1);
 
-	DEBUG_LOG("rdma_reg_msgs send_buf\n");
-	ct->send_mr = rdma_reg_msgs(id, &ct->send_buf, sizeof(ct->send_buf));
+	DEBUG_LOG("ibv_reg_mr send_buf\n");
+	ct->send_mr = ibv_reg_mr(pd, ct->send_msg, sizeof(ct->send_msg),
+		IBV_ACCESS_LOCAL_WRITE);
 	if (ct->send_mr == NULL) {
-		perror("rdma_reg_msgs send_buf");
+		perror("ibv_reg_mr send_buf");
 		return 1;
 	}
+	rpp_stat_mr(1);
 
-	DEBUG_LOG("rdma_reg_read\n");
-	ct->read_mr = rdma_reg_read(id, ct->read_data, DATA_SIZE);
+	DEBUG_LOG("ibv_reg_mr read_data\n");
+	ct->read_mr = ibv_reg_mr(pd, ct->read_data, DATA_SIZE,
+		IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ);
 	if (ct->read_mr == NULL) {
-		perror("rdma_reg_read");
+		perror("ibv_reg_mr read_data");
 		return 1;
 	}
+	rpp_stat_mr(1);
 
-	DEBUG_LOG("rdma_reg_write\n");
-	ct->write_mr = rdma_reg_write(id, ct->write_data, DATA_SIZE);
+	DEBUG_LOG("ibv_reg_mr write_data\n");
+	ct->write_mr = ibv_reg_mr(pd, ct->write_data, DATA_SIZE,
+		IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE);
 	if (ct->write_mr == NULL) {
-		perror("rdma_reg_write");
+		perror("ibv_reg_mr write_data");
 		return 1;
 	}
+	rpp_stat_mr(1);
 
 	return 0;
 }
 
-static void
-rpp_free_buffers(struct rdma_cm_id *id)
+int
+rpp_setup_buffers(struct rdma_cm_id *id)
+{
+	return rpp_reg_buffers(id->context, id->pd);
+}
+
+/* post recv_msg, or the receive ring of depth slots if depth > 0 */
+static int
+rpp_post_first_recv(struct rdma_cm_id *id, unsigned int depth)
 {
 	struct rpp_context *ct = id->context;
+	int ret;
 
-	if (ct == NULL) {
+	if (depth > 0) {
+		return rpp_recv_ring_create(id, depth);
+	}
+
+	DEBUG_LOG("rdma_post_recv\n");
+	ret = rdma_post_recv(id, NULL, ct->recv_msg, sizeof(ct->recv_msg),
+		       ct->recv_mr);
+	if (ret != 0) {
+		perror("rdma_post_recv");
+	}
+
+	return ret;
+}
+
+/* deregister the buffers of ct and free it */
+void
+rpp_destroy_context(struct rpp_context *ct)
+{
+	if (ct->flags & RPP_CT_ARENA) {
+		rpp_recv_ring_destroy(ct);
+		rpp_ctx_free(ct);
 		return;
 	}
 	if (ct->recv_mr) {
@@ -160,37 +286,64 @@ rpp_free_buffers(struct rdma_cm_id *id)
 		if (rdma_dereg_mr(ct->recv_mr) != 0) {
 			perror("rdma_rereg_mr recv_mr");
 		}
+		rpp_stat_mr(-1);
 	}
 	if (ct->send_mr) {
 		DEBUG_LOG("rdma_dereg_mr send_mr\n");
 		if (rdma_dereg_mr(ct->send_mr) != 0) {
 			perror("rdma_rereg_mr send_mr");
 		}
+		rpp_stat_mr(-1);
 	}
 	if (ct->read_mr) {
 		DEBUG_LOG("rdma_dereg_mr read_mr\n");
 		if (rdma_dereg_mr(ct->read_mr) != 0) {
 			perror("rdma_rereg_mr read_mr");
 		}
+		rpp_stat_mr(-1);
 	}
 	if (ct->write_mr) {
 		DEBUG_LOG("rdma_dereg_mr write_mr\n");
 		if (rdma_dereg_mr(ct->write_mr) != 0) {
 			perror("rdma_rereg_mr write_mr");
 		}
+		rpp_stat_mr(-1);
 	}
+	rpp_recv_ring_destroy(ct);
 	rpp_free_context(ct);
 }
 
-static int
-rpp_rdma_recv(struct rdma_cm_id *id)
+void
+rpp_free_buffers(struct rdma_cm_id *id)
+{
+	if (id->context != NULL) {
+		rpp_destroy_context(id->context);
+	}
+}
+
+/* wait for a message, copy up to len bytes of it to msg (if not NULL)
+ * and post the recieve buffer again. */
+int
+rpp_recv_msg(struct rdma_cm_id *id, void *msg, size_t len)
+{
+	struct ibv_wc wc;
+
+	return rpp_recv_msg_wc(id, msg, len, &wc);
+}
+
+/* rpp_recv_msg which gives the work completion too */
+int
+rpp_recv_msg_wc(struct rdma_cm_id *id, void *msg, size_t len,
+	struct ibv_wc *wc)
 {
 	struct rpp_context *ct = id->context;
 	int ret;
-	struct ibv_wc wc;
+	uint64_t start = rpp_stat_start(ct->st);
 
 	DEBUG_LOG("rdma_get_recv_comp\n");
-	ret = rdma_get_recv_comp(id, &wc);
+	TRACE_BEGIN(RPP_TR_RECV);
+	ret = rdma_get_recv_comp(id, wc);
+	TRACE_END(RPP_TR_RECV);
 	if (ret < 0) {
 		perror("rdma_get_recv_comp");
 		return 1;
@@ -198,21 +351,23 @@ rpp_rdma_recv(struct rdma_cm_id *id)
 		fprintf(stderr, "rdma_get_recv_comp ret 0\n");
 		return 1;
 	}
+	rpp_stat_add(ct->st, RPP_ST_RECVS, 1);
+	rpp_stat_lat(ct->st, RPP_LT_RECV, start);
 
-	/* NOTE: client send remote buffer info to server.
-	 * server's send is to notify only and data has no meaning.
-	 */
-	if (server) {
-		ct->rkey = ct->recv_buf.rkey;
-		ct->raddr = ct->recv_buf.buf;
-		ct->rlen = ct->recv_buf.size;
-		printf("remote rkey %x, addr %lx, len %d\n", ct->rkey,
-			       ct->raddr, ct->rlen);
+	if (ct->ring != NULL) {
+		return rpp_recv_ring_msg(id, wc, msg, len);
+	}
+
+	if (msg != NULL) {
+		if (len > sizeof(ct->recv_msg)) {
+			len = sizeof(ct->recv_msg);
+		}
+		memcpy(msg, ct->recv_msg, len);
 	}
 
 	/* register for next recieve */
 	DEBUG_LOG("rdma_post_recv\n");
-	ret = rdma_post_recv(id, NULL, &ct->recv_buf, sizeof(ct->recv_buf),
+	ret = rdma_post_recv(id, NULL, ct->recv_msg, sizeof(ct->recv_msg),
 		       ct->recv_mr);
 	if (ret != 0) {
 		perror("rdma_post_recv");
@@ -222,7 +377,33 @@ rpp_rdma_recv(struct rdma_cm_id *id)
 	return 0;
 }
 
-static int
+int
+rpp_rdma_recv(struct rdma_cm_id *id)
+{
+	struct rpp_context *ct = id->context;
+	struct rpp_rdma_info info;
+	int ret;
+
+	ret = rpp_recv_msg(id, &info, sizeof(info));
+	if (ret != 0) {
+		return ret;
+	}
+
+	/* NOTE: client send remote buffer info to server.
+	 * server's send is to notify only and data has no meaning.
+	 */
+	if (server) {
+		ct->rkey = info.rkey;
+		ct->raddr = info.buf;
+		ct->rlen = info.size;
+		rpp_log("remote rkey %x, addr %lx, len %d\n", ct->rkey,
+			       ct->raddr, ct->rlen);
+	}
+
+	return 0;
+}
+
+int
 rpp_wait_send_comp(struct rdma_cm_id *id)
 {
 	int ret;
@@ -241,120 +422,329 @@ rpp_wait_send_comp(struct rdma_cm_id *id)
 	return 0;
 }
 
-static int
-rpp_rdma_send(struct rdma_cm_id *id)
+/* busy poll the send CQ until n work requests completed. used by the
+ * modes which measure latency of one-sided operations. */
+int
+rpp_poll_send_comp(struct rdma_cm_id *id, int n)
 {
-	struct rpp_context *ct = id->context;
+	struct ibv_wc wc;
 	int ret;
 
-	DEBUG_LOG("rdma_post_send\n");
-	ret = rdma_post_send(id, NULL, &ct->send_buf, sizeof(ct->send_buf),
-		       ct->send_mr, 0);
-	if (ret != 0) {
-		perror("rdma_post_send");
-		return 1;
+	while (n > 0) {
+		ret = ibv_poll_cq(id->send_cq, 1, &wc);
+		if (ret < 0) {
+			perror("ibv_poll_cq");
+			return 1;
+		} else if (ret == 0) {
+			continue;
+		}
+		if (wc.status != IBV_WC_SUCCESS) {
+			fprintf(stderr, "ibv_poll_cq: %s\n",
+				ibv_wc_status_str(wc.status));
+			return 1;
+		}
+		n--;
 	}
 
-	return rpp_wait_send_comp(id);
+	return 0;
 }
 
-static void *
-exec_rpp(void *arg)
+/* send len bytes of send_msg. msg (if not NULL) is copied to send_msg
+ * first. */
+int
+rpp_send_msg(struct rdma_cm_id *id, const void *msg, size_t len)
 {
-	struct rdma_cm_id *id = (struct rdma_cm_id *)arg;
+	struct rpp_context *ct = id->context;
 	int ret;
-	struct rpp_context *ct;
+	uint64_t start = rpp_stat_start(ct->st);
 
-	ct = rpp_init_context();
-	if (ct == NULL) {
-		goto out;
+	if (len > sizeof(ct->send_msg)) {
+		fprintf(stderr, "message too long (%zu)\n", len);
+		return 1;
+	}
+	if (msg != NULL) {
+		memcpy(ct->send_msg, msg, len);
 	}
-	id->context = ct;
 
-	ret = rpp_create_qp(id);
+	DEBUG_LOG("rdma_post_send\n");
+	TRACE_BEGIN(RPP_TR_SEND);
+	/* NOTE: signaled for the QPs without sq_sig_all too */
+	ret = rdma_post_send(id, NULL, ct->send_msg, len, ct->send_mr,
+		IBV_SEND_SIGNALED);
 	if (ret != 0) {
+		perror("rdma_post_send");
+		ret = 1;
 		goto out;
 	}
 
-	ret = rpp_setup_buffers(id);
-	if (ret != 0) {
-		goto out;
+	ret = rpp_wait_send_comp(id);
+	if (ret == 0) {
+		rpp_stat_add(ct->st, RPP_ST_SENDS, 1);
+		rpp_stat_lat(ct->st, RPP_LT_SEND, start);
 	}
 
-	/* regisger for first recieve */
-	DEBUG_LOG("rdma_post_recv\n");
-	ret = rdma_post_recv(id, NULL, &ct->recv_buf, sizeof(ct->recv_buf),
-		       ct->recv_mr);
+out:
+	TRACE_END(RPP_TR_SEND);
+
+	return ret;
+}
+
+int
+rpp_rdma_send(struct rdma_cm_id *id)
+{
+	struct rpp_context *ct = id->context;
+
+	return rpp_send_msg(id, NULL, sizeof(ct->send_buf));
+}
+
+/* RDMA READ of the remote buffer (raddr/rkey/rlen) into read_data */
+int
+rpp_rdma_read(struct rdma_cm_id *id)
+{
+	struct rpp_context *ct = id->context;
+	struct rpp_stat_slot *st = ct->st;
+	uint64_t start;
+	int ret;
+
+	DEBUG_LOG("rdma_post_read\n");
+	TRACE_BEGIN(RPP_TR_READ);
+	start = rpp_stat_start(st);
+	rpp_admit_bytes(ct->rlen);
+	ret = rdma_post_read(id, NULL, ct->read_data, ct->rlen, ct->read_mr,
+		       0, ct->raddr, ct->rkey);
 	if (ret != 0) {
-		perror("rdma_post_recv");
+		perror("rdma_post_read");
 		goto out;
 	}
 
-	DEBUG_LOG("rdma_accept\n");
-	ret = rdma_accept(id, NULL);
+	ret = rpp_wait_send_comp(id);
+	if (ret == 0) {
+		rpp_stat_add(st, RPP_ST_READ_OPS, 1);
+		rpp_stat_add(st, RPP_ST_READ_BYTES, ct->rlen);
+		rpp_stat_lat(st, RPP_LT_READ, start);
+	}
+
+out:
+	rpp_admit_bytes(-(int64_t)ct->rlen);
+	TRACE_END(RPP_TR_READ);
+
+	return ret;
+}
+
+/* RDMA WRITE of write_data to the remote buffer (raddr/rkey/rlen) */
+int
+rpp_rdma_write(struct rdma_cm_id *id)
+{
+	struct rpp_context *ct = id->context;
+	struct rpp_stat_slot *st = ct->st;
+	uint64_t start;
+	int ret;
+
+	DEBUG_LOG("rdma_post_write\n");
+	TRACE_BEGIN(RPP_TR_WRITE);
+	start = rpp_stat_start(st);
+	rpp_admit_bytes(ct->rlen);
+	ret = rdma_post_write(id, NULL, ct->write_data, ct->rlen, ct->write_mr,
+		       0, ct->raddr, ct->rkey);
 	if (ret != 0) {
-		perror("rdma_accept");
+		perror("rdma_post_write");
 		goto out;
 	}
 
+	ret = rpp_wait_send_comp(id);
+	if (ret == 0) {
+		rpp_stat_add(st, RPP_ST_WRITE_OPS, 1);
+		rpp_stat_add(st, RPP_ST_WRITE_BYTES, ct->rlen);
+		rpp_stat_lat(st, RPP_LT_WRITE, start);
+	}
+
+out:
+	rpp_admit_bytes(-(int64_t)ct->rlen);
+	TRACE_END(RPP_TR_WRITE);
+
+	return ret;
+}
+
+/* the original exchange. the client's first message is already
+ * posted for receive when this is called. */
+static int
+rpp_ping_server(struct rdma_cm_id *id)
+{
+	struct rpp_context *ct = id->context;
+	int ret;
+
 	/* recieve remote buffer info from client */
 	ret = rpp_rdma_recv(id);
 	if (ret != 0) {
-		goto out;
+		return ret;
 	}
-
-	/* RDMA READ */
-	DEBUG_LOG("rdma_post_read\n");
-	ret = rdma_post_read(id, NULL, ct->read_data, ct->rlen, ct->read_mr,
-		       0, ct->raddr, ct->rkey);
+	ret = rpp_ctx_data(id, ct->rlen);
 	if (ret != 0) {
-		perror("rdma_post_read");
-		goto out;
+		return ret;
 	}
 
-	ret = rpp_wait_send_comp(id);
+	/* RDMA READ */
+	ret = rpp_rdma_read(id);
 	if (ret != 0) {
-		goto out;
+		return ret;
 	}
 
-	printf("RDMA READ data: %s\n", ct->read_data);
+	rpp_log("RDMA READ data: %s\n", ct->read_data);
 
 	/* send go ahead to clinet */
 	ret = rpp_rdma_send(id);
 	if (ret != 0) {
-		goto out;
+		return ret;
 	}
 
 	/* recieve remote buffer info from client */
 	ret = rpp_rdma_recv(id);
 	if (ret != 0) {
-		goto out;
+		return ret;
+	}
+	ret = rpp_ctx_data(id, ct->rlen);
+	if (ret != 0) {
+		return ret;
 	}
 
 	/* prepare write data */
 	strcpy(ct->write_data, "bbb");
 
 	/* RDMA WRITE */
-	DEBUG_LOG("rdma_post_write\n");
-	ret = rdma_post_write(id, NULL, ct->write_data, ct->rlen, ct->write_mr,
-		       0, ct->raddr, ct->rkey);
+	ret = rpp_rdma_write(id);
 	if (ret != 0) {
-		perror("rdma_post_write");
-		goto out;
+		return ret;
 	}
 
-	ret = rpp_wait_send_comp(id);
+	/* send complete to clinet */
+	ret = rpp_rdma_send(id);
 	if (ret != 0) {
-		goto out;
+		return ret;
 	}
 
-	/* send complete to clinet */
-	ret = rpp_rdma_send(id);
+	rpp_log("done\n");
+
+	return 0;
+}
+
+/* QP and buffers of a session made when its request arrived */
+static int
+session_qp(struct rdma_cm_id *id, int mode, uint32_t depth)
+{
+	struct rpp_context *ct;
+	int ret;
+
+	ct = rpp_ctx_alloc();
+	if (ct == NULL) {
+		return 1;
+	}
+	id->context = ct;
+
+	ret = rpp_create_qp_cap(id, mode_send_wr(mode), depth ? depth : 2);
 	if (ret != 0) {
-		goto out;
+		return ret;
 	}
 
-	printf("done\n");
+	ret = rpp_ctx_bind(ct, id->pd);
+	if (ret != 0) {
+		return ret;
+	}
+
+	/* regisger for first recieve */
+	return rpp_post_first_recv(id, depth);
+}
+
+static void *
+exec_rpp(void *arg)
+{
+	struct rpp_request *req = (struct rpp_request *)arg;
+	struct rdma_cm_id *id = req->id;
+	int mode = req->hello.mode;
+	uint32_t depth = req->hello.recv_depth;
+	uint64_t start = req->start;
+	int pooled = req->pooled;
+	int ret = 1;
+	struct rpp_context *ct;
+	struct rpp_stat_slot *st;
+	uint64_t session_start = rpp_stat_now();
+	int accepted = 0;
+
+	free(req);
+
+	TRACE_NEW_SID();
+	TRACE_BEGIN(RPP_TR_SESSION);
+	st = rpp_stat_slot();
+	rpp_stat_add(st, RPP_ST_SESSIONS, 1);
+	rpp_stat_session(1);
+
+	/* NOTE: a QP of the pool has the first receive posted */
+	if (!pooled) {
+		ret = session_qp(id, mode, depth);
+		if (ret != 0) {
+			goto out;
+		}
+	}
+	ct = id->context;
+	ct->st = st;
+
+	DEBUG_LOG("rdma_accept\n");
+	TRACE_BEGIN(RPP_TR_ACCEPT);
+	ret = rdma_accept(id, NULL);
+	TRACE_END(RPP_TR_ACCEPT);
+	if (ret != 0) {
+		perror("rdma_accept");
+		goto out;
+	}
+	/* NOTE: from the connect request, so it includes the QP setup */
+	rpp_stat_lat(st, RPP_LT_ACCEPT, start);
+	accepted = 1;
+
+	switch (mode) {
+	case RPP_MODE_ATOMIC:
+		ret = rpp_atomic_server(id);
+		break;
+	case RPP_MODE_KV:
+		ret = rpp_kv_server(id);
+		break;
+	case RPP_MODE_POOL:
+		ret = rpp_pool_server(id);
+		break;
+	case RPP_MODE_SCALE:
+		ret = rpp_scale_server(id);
+		break;
+	case RPP_MODE_SESSION:
+	case RPP_MODE_CPOOL:
+		ret = rpp_session_server(id);
+		break;
+	case RPP_MODE_BURST:
+		ret = rpp_burst_server(id);
+		break;
+	case RPP_MODE_CRC:
+		ret = rpp_crc_server(id);
+		break;
+	case RPP_MODE_FANOUT:
+		ret = rpp_fanout_server(id);
+		break;
+	case RPP_MODE_STORM:
+		ret = rpp_storm_server(id);
+		break;
+	case RPP_MODE_MCONNECT:
+		ret = rpp_mconnect_server(id);
+		break;
+	case RPP_MODE_MW:
+		ret = rpp_mw_server(id);
+		break;
+	case RPP_MODE_WORKLOAD:
+	case RPP_MODE_AUTOTUNE:
+		ret = rpp_workload_server(id);
+		break;
+	case RPP_MODE_REPL:
+		ret = rpp_repl_server(id);
+		break;
+	default:
+		ret = rpp_ping_server(id);
+		break;
+	}
 
 out:
 	rpp_free_buffers(id);
@@ -364,6 +754,14 @@ out:
 	if (rdma_destroy_id(id) != 0) {
 		perror("rdma_destroy_id id");
 	}
+	if (ret != 0) {
+		rpp_stat_add(st, accepted ? RPP_ST_SESSION_FAIL :
+			RPP_ST_ACCEPT_FAIL, 1);
+	}
+	rpp_stat_lat(st, RPP_LT_SESSION, session_start);
+	rpp_stat_session(-1);
+	rpp_admit_done(rpp_stat_now() - session_start);
+	TRACE_END(RPP_TR_SESSION);
 
 	return NULL;
 }
@@ -374,15 +772,20 @@ static void handle_sigint(int sig)
 }
 
 static int
-run_server(struct sockaddr *addr)
+run_server(struct rpp_addr *a)
 {
+	struct sockaddr *addr = (struct sockaddr *)&a->sin;
 	int ret;
 	struct rdma_event_channel *ch;
 	struct rdma_cm_id *listen_id;
 	struct rdma_cm_event *event;
 	struct rdma_cm_id *id = NULL;
+	struct rpp_request *req;
+	const struct rpp_hello *hello;
 	pthread_t th;
-	struct sigaction act;
+	uint64_t start;
+	struct rpp_qpool *qpool = NULL;
+	struct rpp_reject rej;
 
 	DEBUG_LOG("rdma_create_event_channel\n");
 	ch = rdma_create_event_channel();
@@ -409,29 +812,33 @@ run_server(struct sockaddr *addr)
 	}
 
 	DEBUG_LOG("rdma_listen\n");
-	ret = rdma_listen(listen_id, 3);
+	ret = rdma_listen(listen_id, backlog);
 	if (ret != 0) {
 		perror("rdma_listen");
 		goto out;
 	}
 
-	/* NOTE: use sigaction(2) to wake blocked system call by EINTR
-	 * after signal catched. signal(2) implies SA_RESTART. */
-	memset(&act, 0, sizeof(act));
-	act.sa_handler = handle_sigint;
-	ret = sigaction(SIGINT, &act, NULL);
-	if (ret != 0) {
-		perror("sigaction");
-		goto out;
+	/* the server runs without the pool too */
+	if (qpool_size > 0) {
+		qpool = rpp_qpool_create(listen_id, qpool_size);
+		if (qpool == NULL) {
+			fprintf(stderr, "qp pool disabled\n");
+		}
 	}
 
 	while (terminate == 0) {
 		DEBUG_LOG("rdma_get_cm_event\n");
 		ret = rdma_get_cm_event(ch, &event);
 		if (ret != 0) {
+			/* NOTE: interrupted by run_servers to stop */
+			if (terminate) {
+				ret = 0;
+				break;
+			}
 			perror("rdma_get_cm_event");
 			goto out;
 		}
+		start = rpp_stat_now();
 		if (event->status != 0) {
 			fprintf(stderr, "event status == %d\n", event->status);
 			goto out;
@@ -442,10 +849,58 @@ run_server(struct sockaddr *addr)
 			goto out;
 		}
 		id = event->id;
+
+		/* NOTE: reject before anything is made for the session.
+		 * a slow accept is worse than a reject with a retry hint. */
+		if (rpp_admit(&rej) != 0) {
+			DEBUG_LOG("rdma_reject\n");
+			if (rdma_reject(id, &rej, sizeof(rej)) != 0) {
+				perror("rdma_reject");
+			}
+			rpp_stat_add(rpp_stat_slot(), RPP_ST_REJECTS, 1);
+			rdma_ack_cm_event(event);
+			DEBUG_LOG("rdma_destroy_id id\n");
+			if (rdma_destroy_id(id) != 0) {
+				perror("rdma_destroy_id id");
+			}
+			id = NULL;
+			continue;
+		}
+
+		/* NOTE: private data is valid until the event is acked */
+		req = (struct rpp_request *)malloc(sizeof(*req));
+		if (req == NULL) {
+			perror("malloc rpp_request");
+			rpp_admit_done(0);
+			rdma_ack_cm_event(event);
+			goto out;
+		}
+		req->id = id;
+		req->start = start;
+		req->hello.magic = RPP_HELLO_MAGIC;
+		req->hello.mode = RPP_MODE_PING;
+		req->hello.recv_depth = 0;
+		hello = event->param.conn.private_data;
+		/* NOTE: hello of old clients has no recv_depth */
+		if (hello != NULL &&
+		    event->param.conn.private_data_len >=
+				offsetof(struct rpp_hello, recv_depth) &&
+		    hello->magic == RPP_HELLO_MAGIC &&
+		    hello->mode < RPP_MODE_NR) {
+			req->hello.mode = hello->mode;
+			if (event->param.conn.private_data_len >=
+					sizeof(*hello) &&
+			    hello->recv_depth <= RPP_RING_MAX) {
+				req->hello.recv_depth = hello->recv_depth;
+			}
+		}
+
 		DEBUG_LOG("rdma_ack_cm_event\n");
 		ret = rdma_ack_cm_event(event);
 		if (ret != 0) {
 			perror("rdma_ack_cm_event");
+			rpp_admit_done(0);
+			free(req);
 			goto out;
 		}
 
@@ -454,15 +909,28 @@ run_server(struct sockaddr *addr)
 		ret = rdma_migrate_id(id, NULL);
 		if (ret != 0) {
 			perror("rdma_migrate_id");
+			rpp_admit_done(0);
+			rpp_stat_add(rpp_stat_slot(), RPP_ST_ACCEPT_FAIL, 1);
+			free(req);
 			goto out;
 		}
 
-		ret = pthread_create(&th, NULL, exec_rpp, (void *)id);
+		/* NOTE: attached here, the pool is destroyed when this loop
+		 * ends while sessions may still be starting */
+		req->pooled = mode_send_wr(req->hello.mode) == 2 &&
+			req->hello.recv_depth == 0 &&
+			rpp_qpool_attach(qpool, id) == 0;
+
+		ret = pthread_create(&th, &session_attr, exec_rpp, (void *)req);
 		if (ret != 0) {
 			perror("pthread_create");
+			rpp_admit_done(0);
+			rpp_stat_add(rpp_stat_slot(), RPP_ST_ACCEPT_FAIL, 1);
+			free(req);
 			goto out;
 		}
 		id = NULL;
+		a->sessions++;
 
 		ret = pthread_detach(th);
 		if (ret != 0) {
@@ -481,6 +949,7 @@ out:
 			perror("rdma_destroy_id id");
 		}
 	}
+	rpp_qpool_destroy(qpool);
 	DEBUG_LOG("rdma_destroy_id listen_id\n");
 	if (rdma_destroy_id(listen_id) != 0) {
 		perror("rdma_destroy_id listen_id");
@@ -491,65 +960,318 @@ out:
 	return ret;
 }
 
+static void *
+listen_thread(void *arg)
+{
+	struct rpp_addr *a = (struct rpp_addr *)arg;
+	sigset_t set;
+
+	/* NOTE: SIGUSR1 from run_servers interrupts rdma_get_cm_event */
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+
+	a->ret = run_server(a);
+	if (a->ret != 0) {
+		/* a failed listener stops the server as before */
+		terminate = 1;
+		pthread_kill(server_thread, SIGUSR1);
+	}
+
+	return NULL;
+}
+
+/* listen on every address, each in its own thread */
 static int
-run_client(struct sockaddr *addr)
+run_servers(void)
+{
+	struct sigaction act;
+	struct timespec ts;
+	sigset_t set, old;
+	unsigned int i, n;
+	int ret = 0;
+
+	/* NOTE: use sigaction(2) to wake blocked system call by EINTR
+	 * after signal catched. signal(2) implies SA_RESTART. */
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = handle_sigint;
+	if (sigaction(SIGINT, &act, NULL) != 0 ||
+	    sigaction(SIGUSR1, &act, NULL) != 0) {
+		perror("sigaction");
+		return 1;
+	}
+
+	/* NOTE: the signals go to this thread. listeners and sessions
+	 * inherit the mask. */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	server_thread = pthread_self();
+
+	pthread_attr_init(&session_attr);
+	if (pthread_attr_setstacksize(&session_attr, RPP_SESSION_STACK) != 0) {
+		fprintf(stderr, "pthread_attr_setstacksize failed\n");
+	}
+
+	for (n = 0; n < naddrs; n++) {
+		if (pthread_create(&addrs[n].th, NULL, listen_thread,
+				&addrs[n]) != 0) {
+			perror("pthread_create");
+			terminate = 1;
+			ret = 1;
+			break;
+		}
+	}
+
+	sigdelset(&old, SIGINT);
+	sigdelset(&old, SIGUSR1);
+	while (terminate == 0) {
+		sigsuspend(&old);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	for (i = 0; i < n; i++) {
+		/* NOTE: a listener may not yet be in rdma_get_cm_event */
+		for (;;) {
+			pthread_kill(addrs[i].th, SIGUSR1);
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 100000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			if (pthread_timedjoin_np(addrs[i].th, NULL, &ts) == 0) {
+				break;
+			}
+		}
+		if (addrs[i].ret != 0) {
+			ret = 1;
+		}
+		if (naddrs > 1) {
+			rpp_log("listen %s:%u: %lu sessions\n",
+				inet_ntoa(addrs[i].sin.sin_addr),
+				ntohs(addrs[i].sin.sin_port), addrs[i].sessions);
+		}
+	}
+
+	return ret;
+}
+
+/* the server address (the first one) stands for all the addresses
+ * given. choose one of them by -b. returns its index, or -1 if addr
+ * is some other address. */
+static int
+pick_target(const struct sockaddr *addr)
+{
+	const struct sockaddr_in *sin = (const struct sockaddr_in *)addr;
+	unsigned int i, t, n, min = UINT_MAX;
+	int best;
+
+	if (naddrs == 0 || addr->sa_family != AF_INET ||
+	    sin->sin_addr.s_addr != addrs[0].sin.sin_addr.s_addr ||
+	    sin->sin_port != addrs[0].sin.sin_port) {
+		return -1;
+	}
+	t = __atomic_fetch_add(&balance_next, 1, __ATOMIC_RELAXED) % naddrs;
+	best = t;
+	/* NOTE: ties go round-robin too */
+	if (balance == RPP_BAL_LOAD) {
+		for (i = 0; i < naddrs; i++, t = (t + 1) % naddrs) {
+			n = __atomic_load_n(&addrs[t].conns, __ATOMIC_RELAXED);
+			if (n < min) {
+				min = n;
+				best = t;
+			}
+		}
+	}
+	__atomic_add_fetch(&addrs[best].conns, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&addrs[best].total, 1, __ATOMIC_RELAXED);
+
+	return best;
+}
+
+/* address to connect to for addr. *target is to be given to
+ * rpp_target_put when the connection is closed. */
+struct sockaddr *
+rpp_target_get(struct sockaddr *addr, int *target)
+{
+	*target = pick_target(addr);
+	if (*target < 0) {
+		return addr;
+	}
+
+	return (struct sockaddr *)&addrs[*target].sin;
+}
+
+void
+rpp_target_put(int target)
+{
+	if (target >= 0) {
+		__atomic_sub_fetch(&addrs[target].conns, 1, __ATOMIC_RELAXED);
+	}
+}
+
+/* NOTE: with conn_param, responder_resources/initiator_depth must
+ * be given explicitly. RDMA_MAX_* means the device maximum, which
+ * is what rdma_connect(id, NULL) uses. */
+void
+rpp_conn_param(struct rdma_conn_param *param, struct rpp_hello *hello,
+	int mode)
+{
+	hello->magic = RPP_HELLO_MAGIC;
+	hello->mode = mode;
+	hello->recv_depth = opts.recv_depth;
+	memset(param, 0, sizeof(*param));
+	param->private_data = hello;
+	param->private_data_len = sizeof(*hello);
+	param->responder_resources = RDMA_MAX_RESP_RES;
+	param->initiator_depth = RDMA_MAX_INIT_DEPTH;
+	param->retry_count = 7;
+	param->rnr_retry_count = 7;
+}
+
+/* connect to the server for the service 'mode'. the first receive is
+ * already posted when this returns. */
+struct rdma_cm_id *
+rpp_client_connect_sig(struct sockaddr *addr, int mode, uint32_t send_wr,
+	uint32_t recv_wr, int sig_all)
 {
 	int ret;
 	struct rdma_cm_id *id;
-	struct ibv_wc wc;
 	struct rpp_context *ct;
+	struct rdma_conn_param param;
+	struct rpp_hello hello;
 
+	last_reject.magic = 0;
 	ct = rpp_init_context();
 	if (ct == NULL) {
-		return 1;
+		return NULL;
 	}
 	DEBUG_LOG("rdma_create_id\n");
 	ret = rdma_create_id(NULL, &id, ct, RDMA_PS_TCP);
 	if (ret != 0) {
 		perror("rdma_create_id");
 		rpp_free_context(ct);
-		return 1;
+		return NULL;
 	}
+	addr = rpp_target_get(addr, &ct->target);
 
 	DEBUG_LOG("rdma_resolve_addr\n");
 	ret = rdma_resolve_addr(id, NULL, addr, 2000);
 	if (ret != 0) {
 		perror("rdma_resolve_addr");
-		goto out;
+		goto err;
 	}
 
 	DEBUG_LOG("rdma_resolve_route\n");
 	ret = rdma_resolve_route(id, 2000);
 	if (ret != 0) {
 		perror("rdma_resolve_route");
-		goto out;
+		goto err;
 	}
 
-	ret = rpp_create_qp(id);
+	if (recv_wr < opts.recv_depth) {
+		recv_wr = opts.recv_depth;
+	}
+	ret = rpp_create_qp_sig(id, send_wr, recv_wr, sig_all);
 	if (ret != 0) {
-		goto out;
+		goto err;
 	}
 
 	ret = rpp_setup_buffers(id);
 	if (ret != 0) {
-		goto out;
+		goto err;
 	}
 
 	/* regisger for first recieve */
-	DEBUG_LOG("rdma_post_recv\n");
-	ret = rdma_post_recv(id, NULL, &ct->recv_buf, sizeof(ct->recv_buf),
-		       ct->recv_mr);
+	ret = rpp_post_first_recv(id, opts.recv_depth);
 	if (ret != 0) {
-		perror("rdma_post_recv");
-		goto out;
+		goto err;
 	}
 
+	rpp_conn_param(&param, &hello, mode);
+
 	DEBUG_LOG("rdma_connect\n");
-	ret = rdma_connect(id, NULL);
+	TRACE_BEGIN(RPP_TR_CONNECT);
+	ret = rdma_connect(id, &param);
+	TRACE_END(RPP_TR_CONNECT);
 	if (ret != 0) {
-		perror("rdma_connect");
-		goto out;
+		/* NOTE: a synchronous id keeps the REJECTED event */
+		if (errno == ECONNREFUSED && id->event != NULL &&
+		    id->event->param.conn.private_data_len >=
+				sizeof(last_reject) &&
+		    ((const struct rpp_reject *)
+				id->event->param.conn.private_data)->magic ==
+				RPP_REJECT_MAGIC) {
+			memcpy(&last_reject, id->event->param.conn.private_data,
+				sizeof(last_reject));
+			DEBUG_LOG("rejected reason %u retry %u ms\n",
+				last_reject.reason, last_reject.retry_ms);
+		} else {
+			perror("rdma_connect");
+		}
+		goto err;
+	}
+
+	return id;
+
+err:
+	rpp_client_close(id);
+	return NULL;
+}
+
+struct rdma_cm_id *
+rpp_client_connect(struct sockaddr *addr, int mode, uint32_t send_wr,
+	uint32_t recv_wr)
+{
+	return rpp_client_connect_sig(addr, mode, send_wr, recv_wr, 1);
+}
+
+/* whether the last rpp_client_connect of this thread was rejected by
+ * the server's admission control. rej gets the reason and the hint. */
+int
+rpp_client_rejected(struct rpp_reject *rej)
+{
+	if (last_reject.magic != RPP_REJECT_MAGIC) {
+		return 0;
 	}
+	*rej = last_reject;
+
+	return 1;
+}
+
+void
+rpp_client_close(struct rdma_cm_id *id)
+{
+	struct rpp_context *ct = id->context;
+
+	if (ct != NULL) {
+		rpp_target_put(ct->target);
+	}
+	rpp_free_buffers(id);
+	DEBUG_LOG("rdma_destroy_qp\n");
+	rdma_destroy_qp(id);
+	DEBUG_LOG("rdma_destroy_id\n");
+	if (rdma_destroy_id(id) != 0) {
+		perror("rdma_destroy_id");
+	}
+}
+
+static int
+run_client(struct sockaddr *addr)
+{
+	int ret;
+	struct rdma_cm_id *id;
+	struct rpp_context *ct;
+
+	TRACE_BEGIN(RPP_TR_SESSION);
+	id = rpp_client_connect(addr, RPP_MODE_PING, 2, 2);
+	if (id == NULL) {
+		TRACE_END(RPP_TR_SESSION);
+		return 1;
+	}
+	ct = id->context;
 
 	/* prepare data for RDMA READ */
 	strcpy(ct->read_data, "aaa");
@@ -586,18 +1308,13 @@ run_client(struct sockaddr *addr)
 		goto out;
 	}
 
-	printf("RDMA WRITE data: %s\n", ct->write_data);
+	rpp_log("RDMA WRITE data: %s\n", ct->write_data);
 
-	printf("done\n");
+	rpp_log("done\n");
 
 out:
-	rpp_free_buffers(id);
-	DEBUG_LOG("rdma_destroy_qp\n");
-	rdma_destroy_qp(id);
-	DEBUG_LOG("rdma_destroy_id\n");
-	if (rdma_destroy_id(id) != 0) {
-		perror("rdma_destroy_id");
-	}
+	rpp_client_close(id);
+	TRACE_END(RPP_TR_SESSION);
 
 	return ret;
 }
@@ -605,16 +1322,62 @@ out:
 static void
 usage(void)
 {
-	fprintf(stderr, "usage: rpp_h {-s|-c} [-d] server-ip-address\n");
+	fprintf(stderr, "usage: rpp_h {-s|-c} [-d] [-t trace-file] "
+		"[-L log-rate] [-S stat-shm] [-P stat-endpoint]\n"
+		"             [-m mode] [-T threads] [-n count] [-q depth] "
+		"[-k range] [-o op]\n"
+		"             [-R recv-depth] [-Q qp-pool] [-b rr|load] "
+		"[-A shards] [-l backlog]\n"
+		"             [-M max-sessions] [-B max-inflight-bytes] "
+		"[-w workload-file]\n"
+		"             [-C config-file] [-W tuned-config-file]\n"
+		"             server-ip-address[:port] ...\n"
+		"  mode: ping(default), atomic, kv, pool, ud,\n"
+		"        scale, session, cpool, burst, crc, fanout,\n"
+		"        allreduce, storm, mconnect, mw, workload, autotune,\n"
+		"        repl\n");
+}
+
+/* "ip" or "ip:port" */
+static int
+parse_addr(const char *str, struct sockaddr_in *sin)
+{
+	char buf[64];
+	char *p, *end;
+	unsigned long port = 7999;
+
+	if (strlen(str) >= sizeof(buf)) {
+		return 1;
+	}
+	strcpy(buf, str);
+	p = strchr(buf, ':');
+	if (p != NULL) {
+		*p++ = '\0';
+		port = strtoul(p, &end, 0);
+		if (*p == '\0' || *end != '\0' || port == 0 ||
+		    port > 65535) {
+			return 1;
+		}
+	}
+
+	memset(sin, 0, sizeof(*sin));
+	sin->sin_family = AF_INET;
+	sin->sin_port = htons(port);
+	if (inet_aton(buf, &sin->sin_addr) == 0) {
+		return 1;
+	}
+
+	return 0;
 }
 
 int main(int argc, char *argv[])
 {
 	int opt;
-	struct sockaddr_in addr;
+	struct sockaddr *addr;
+	unsigned int i, k, n;
 	int ret = 0;
 
-	while ((opt = getopt(argc, argv, "csd")) != -1) {
+	while ((opt = getopt(argc, argv, "csdt:L:S:P:m:T:n:q:k:o:R:Q:b:A:l:M:B:w:C:W:")) != -1) {
 		switch (opt) {
 		case 'c':
 			if (server == 1) {
@@ -633,6 +1396,93 @@ int main(int argc, char *argv[])
 		case 'd':
 			debug = 1;
 			break;
+		case 't':
+			trace_file = optarg;
+			break;
+		case 'L':
+			log_rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			stat_name = optarg;
+			break;
+		case 'P':
+			stat_endpoint = optarg;
+			break;
+		case 'm':
+			for (opts.mode = 0; opts.mode < RPP_MODE_NR;
+					opts.mode++) {
+				if (strcmp(optarg, mode_name[opts.mode]) == 0) {
+					break;
+				}
+			}
+			if (opts.mode == RPP_MODE_NR) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'T':
+			opts.threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			opts.count = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			opts.depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'k':
+			opts.range = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			opts.op = optarg;
+			break;
+		case 'w':
+			opts.workload = optarg;
+			break;
+		case 'C':
+			/* NOTE: options after -C override the file */
+			if (rpp_config_load(optarg) != 0) {
+				return 1;
+			}
+			break;
+		case 'W':
+			opts.tuned = optarg;
+			break;
+		case 'R':
+			opts.recv_depth = strtoul(optarg, NULL, 0);
+			if (opts.recv_depth > RPP_RING_MAX) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'Q':
+			qpool_size = strtoul(optarg, NULL, 0);
+			break;
+		case 'A':
+			shards = strtoul(optarg, NULL, 0);
+			if (shards == 0) {
+				usage();
+				return 1;
+			}
+			break;
+		case 'l':
+			backlog = strtol(optarg, NULL, 0);
+			break;
+		case 'M':
+			max_sessions = strtoul(optarg, NULL, 0);
+			break;
+		case 'B':
+			max_bytes = strtoull(optarg, NULL, 0);
+			break;
+		case 'b':
+			if (strcmp(optarg, "rr") == 0) {
+				balance = RPP_BAL_RR;
+			} else if (strcmp(optarg, "load") == 0) {
+				balance = RPP_BAL_LOAD;
+			} else {
+				usage();
+				return 1;
+			}
+			break;
 		default:
 			usage();
 			return 1;
@@ -644,22 +1494,128 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	if (optind != argc - 1) {
+	n = argc - optind;
+	if (n == 0 || n * shards > RPP_ADDR_MAX) {
 		usage();
 		return 1;
 	}
 
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(7999);
-	if (inet_aton(argv[optind], &addr.sin_addr) == 0) {
-		fprintf(stderr, "Invalid IP address: %s\n", argv[optind]);
+	for (i = 0; i < n; i++) {
+		if (parse_addr(argv[optind + i], &addrs[i].sin) != 0 ||
+		    ntohs(addrs[i].sin.sin_port) + shards - 1 > 65535) {
+			fprintf(stderr, "Invalid IP address: %s\n",
+				argv[optind + i]);
+			return 1;
+		}
+	}
+	/* NOTE: shards of all addresses interleave, so round-robin
+	 * goes over the addresses first */
+	for (k = 1; k < shards; k++) {
+		for (i = 0; i < n; i++) {
+			addrs[k * n + i].sin = addrs[i].sin;
+			addrs[k * n + i].sin.sin_port =
+				htons(ntohs(addrs[i].sin.sin_port) + k);
+		}
+	}
+	naddrs = n * shards;
+	/* NOTE: modes get the first address. rpp_client_connect spreads
+	 * the connections to it over all of them. */
+	addr = (struct sockaddr *)&addrs[0].sin;
+
+	if (trace_file) {
+		TRACE_INIT();
+	}
+
+	if (rpp_log_start(log_rate) != 0) {
 		return 1;
 	}
 
 	if (server) {
-		ret = run_server((struct sockaddr *)&addr);
+		/* statistics are optional. the server runs without them. */
+		if (rpp_stat_create(stat_name) != 0) {
+			fprintf(stderr, "statistics disabled\n");
+		} else if (stat_endpoint && rpp_stat_serve(stat_endpoint) != 0) {
+			fprintf(stderr, "statistics endpoint disabled\n");
+		}
+		rpp_admit_init(max_sessions, max_bytes);
+		/* NOTE: ud listens on the first address only */
+		if (opts.mode == RPP_MODE_UD) {
+			ret = rpp_ud_server(addr);
+		} else {
+			ret = run_servers();
+		}
+		rpp_stat_destroy();
 	} else {
-		ret = run_client((struct sockaddr *)&addr);
+		switch (opts.mode) {
+		case RPP_MODE_ATOMIC:
+			ret = rpp_atomic_client(addr);
+			break;
+		case RPP_MODE_KV:
+			ret = rpp_kv_client(addr);
+			break;
+		case RPP_MODE_POOL:
+			ret = rpp_pool_client(addr);
+			break;
+		case RPP_MODE_UD:
+			ret = rpp_ud_client(addr);
+			break;
+		case RPP_MODE_SCALE:
+			ret = rpp_scale_client(addr);
+			break;
+		case RPP_MODE_SESSION:
+			ret = rpp_session_client(addr);
+			break;
+		case RPP_MODE_CPOOL:
+			ret = rpp_cpool_client(addr);
+			break;
+		case RPP_MODE_BURST:
+			ret = rpp_burst_client(addr);
+			break;
+		case RPP_MODE_CRC:
+			ret = rpp_crc_client(addr);
+			break;
+		case RPP_MODE_FANOUT:
+			ret = rpp_fanout_client(addr);
+			break;
+		case RPP_MODE_ALLREDUCE:
+			ret = rpp_allreduce_client(addr);
+			break;
+		case RPP_MODE_STORM:
+			ret = rpp_storm_client(addr);
+			break;
+		case RPP_MODE_MCONNECT:
+			ret = rpp_mconnect_client(addr);
+			break;
+		case RPP_MODE_MW:
+			ret = rpp_mw_client(addr);
+			break;
+		case RPP_MODE_WORKLOAD:
+			ret = rpp_workload_client(addr);
+			break;
+		case RPP_MODE_AUTOTUNE:
+			ret = rpp_autotune_client(addr);
+			break;
+		case RPP_MODE_REPL:
+			ret = rpp_repl_client(addr);
+			break;
+		default:
+			ret = run_client(addr);
+			break;
+		}
+		if (naddrs > 1) {
+			for (i = 0; i < naddrs; i++) {
+				printf("%s:%u: %lu connections\n",
+					inet_ntoa(addrs[i].sin.sin_addr),
+					ntohs(addrs[i].sin.sin_port),
+					addrs[i].total);
+			}
+		}
+	}
+
+	rpp_log_stop();
+
+	if (trace_file) {
+		TRACE_DUMP(trace_file);
 	}
 
 	return ret;
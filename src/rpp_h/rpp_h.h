@@ -0,0 +1,274 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#ifndef RPP_H_H
+#define RPP_H_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+#include <rdma/rdma_cma.h>
+#include <rdma/rdma_verbs.h>
+
+#include "rpp_log.h"
+#include "rpp_stat.h"
+#include "rpp_trace.h"
+
+/* interface between rpp_h.c and the modules of each mode (rpp_*.c). */
+
+extern int server;
+extern int debug;
+/* NOTE: all output of the data path goes through rpp_log, which
+ * does not block on stdout. errors are still reported by perror. */
+#define DEBUG_LOG if (debug) rpp_log
+
+struct rpp_rdma_info {
+	uint64_t buf;
+	uint32_t rkey;
+	uint32_t size;
+};
+
+/* NOTE: messages of the ping exchange are struct rpp_rdma_info.
+ * other modes put their own messages (up to RPP_MSG_SIZE) in
+ * recv_msg/send_msg. */
+#define RPP_MSG_SIZE 256
+
+#define DATA_SIZE 4096
+struct rpp_recv_ring;
+struct rpp_context {
+	union {
+		struct rpp_rdma_info recv_buf;
+		char recv_msg[RPP_MSG_SIZE];
+	};
+	struct ibv_mr *recv_mr;
+
+	union {
+		struct rpp_rdma_info send_buf;
+		char send_msg[RPP_MSG_SIZE];
+	};
+	struct ibv_mr *send_mr;
+
+	char *read_data;
+	char *write_data;
+
+	struct ibv_mr *read_mr;
+	struct ibv_mr *write_mr;
+
+	uint32_t rkey;
+	uint64_t raddr;
+	uint32_t rlen;
+
+	struct rpp_stat_slot *st;
+
+	struct rpp_recv_ring *ring;	/* NULL: recv_msg only */
+
+	int target;	/* client: server address it went to, -1: other */
+
+	unsigned int flags;
+	struct ibv_pd *pd;	/* RPP_CT_ARENA: where the MRs are */
+	size_t data_len;	/* RPP_CT_ARENA: of read_data/write_data */
+};
+
+/* NOTE: the context is a record of rpp_arena. its MRs are shared with
+ * other contexts, and read_data/write_data are NULL until rpp_ctx_data. */
+#define RPP_CT_ARENA 0x1
+
+/* private data of the connect request. it selects the service the
+ * server runs on the session. a request without it is RPP_MODE_PING,
+ * so clients which know nothing about modes keep working.
+ */
+#define RPP_HELLO_MAGIC 0x72707068	/* "rpph" */
+
+enum rpp_mode {
+	RPP_MODE_PING,		/* READ->send->recv->WRITE->send (original) */
+	RPP_MODE_ATOMIC,	/* remote fetch-and-add/compare-and-swap */
+	RPP_MODE_KV,		/* key-value store, GET by RDMA READ */
+	RPP_MODE_POOL,		/* remote memory pool of slabs */
+	RPP_MODE_UD,		/* request/response over UD (not RC) */
+	RPP_MODE_SCALE,		/* READ/WRITE with many sessions */
+	RPP_MODE_SESSION,	/* ping requests on one long-lived session */
+	RPP_MODE_CPOOL,		/* session requests on pooled connections */
+	RPP_MODE_BURST,		/* bursts of sends, see -R */
+	RPP_MODE_CRC,		/* READ with CRC32C check of each chunk */
+	RPP_MODE_FANOUT,	/* one buffer WRITten to all subscribers */
+	RPP_MODE_ALLREDUCE,	/* ring allreduce of N peers (client only) */
+	RPP_MODE_STORM,		/* connect/disconnect storm, see -A */
+	RPP_MODE_MCONNECT,	/* many connects on asynchronous ids */
+	RPP_MODE_MW,		/* per request memory windows */
+	RPP_MODE_WORKLOAD,	/* traffic of a workload file, see -w */
+	RPP_MODE_AUTOTUNE,	/* search of depth, size, signal, QPs */
+	RPP_MODE_REPL,		/* log replication by WRITEs */
+	RPP_MODE_NR
+};
+
+struct rpp_hello {
+	uint32_t magic;
+	uint32_t mode;
+	uint32_t recv_depth;	/* 0: single recv_msg on both sides */
+};
+
+/* private data of a reject by the server, see rpp_admit.c */
+struct rpp_reject {
+	uint32_t magic;
+	uint16_t reason;	/* RPP_REJ_xxx */
+	uint16_t pad;
+	uint32_t retry_ms;	/* try again after this */
+	uint32_t sessions;	/* admitted when rejected */
+};
+
+#define RPP_REJECT_MAGIC 0x72656a31	/* "rej1" */
+
+enum {
+	RPP_REJ_NONE,
+	RPP_REJ_SESSIONS,	/* -M */
+	RPP_REJ_BYTES,		/* -B */
+};
+
+/* NOTE: the receive ring has to fit in max_recv_wr of the device */
+#define RPP_RING_MAX 16384
+
+/* options of the client side modes */
+struct rpp_opts {
+	int mode;		/* -m */
+	unsigned int threads;	/* -T */
+	unsigned long count;	/* -n */
+	unsigned int depth;	/* -q */
+	unsigned int range;	/* -k */
+	const char *op;		/* -o */
+	unsigned int recv_depth;	/* -R */
+	const char *workload;	/* -w */
+	uint32_t size;		/* -C, 0: the default of the mode */
+	unsigned int signal;	/* -C, signal every n-th send */
+	const char *tuned;	/* -W */
+};
+
+extern struct rpp_opts opts;
+
+struct rpp_context *rpp_init_context(void);
+void rpp_free_context(struct rpp_context *ct);
+int rpp_create_qp_cap(struct rdma_cm_id *id, uint32_t send_wr,
+	uint32_t recv_wr);
+int rpp_create_qp_sig(struct rdma_cm_id *id, uint32_t send_wr,
+	uint32_t recv_wr, int sig_all);
+int rpp_create_qp(struct rdma_cm_id *id);
+int rpp_reg_buffers(struct rpp_context *ct, struct ibv_pd *pd);
+int rpp_setup_buffers(struct rdma_cm_id *id);
+void rpp_destroy_context(struct rpp_context *ct);
+void rpp_free_buffers(struct rdma_cm_id *id);
+int rpp_recv_msg(struct rdma_cm_id *id, void *msg, size_t len);
+int rpp_recv_msg_wc(struct rdma_cm_id *id, void *msg, size_t len,
+	struct ibv_wc *wc);
+int rpp_rdma_recv(struct rdma_cm_id *id);
+int rpp_wait_send_comp(struct rdma_cm_id *id);
+int rpp_poll_send_comp(struct rdma_cm_id *id, int n);
+int rpp_send_msg(struct rdma_cm_id *id, const void *msg, size_t len);
+int rpp_rdma_send(struct rdma_cm_id *id);
+int rpp_rdma_read(struct rdma_cm_id *id);
+int rpp_rdma_write(struct rdma_cm_id *id);
+struct rdma_cm_id *rpp_client_connect(struct sockaddr *addr, int mode,
+	uint32_t send_wr, uint32_t recv_wr);
+struct rdma_cm_id *rpp_client_connect_sig(struct sockaddr *addr, int mode,
+	uint32_t send_wr, uint32_t recv_wr, int sig_all);
+void rpp_client_close(struct rdma_cm_id *id);
+int rpp_client_rejected(struct rpp_reject *rej);
+struct sockaddr *rpp_target_get(struct sockaddr *addr, int *target);
+void rpp_target_put(int target);
+void rpp_conn_param(struct rdma_conn_param *param, struct rpp_hello *hello,
+	int mode);
+
+/* rpp_admit.c */
+void rpp_admit_init(unsigned int sessions, uint64_t bytes);
+int rpp_admit(struct rpp_reject *rej);
+void rpp_admit_done(uint64_t ns);
+void rpp_admit_bytes(int64_t delta);
+
+/* rpp_ring.c */
+int rpp_recv_ring_create(struct rdma_cm_id *id, unsigned int depth);
+void rpp_recv_ring_destroy(struct rpp_context *ct);
+int rpp_recv_ring_msg(struct rdma_cm_id *id, struct ibv_wc *wc, void *msg,
+	size_t len);
+
+/* rpp_arena.c */
+struct rpp_context *rpp_ctx_alloc(void);
+int rpp_ctx_bind(struct rpp_context *ct, struct ibv_pd *pd);
+int rpp_ctx_data(struct rdma_cm_id *id, size_t len);
+void rpp_ctx_free(struct rpp_context *ct);
+
+/* rpp_qpool.c */
+struct rpp_qpool;
+struct rpp_qpool *rpp_qpool_create(struct rdma_cm_id *listen_id,
+	unsigned int size);
+int rpp_qpool_attach(struct rpp_qpool *pool, struct rdma_cm_id *id);
+void rpp_qpool_destroy(struct rpp_qpool *pool);
+
+/* rpp_atomic.c */
+int rpp_atomic_server(struct rdma_cm_id *id);
+int rpp_atomic_client(struct sockaddr *addr);
+
+/* rpp_kv.c */
+int rpp_kv_server(struct rdma_cm_id *id);
+int rpp_kv_client(struct sockaddr *addr);
+
+/* rpp_pool.c */
+int rpp_pool_server(struct rdma_cm_id *id);
+int rpp_pool_client(struct sockaddr *addr);
+
+/* rpp_ud.c */
+int rpp_ud_server(struct sockaddr *addr);
+int rpp_ud_client(struct sockaddr *addr);
+
+/* rpp_scale.c */
+int rpp_scale_server(struct rdma_cm_id *id);
+int rpp_scale_client(struct sockaddr *addr);
+
+/* rpp_session.c */
+int rpp_session_server(struct rdma_cm_id *id);
+int rpp_session_client(struct sockaddr *addr);
+int rpp_cpool_client(struct sockaddr *addr);
+
+/* rpp_burst.c */
+int rpp_burst_server(struct rdma_cm_id *id);
+int rpp_burst_client(struct sockaddr *addr);
+
+/* rpp_crc32c.c */
+uint32_t rpp_crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* rpp_crc.c */
+int rpp_crc_server(struct rdma_cm_id *id);
+int rpp_crc_client(struct sockaddr *addr);
+
+/* rpp_fanout.c */
+#define RPP_FANOUT_SLOTS 64	/* max sink slots (credits) of a subscriber */
+int rpp_fanout_server(struct rdma_cm_id *id);
+int rpp_fanout_client(struct sockaddr *addr);
+
+/* rpp_allreduce.c */
+int rpp_allreduce_client(struct sockaddr *addr);
+
+/* rpp_storm.c */
+int rpp_storm_server(struct rdma_cm_id *id);
+int rpp_storm_client(struct sockaddr *addr);
+
+/* rpp_mconnect.c */
+int rpp_mconnect_server(struct rdma_cm_id *id);
+int rpp_mconnect_client(struct sockaddr *addr);
+
+/* rpp_mw.c */
+int rpp_mw_server(struct rdma_cm_id *id);
+int rpp_mw_client(struct sockaddr *addr);
+
+/* rpp_workload.c */
+#define RPP_WL_REGION (1UL << 20)	/* region the server exports */
+int rpp_workload_server(struct rdma_cm_id *id);
+int rpp_workload_client(struct sockaddr *addr);
+int rpp_workload_close(struct rdma_cm_id *id);
+
+/* rpp_autotune.c */
+int rpp_autotune_client(struct sockaddr *addr);
+int rpp_config_load(const char *path);
+
+/* rpp_repl.c */
+int rpp_repl_server(struct rdma_cm_id *id);
+int rpp_repl_client(struct sockaddr *addr);
+
+#endif /* RPP_H_H */
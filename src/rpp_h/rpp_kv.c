@@ -0,0 +1,717 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "rpp_h.h"
+#include "rpp_bench.h"
+
+/* kv mode: key-value store, GET by one-sided RDMA READ.
+ *
+ * the server builds one cuckoo hash table in a region registered for
+ * remote read and shares it with all kv sessions.
+ * 	server sends table addr/rkey/len on accept
+ * 	client GET: RDMA READ both candidate buckets of the key
+ * 	client PUT/DEL: send request, server updates table, send reply
+ * 	client sends DONE
+ * the server CPU is not involved in GET.
+ *
+ * a slot has a version at both ends. the server (writer) updates a slot
+ * in this order:
+ * 	ver_end = v + 1
+ * 	key, value
+ * 	ver_begin = v + 2
+ * 	ver_end = v + 2
+ * a reader accepts the slot only if ver_begin == ver_end. this relies
+ * on the HCA reading a bucket in ascending address order, which is the
+ * case for the HCAs we use. a torn slot is read again.
+ *
+ * NOTE: a key moved by a cuckoo insert is copied to its new place
+ * before the old place is overwritten, but a GET which reads the two
+ * buckets just at that time may miss it. clients retry a miss once.
+ */
+
+#define KV_KEY_LEN	16
+#define KV_VAL_LEN	88
+#define KV_WAYS		4	/* slots per bucket */
+#define KV_BUCKETS	65536
+#define KV_MAX_PATH	64	/* cuckoo displacement */
+#define KV_MAX_TRY	16
+
+struct kv_slot {
+	uint64_t ver_begin;
+	char key[KV_KEY_LEN];
+	uint32_t vlen;
+	uint32_t used;
+	char val[KV_VAL_LEN];
+	uint64_t ver_end;
+} __attribute__((aligned(64)));
+
+struct kv_bucket {
+	struct kv_slot slot[KV_WAYS];
+};
+
+enum kv_op {
+	KV_OP_PUT = 1,
+	KV_OP_DEL,
+	KV_OP_DONE,
+};
+
+enum kv_status {
+	KV_OK,
+	KV_NOENT,
+	KV_FULL,
+	KV_INVAL,
+};
+
+/* send/recv message of PUT/DEL */
+struct rpp_kv_msg {
+	uint32_t op;
+	uint32_t status;
+	uint32_t vlen;
+	uint32_t pad;
+	char key[KV_KEY_LEN];
+	char val[KV_VAL_LEN];
+};
+
+static inline uint64_t
+kv_hash(const char *key, uint64_t h)
+{
+	int i;
+
+	/* FNV-1a */
+	for (i = 0; i < KV_KEY_LEN; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 0x100000001b3ULL;
+	}
+	/* finalizer of murmur3 */
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+
+	return h;
+}
+
+static void
+kv_buckets(const char *key, uint32_t nb, uint32_t *b1, uint32_t *b2)
+{
+	*b1 = kv_hash(key, 0xcbf29ce484222325ULL) % nb;
+	*b2 = kv_hash(key, 0x84222325cbf29ce4ULL) % nb;
+	if (*b2 == *b1) {
+		*b2 = (*b1 + 1) % nb;
+	}
+}
+
+/*
+ * server
+ */
+
+static struct kv_bucket *table;
+static struct ibv_mr *table_mr;
+/* table_lock serializes writers. readers never take it. */
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+kv_export(struct rdma_cm_id *id)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&table_lock);
+	if (table_mr != NULL) {
+		goto out;
+	}
+	if (posix_memalign((void **)&table, 4096,
+			KV_BUCKETS * sizeof(struct kv_bucket)) != 0) {
+		perror("posix_memalign table");
+		ret = 1;
+		goto out;
+	}
+	memset(table, 0, KV_BUCKETS * sizeof(struct kv_bucket));
+
+	DEBUG_LOG("rdma_reg_read table\n");
+	table_mr = rdma_reg_read(id, table,
+		KV_BUCKETS * sizeof(struct kv_bucket));
+	if (table_mr == NULL) {
+		perror("rdma_reg_read table");
+		free(table);
+		table = NULL;
+		ret = 1;
+	} else {
+		rpp_stat_mr(1);
+	}
+out:
+	pthread_mutex_unlock(&table_lock);
+
+	return ret;
+}
+
+/* update a slot under its version. key/val NULL clears the slot. */
+static void
+kv_slot_write(struct kv_slot *s, const char *key, const char *val,
+	uint32_t vlen)
+{
+	uint64_t v = s->ver_begin;
+
+	__atomic_store_n(&s->ver_end, v + 1, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	if (key != NULL) {
+		memcpy(s->key, key, KV_KEY_LEN);
+		memcpy(s->val, val, vlen);
+		s->vlen = vlen;
+		s->used = 1;
+	} else {
+		s->used = 0;
+	}
+	__atomic_store_n(&s->ver_begin, v + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&s->ver_end, v + 2, __ATOMIC_RELEASE);
+}
+
+static struct kv_slot *
+kv_lookup(const char *key)
+{
+	uint32_t b[2];
+	struct kv_slot *s;
+	int i, j;
+
+	kv_buckets(key, KV_BUCKETS, &b[0], &b[1]);
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < KV_WAYS; j++) {
+			s = &table[b[i]].slot[j];
+			if (s->used && memcmp(s->key, key, KV_KEY_LEN) == 0) {
+				return s;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+static struct kv_slot *
+kv_free_slot(uint32_t b)
+{
+	int j;
+
+	for (j = 0; j < KV_WAYS; j++) {
+		if (!table[b].slot[j].used) {
+			return &table[b].slot[j];
+		}
+	}
+
+	return NULL;
+}
+
+static uint32_t
+kv_alt_bucket(struct kv_slot *s, uint32_t b)
+{
+	uint32_t b1, b2;
+
+	kv_buckets(s->key, KV_BUCKETS, &b1, &b2);
+
+	return b == b1 ? b2 : b1;
+}
+
+/* find a cuckoo path by random walk and move keys along it from the
+ * end, so each key is always in the table. returns the freed slot. */
+static struct kv_slot *
+kv_cuckoo(uint32_t b, uint64_t *seed)
+{
+	struct kv_slot *path[KV_MAX_PATH + 1];
+	struct kv_slot *s;
+	uint32_t alt;
+	int n, i;
+
+	for (n = 0; n < KV_MAX_PATH; n++) {
+		*seed = *seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		s = &table[b].slot[(*seed >> 33) % KV_WAYS];
+		for (i = 0; i < n; i++) {
+			if (path[i] == s) {
+				return NULL;
+			}
+		}
+		path[n] = s;
+		alt = kv_alt_bucket(s, b);
+		path[n + 1] = kv_free_slot(alt);
+		if (path[n + 1] != NULL) {
+			break;
+		}
+		b = alt;
+	}
+	if (n == KV_MAX_PATH) {
+		return NULL;
+	}
+
+	for (i = n; i >= 0; i--) {
+		kv_slot_write(path[i + 1], path[i]->key, path[i]->val,
+			path[i]->vlen);
+	}
+
+	return path[0];
+}
+
+static int
+kv_put(const char *key, const char *val, uint32_t vlen)
+{
+	static uint64_t seed = 1;
+	uint32_t b1, b2;
+	struct kv_slot *s;
+	int i;
+
+	s = kv_lookup(key);
+	if (s != NULL) {
+		kv_slot_write(s, key, val, vlen);
+		return KV_OK;
+	}
+
+	kv_buckets(key, KV_BUCKETS, &b1, &b2);
+	s = kv_free_slot(b1);
+	if (s == NULL) {
+		s = kv_free_slot(b2);
+	}
+	for (i = 0; s == NULL && i < KV_MAX_TRY; i++) {
+		s = kv_cuckoo(i & 1 ? b2 : b1, &seed);
+	}
+	if (s == NULL) {
+		return KV_FULL;
+	}
+	kv_slot_write(s, key, val, vlen);
+
+	return KV_OK;
+}
+
+static int
+kv_del(const char *key)
+{
+	struct kv_slot *s;
+
+	s = kv_lookup(key);
+	if (s == NULL) {
+		return KV_NOENT;
+	}
+	kv_slot_write(s, NULL, NULL, 0);
+
+	return KV_OK;
+}
+
+int
+rpp_kv_server(struct rdma_cm_id *id)
+{
+	struct rpp_context *ct = id->context;
+	struct rpp_rdma_info info;
+	struct rpp_kv_msg req;
+	uint32_t status;
+	int ret;
+
+	ret = kv_export(id);
+	if (ret != 0) {
+		return ret;
+	}
+	/* NOTE: rdma_cm allocates one PD per device. */
+	if (table_mr->pd != id->pd) {
+		fprintf(stderr, "kv: table is on another device\n");
+		return 1;
+	}
+
+	/* send table info to client */
+	info.buf = (uint64_t)table;
+	info.rkey = table_mr->rkey;
+	info.size = KV_BUCKETS * sizeof(struct kv_bucket);
+	ret = rpp_send_msg(id, &info, sizeof(info));
+	if (ret != 0) {
+		return ret;
+	}
+
+	for (;;) {
+		ret = rpp_recv_msg(id, &req, sizeof(req));
+		if (ret != 0) {
+			return ret;
+		}
+		if (req.op == KV_OP_DONE) {
+			break;
+		}
+
+		pthread_mutex_lock(&table_lock);
+		if (req.op == KV_OP_PUT && req.vlen <= KV_VAL_LEN) {
+			status = kv_put(req.key, req.val, req.vlen);
+		} else if (req.op == KV_OP_DEL) {
+			status = kv_del(req.key);
+		} else {
+			status = KV_INVAL;
+		}
+		pthread_mutex_unlock(&table_lock);
+		if (status == KV_OK) {
+			rpp_stat_add(ct->st, RPP_ST_WRITE_OPS, 1);
+			rpp_stat_add(ct->st, RPP_ST_WRITE_BYTES, req.vlen);
+		}
+		DEBUG_LOG("kv op %u status %u\n", req.op, status);
+
+		/* reply is the request with status */
+		req.status = status;
+		ret = rpp_send_msg(id, &req, sizeof(req));
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * client
+ */
+
+struct kv_worker {
+	pthread_t th;
+	unsigned int index;
+	struct sockaddr *addr;
+	struct rpp_lat put_lat;
+	struct rpp_lat get_lat;
+	uint64_t puts;
+	uint64_t gets;
+	uint64_t torn;
+	uint64_t miss;
+	uint64_t bad;
+	uint64_t put_end;
+	uint64_t get_end;
+	int ret;
+};
+
+/* start gate, the same as atomic mode. 'loaded' counts workers which
+ * finished PUT, so GET does not run on a partly loaded table. */
+static unsigned int nstarted;
+static unsigned int ready;
+static unsigned int loaded;
+static unsigned int go;
+
+static void
+kv_key(char *key, uint64_t k)
+{
+	char tmp[KV_KEY_LEN + 1];
+
+	snprintf(tmp, sizeof(tmp), "key%012lu", k);
+	memcpy(key, tmp, KV_KEY_LEN);
+}
+
+static int
+kv_client_put(struct rdma_cm_id *id, uint64_t k)
+{
+	struct rpp_kv_msg req;
+
+	memset(&req, 0, sizeof(req));
+	req.op = KV_OP_PUT;
+	kv_key(req.key, k);
+	req.vlen = snprintf(req.val, KV_VAL_LEN, "value-%lu", k) + 1;
+	if (rpp_send_msg(id, &req, sizeof(req)) != 0) {
+		return 1;
+	}
+	if (rpp_recv_msg(id, &req, sizeof(req)) != 0) {
+		return 1;
+	}
+	if (req.status != KV_OK) {
+		fprintf(stderr, "kv: put %lu status %u\n", k, req.status);
+		return 1;
+	}
+
+	return 0;
+}
+
+struct kv_remote {
+	uint64_t raddr;
+	uint32_t rkey;
+	uint32_t nb;
+	struct kv_bucket *buf;	/* 2 buckets */
+	struct ibv_mr *mr;
+};
+
+/* returns 0 and the value on hit, KV_NOENT on miss, -1 on error */
+static int
+kv_client_get(struct rdma_cm_id *id, struct kv_remote *r, const char *key,
+	char *val, uint64_t *torn)
+{
+	uint32_t b[2];
+	struct kv_slot *s;
+	int i, j, retry;
+
+	kv_buckets(key, r->nb, &b[0], &b[1]);
+	for (retry = 0; retry < 1000; retry++) {
+		for (i = 0; i < 2; i++) {
+			if (rdma_post_read(id, NULL, &r->buf[i],
+					sizeof(struct kv_bucket), r->mr, 0,
+					r->raddr + b[i] *
+					sizeof(struct kv_bucket),
+					r->rkey) != 0) {
+				perror("rdma_post_read bucket");
+				return -1;
+			}
+		}
+		if (rpp_poll_send_comp(id, 2) != 0) {
+			return -1;
+		}
+
+		for (i = 0; i < 2; i++) {
+			for (j = 0; j < KV_WAYS; j++) {
+				s = &r->buf[i].slot[j];
+				if (s->ver_begin != s->ver_end) {
+					goto torn;
+				}
+				if (s->used && memcmp(s->key, key,
+						KV_KEY_LEN) == 0) {
+					memcpy(val, s->val, KV_VAL_LEN);
+					return 0;
+				}
+			}
+		}
+		return KV_NOENT;
+torn:
+		(*torn)++;
+	}
+	fprintf(stderr, "kv: slot keeps changing\n");
+
+	return -1;
+}
+
+static int
+kv_run(struct kv_worker *w, struct rdma_cm_id *id)
+{
+	struct rpp_rdma_info info;
+	struct kv_remote r;
+	char key[KV_KEY_LEN];
+	char val[KV_VAL_LEN];
+	char expect[KV_VAL_LEN];
+	uint64_t seed = 88172645463325252ULL + w->index;
+	uint64_t k, start;
+	int counted_ready = 0, counted_loaded = 0;
+	int i, hit;
+	int ret = 1;
+
+	memset(&r, 0, sizeof(r));
+
+	/* recieve table info from server */
+	if (rpp_recv_msg(id, &info, sizeof(info)) != 0) {
+		goto out;
+	}
+	r.raddr = info.buf;
+	r.rkey = info.rkey;
+	r.nb = info.size / sizeof(struct kv_bucket);
+	if (opts.range > r.nb * KV_WAYS) {
+		fprintf(stderr, "kv: %u keys > %u slots\n", opts.range,
+			r.nb * KV_WAYS);
+		goto out;
+	}
+
+	r.buf = (struct kv_bucket *)aligned_alloc(64, 2 * sizeof(*r.buf));
+	if (r.buf == NULL) {
+		perror("aligned_alloc kv");
+		goto out;
+	}
+	r.mr = rdma_reg_msgs(id, r.buf, 2 * sizeof(*r.buf));
+	if (r.mr == NULL) {
+		perror("rdma_reg_msgs kv");
+		goto out;
+	}
+
+	__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+	counted_ready = 1;
+	rpp_wait_until(&go, 1);
+
+	/* load: thread i puts keys i, i + threads, ... */
+	if (strcmp(opts.op, "get") != 0) {
+		for (k = w->index; k < opts.range; k += opts.threads) {
+			start = rpp_stat_now();
+			if (kv_client_put(id, k) != 0) {
+				goto out;
+			}
+			rpp_lat_add(&w->put_lat, rpp_stat_now() - start);
+			w->puts++;
+		}
+	}
+	w->put_end = rpp_stat_now();
+	__atomic_add_fetch(&loaded, 1, __ATOMIC_RELEASE);
+	counted_loaded = 1;
+	rpp_wait_until(&loaded, nstarted);
+
+	while (w->gets < opts.count) {
+		k = opts.range == 1 ? 0 : rpp_xorshift64(&seed) % opts.range;
+		kv_key(key, k);
+		snprintf(expect, sizeof(expect), "value-%lu", k);
+
+		start = rpp_stat_now();
+		for (i = 0; i < 2; i++) {
+			hit = kv_client_get(id, &r, key, val, &w->torn);
+			if (hit != KV_NOENT) {
+				break;
+			}
+		}
+		if (hit < 0) {
+			goto out;
+		}
+		rpp_lat_add(&w->get_lat, rpp_stat_now() - start);
+		w->gets++;
+		if (hit == KV_NOENT) {
+			w->miss++;
+		} else if (strncmp(val, expect, KV_VAL_LEN) != 0) {
+			w->bad++;
+		}
+	}
+	ret = 0;
+
+out:
+	w->get_end = rpp_stat_now();
+	if (!counted_ready) {
+		/* failed before the start gate */
+		__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+	}
+	if (!counted_loaded) {
+		if (w->put_end == 0) {
+			w->put_end = w->get_end;
+		}
+		__atomic_add_fetch(&loaded, 1, __ATOMIC_RELEASE);
+	}
+	if (r.mr) {
+		rdma_dereg_mr(r.mr);
+	}
+	free(r.buf);
+
+	return ret;
+}
+
+static void *
+kv_worker(void *arg)
+{
+	struct kv_worker *w = (struct kv_worker *)arg;
+	struct rdma_cm_id *id;
+	struct rpp_kv_msg done;
+
+	w->ret = 1;
+	id = rpp_client_connect(w->addr, RPP_MODE_KV, 4, 2);
+	if (id == NULL) {
+		__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+		__atomic_add_fetch(&loaded, 1, __ATOMIC_RELEASE);
+		return NULL;
+	}
+
+	w->ret = kv_run(w, id);
+
+	/* send done to server */
+	memset(&done, 0, sizeof(done));
+	done.op = KV_OP_DONE;
+	if (rpp_send_msg(id, &done, sizeof(done)) != 0) {
+		w->ret = 1;
+	}
+
+	rpp_client_close(id);
+
+	return NULL;
+}
+
+static void
+kv_report(const char *op, uint64_t ops, uint64_t start, uint64_t end,
+	struct rpp_lat *lat)
+{
+	double sec = end > start ? (end - start) / 1e9 : 0;
+
+	printf("kv %s: threads %u, keys %u: %lu ops in %.3f sec, "
+		"%.3f Mops/s\n", op, opts.threads, opts.range, ops, sec,
+		sec > 0 ? ops / sec / 1e6 : 0);
+	rpp_lat_report("latency", lat);
+}
+
+int
+rpp_kv_client(struct sockaddr *addr)
+{
+	struct kv_worker *w;
+	struct rpp_lat put_lat, get_lat;
+	uint64_t nput = 0, nget = 0, torn = 0, miss = 0, bad = 0;
+	uint64_t start, put_end = 0, get_end = 0;
+	unsigned int i;
+	int ret = 0;
+
+	if (opts.op == NULL) {
+		opts.op = "put";
+	}
+	if (strcmp(opts.op, "put") != 0 && strcmp(opts.op, "get") != 0) {
+		fprintf(stderr, "kv: op must be put (load and get) or get\n");
+		return 1;
+	}
+	if (opts.threads == 0 || opts.range == 0) {
+		fprintf(stderr, "kv: threads and keys must be > 0\n");
+		return 1;
+	}
+
+	w = (struct kv_worker *)calloc(opts.threads, sizeof(*w));
+	if (w == NULL) {
+		perror("calloc kv_worker");
+		return 1;
+	}
+
+	for (i = 0; i < opts.threads; i++) {
+		w[i].index = i;
+		w[i].addr = addr;
+		if (rpp_lat_init(&w[i].put_lat,
+				opts.range / opts.threads + 1) != 0 ||
+				rpp_lat_init(&w[i].get_lat, opts.count) != 0) {
+			rpp_lat_free(&w[i].put_lat);
+			ret = 1;
+			break;
+		}
+		if (pthread_create(&w[i].th, NULL, kv_worker, &w[i]) != 0) {
+			perror("pthread_create");
+			rpp_lat_free(&w[i].put_lat);
+			rpp_lat_free(&w[i].get_lat);
+			ret = 1;
+			break;
+		}
+	}
+	opts.threads = i;
+	nstarted = i;
+
+	rpp_wait_until(&ready, nstarted);
+	start = rpp_stat_now();
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+
+	rpp_lat_init(&put_lat, 0);
+	rpp_lat_init(&get_lat, 0);
+	for (i = 0; i < opts.threads; i++) {
+		pthread_join(w[i].th, NULL);
+		if (w[i].put_end > put_end) {
+			put_end = w[i].put_end;
+		}
+		if (w[i].get_end > get_end) {
+			get_end = w[i].get_end;
+		}
+		if (w[i].ret != 0) {
+			ret = 1;
+		}
+		nput += w[i].puts;
+		nget += w[i].gets;
+		torn += w[i].torn;
+		miss += w[i].miss;
+		bad += w[i].bad;
+		rpp_lat_merge(&put_lat, &w[i].put_lat);
+		rpp_lat_merge(&get_lat, &w[i].get_lat);
+		rpp_lat_free(&w[i].put_lat);
+		rpp_lat_free(&w[i].get_lat);
+	}
+
+	if (nput > 0) {
+		kv_report("put", nput, start, put_end, &put_lat);
+	}
+	kv_report("get", nget, put_end, get_end, &get_lat);
+	printf("torn reads: %lu, misses: %lu, bad values: %lu\n", torn, miss,
+		bad);
+	if (miss > 0 || bad > 0) {
+		ret = 1;
+	}
+
+	rpp_lat_free(&put_lat);
+	rpp_lat_free(&get_lat);
+	free(w);
+
+	return ret;
+}
@@ -0,0 +1,542 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+
+#include "rpp_log.h"
+
+struct rpp_log_rec {
+	const char *fmt;
+	uint64_t args[RPP_LOG_MAX_ARGS];
+	char str[RPP_LOG_STR_SIZE];	/* %s arguments, NUL separated */
+} __attribute__((aligned(64)));
+
+struct rpp_log_ring {
+	/* written by the producer (owner thread) */
+	uint64_t head;
+	uint64_t tail_cache;
+	uint64_t drops;
+	time_t win;
+	unsigned int win_cnt;
+	int busy;	/* inside rpp_log */
+
+	/* written by the consumer (logger thread) */
+	uint64_t tail __attribute__((aligned(64)));
+
+	int in_use;
+	struct rpp_log_ring *next;
+	struct rpp_log_rec rec[RPP_LOG_RING_SIZE];
+};
+
+enum {
+	ARG_NONE,	/* "%%" */
+	ARG_INT,
+	ARG_LONG,
+	ARG_LLONG,
+	ARG_SIZE,
+	ARG_DOUBLE,
+	ARG_STR,
+	ARG_PTR,
+	ARG_BAD,
+};
+
+/* same scheme as rpp_trace: rings are reused, never freed. */
+static struct rpp_log_ring *ring_list;
+static pthread_key_t ring_key;
+static __thread struct rpp_log_ring *cur_ring;
+
+static int running;
+static int stopping;
+static int sleeping;	/* the logger thread waits on wake_fd */
+static int wake_fd = -1;
+static unsigned int rate_limit;	/* records/sec per thread, 0: no limit */
+static pthread_t log_th;
+
+static char obuf[65536];
+static size_t opos;
+
+/* parse one conversion. p points just after '%'. */
+static const char *
+parse_conv(const char *p, int *type)
+{
+	int l = 0;
+	int z = 0;
+
+	while (*p != '\0' && strchr("-+ #0123456789.", *p) != NULL) {
+		p++;
+	}
+	for (;; p++) {
+		if (*p == 'l' || *p == 'j') {
+			l++;
+		} else if (*p == 'z' || *p == 't') {
+			z = 1;
+		} else if (*p != 'h') {
+			break;
+		}
+	}
+
+	switch (*p) {
+	case 'd': case 'i': case 'o': case 'u': case 'x': case 'X': case 'c':
+		if (z) {
+			*type = ARG_SIZE;
+		} else if (l >= 2) {
+			*type = ARG_LLONG;
+		} else if (l == 1) {
+			*type = ARG_LONG;
+		} else {
+			*type = ARG_INT;
+		}
+		break;
+	case 'e': case 'E': case 'f': case 'F':
+	case 'g': case 'G': case 'a': case 'A':
+		*type = ARG_DOUBLE;
+		break;
+	case 's':
+		*type = ARG_STR;
+		break;
+	case 'p':
+		*type = ARG_PTR;
+		break;
+	case '%':
+		*type = ARG_NONE;
+		break;
+	default:
+		*type = ARG_BAD;
+		return p;
+	}
+
+	return p + 1;
+}
+
+static void
+record_args(struct rpp_log_rec *e, const char *fmt, va_list ap)
+{
+	const char *p = fmt;
+	const char *s;
+	size_t spos = 0;
+	size_t len;
+	double d;
+	int n = 0;
+	int type;
+
+	while ((p = strchr(p, '%')) != NULL && n < RPP_LOG_MAX_ARGS) {
+		p = parse_conv(p + 1, &type);
+		switch (type) {
+		case ARG_NONE:
+			continue;
+		case ARG_INT:
+			e->args[n] = (uint64_t)va_arg(ap, int);
+			break;
+		case ARG_LONG:
+			e->args[n] = (uint64_t)va_arg(ap, long);
+			break;
+		case ARG_LLONG:
+			e->args[n] = (uint64_t)va_arg(ap, long long);
+			break;
+		case ARG_SIZE:
+			e->args[n] = (uint64_t)va_arg(ap, size_t);
+			break;
+		case ARG_DOUBLE:
+			d = va_arg(ap, double);
+			memcpy(&e->args[n], &d, sizeof(d));
+			break;
+		case ARG_STR:
+			s = va_arg(ap, const char *);
+			if (s == NULL) {
+				s = "(null)";
+			}
+			/* last byte of str is always NUL */
+			len = strnlen(s, RPP_LOG_STR_SIZE - 1 - spos);
+			memcpy(e->str + spos, s, len);
+			e->str[spos + len] = '\0';
+			e->args[n] = spos;
+			spos += len;
+			if (spos < RPP_LOG_STR_SIZE - 1) {
+				spos++;
+			}
+			break;
+		case ARG_PTR:
+			e->args[n] = (uint64_t)(uintptr_t)va_arg(ap, void *);
+			break;
+		default:
+			return;
+		}
+		n++;
+	}
+}
+
+static size_t
+format_rec(char *out, size_t size, struct rpp_log_rec *e)
+{
+	const char *p = e->fmt;
+	const char *q;
+	char spec[32];
+	size_t pos = 0;
+	size_t len;
+	double d;
+	int n = 0;
+	int type;
+	int ret;
+
+	while (*p != '\0' && pos < size - 1) {
+		if (*p != '%') {
+			out[pos++] = *p++;
+			continue;
+		}
+		q = parse_conv(p + 1, &type);
+		len = q - p;
+		if (type == ARG_BAD || len >= sizeof(spec) ||
+				(type != ARG_NONE && n >= RPP_LOG_MAX_ARGS)) {
+			/* print the rest as is */
+			len = strnlen(p, size - 1 - pos);
+			memcpy(out + pos, p, len);
+			pos += len;
+			break;
+		}
+		memcpy(spec, p, len);
+		spec[len] = '\0';
+		p = q;
+
+		switch (type) {
+		case ARG_NONE:
+			ret = 1;
+			out[pos] = '%';
+			break;
+		case ARG_INT:
+			ret = snprintf(out + pos, size - pos, spec,
+				(int)e->args[n]);
+			break;
+		case ARG_LONG:
+			ret = snprintf(out + pos, size - pos, spec,
+				(long)e->args[n]);
+			break;
+		case ARG_LLONG:
+			ret = snprintf(out + pos, size - pos, spec,
+				(long long)e->args[n]);
+			break;
+		case ARG_SIZE:
+			ret = snprintf(out + pos, size - pos, spec,
+				(size_t)e->args[n]);
+			break;
+		case ARG_DOUBLE:
+			memcpy(&d, &e->args[n], sizeof(d));
+			ret = snprintf(out + pos, size - pos, spec, d);
+			break;
+		case ARG_STR:
+			ret = snprintf(out + pos, size - pos, spec,
+				e->str + e->args[n]);
+			break;
+		default:	/* ARG_PTR */
+			ret = snprintf(out + pos, size - pos, spec,
+				(void *)(uintptr_t)e->args[n]);
+			break;
+		}
+		if (type != ARG_NONE) {
+			n++;
+		}
+		if (ret < 0) {
+			break;
+		}
+		pos += (size_t)ret < size - pos ? (size_t)ret : size - 1 - pos;
+	}
+
+	return pos;
+}
+
+static void
+ring_release(void *arg)
+{
+	struct rpp_log_ring *r = arg;
+
+	__atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static struct rpp_log_ring *
+ring_attach(void)
+{
+	struct rpp_log_ring *r;
+	int zero;
+
+	for (r = __atomic_load_n(&ring_list, __ATOMIC_ACQUIRE); r != NULL;
+			r = r->next) {
+		zero = 0;
+		if (__atomic_compare_exchange_n(&r->in_use, &zero, 1, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			goto found;
+		}
+	}
+
+	if (posix_memalign((void **)&r, 64, sizeof(*r)) != 0) {
+		return NULL;
+	}
+	memset(r, 0, sizeof(*r));
+	r->in_use = 1;
+	r->next = __atomic_load_n(&ring_list, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&ring_list, &r->next, r, 0,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+found:
+	pthread_setspecific(ring_key, r);
+	cur_ring = r;
+
+	return r;
+}
+
+static void
+log_wake(void)
+{
+	uint64_t one = 1;
+
+	if (write(wake_fd, &one, sizeof(one)) < 0) {
+		/* counter overflow only. a wakeup is pending anyway. */
+	}
+}
+
+static void
+ring_drop(struct rpp_log_ring *r)
+{
+	__atomic_store_n(&r->drops, r->drops + 1, __ATOMIC_RELAXED);
+}
+
+void
+rpp_log(const char *fmt, ...)
+{
+	struct rpp_log_ring *r;
+	struct rpp_log_rec *e;
+	struct timespec ts;
+	va_list ap;
+	uint64_t h;
+
+	va_start(ap, fmt);
+	r = cur_ring;
+	if (r == NULL && (!__atomic_load_n(&running, __ATOMIC_ACQUIRE) ||
+			(r = ring_attach()) == NULL)) {
+		vprintf(fmt, ap);
+		va_end(ap);
+		return;
+	}
+
+	/* pairs with the fence in rpp_log_stop: either rpp_log_stop
+	 * waits for this record, or this sees running == 0. */
+	__atomic_store_n(&r->busy, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (!__atomic_load_n(&running, __ATOMIC_RELAXED)) {
+		__atomic_store_n(&r->busy, 0, __ATOMIC_RELEASE);
+		vprintf(fmt, ap);
+		va_end(ap);
+		return;
+	}
+
+	if (rate_limit) {
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+		if (ts.tv_sec != r->win) {
+			r->win = ts.tv_sec;
+			r->win_cnt = 0;
+		}
+		if (r->win_cnt >= rate_limit) {
+			ring_drop(r);
+			goto out;
+		}
+		r->win_cnt++;
+	}
+
+	h = r->head;
+	if (h - r->tail_cache >= RPP_LOG_RING_SIZE) {
+		r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+		if (h - r->tail_cache >= RPP_LOG_RING_SIZE) {
+			ring_drop(r);
+			goto out;
+		}
+	}
+	e = &r->rec[h & (RPP_LOG_RING_SIZE - 1)];
+	e->fmt = fmt;
+	record_args(e, fmt, ap);
+
+	__atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+
+	/* pairs with the fence in log_thread before it sleeps */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&sleeping, __ATOMIC_RELAXED) &&
+			__atomic_exchange_n(&sleeping, 0, __ATOMIC_RELAXED)) {
+		log_wake();
+	}
+out:
+	va_end(ap);
+	__atomic_store_n(&r->busy, 0, __ATOMIC_RELEASE);
+}
+
+static void
+obuf_flush(void)
+{
+	if (opos == 0) {
+		return;
+	}
+	fwrite(obuf, 1, opos, stdout);
+	fflush(stdout);
+	opos = 0;
+}
+
+static int
+drain(void)
+{
+	struct rpp_log_ring *r;
+	uint64_t head, tail;
+	char line[1024];
+	size_t len;
+	int n = 0;
+
+	for (r = __atomic_load_n(&ring_list, __ATOMIC_ACQUIRE); r != NULL;
+			r = r->next) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		for (tail = r->tail; tail < head; tail++) {
+			len = format_rec(line, sizeof(line),
+				&r->rec[tail & (RPP_LOG_RING_SIZE - 1)]);
+			if (opos + len > sizeof(obuf)) {
+				obuf_flush();
+			}
+			memcpy(obuf + opos, line, len);
+			opos += len;
+			n++;
+		}
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	}
+	obuf_flush();
+
+	return n;
+}
+
+static uint64_t
+total_drops(void)
+{
+	struct rpp_log_ring *r;
+	uint64_t sum = 0;
+
+	for (r = __atomic_load_n(&ring_list, __ATOMIC_ACQUIRE); r != NULL;
+			r = r->next) {
+		sum += __atomic_load_n(&r->drops, __ATOMIC_RELAXED);
+	}
+
+	return sum;
+}
+
+static void
+log_sleep(void)
+{
+	struct pollfd pfd = { .fd = wake_fd, .events = POLLIN };
+	uint64_t v;
+
+	__atomic_store_n(&sleeping, 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	/* a record published before sleeping was set is seen here */
+	if (drain() == 0 && !__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+		/* wake up once a second to report drops */
+		poll(&pfd, 1, 1000);
+	}
+	__atomic_store_n(&sleeping, 0, __ATOMIC_RELAXED);
+	if (read(wake_fd, &v, sizeof(v)) < 0) {
+		/* EAGAIN: nobody woke us */
+	}
+}
+
+static void *
+log_thread(void *arg)
+{
+	struct timespec now;
+	time_t last = 0;
+	uint64_t reported = 0;
+	uint64_t drops;
+	int stop;
+
+	do {
+		stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+		if (drain() == 0 && !stop) {
+			log_sleep();
+		}
+
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+		if (now.tv_sec != last || stop) {
+			last = now.tv_sec;
+			drops = total_drops();
+			if (drops != reported) {
+				fprintf(stderr, "rpp_log: %lu records dropped\n",
+					drops - reported);
+				reported = drops;
+			}
+		}
+	} while (!stop);
+
+	return NULL;
+}
+
+int
+rpp_log_start(unsigned int rate)
+{
+	int ret;
+
+	rate_limit = rate;
+
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake_fd < 0) {
+		perror("eventfd log");
+		return 1;
+	}
+
+	ret = pthread_key_create(&ring_key, ring_release);
+	if (ret != 0) {
+		perror("pthread_key_create");
+		close(wake_fd);
+		wake_fd = -1;
+		return 1;
+	}
+
+	ret = pthread_create(&log_th, NULL, log_thread, NULL);
+	if (ret != 0) {
+		perror("pthread_create log");
+		close(wake_fd);
+		wake_fd = -1;
+		return 1;
+	}
+	__atomic_store_n(&running, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+void
+rpp_log_stop(void)
+{
+	struct rpp_log_ring *r;
+
+	if (!__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	/* new records go to printf. wait for the writers still inside
+	 * rpp_log, so the last drain of the logger thread sees all
+	 * records in the rings. */
+	__atomic_store_n(&running, 0, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (r = __atomic_load_n(&ring_list, __ATOMIC_ACQUIRE); r != NULL;
+			r = r->next) {
+		while (__atomic_load_n(&r->busy, __ATOMIC_ACQUIRE)) {
+			sched_yield();
+		}
+	}
+
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	log_wake();
+	pthread_join(log_th, NULL);
+	close(wake_fd);
+	wake_fd = -1;
+}
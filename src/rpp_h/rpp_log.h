@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#ifndef RPP_LOG_H
+#define RPP_LOG_H
+
+#include <stdint.h>
+
+/* rpp_log: asynchronous logger.
+ *
+ * rpp_log() does not format. it copies the format pointer and the raw
+ * arguments into a fixed size record of a per-thread SPSC ring and
+ * returns. a background thread formats the records and writes them
+ * to stdout in batches, so session threads never take the stdio lock.
+ * while the rings are empty the thread sleeps on an eventfd, which a
+ * writer kicks only when the thread is asleep.
+ *
+ * restrictions:
+ *  - fmt must be a string literal (only the pointer is recorded).
+ *  - at most RPP_LOG_MAX_ARGS conversions. '*' width is not supported.
+ *  - %s arguments are copied and truncated to share RPP_LOG_STR_SIZE.
+ *
+ * a record is dropped, and counted, when the ring is full or the
+ * thread exceeds the rate limit. the drop count is reported on stderr.
+ * before rpp_log_start and after rpp_log_stop, rpp_log is plain printf.
+ * rpp_log_stop writes out all records in the rings before it returns.
+ */
+
+#define RPP_LOG_MAX_ARGS 6
+#define RPP_LOG_STR_SIZE 64
+#define RPP_LOG_RING_SIZE 1024	/* records per thread, power of 2 */
+
+void rpp_log(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+int rpp_log_start(unsigned int rate);
+void rpp_log_stop(void);
+
+#endif /* RPP_LOG_H */
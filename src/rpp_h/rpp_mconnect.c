@@ -0,0 +1,425 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rpp_h.h"
+#include "rpp_bench.h"
+
+/* mconnect mode: mass connect with asynchronous ids.
+ *
+ * rpp_client_connect makes one synchronous id and blocks on each step.
+ * here one thread drives -k connections on one event channel, each a
+ * state machine of resolve_addr -> resolve_route -> connect, with up
+ * to -q of them in progress at a time (0: all). the connections are
+ * held until all are up or failed, then disconnected together.
+ *
+ * NOTE: the QPs of a device share one CQ, nothing is posted on them.
+ * the ids need no file descriptor of their own, so the number of
+ * connections is limited by the server and the device.
+ */
+
+#define MC_TIMEOUT 2000		/* ms, resolve_addr/route as rpp_client_connect */
+#define MC_DEVS 8
+
+enum mc_state {
+	MC_IDLE,
+	MC_ADDR,		/* resolving address */
+	MC_ROUTE,		/* resolving route */
+	MC_CONNECT,		/* connecting */
+	MC_UP,
+	MC_CLOSING,		/* disconnecting */
+	MC_DONE,
+};
+
+enum mc_fail {
+	MC_F_ADDR,
+	MC_F_ROUTE,
+	MC_F_UNREACHABLE,
+	MC_F_REJECTED,
+	MC_F_CONNECT,
+	MC_F_OTHER,
+	MC_F_NR
+};
+
+static const char *mc_fail_name[MC_F_NR] = {
+	[MC_F_ADDR] = "addr",
+	[MC_F_ROUTE] = "route",
+	[MC_F_UNREACHABLE] = "unreachable",
+	[MC_F_REJECTED] = "rejected",
+	[MC_F_CONNECT] = "connect",
+	[MC_F_OTHER] = "other",
+};
+
+struct mc_conn {
+	struct rdma_cm_id *id;
+	int state;
+	int target;
+	uint64_t start;		/* of the current step */
+	uint64_t begin;		/* rdma_create_id */
+};
+
+struct mc_cq {
+	struct ibv_context *verbs;
+	struct ibv_cq *cq;
+};
+
+struct mc_ctx {
+	struct rdma_event_channel *ch;
+	struct sockaddr *addr;
+	struct mc_conn *conn;
+	struct mc_cq cq[MC_DEVS];
+	unsigned int ncq;
+	unsigned int inflight;
+	unsigned int up;
+	unsigned int done;	/* up or failed */
+	uint64_t fail[MC_F_NR];
+	struct rpp_lat lat_addr;
+	struct rpp_lat lat_route;
+	struct rpp_lat lat_connect;
+	struct rpp_lat lat_total;
+};
+
+int
+rpp_mconnect_server(struct rdma_cm_id *id)
+{
+	struct rdma_cm_event *event;
+	int ret;
+
+	/* NOTE: nothing is sent. the session ends when the client
+	 * disconnects. */
+	DEBUG_LOG("rdma_get_cm_event\n");
+	if (rdma_get_cm_event(id->channel, &event) != 0) {
+		perror("rdma_get_cm_event");
+		return 1;
+	}
+	ret = event->event == RDMA_CM_EVENT_DISCONNECTED ? 0 : 1;
+	rdma_ack_cm_event(event);
+
+	return ret;
+}
+
+static struct ibv_cq *
+mc_get_cq(struct mc_ctx *c, struct ibv_context *verbs)
+{
+	unsigned int i;
+
+	for (i = 0; i < c->ncq; i++) {
+		if (c->cq[i].verbs == verbs) {
+			return c->cq[i].cq;
+		}
+	}
+	if (c->ncq == MC_DEVS) {
+		return NULL;
+	}
+	DEBUG_LOG("ibv_create_cq\n");
+	c->cq[i].cq = ibv_create_cq(verbs, 16, NULL, NULL, 0);
+	if (c->cq[i].cq == NULL) {
+		perror("ibv_create_cq");
+		return NULL;
+	}
+	c->cq[i].verbs = verbs;
+	c->ncq++;
+
+	return c->cq[i].cq;
+}
+
+static void
+mc_close(struct mc_conn *mc)
+{
+	if (mc->id == NULL) {
+		return;
+	}
+	rpp_target_put(mc->target);
+	if (mc->id->qp != NULL) {
+		DEBUG_LOG("rdma_destroy_qp\n");
+		rdma_destroy_qp(mc->id);
+	}
+	DEBUG_LOG("rdma_destroy_id\n");
+	if (rdma_destroy_id(mc->id) != 0) {
+		perror("rdma_destroy_id");
+	}
+	mc->id = NULL;
+}
+
+static void
+mc_start(struct mc_ctx *c, struct mc_conn *mc)
+{
+	struct sockaddr *addr;
+
+	mc->begin = mc->start = rpp_stat_now();
+	if (rdma_create_id(c->ch, &mc->id, mc, RDMA_PS_TCP) != 0) {
+		perror("rdma_create_id");
+		mc->id = NULL;
+		c->fail[MC_F_OTHER]++;
+		c->done++;
+		mc->state = MC_DONE;
+		return;
+	}
+	addr = rpp_target_get(c->addr, &mc->target);
+	if (rdma_resolve_addr(mc->id, NULL, addr, MC_TIMEOUT) != 0) {
+		perror("rdma_resolve_addr");
+		c->fail[MC_F_ADDR]++;
+		c->done++;
+		mc->state = MC_DONE;
+		mc_close(mc);
+		return;
+	}
+	mc->state = MC_ADDR;
+	c->inflight++;
+}
+
+/* the next step after ROUTE_RESOLVED */
+static int
+mc_connect(struct mc_ctx *c, struct mc_conn *mc)
+{
+	struct ibv_qp_init_attr init_attr;
+	struct rdma_conn_param param;
+	struct rpp_hello hello;
+	struct ibv_cq *cq;
+
+	cq = mc_get_cq(c, mc->id->verbs);
+	if (cq == NULL) {
+		return 1;
+	}
+	memset(&init_attr, 0, sizeof(init_attr));
+	init_attr.send_cq = cq;
+	init_attr.recv_cq = cq;
+	init_attr.cap.max_send_wr = 1;
+	init_attr.cap.max_recv_wr = 1;
+	init_attr.cap.max_recv_sge = 1;
+	init_attr.cap.max_send_sge = 1;
+	init_attr.qp_type = IBV_QPT_RC;
+	DEBUG_LOG("rdma_create_qp\n");
+	if (rdma_create_qp(mc->id, NULL, &init_attr) != 0) {
+		perror("rdma_create_qp");
+		return 1;
+	}
+
+	rpp_conn_param(&param, &hello, RPP_MODE_MCONNECT);
+	DEBUG_LOG("rdma_connect\n");
+	if (rdma_connect(mc->id, &param) != 0) {
+		perror("rdma_connect");
+		return 1;
+	}
+
+	return 0;
+}
+
+/* handle an event of mc. returns 1 if the connection failed. */
+static int
+mc_event(struct mc_ctx *c, struct mc_conn *mc, struct rdma_cm_event *event)
+{
+	uint64_t now = rpp_stat_now();
+
+	switch (event->event) {
+	case RDMA_CM_EVENT_ADDR_RESOLVED:
+		rpp_lat_add(&c->lat_addr, now - mc->start);
+		mc->start = now;
+		if (rdma_resolve_route(mc->id, MC_TIMEOUT) != 0) {
+			perror("rdma_resolve_route");
+			c->fail[MC_F_ROUTE]++;
+			return 1;
+		}
+		mc->state = MC_ROUTE;
+		return 0;
+	case RDMA_CM_EVENT_ROUTE_RESOLVED:
+		rpp_lat_add(&c->lat_route, now - mc->start);
+		mc->start = now;
+		if (mc_connect(c, mc) != 0) {
+			c->fail[MC_F_CONNECT]++;
+			return 1;
+		}
+		mc->state = MC_CONNECT;
+		return 0;
+	case RDMA_CM_EVENT_ESTABLISHED:
+		rpp_lat_add(&c->lat_connect, now - mc->start);
+		rpp_lat_add(&c->lat_total, now - mc->begin);
+		mc->state = MC_UP;
+		c->up++;
+		c->done++;
+		c->inflight--;
+		return 0;
+	case RDMA_CM_EVENT_ADDR_ERROR:
+		c->fail[MC_F_ADDR]++;
+		return 1;
+	case RDMA_CM_EVENT_ROUTE_ERROR:
+		c->fail[MC_F_ROUTE]++;
+		return 1;
+	case RDMA_CM_EVENT_UNREACHABLE:
+		c->fail[MC_F_UNREACHABLE]++;
+		return 1;
+	case RDMA_CM_EVENT_REJECTED:
+		c->fail[MC_F_REJECTED]++;
+		return 1;
+	case RDMA_CM_EVENT_CONNECT_ERROR:
+		c->fail[MC_F_CONNECT]++;
+		return 1;
+	case RDMA_CM_EVENT_DISCONNECTED:
+		/* the server went away while holding */
+		if (mc->state == MC_UP) {
+			mc->state = MC_CLOSING;
+			return 0;
+		}
+		c->fail[MC_F_OTHER]++;
+		return 1;
+	default:
+		fprintf(stderr, "mconnect: unexpected event %s\n",
+			rdma_event_str(event->event));
+		c->fail[MC_F_OTHER]++;
+		return 1;
+	}
+}
+
+static void
+mc_report(const char *label, struct rpp_lat *l)
+{
+	if (l->n > 0) {
+		rpp_lat_report(label, l);
+	}
+}
+
+int
+rpp_mconnect_client(struct sockaddr *addr)
+{
+	struct mc_ctx c;
+	struct mc_conn *mc;
+	struct rdma_cm_event *event;
+	unsigned int n = opts.range, depth = opts.depth, next = 0, i;
+	unsigned int closing = 0;
+	uint64_t start, connected, closed;
+	int failed, ret = 0;
+
+	if (n == 0) {
+		fprintf(stderr, "mconnect: connections must be > 0\n");
+		return 1;
+	}
+	if (depth == 0 || depth > n) {
+		depth = n;
+	}
+
+	memset(&c, 0, sizeof(c));
+	c.addr = addr;
+	c.conn = (struct mc_conn *)calloc(n, sizeof(*c.conn));
+	if (c.conn == NULL) {
+		perror("calloc mc_conn");
+		return 1;
+	}
+	if (rpp_lat_init(&c.lat_addr, n) != 0 ||
+	    rpp_lat_init(&c.lat_route, n) != 0 ||
+	    rpp_lat_init(&c.lat_connect, n) != 0 ||
+	    rpp_lat_init(&c.lat_total, n) != 0) {
+		ret = 1;
+		goto free;
+	}
+	DEBUG_LOG("rdma_create_event_channel\n");
+	c.ch = rdma_create_event_channel();
+	if (c.ch == NULL) {
+		perror("rdma_create_event_channel");
+		ret = 1;
+		goto free;
+	}
+
+	start = rpp_stat_now();
+	while (c.done < n) {
+		while (c.inflight < depth && next < n) {
+			mc_start(&c, &c.conn[next++]);
+		}
+		if (c.inflight == 0) {
+			continue;
+		}
+		if (rdma_get_cm_event(c.ch, &event) != 0) {
+			perror("rdma_get_cm_event");
+			ret = 1;
+			break;
+		}
+		mc = (struct mc_conn *)event->id->context;
+		failed = mc_event(&c, mc, event);
+		/* NOTE: an id is destroyed only after its event is acked */
+		rdma_ack_cm_event(event);
+		if (failed) {
+			if (mc->state >= MC_ADDR && mc->state <= MC_CONNECT) {
+				c.inflight--;
+				c.done++;
+			}
+			mc->state = MC_DONE;
+			mc_close(mc);
+		}
+	}
+	connected = rpp_stat_now();
+
+	/* disconnect all at once and wait for the DISCONNECTED events */
+	for (i = 0; i < next; i++) {
+		mc = &c.conn[i];
+		if (mc->state == MC_UP) {
+			if (rdma_disconnect(mc->id) == 0) {
+				mc->state = MC_CLOSING;
+				closing++;
+			} else {
+				perror("rdma_disconnect");
+				mc->state = MC_DONE;
+			}
+		} else if (mc->state == MC_CLOSING) {
+			/* already disconnected by the server */
+			mc->state = MC_DONE;
+		}
+	}
+	while (closing > 0 && ret == 0) {
+		if (rdma_get_cm_event(c.ch, &event) != 0) {
+			perror("rdma_get_cm_event");
+			ret = 1;
+			break;
+		}
+		mc = (struct mc_conn *)event->id->context;
+		if (event->event == RDMA_CM_EVENT_DISCONNECTED &&
+		    mc->state == MC_CLOSING) {
+			mc->state = MC_DONE;
+			closing--;
+		}
+		rdma_ack_cm_event(event);
+	}
+	closed = rpp_stat_now();
+
+	printf("mconnect: %u connections, in progress %u: %u up in %.3f s "
+		"(%.1f conns/s), disconnected in %.3f s\n", n, depth, c.up,
+		(connected - start) / 1e9,
+		connected > start ? c.up / ((connected - start) / 1e9) : 0,
+		(closed - connected) / 1e9);
+	printf("failed:");
+	for (i = 0; i < MC_F_NR; i++) {
+		printf(" %s %lu", mc_fail_name[i], c.fail[i]);
+	}
+	printf("\n");
+	mc_report("resolve_addr", &c.lat_addr);
+	mc_report("resolve_route", &c.lat_route);
+	mc_report("connect", &c.lat_connect);
+	mc_report("total", &c.lat_total);
+	if (c.up < n) {
+		ret = 1;
+	}
+
+	for (i = 0; i < next; i++) {
+		mc_close(&c.conn[i]);
+	}
+	for (i = 0; i < c.ncq; i++) {
+		if (ibv_destroy_cq(c.cq[i].cq) != 0) {
+			perror("ibv_destroy_cq");
+		}
+	}
+	rdma_destroy_event_channel(c.ch);
+
+free:
+	rpp_lat_free(&c.lat_addr);
+	rpp_lat_free(&c.lat_route);
+	rpp_lat_free(&c.lat_connect);
+	rpp_lat_free(&c.lat_total);
+	free(c.conn);
+
+	return ret;
+}
@@ -0,0 +1,531 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "rpp_h.h"
+#include "rpp_bench.h"
+
+/* mw mode: per request access grant with memory windows.
+ *
+ * the other modes hand the server the rkey of a whole MR, which stays
+ * valid until rdma_dereg_mr. here the client registers its buffer once
+ * (IBV_ACCESS_MW_BIND, no remote access) and for each request binds a
+ * type 2 memory window over just the bytes of the request:
+ * 	client binds the window (IBV_WR_BIND_MW, a new rkey each time)
+ * 	client sends request {id, READ|WRITE, addr/rkey/len of window}
+ * 	server does RDMA READ from / RDMA WRITE to the window
+ * 	server replies, with IBV_WR_SEND_WITH_INV of the rkey (-o remote)
+ * 	or the client invalidates it by IBV_WR_LOCAL_INV (-o local)
+ * so the rkey is good for one request and its bytes only. -o reg
+ * registers an MR per request instead and -o mr uses one MR for all,
+ * to compare with. requests alternate READ and WRITE.
+ */
+
+#define RPP_MW_SLOTS 64		/* windows go round the buffer */
+
+enum mw_op {
+	MW_OP_READ = 1,
+	MW_OP_WRITE,
+	MW_OP_CLOSE,
+};
+
+enum mw_grant {
+	MW_G_REMOTE,	/* bind, SEND_WITH_INV */
+	MW_G_LOCAL,	/* bind, LOCAL_INV */
+	MW_G_REG,	/* ibv_reg_mr/ibv_dereg_mr */
+	MW_G_MR,	/* one MR */
+};
+
+static const char *mw_grant_name[] = {
+	[MW_G_REMOTE] = "remote",
+	[MW_G_LOCAL] = "local",
+	[MW_G_REG] = "reg",
+	[MW_G_MR] = "mr",
+};
+
+struct mw_msg {
+	uint32_t op;
+	uint32_t status;	/* 0: ok */
+	uint64_t req_id;
+	uint64_t addr;
+	uint32_t rkey;
+	uint32_t len;
+	uint32_t inv;		/* reply with SEND_WITH_INV of rkey */
+	uint32_t pad;
+};
+
+/* wait for the send completion of a work request posted by ibv_post_send.
+ * unlike rpp_wait_send_comp, the status matters here. */
+static int
+mw_send_comp(struct rdma_cm_id *id, const char *what)
+{
+	struct ibv_wc wc;
+	int ret;
+
+	DEBUG_LOG("rdma_get_send_comp %s\n", what);
+	ret = rdma_get_send_comp(id, &wc);
+	if (ret <= 0) {
+		perror("rdma_get_send_comp");
+		return 1;
+	}
+	if (wc.status != IBV_WC_SUCCESS) {
+		fprintf(stderr, "mw: %s %s\n", what,
+			ibv_wc_status_str(wc.status));
+		return 1;
+	}
+
+	return 0;
+}
+
+/* rpp_send_msg with the invalidation of rkey at the receiver */
+static int
+mw_send_inv(struct rdma_cm_id *id, const void *msg, size_t len,
+	uint32_t rkey)
+{
+	struct rpp_context *ct = id->context;
+	struct ibv_send_wr wr, *bad;
+	struct ibv_sge sge;
+
+	memcpy(ct->send_msg, msg, len);
+	sge.addr = (uint64_t)(uintptr_t)ct->send_msg;
+	sge.length = len;
+	sge.lkey = ct->send_mr->lkey;
+	memset(&wr, 0, sizeof(wr));
+	wr.opcode = IBV_WR_SEND_WITH_INV;
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.invalidate_rkey = rkey;
+
+	DEBUG_LOG("ibv_post_send SEND_WITH_INV\n");
+	if (ibv_post_send(id->qp, &wr, &bad) != 0) {
+		perror("ibv_post_send SEND_WITH_INV");
+		return 1;
+	}
+	if (mw_send_comp(id, "SEND_WITH_INV") != 0) {
+		return 1;
+	}
+	rpp_stat_add(ct->st, RPP_ST_SENDS, 1);
+
+	return 0;
+}
+
+int
+rpp_mw_server(struct rdma_cm_id *id)
+{
+	struct rpp_context *ct = id->context;
+	struct mw_msg msg;
+	int ret;
+
+	for (;;) {
+		ret = rpp_recv_msg(id, &msg, sizeof(msg));
+		if (ret != 0) {
+			return ret;
+		}
+		if (msg.op == MW_OP_CLOSE) {
+			break;
+		}
+
+		ct->raddr = msg.addr;
+		ct->rkey = msg.rkey;
+		ct->rlen = msg.len;
+		msg.status = 0;
+		if (rpp_ctx_data(id, msg.len) != 0) {
+			msg.status = 1;
+		} else if (msg.op == MW_OP_READ) {
+			ret = rpp_rdma_read(id);
+		} else {
+			snprintf(ct->write_data, msg.len, "req %lu",
+				msg.req_id);
+			ret = rpp_rdma_write(id);
+		}
+		/* NOTE: a failed READ/WRITE (a bad window) breaks the QP */
+		if (ret != 0) {
+			return ret;
+		}
+
+		if (msg.inv) {
+			ret = mw_send_inv(id, &msg, sizeof(msg), msg.rkey);
+		} else {
+			ret = rpp_send_msg(id, &msg, sizeof(msg));
+		}
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+struct mw_worker {
+	pthread_t th;
+	struct sockaddr *addr;
+	unsigned int index;
+	struct rpp_lat lat;	/* request */
+	struct rpp_lat grant;	/* bind or reg */
+	struct rpp_lat revoke;	/* invalidation or dereg */
+	uint64_t reqs;
+	uint64_t bad;
+	uint64_t start;
+	uint64_t end;
+	int ret;
+};
+
+static int grant;
+static unsigned int nstarted;
+static unsigned int ready;
+static unsigned int go;
+
+static int
+mw_bind(struct rdma_cm_id *id, struct ibv_mw *mw, struct ibv_mr *mr,
+	char *addr, uint32_t len, uint32_t rkey)
+{
+	struct ibv_send_wr wr, *bad;
+
+	memset(&wr, 0, sizeof(wr));
+	wr.opcode = IBV_WR_BIND_MW;
+	wr.bind_mw.mw = mw;
+	wr.bind_mw.rkey = rkey;
+	wr.bind_mw.bind_info.mr = mr;
+	wr.bind_mw.bind_info.addr = (uint64_t)(uintptr_t)addr;
+	wr.bind_mw.bind_info.length = len;
+	wr.bind_mw.bind_info.mw_access_flags = IBV_ACCESS_REMOTE_READ |
+		IBV_ACCESS_REMOTE_WRITE;
+
+	DEBUG_LOG("ibv_post_send BIND_MW\n");
+	if (ibv_post_send(id->qp, &wr, &bad) != 0) {
+		perror("ibv_post_send BIND_MW");
+		return 1;
+	}
+
+	return mw_send_comp(id, "BIND_MW");
+}
+
+static int
+mw_local_inv(struct rdma_cm_id *id, uint32_t rkey)
+{
+	struct ibv_send_wr wr, *bad;
+
+	memset(&wr, 0, sizeof(wr));
+	wr.opcode = IBV_WR_LOCAL_INV;
+	wr.invalidate_rkey = rkey;
+
+	DEBUG_LOG("ibv_post_send LOCAL_INV\n");
+	if (ibv_post_send(id->qp, &wr, &bad) != 0) {
+		perror("ibv_post_send LOCAL_INV");
+		return 1;
+	}
+
+	return mw_send_comp(id, "LOCAL_INV");
+}
+
+/* one request on the slot at buf. returns 1 on error. */
+static int
+mw_request(struct mw_worker *w, struct rdma_cm_id *id, struct ibv_mr *mr,
+	struct ibv_mw *mw, uint32_t *rkey, char *buf, uint64_t req_id,
+	int write)
+{
+	struct ibv_mr *req_mr = NULL;
+	struct mw_msg msg;
+	struct ibv_wc wc;
+	char expect[32];
+	uint64_t t;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = write ? MW_OP_WRITE : MW_OP_READ;
+	msg.req_id = req_id;
+	msg.addr = (uint64_t)(uintptr_t)buf;
+	msg.len = DATA_SIZE;
+	if (write) {
+		buf[0] = '\0';
+	} else {
+		snprintf(buf, DATA_SIZE, "req %lu", req_id);
+	}
+
+	t = rpp_stat_now();
+	switch (grant) {
+	case MW_G_REMOTE:
+	case MW_G_LOCAL:
+		/* NOTE: the key part of the rkey changes on every bind,
+		 * so an rkey of an earlier request does not match */
+		*rkey = ibv_inc_rkey(*rkey);
+		if (mw_bind(id, mw, mr, buf, DATA_SIZE, *rkey) != 0) {
+			return 1;
+		}
+		msg.rkey = *rkey;
+		msg.inv = grant == MW_G_REMOTE;
+		break;
+	case MW_G_REG:
+		req_mr = ibv_reg_mr(id->pd, buf, DATA_SIZE,
+			IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+			IBV_ACCESS_REMOTE_WRITE);
+		if (req_mr == NULL) {
+			perror("ibv_reg_mr mw request");
+			return 1;
+		}
+		msg.rkey = req_mr->rkey;
+		break;
+	default:
+		msg.rkey = mr->rkey;
+		break;
+	}
+	rpp_lat_add(&w->grant, rpp_stat_now() - t);
+
+	if (rpp_send_msg(id, &msg, sizeof(msg)) != 0 ||
+	    rpp_recv_msg_wc(id, &msg, sizeof(msg), &wc) != 0) {
+		goto err;
+	}
+	if (msg.req_id != req_id || msg.status != 0) {
+		fprintf(stderr, "mw: request %lu: reply %lu status %u\n",
+			req_id, msg.req_id, msg.status);
+		goto err;
+	}
+
+	t = rpp_stat_now();
+	switch (grant) {
+	case MW_G_REMOTE:
+		if (!(wc.wc_flags & IBV_WC_WITH_INV) ||
+		    wc.invalidated_rkey != *rkey) {
+			fprintf(stderr, "mw: request %lu: rkey %x not "
+				"invalidated\n", req_id, *rkey);
+			return 1;
+		}
+		break;
+	case MW_G_LOCAL:
+		if (mw_local_inv(id, *rkey) != 0) {
+			return 1;
+		}
+		break;
+	case MW_G_REG:
+		if (ibv_dereg_mr(req_mr) != 0) {
+			perror("ibv_dereg_mr mw request");
+			return 1;
+		}
+		break;
+	}
+	rpp_lat_add(&w->revoke, rpp_stat_now() - t);
+
+	if (write) {
+		snprintf(expect, sizeof(expect), "req %lu", req_id);
+		if (strcmp(buf, expect) != 0) {
+			w->bad++;
+		}
+	}
+
+	return 0;
+
+err:
+	if (req_mr != NULL) {
+		ibv_dereg_mr(req_mr);
+	}
+	return 1;
+}
+
+static void *
+mw_worker(void *arg)
+{
+	struct mw_worker *w = (struct mw_worker *)arg;
+	struct rdma_cm_id *id;
+	struct ibv_device_attr attr;
+	struct ibv_mr *mr = NULL;
+	struct ibv_mw *mw = NULL;
+	struct mw_msg msg;
+	uint32_t rkey = 0;
+	char *buf;
+	uint64_t req_id, t;
+	int access;
+
+	w->ret = 1;
+	buf = (char *)calloc(RPP_MW_SLOTS, DATA_SIZE);
+	if (buf == NULL) {
+		perror("calloc mw buffer");
+	}
+	id = rpp_client_connect(w->addr, RPP_MODE_MW, 2, 2);
+	if (id == NULL || buf == NULL) {
+		goto out;
+	}
+
+	/* NOTE: a window needs IBV_ACCESS_MW_BIND in the MR. the MR
+	 * gives remote access itself only with -o mr. */
+	access = IBV_ACCESS_LOCAL_WRITE;
+	if (grant == MW_G_MR) {
+		access |= IBV_ACCESS_REMOTE_READ | IBV_ACCESS_REMOTE_WRITE;
+	} else if (grant != MW_G_REG) {
+		access |= IBV_ACCESS_MW_BIND;
+		if (ibv_query_device(id->verbs, &attr) != 0) {
+			perror("ibv_query_device");
+			goto out;
+		}
+		if (!(attr.device_cap_flags &
+				(IBV_DEVICE_MEM_WINDOW_TYPE_2A |
+				 IBV_DEVICE_MEM_WINDOW_TYPE_2B))) {
+			fprintf(stderr, "mw: no type 2 memory windows\n");
+			goto out;
+		}
+		DEBUG_LOG("ibv_alloc_mw\n");
+		mw = ibv_alloc_mw(id->pd, IBV_MW_TYPE_2);
+		if (mw == NULL) {
+			perror("ibv_alloc_mw");
+			goto out;
+		}
+		rkey = mw->rkey;
+	}
+	DEBUG_LOG("ibv_reg_mr mw buffer\n");
+	mr = ibv_reg_mr(id->pd, buf, RPP_MW_SLOTS * DATA_SIZE, access);
+	if (mr == NULL) {
+		perror("ibv_reg_mr mw buffer");
+		goto out;
+	}
+
+	__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+	rpp_wait_until(&go, 1);
+
+	w->start = rpp_stat_now();
+	for (w->reqs = 0; w->reqs < opts.count; w->reqs++) {
+		req_id = (uint64_t)w->index << 48 | w->reqs;
+		t = rpp_stat_now();
+		if (mw_request(w, id, mr, mw, &rkey,
+				buf + (w->reqs % RPP_MW_SLOTS) * DATA_SIZE,
+				req_id, w->reqs & 1) != 0) {
+			goto close;
+		}
+		rpp_lat_add(&w->lat, rpp_stat_now() - t);
+	}
+	w->end = rpp_stat_now();
+	w->ret = 0;
+
+close:
+	memset(&msg, 0, sizeof(msg));
+	msg.op = MW_OP_CLOSE;
+	if (rpp_send_msg(id, &msg, sizeof(msg)) != 0) {
+		w->ret = 1;
+	}
+out:
+	if (w->ret != 0 && w->start == 0) {
+		/* NOTE: not ready yet, do not hold the others */
+		__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+	}
+	if (mr != NULL) {
+		ibv_dereg_mr(mr);
+	}
+	if (mw != NULL) {
+		ibv_dealloc_mw(mw);
+	}
+	if (id != NULL) {
+		rpp_client_close(id);
+	}
+	free(buf);
+
+	return NULL;
+}
+
+int
+rpp_mw_client(struct sockaddr *addr)
+{
+	struct mw_worker *w;
+	struct rpp_lat lat, grant_lat, revoke_lat;
+	uint64_t reqs = 0, bad = 0, start = UINT64_MAX, end = 0;
+	unsigned int i;
+	int ret = 0;
+
+	if (opts.op == NULL) {
+		opts.op = "remote";
+	}
+	for (grant = 0; grant <= MW_G_MR; grant++) {
+		if (strcmp(opts.op, mw_grant_name[grant]) == 0) {
+			break;
+		}
+	}
+	if (grant > MW_G_MR) {
+		fprintf(stderr, "mw: op must be remote, local, reg or mr\n");
+		return 1;
+	}
+	if (opts.threads == 0) {
+		fprintf(stderr, "mw: threads must be > 0\n");
+		return 1;
+	}
+
+	w = (struct mw_worker *)calloc(opts.threads, sizeof(*w));
+	if (w == NULL) {
+		perror("calloc mw_worker");
+		return 1;
+	}
+
+	for (i = 0; i < opts.threads; i++) {
+		w[i].index = i;
+		w[i].addr = addr;
+		if (rpp_lat_init(&w[i].lat, opts.count) != 0 ||
+		    rpp_lat_init(&w[i].grant, opts.count) != 0 ||
+		    rpp_lat_init(&w[i].revoke, opts.count) != 0) {
+			rpp_lat_free(&w[i].lat);
+			rpp_lat_free(&w[i].grant);
+			rpp_lat_free(&w[i].revoke);
+			ret = 1;
+			break;
+		}
+		if (pthread_create(&w[i].th, NULL, mw_worker, &w[i]) != 0) {
+			perror("pthread_create");
+			rpp_lat_free(&w[i].lat);
+			rpp_lat_free(&w[i].grant);
+			rpp_lat_free(&w[i].revoke);
+			ret = 1;
+			break;
+		}
+	}
+	opts.threads = i;
+	nstarted = i;
+
+	rpp_wait_until(&ready, nstarted);
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+
+	rpp_lat_init(&lat, 0);
+	rpp_lat_init(&grant_lat, 0);
+	rpp_lat_init(&revoke_lat, 0);
+	for (i = 0; i < opts.threads; i++) {
+		pthread_join(w[i].th, NULL);
+		if (w[i].ret != 0) {
+			ret = 1;
+		} else {
+			if (w[i].start < start) {
+				start = w[i].start;
+			}
+			if (w[i].end > end) {
+				end = w[i].end;
+			}
+		}
+		reqs += w[i].reqs;
+		bad += w[i].bad;
+		rpp_lat_merge(&lat, &w[i].lat);
+		rpp_lat_merge(&grant_lat, &w[i].grant);
+		rpp_lat_merge(&revoke_lat, &w[i].revoke);
+		rpp_lat_free(&w[i].lat);
+		rpp_lat_free(&w[i].grant);
+		rpp_lat_free(&w[i].revoke);
+	}
+
+	printf("mw %s: threads %u, %d bytes: %lu requests, %lu bad, "
+		"%.1f Kreq/s\n", opts.op, opts.threads, DATA_SIZE, reqs, bad,
+		end > start ? reqs / ((end - start) / 1e9) / 1e3 : 0);
+	rpp_lat_report("request", &lat);
+	if (grant != MW_G_MR) {
+		rpp_lat_report("grant", &grant_lat);
+		rpp_lat_report("revoke", &revoke_lat);
+	}
+	if (bad != 0) {
+		ret = 1;
+	}
+
+	rpp_lat_free(&lat);
+	rpp_lat_free(&grant_lat);
+	rpp_lat_free(&revoke_lat);
+	free(w);
+
+	return ret;
+}
@@ -0,0 +1,602 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "rpp_h.h"
+#include "rpp_bench.h"
+
+/* pool mode: remote memory pool (far memory).
+ *
+ * the server reserves one pool of RPP_POOL_SIZE bytes and registers it
+ * once for remote read/write. the pool is cut into slabs of
+ * RPP_POOL_SLAB bytes, and clients manage them by messages:
+ * 	ALLOC name	-> slab, addr, rkey, len
+ * 	LOOKUP name	-> slab, addr, rkey, len
+ * 	FREE slab
+ * 	DONE		(end of session, no reply)
+ * the data of a slab is accessed by RDMA READ/WRITE directly. no MR is
+ * registered per allocation, so all slabs have the rkey of the pool.
+ *
+ * slabs are not owned by the session. a slab stays allocated after the
+ * session ends, and another client can find it by LOOKUP.
+ */
+
+#ifndef RPP_POOL_SIZE
+#define RPP_POOL_SIZE	(256UL << 20)
+#endif
+#ifndef RPP_POOL_SLAB
+#define RPP_POOL_SLAB	(64UL << 10)
+#endif
+#define POOL_NSLABS	(RPP_POOL_SIZE / RPP_POOL_SLAB)
+#define POOL_NAME_LEN	32
+#define POOL_HASH	1024	/* name hash buckets */
+
+enum pool_op {
+	POOL_OP_ALLOC = 1,
+	POOL_OP_FREE,
+	POOL_OP_LOOKUP,
+	POOL_OP_DONE,
+};
+
+enum pool_status {
+	POOL_OK,
+	POOL_NOMEM,
+	POOL_NOENT,
+	POOL_EXIST,
+	POOL_INVAL,
+};
+
+struct rpp_pool_msg {
+	uint32_t op;
+	uint32_t status;
+	uint32_t slab;
+	uint32_t rkey;
+	uint64_t addr;
+	uint64_t len;
+	char name[POOL_NAME_LEN];
+};
+
+/*
+ * server
+ */
+
+struct pool_slab {
+	int next;		/* free list or hash chain */
+	int used;
+	char name[POOL_NAME_LEN];
+};
+
+static char *pool;
+static struct ibv_mr *pool_mr;
+static struct pool_slab *slabs;
+static int free_head;
+static int name_hash[POOL_HASH];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+pool_export(struct rdma_cm_id *id)
+{
+	int ret = 0;
+	int i;
+
+	pthread_mutex_lock(&pool_lock);
+	if (pool_mr != NULL) {
+		goto out;
+	}
+	/* NOTE: touch the pool here, so page faults do not happen on the
+	 * data path. */
+	pool = mmap(NULL, RPP_POOL_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (pool == MAP_FAILED) {
+		perror("mmap pool");
+		pool = NULL;
+		ret = 1;
+		goto out;
+	}
+	slabs = (struct pool_slab *)calloc(POOL_NSLABS, sizeof(*slabs));
+	if (slabs == NULL) {
+		perror("calloc slabs");
+		goto err;
+	}
+	for (i = 0; i < (int)POOL_NSLABS; i++) {
+		slabs[i].next = i + 1 < (int)POOL_NSLABS ? i + 1 : -1;
+	}
+	free_head = 0;
+	for (i = 0; i < POOL_HASH; i++) {
+		name_hash[i] = -1;
+	}
+
+	DEBUG_LOG("ibv_reg_mr pool\n");
+	pool_mr = ibv_reg_mr(id->pd, pool, RPP_POOL_SIZE,
+		IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+		IBV_ACCESS_REMOTE_WRITE);
+	if (pool_mr == NULL) {
+		perror("ibv_reg_mr pool");
+		goto err;
+	}
+	rpp_stat_mr(1);
+	rpp_log("pool: %lu slabs of %lu bytes\n", POOL_NSLABS, RPP_POOL_SLAB);
+	goto out;
+
+err:
+	free(slabs);
+	slabs = NULL;
+	munmap(pool, RPP_POOL_SIZE);
+	pool = NULL;
+	ret = 1;
+out:
+	pthread_mutex_unlock(&pool_lock);
+
+	return ret;
+}
+
+static unsigned int
+pool_name_hash(const char *name)
+{
+	uint32_t h = 2166136261U;
+	int i;
+
+	for (i = 0; i < POOL_NAME_LEN && name[i] != '\0'; i++) {
+		h ^= (unsigned char)name[i];
+		h *= 16777619U;
+	}
+
+	return h % POOL_HASH;
+}
+
+/* called with pool_lock held */
+static int
+pool_find(const char *name)
+{
+	int i;
+
+	for (i = name_hash[pool_name_hash(name)]; i >= 0; i = slabs[i].next) {
+		if (strncmp(slabs[i].name, name, POOL_NAME_LEN) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static void
+pool_reply(struct rpp_pool_msg *msg, int slab)
+{
+	msg->slab = slab;
+	msg->addr = (uint64_t)(pool + (uint64_t)slab * RPP_POOL_SLAB);
+	msg->rkey = pool_mr->rkey;
+	msg->len = RPP_POOL_SLAB;
+}
+
+/* called with pool_lock held */
+static int
+pool_alloc(struct rpp_pool_msg *msg)
+{
+	unsigned int h;
+	int i;
+
+	if (msg->name[0] != '\0' && pool_find(msg->name) >= 0) {
+		return POOL_EXIST;
+	}
+	i = free_head;
+	if (i < 0) {
+		return POOL_NOMEM;
+	}
+	free_head = slabs[i].next;
+
+	slabs[i].used = 1;
+	memcpy(slabs[i].name, msg->name, POOL_NAME_LEN);
+	/* anonymous slabs are not hashed */
+	if (msg->name[0] != '\0') {
+		h = pool_name_hash(msg->name);
+		slabs[i].next = name_hash[h];
+		name_hash[h] = i;
+	} else {
+		slabs[i].next = -1;
+	}
+	pool_reply(msg, i);
+
+	return POOL_OK;
+}
+
+/* called with pool_lock held */
+static int
+pool_free(struct rpp_pool_msg *msg)
+{
+	int *p;
+	int i = msg->slab;
+
+	if (i < 0 || i >= (int)POOL_NSLABS || !slabs[i].used) {
+		return POOL_INVAL;
+	}
+	if (slabs[i].name[0] != '\0') {
+		for (p = &name_hash[pool_name_hash(slabs[i].name)]; *p != i;
+				p = &slabs[*p].next) {
+			;
+		}
+		*p = slabs[i].next;
+	}
+
+	slabs[i].used = 0;
+	slabs[i].name[0] = '\0';
+	slabs[i].next = free_head;
+	free_head = i;
+
+	return POOL_OK;
+}
+
+int
+rpp_pool_server(struct rdma_cm_id *id)
+{
+	struct rpp_pool_msg msg;
+	int ret;
+	int i;
+
+	ret = pool_export(id);
+	if (ret != 0) {
+		return ret;
+	}
+	/* NOTE: rdma_cm allocates one PD per device. */
+	if (pool_mr->pd != id->pd) {
+		fprintf(stderr, "pool: pool is on another device\n");
+		return 1;
+	}
+
+	for (;;) {
+		ret = rpp_recv_msg(id, &msg, sizeof(msg));
+		if (ret != 0) {
+			return ret;
+		}
+		if (msg.op == POOL_OP_DONE) {
+			break;
+		}
+		msg.name[POOL_NAME_LEN - 1] = '\0';
+
+		pthread_mutex_lock(&pool_lock);
+		switch (msg.op) {
+		case POOL_OP_ALLOC:
+			msg.status = pool_alloc(&msg);
+			break;
+		case POOL_OP_FREE:
+			msg.status = pool_free(&msg);
+			break;
+		case POOL_OP_LOOKUP:
+			i = pool_find(msg.name);
+			if (i < 0) {
+				msg.status = POOL_NOENT;
+			} else {
+				pool_reply(&msg, i);
+				msg.status = POOL_OK;
+			}
+			break;
+		default:
+			msg.status = POOL_INVAL;
+			break;
+		}
+		pthread_mutex_unlock(&pool_lock);
+		DEBUG_LOG("pool op %u slab %u status %u\n", msg.op, msg.slab,
+			msg.status);
+
+		ret = rpp_send_msg(id, &msg, sizeof(msg));
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * client
+ */
+
+struct pool_worker {
+	pthread_t th;
+	unsigned int index;
+	struct sockaddr *addr;
+	struct rpp_lat alloc_lat;
+	struct rpp_lat free_lat;
+	struct rpp_lat read_lat;
+	struct rpp_lat write_lat;
+	uint64_t allocs;
+	uint64_t accesses;
+	uint64_t alloc_ns;
+	uint64_t access_ns;
+	uint64_t bad;
+	int ret;
+};
+
+static unsigned int nstarted;
+static unsigned int ready;
+static unsigned int go;
+
+static int
+pool_call(struct rdma_cm_id *id, struct rpp_pool_msg *msg)
+{
+	if (rpp_send_msg(id, msg, sizeof(*msg)) != 0) {
+		return 1;
+	}
+	if (rpp_recv_msg(id, msg, sizeof(*msg)) != 0) {
+		return 1;
+	}
+	if (msg->status != POOL_OK) {
+		fprintf(stderr, "pool: op %u %s status %u\n", msg->op,
+			msg->name, msg->status);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* alloc/free rate. anonymous slabs, freed at once. */
+static int
+pool_run_alloc(struct pool_worker *w, struct rdma_cm_id *id)
+{
+	struct rpp_pool_msg msg;
+	uint64_t start, t;
+
+	start = rpp_stat_now();
+	while (w->allocs < opts.count) {
+		memset(&msg, 0, sizeof(msg));
+		msg.op = POOL_OP_ALLOC;
+		t = rpp_stat_now();
+		if (pool_call(id, &msg) != 0) {
+			return 1;
+		}
+		rpp_lat_add(&w->alloc_lat, rpp_stat_now() - t);
+
+		msg.op = POOL_OP_FREE;
+		t = rpp_stat_now();
+		if (pool_call(id, &msg) != 0) {
+			return 1;
+		}
+		rpp_lat_add(&w->free_lat, rpp_stat_now() - t);
+		w->allocs++;
+	}
+	w->alloc_ns = rpp_stat_now() - start;
+
+	return 0;
+}
+
+/* far memory access. WRITE a block at a random offset of a named slab
+ * and READ it back. */
+static int
+pool_run_access(struct pool_worker *w, struct rdma_cm_id *id)
+{
+	struct rpp_context *ct = id->context;
+	struct rpp_pool_msg msg, found;
+	uint64_t seed = 88172645463325252ULL + w->index;
+	uint64_t nblk = RPP_POOL_SLAB / DATA_SIZE;
+	uint64_t raddr, start, t;
+	int ret = 1;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = POOL_OP_ALLOC;
+	snprintf(msg.name, sizeof(msg.name), "rpp_h-%d-%u", getpid(),
+		w->index);
+	if (pool_call(id, &msg) != 0) {
+		return 1;
+	}
+
+	/* the slab can be found by name */
+	memset(&found, 0, sizeof(found));
+	found.op = POOL_OP_LOOKUP;
+	strcpy(found.name, msg.name);
+	if (pool_call(id, &found) != 0) {
+		goto out;
+	}
+	if (found.slab != msg.slab || found.addr != msg.addr) {
+		fprintf(stderr, "pool: lookup %s: slab %u, expected %u\n",
+			msg.name, found.slab, msg.slab);
+		goto out;
+	}
+
+	start = rpp_stat_now();
+	while (w->accesses < opts.count) {
+		raddr = msg.addr + (nblk > 1 ?
+			rpp_xorshift64(&seed) % nblk : 0) * DATA_SIZE;
+		memset(ct->write_data, 0, DATA_SIZE);
+		snprintf(ct->write_data, DATA_SIZE, "%u-%lu", w->index,
+			w->accesses);
+
+		t = rpp_stat_now();
+		if (rdma_post_write(id, NULL, ct->write_data, DATA_SIZE,
+				ct->write_mr, 0, raddr, msg.rkey) != 0) {
+			perror("rdma_post_write pool");
+			goto out;
+		}
+		if (rpp_poll_send_comp(id, 1) != 0) {
+			goto out;
+		}
+		rpp_lat_add(&w->write_lat, rpp_stat_now() - t);
+
+		t = rpp_stat_now();
+		if (rdma_post_read(id, NULL, ct->read_data, DATA_SIZE,
+				ct->read_mr, 0, raddr, msg.rkey) != 0) {
+			perror("rdma_post_read pool");
+			goto out;
+		}
+		if (rpp_poll_send_comp(id, 1) != 0) {
+			goto out;
+		}
+		rpp_lat_add(&w->read_lat, rpp_stat_now() - t);
+
+		if (strcmp(ct->read_data, ct->write_data) != 0) {
+			w->bad++;
+		}
+		w->accesses++;
+	}
+	w->access_ns = rpp_stat_now() - start;
+	ret = 0;
+
+out:
+	msg.op = POOL_OP_FREE;
+	if (pool_call(id, &msg) != 0) {
+		ret = 1;
+	}
+
+	return ret;
+}
+
+static void *
+pool_worker(void *arg)
+{
+	struct pool_worker *w = (struct pool_worker *)arg;
+	struct rdma_cm_id *id;
+	struct rpp_pool_msg done;
+	int counted_ready = 0;
+
+	w->ret = 1;
+	id = rpp_client_connect(w->addr, RPP_MODE_POOL, 2, 2);
+	if (id == NULL) {
+		goto out;
+	}
+
+	__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+	counted_ready = 1;
+	rpp_wait_until(&go, 1);
+
+	w->ret = 0;
+	if (strcmp(opts.op, "access") != 0) {
+		w->ret = pool_run_alloc(w, id);
+	}
+	if (w->ret == 0 && strcmp(opts.op, "alloc") != 0) {
+		w->ret = pool_run_access(w, id);
+	}
+
+	/* send done to server */
+	memset(&done, 0, sizeof(done));
+	done.op = POOL_OP_DONE;
+	if (rpp_send_msg(id, &done, sizeof(done)) != 0) {
+		w->ret = 1;
+	}
+
+	rpp_client_close(id);
+out:
+	if (!counted_ready) {
+		__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+	}
+
+	return NULL;
+}
+
+int
+rpp_pool_client(struct sockaddr *addr)
+{
+	struct pool_worker *w;
+	struct rpp_lat alloc_lat, free_lat, read_lat, write_lat;
+	double alloc_rate = 0, access_rate = 0;
+	uint64_t allocs = 0, accesses = 0, bad = 0;
+	unsigned int i;
+	int ret = 0;
+
+	if (opts.op == NULL) {
+		opts.op = "all";
+	}
+	if (strcmp(opts.op, "all") != 0 && strcmp(opts.op, "alloc") != 0 &&
+			strcmp(opts.op, "access") != 0) {
+		fprintf(stderr, "pool: op must be all, alloc or access\n");
+		return 1;
+	}
+	if (opts.threads == 0) {
+		fprintf(stderr, "pool: threads must be > 0\n");
+		return 1;
+	}
+
+	w = (struct pool_worker *)calloc(opts.threads, sizeof(*w));
+	if (w == NULL) {
+		perror("calloc pool_worker");
+		return 1;
+	}
+
+	for (i = 0; i < opts.threads; i++) {
+		w[i].index = i;
+		w[i].addr = addr;
+		if (rpp_lat_init(&w[i].alloc_lat, opts.count) != 0 ||
+				rpp_lat_init(&w[i].free_lat, opts.count) != 0 ||
+				rpp_lat_init(&w[i].read_lat, opts.count) != 0 ||
+				rpp_lat_init(&w[i].write_lat, opts.count) != 0) {
+			ret = 1;
+		} else if (pthread_create(&w[i].th, NULL, pool_worker,
+				&w[i]) != 0) {
+			perror("pthread_create");
+			ret = 1;
+		}
+		if (ret != 0) {
+			rpp_lat_free(&w[i].alloc_lat);
+			rpp_lat_free(&w[i].free_lat);
+			rpp_lat_free(&w[i].read_lat);
+			rpp_lat_free(&w[i].write_lat);
+			break;
+		}
+	}
+	opts.threads = i;
+	nstarted = i;
+
+	rpp_wait_until(&ready, nstarted);
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+
+	rpp_lat_init(&alloc_lat, 0);
+	rpp_lat_init(&free_lat, 0);
+	rpp_lat_init(&read_lat, 0);
+	rpp_lat_init(&write_lat, 0);
+	for (i = 0; i < opts.threads; i++) {
+		pthread_join(w[i].th, NULL);
+		if (w[i].ret != 0) {
+			ret = 1;
+		}
+		/* threads run independently, so rates are added up */
+		if (w[i].alloc_ns > 0) {
+			alloc_rate += w[i].allocs / (w[i].alloc_ns / 1e9);
+		}
+		if (w[i].access_ns > 0) {
+			access_rate += w[i].accesses / (w[i].access_ns / 1e9);
+		}
+		allocs += w[i].allocs;
+		accesses += w[i].accesses;
+		bad += w[i].bad;
+		rpp_lat_merge(&alloc_lat, &w[i].alloc_lat);
+		rpp_lat_merge(&free_lat, &w[i].free_lat);
+		rpp_lat_merge(&read_lat, &w[i].read_lat);
+		rpp_lat_merge(&write_lat, &w[i].write_lat);
+		rpp_lat_free(&w[i].alloc_lat);
+		rpp_lat_free(&w[i].free_lat);
+		rpp_lat_free(&w[i].read_lat);
+		rpp_lat_free(&w[i].write_lat);
+	}
+
+	if (allocs > 0) {
+		printf("pool alloc: threads %u, slab %lu: %lu alloc/free, "
+			"%.3f Kops/s\n", opts.threads, RPP_POOL_SLAB, allocs,
+			alloc_rate / 1e3);
+		rpp_lat_report("alloc", &alloc_lat);
+		rpp_lat_report("free", &free_lat);
+	}
+	if (accesses > 0) {
+		printf("pool access: threads %u, %d bytes: %lu WRITE+READ, "
+			"%.3f Kops/s, bad %lu\n", opts.threads, DATA_SIZE,
+			accesses, access_rate / 1e3, bad);
+		rpp_lat_report("write", &write_lat);
+		rpp_lat_report("read", &read_lat);
+	}
+	if (bad > 0) {
+		ret = 1;
+	}
+
+	rpp_lat_free(&alloc_lat);
+	rpp_lat_free(&free_lat);
+	rpp_lat_free(&read_lat);
+	rpp_lat_free(&write_lat);
+	free(w);
+
+	return ret;
+}
@@ -0,0 +1,308 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "rpp_h.h"
+
+/* rpp_qpool: QPs of the server made before the connect requests.
+ *
+ * without the pool a session thread creates two completion channels,
+ * two CQs and a QP before it can call rdma_accept, all of them calls
+ * into the kernel. an entry of the pool
+ * has all of these made on the device of the listen id, the QP moved
+ * to INIT and the first receive posted. a session takes an entry and
+ * only hands it to its id. a background thread makes new entries when
+ * the pool is below half full. each listen id has its own pool.
+ *
+ * NOTE: rdma_cm allocates one PD per device, so the PD of the listen
+ * id is the PD of every id of a request on the device. rdma_accept
+ * moves the QP of the id through INIT (with the attributes of the
+ * request) to RTS, and rdma_destroy_qp destroys the QP, CQs and
+ * channels of the id whoever made them.
+ *
+ * an entry has the shape of rpp_create_qp (2 send, 2 recv, recv_msg
+ * only). requests which need other queues (fanout, -R) and requests
+ * for another port make their own as before.
+ */
+
+struct qpool_entry {
+	struct rpp_context *ct;
+	struct ibv_comp_channel *send_ch;
+	struct ibv_comp_channel *recv_ch;
+	struct ibv_cq *send_cq;
+	struct ibv_cq *recv_cq;
+	struct ibv_qp *qp;
+};
+
+struct rpp_qpool {
+	struct ibv_context *verbs;
+	struct ibv_pd *pd;
+	uint8_t port_num;
+	unsigned int size;
+	unsigned int n;			/* entries ready */
+	struct qpool_entry *entry;	/* stack of size */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;		/* wakes the refill thread */
+	pthread_t th;
+	int started;
+	int stop;
+	uint64_t hits;
+	uint64_t misses;
+};
+
+static void
+qpool_entry_free(struct qpool_entry *e)
+{
+	if (e->qp && ibv_destroy_qp(e->qp) != 0) {
+		perror("ibv_destroy_qp");
+	}
+	if (e->send_cq && ibv_destroy_cq(e->send_cq) != 0) {
+		perror("ibv_destroy_cq send_cq");
+	}
+	if (e->recv_cq && ibv_destroy_cq(e->recv_cq) != 0) {
+		perror("ibv_destroy_cq recv_cq");
+	}
+	if (e->send_ch && ibv_destroy_comp_channel(e->send_ch) != 0) {
+		perror("ibv_destroy_comp_channel send_ch");
+	}
+	if (e->recv_ch && ibv_destroy_comp_channel(e->recv_ch) != 0) {
+		perror("ibv_destroy_comp_channel recv_ch");
+	}
+	if (e->ct) {
+		rpp_destroy_context(e->ct);
+	}
+	memset(e, 0, sizeof(*e));
+}
+
+/* what rdma_create_qp and rpp_ctx_bind do for an id */
+static int
+qpool_entry_make(struct rpp_qpool *pool, struct qpool_entry *e)
+{
+	struct ibv_qp_init_attr init_attr;
+	struct ibv_qp_attr attr;
+	struct ibv_sge sge;
+	struct ibv_recv_wr wr, *bad;
+
+	memset(e, 0, sizeof(*e));
+	e->ct = rpp_ctx_alloc();
+	if (e->ct == NULL) {
+		return 1;
+	}
+	if (rpp_ctx_bind(e->ct, pool->pd) != 0) {
+		goto err;
+	}
+
+	e->recv_ch = ibv_create_comp_channel(pool->verbs);
+	e->send_ch = ibv_create_comp_channel(pool->verbs);
+	if (e->recv_ch == NULL || e->send_ch == NULL) {
+		perror("ibv_create_comp_channel");
+		goto err;
+	}
+	e->recv_cq = ibv_create_cq(pool->verbs, 2, NULL, e->recv_ch, 0);
+	e->send_cq = ibv_create_cq(pool->verbs, 2, NULL, e->send_ch, 0);
+	if (e->recv_cq == NULL || e->send_cq == NULL) {
+		perror("ibv_create_cq");
+		goto err;
+	}
+
+	memset(&init_attr, 0, sizeof(init_attr));
+	init_attr.send_cq = e->send_cq;
+	init_attr.recv_cq = e->recv_cq;
+	init_attr.cap.max_send_wr = 2;
+	init_attr.cap.max_recv_wr = 2;
+	init_attr.cap.max_recv_sge = 1;
+	init_attr.cap.max_send_sge = 1;
+	init_attr.qp_type = IBV_QPT_RC;
+	init_attr.sq_sig_all = 1;
+	e->qp = ibv_create_qp(pool->pd, &init_attr);
+	if (e->qp == NULL) {
+		perror("ibv_create_qp");
+		goto err;
+	}
+
+	/* NOTE: as rdma_cm does for an IB/RoCE id. a receive can be
+	 * posted from INIT on. */
+	memset(&attr, 0, sizeof(attr));
+	attr.qp_state = IBV_QPS_INIT;
+	attr.pkey_index = 0;
+	attr.port_num = pool->port_num;
+	attr.qp_access_flags = 0;
+	if (ibv_modify_qp(e->qp, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX |
+			IBV_QP_PORT | IBV_QP_ACCESS_FLAGS) != 0) {
+		perror("ibv_modify_qp INIT");
+		goto err;
+	}
+
+	sge.addr = (uint64_t)(uintptr_t)e->ct->recv_msg;
+	sge.length = sizeof(e->ct->recv_msg);
+	sge.lkey = e->ct->recv_mr->lkey;
+	memset(&wr, 0, sizeof(wr));
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	if (ibv_post_recv(e->qp, &wr, &bad) != 0) {
+		perror("ibv_post_recv");
+		goto err;
+	}
+
+	return 0;
+
+err:
+	qpool_entry_free(e);
+	return 1;
+}
+
+static void *
+qpool_refill(void *arg)
+{
+	struct rpp_qpool *pool = (struct rpp_qpool *)arg;
+	struct qpool_entry e;
+	int failed = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->stop) {
+		if (pool->n > pool->size / 2 || failed) {
+			/* NOTE: after a failure, try again on the next
+			 * wake up */
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			failed = 0;
+			continue;
+		}
+		/* NOTE: made without the lock, rpp_qpool_attach does not
+		 * wait for it */
+		while (!pool->stop && pool->n < pool->size) {
+			pthread_mutex_unlock(&pool->lock);
+			failed = qpool_entry_make(pool, &e);
+			pthread_mutex_lock(&pool->lock);
+			if (failed) {
+				break;
+			}
+			pool->entry[pool->n++] = e;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/* make size entries on the device of listen_id (bound to an address)
+ * and start the refill thread */
+struct rpp_qpool *
+rpp_qpool_create(struct rdma_cm_id *listen_id, unsigned int size)
+{
+	struct rpp_qpool *pool;
+	unsigned int i;
+
+	if (listen_id->verbs == NULL || listen_id->pd == NULL) {
+		fprintf(stderr, "qpool: listen id has no device\n");
+		return NULL;
+	}
+	pool = (struct rpp_qpool *)calloc(1, sizeof(*pool));
+	if (pool == NULL) {
+		perror("calloc rpp_qpool");
+		return NULL;
+	}
+	pool->entry = (struct qpool_entry *)calloc(size, sizeof(*pool->entry));
+	if (pool->entry == NULL) {
+		perror("calloc qpool_entry");
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pool->verbs = listen_id->verbs;
+	pool->pd = listen_id->pd;
+	pool->port_num = listen_id->port_num;
+	pool->size = size;
+
+	for (i = 0; i < size; i++) {
+		if (qpool_entry_make(pool, &pool->entry[i]) != 0) {
+			break;
+		}
+		pool->n++;
+	}
+	if (pool->n == 0) {
+		rpp_qpool_destroy(pool);
+		return NULL;
+	}
+
+	if (pthread_create(&pool->th, NULL, qpool_refill, pool) != 0) {
+		perror("pthread_create");
+		rpp_qpool_destroy(pool);
+		return NULL;
+	}
+	pool->started = 1;
+	DEBUG_LOG("qpool: %u entries\n", pool->n);
+
+	return pool;
+}
+
+/* give id a QP, CQs and context of the pool. returns 1 if the pool
+ * (NULL: none) has nothing for it; the caller makes its own. */
+int
+rpp_qpool_attach(struct rpp_qpool *pool, struct rdma_cm_id *id)
+{
+	struct qpool_entry e;
+
+	if (pool == NULL) {
+		return 1;
+	}
+	pthread_mutex_lock(&pool->lock);
+	if (pool->n == 0 || id->pd != pool->pd ||
+	    id->port_num != pool->port_num) {
+		pool->misses++;
+		pthread_mutex_unlock(&pool->lock);
+		return 1;
+	}
+	e = pool->entry[--pool->n];
+	pool->hits++;
+	if (pool->n <= pool->size / 2) {
+		pthread_cond_signal(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	id->context = e.ct;
+	id->qp = e.qp;
+	id->send_cq_channel = e.send_ch;
+	id->recv_cq_channel = e.recv_ch;
+	id->send_cq = e.send_cq;
+	id->recv_cq = e.recv_cq;
+	/* NOTE: rdma_get_{send,recv}_comp check that the CQ context is
+	 * the id, as rdma_create_qp makes it */
+	e.send_cq->cq_context = id;
+	e.recv_cq->cq_context = id;
+
+	return 0;
+}
+
+void
+rpp_qpool_destroy(struct rpp_qpool *pool)
+{
+	if (pool == NULL) {
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_signal(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+	if (pool->started) {
+		pthread_join(pool->th, NULL);
+		rpp_log("qpool: %lu hits, %lu misses\n", pool->hits,
+			pool->misses);
+	}
+
+	while (pool->n > 0) {
+		qpool_entry_free(&pool->entry[--pool->n]);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->cond);
+	free(pool->entry);
+	free(pool);
+}
@@ -0,0 +1,734 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+
+#include "rpp_h.h"
+#include "rpp_bench.h"
+
+/* repl mode: replication of an append-only log to a backup.
+ *
+ * the backup (server) exports a log region per session: a header with
+ * the committed tail (WRITten by the primary) and the applied head
+ * (by the backup), and a circular log of RPP_REPL_LOG bytes. positions
+ * are byte counts since the start, the offset in the log is the
+ * position modulo RPP_REPL_LOG.
+ *
+ * the primary (client) keeps a mirror of the log. -T producer threads
+ * append records (-k bytes of payload) to the mirror and wait for
+ * their commit. the main thread sends all records appended since the
+ * last batch with one or two WRITEs (two at the end of the log) and
+ * publishes the new tail:
+ *
+ *	-o write	a second WRITE of the tail in the header (default).
+ *			the backup polls the tail.
+ *	-o imm		the last WRITE of the records is WRITE_WITH_IMM,
+ *			the immediate is the bytes of the batch. the
+ *			backup waits for the receive completion.
+ *
+ * a batch is committed when the WRITE which publishes it completes.
+ * up to -q batches are in flight, more records appended meanwhile go
+ * in the next batch (group commit).
+ *
+ * NOTE: RC WRITEs are placed in order, so the backup sees the records
+ * of a batch before its tail.
+ *
+ * the backup checks the sequence number and the CRC32C of each record
+ * up to the tail and moves the head. the primary READs the head only
+ * when the log is full. at the end the tail has RPP_REPL_CLOSED (or the
+ * immediate is RPP_REPL_IMM_CLOSE) and the backup replies with what it
+ * applied.
+ */
+
+#define RPP_REPL_LOG (16UL << 20)
+#define RPP_REPL_REC_MAX (64 * 1024)
+#define RPP_REPL_REC_DEF 64
+#define RPP_REPL_DEPTH 128	/* max batches in flight */
+#define RPP_REPL_CLOSED (1ULL << 63)
+#define RPP_REPL_IMM_CLOSE 0xffffffffU
+#define RPP_REPL_PAD 0xffffffffU	/* rest of the log is unused */
+#define RPP_REPL_WR_HEAD UINT64_MAX	/* wr_id of the head READ */
+#define RPP_REPL_IDLE_CHECK 4096	/* idle polls between CM checks */
+
+struct repl_hdr {
+	uint64_t tail;		/* committed, by the primary */
+	char pad0[56];
+	uint64_t head;		/* applied, by the backup */
+	char pad1[56];
+};
+
+/* a record is 8 bytes aligned and does not wrap around the log */
+struct repl_rec {
+	uint32_t len;		/* payload, RPP_REPL_PAD: skip to the end */
+	uint32_t crc;		/* CRC32C of the payload */
+	uint64_t seq;
+};
+
+enum repl_op {
+	REPL_OP_START = 1,
+	REPL_OP_DONE,
+};
+
+struct repl_msg {
+	uint32_t op;
+	uint32_t imm;		/* START: -o imm */
+	uint64_t records;	/* DONE: records applied */
+	uint64_t bytes;		/* DONE: payload applied */
+	uint64_t errors;	/* DONE: bad records */
+};
+
+struct repl_apply {
+	char *log;
+	uint64_t head;
+	uint64_t seq;
+	uint64_t records;
+	uint64_t bytes;
+	uint64_t errors;
+};
+
+static inline uint64_t
+repl_rec_size(uint32_t len)
+{
+	return (sizeof(struct repl_rec) + len + 7) & ~7ULL;
+}
+
+/* apply the records up to tail */
+static void
+repl_apply(struct repl_apply *a, uint64_t tail)
+{
+	struct repl_rec *rec;
+	uint64_t off;
+
+	while (a->head < tail) {
+		off = a->head % RPP_REPL_LOG;
+		rec = (struct repl_rec *)(a->log + off);
+		if (RPP_REPL_LOG - off < sizeof(*rec) ||
+		    rec->len == RPP_REPL_PAD) {
+			a->head += RPP_REPL_LOG - off;
+			continue;
+		}
+		if (rec->len > RPP_REPL_REC_MAX ||
+		    off + repl_rec_size(rec->len) > RPP_REPL_LOG) {
+			/* NOTE: the rest of the batch cannot be parsed */
+			a->errors++;
+			a->head = tail;
+			break;
+		}
+		if (rec->seq != a->seq ||
+		    rpp_crc32c(0, rec + 1, rec->len) != rec->crc) {
+			a->errors++;
+		}
+		a->seq = rec->seq + 1;
+		a->records++;
+		a->bytes += rec->len;
+		a->head += repl_rec_size(rec->len);
+	}
+}
+
+/* a CM event of a session is DISCONNECTED (or worse). the session id
+ * is synchronous, so the event waits on its own channel. */
+static int
+repl_gone(struct rdma_cm_id *id)
+{
+	struct pollfd pfd = { .fd = id->channel->fd, .events = POLLIN };
+
+	return poll(&pfd, 1, 0) > 0;
+}
+
+int
+rpp_repl_server(struct rdma_cm_id *id)
+{
+	struct rpp_context *ct = id->context;
+	struct repl_hdr *hdr;
+	struct repl_apply a;
+	struct repl_msg msg;
+	struct ibv_mr *mr;
+	struct ibv_wc wc;
+	uint64_t tail = 0;
+	uint32_t imm;
+	unsigned int idle = 0;
+	int ret = 1;
+
+	if (posix_memalign((void **)&hdr, 64,
+			sizeof(*hdr) + RPP_REPL_LOG) != 0) {
+		perror("posix_memalign repl log");
+		return 1;
+	}
+	memset(hdr, 0, sizeof(*hdr) + RPP_REPL_LOG);
+	DEBUG_LOG("ibv_reg_mr repl log\n");
+	mr = ibv_reg_mr(id->pd, hdr, sizeof(*hdr) + RPP_REPL_LOG,
+		IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+		IBV_ACCESS_REMOTE_WRITE);
+	if (mr == NULL) {
+		perror("ibv_reg_mr repl log");
+		free(hdr);
+		return 1;
+	}
+	rpp_stat_mr(1);
+
+	ct->send_buf.buf = (uint64_t)hdr;
+	ct->send_buf.rkey = mr->rkey;
+	ct->send_buf.size = sizeof(*hdr) + RPP_REPL_LOG;
+	if (rpp_rdma_send(id) != 0 ||
+	    rpp_recv_msg(id, &msg, sizeof(msg)) != 0) {
+		goto out;
+	}
+	if (msg.op != REPL_OP_START) {
+		fprintf(stderr, "repl: unexpected op %u\n", msg.op);
+		goto out;
+	}
+
+	memset(&a, 0, sizeof(a));
+	a.log = (char *)(hdr + 1);
+	for (;;) {
+		if (msg.imm) {
+			if (rpp_recv_msg_wc(id, NULL, 0, &wc) != 0) {
+				goto out;
+			}
+			if (wc.status != IBV_WC_SUCCESS ||
+			    wc.opcode != IBV_WC_RECV_RDMA_WITH_IMM) {
+				fprintf(stderr, "repl: unexpected completion "
+					"%s opcode %d\n",
+					ibv_wc_status_str(wc.status),
+					wc.opcode);
+				goto out;
+			}
+			imm = ntohl(wc.imm_data);
+			if (imm == RPP_REPL_IMM_CLOSE) {
+				break;
+			}
+			tail += imm;
+		} else {
+			/* NOTE: busy poll, the data path has no event.
+			 * while the tail stays, look for a disconnect of a
+			 * primary gone without the close. */
+			tail = __atomic_load_n(&hdr->tail, __ATOMIC_ACQUIRE);
+			if (tail & RPP_REPL_CLOSED) {
+				repl_apply(&a, tail & ~RPP_REPL_CLOSED);
+				break;
+			}
+			if (tail == a.head) {
+				sched_yield();
+				if (++idle % RPP_REPL_IDLE_CHECK == 0 &&
+				    repl_gone(id)) {
+					fprintf(stderr, "repl: primary "
+						"disconnected\n");
+					goto out;
+				}
+				continue;
+			}
+		}
+		repl_apply(&a, tail);
+		__atomic_store_n(&hdr->head, a.head, __ATOMIC_RELEASE);
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = REPL_OP_DONE;
+	msg.records = a.records;
+	msg.bytes = a.bytes;
+	msg.errors = a.errors;
+	if (rpp_send_msg(id, &msg, sizeof(msg)) != 0) {
+		goto out;
+	}
+	ret = 0;
+
+out:
+	DEBUG_LOG("ibv_dereg_mr repl log\n");
+	if (ibv_dereg_mr(mr) != 0) {
+		perror("ibv_dereg_mr repl log");
+	}
+	rpp_stat_mr(-1);
+	free(hdr);
+
+	return ret;
+}
+
+/* primary */
+
+struct repl_ctrl {
+	uint64_t tail[RPP_REPL_DEPTH];	/* -o write: tail of each batch */
+	uint64_t head;			/* READ of the backup's head */
+};
+
+struct repl_producer {
+	pthread_t th;
+	unsigned int index;
+	uint64_t count;
+	struct rpp_lat lat;	/* commit */
+	int ret;
+};
+
+static char *mirror;
+static uint32_t rec_len;
+static pthread_mutex_t append_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t appended;	/* position, under append_lock */
+static uint64_t next_seq;	/* under append_lock */
+static uint64_t committed;	/* position */
+static uint64_t head_cache;	/* position applied by the backup */
+static unsigned int want_head;
+static unsigned int producing;
+static unsigned int failed;
+static unsigned int ready;
+static unsigned int go;
+
+/* append a record to the mirror. the end position of it, or 0 if the
+ * log is full. */
+static uint64_t
+repl_append(const char *payload, uint64_t *seed)
+{
+	struct repl_rec *rec;
+	uint64_t pos, off, gap, need, end;
+
+	pthread_mutex_lock(&append_lock);
+	pos = appended;
+	off = pos % RPP_REPL_LOG;
+	need = repl_rec_size(rec_len);
+	gap = RPP_REPL_LOG - off < need ? RPP_REPL_LOG - off : 0;
+	if (pos + gap + need - __atomic_load_n(&head_cache,
+			__ATOMIC_ACQUIRE) > RPP_REPL_LOG) {
+		pthread_mutex_unlock(&append_lock);
+		return 0;
+	}
+	if (gap >= sizeof(*rec)) {
+		((struct repl_rec *)(mirror + off))->len = RPP_REPL_PAD;
+	}
+	pos += gap;
+	rec = (struct repl_rec *)(mirror + pos % RPP_REPL_LOG);
+	rec->len = rec_len;
+	rec->seq = next_seq++;
+	memcpy(rec + 1, payload, rec_len);
+	/* NOTE: vary the payload so that the CRC check means something */
+	*(uint64_t *)(rec + 1) = rpp_xorshift64(seed);
+	rec->crc = rpp_crc32c(0, rec + 1, rec_len);
+	end = pos + need;
+	__atomic_store_n(&appended, end, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&append_lock);
+
+	return end;
+}
+
+static void *
+repl_producer(void *arg)
+{
+	struct repl_producer *p = (struct repl_producer *)arg;
+	char payload[RPP_REPL_REC_MAX];
+	uint64_t seed = 0x9e3779b97f4a7c15ULL * (p->index + 1);
+	uint64_t i, t, end;
+
+	memset(payload, 'r', rec_len);
+	__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+	rpp_wait_until(&go, 1);
+
+	for (i = 0; i < p->count; i++) {
+		t = rpp_stat_now();
+		while ((end = repl_append(payload, &seed)) == 0) {
+			/* the main thread READs the head */
+			__atomic_store_n(&want_head, 1, __ATOMIC_RELEASE);
+			while (__atomic_load_n(&want_head, __ATOMIC_ACQUIRE) &&
+			       !__atomic_load_n(&failed, __ATOMIC_ACQUIRE)) {
+				sched_yield();
+			}
+			if (__atomic_load_n(&failed, __ATOMIC_ACQUIRE)) {
+				goto out;
+			}
+		}
+		while (__atomic_load_n(&committed, __ATOMIC_ACQUIRE) < end) {
+			if (__atomic_load_n(&failed, __ATOMIC_ACQUIRE)) {
+				goto out;
+			}
+			sched_yield();
+		}
+		rpp_lat_add(&p->lat, rpp_stat_now() - t);
+	}
+	p->ret = 0;
+out:
+	__atomic_sub_fetch(&producing, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+struct repl_conn {
+	struct rdma_cm_id *id;
+	struct rpp_rdma_info info;
+	struct ibv_mr *mirror_mr;
+	struct ibv_mr *ctrl_mr;
+	struct repl_ctrl *ctrl;
+	int imm;
+};
+
+static int
+repl_post_write(struct repl_conn *c, uint64_t from, uint64_t len,
+	int last, uint64_t wr_id, uint32_t imm)
+{
+	struct ibv_sge sge;
+	struct ibv_send_wr wr, *bad;
+	uint64_t off = from % RPP_REPL_LOG;
+
+	sge.addr = (uint64_t)(uintptr_t)(mirror + off);
+	sge.length = len;
+	sge.lkey = c->mirror_mr->lkey;
+	memset(&wr, 0, sizeof(wr));
+	wr.wr_id = wr_id;
+	wr.sg_list = &sge;
+	wr.num_sge = len > 0;
+	wr.opcode = IBV_WR_RDMA_WRITE;
+	if (last && c->imm) {
+		wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+		wr.imm_data = htonl(imm);
+		wr.send_flags = IBV_SEND_SIGNALED;
+	}
+	wr.wr.rdma.remote_addr = c->info.buf + sizeof(struct repl_hdr) + off;
+	wr.wr.rdma.rkey = c->info.rkey;
+	if (ibv_post_send(c->id->qp, &wr, &bad) != 0) {
+		perror("ibv_post_send repl write");
+		return 1;
+	}
+
+	return 0;
+}
+
+/* WRITE the tail in the header */
+static int
+repl_post_tail(struct repl_conn *c, unsigned int slot, uint64_t tail)
+{
+	c->ctrl->tail[slot] = tail;
+	if (rdma_post_write(c->id, (void *)(uintptr_t)slot,
+			&c->ctrl->tail[slot], sizeof(uint64_t), c->ctrl_mr,
+			IBV_SEND_SIGNALED, c->info.buf, c->info.rkey) != 0) {
+		perror("rdma_post_write repl tail");
+		return 1;
+	}
+
+	return 0;
+}
+
+/* send [from, to) as batch slot, split at the end of the log */
+static int
+repl_post_batch(struct repl_conn *c, unsigned int slot, uint64_t from,
+	uint64_t to)
+{
+	uint64_t wrap = (from / RPP_REPL_LOG + 1) * RPP_REPL_LOG;
+
+	if (to > wrap) {
+		/* NOTE: the record after the wrap starts at the log top */
+		if (repl_post_write(c, from, wrap - from, 0, slot, 0) != 0) {
+			return 1;
+		}
+		if (repl_post_write(c, wrap, to - wrap, 1, slot,
+				to - from) != 0) {
+			return 1;
+		}
+	} else if (repl_post_write(c, from, to - from, 1, slot,
+			to - from) != 0) {
+		return 1;
+	}
+	if (!c->imm) {
+		return repl_post_tail(c, slot, to);
+	}
+
+	return 0;
+}
+
+/* publish the close and wait for it */
+static int
+repl_post_close(struct repl_conn *c, uint64_t tail)
+{
+	struct ibv_sge sge;
+	struct ibv_send_wr wr, *bad;
+
+	if (!c->imm) {
+		if (repl_post_tail(c, 0, tail | RPP_REPL_CLOSED) != 0) {
+			return 1;
+		}
+		return rpp_poll_send_comp(c->id, 1);
+	}
+	memset(&sge, 0, sizeof(sge));
+	memset(&wr, 0, sizeof(wr));
+	wr.sg_list = &sge;
+	wr.num_sge = 0;
+	wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
+	wr.imm_data = htonl(RPP_REPL_IMM_CLOSE);
+	wr.send_flags = IBV_SEND_SIGNALED;
+	wr.wr.rdma.remote_addr = c->info.buf;
+	wr.wr.rdma.rkey = c->info.rkey;
+	if (ibv_post_send(c->id->qp, &wr, &bad) != 0) {
+		perror("ibv_post_send repl close");
+		return 1;
+	}
+
+	return rpp_poll_send_comp(c->id, 1);
+}
+
+/* send batches until the producers are done and all is committed */
+static int
+repl_run(struct repl_conn *c, unsigned int depth, uint64_t *batches)
+{
+	struct ibv_wc wc[RPP_REPL_DEPTH + 1];
+	uint64_t end[RPP_REPL_DEPTH];
+	uint64_t sent = 0, to, nb = 0, nc = 0;
+	int head_pending = 0;
+	int i, n;
+
+	for (;;) {
+		to = __atomic_load_n(&appended, __ATOMIC_ACQUIRE);
+		if (to > sent && nb - nc < depth) {
+			if (repl_post_batch(c, nb % depth, sent, to) != 0) {
+				return 1;
+			}
+			end[nb % depth] = to;
+			sent = to;
+			nb++;
+		}
+		if (!head_pending &&
+		    __atomic_load_n(&want_head, __ATOMIC_ACQUIRE)) {
+			if (rdma_post_read(c->id,
+					(void *)(uintptr_t)RPP_REPL_WR_HEAD,
+					&c->ctrl->head, sizeof(uint64_t),
+					c->ctrl_mr, IBV_SEND_SIGNALED,
+					c->info.buf +
+					offsetof(struct repl_hdr, head),
+					c->info.rkey) != 0) {
+				perror("rdma_post_read repl head");
+				return 1;
+			}
+			head_pending = 1;
+		}
+
+		n = ibv_poll_cq(c->id->send_cq, RPP_REPL_DEPTH + 1, wc);
+		if (n < 0) {
+			perror("ibv_poll_cq");
+			return 1;
+		}
+		for (i = 0; i < n; i++) {
+			if (wc[i].status != IBV_WC_SUCCESS) {
+				fprintf(stderr, "repl: %s\n",
+					ibv_wc_status_str(wc[i].status));
+				return 1;
+			}
+			if (wc[i].wr_id == RPP_REPL_WR_HEAD) {
+				__atomic_store_n(&head_cache, c->ctrl->head,
+					__ATOMIC_RELEASE);
+				__atomic_store_n(&want_head, 0,
+					__ATOMIC_RELEASE);
+				head_pending = 0;
+				continue;
+			}
+			/* NOTE: completions of a QP are in order */
+			__atomic_store_n(&committed, end[nc % depth],
+				__ATOMIC_RELEASE);
+			nc++;
+		}
+
+		if (nc == nb && !head_pending &&
+		    __atomic_load_n(&producing, __ATOMIC_ACQUIRE) == 0 &&
+		    __atomic_load_n(&appended, __ATOMIC_ACQUIRE) == sent) {
+			break;
+		}
+	}
+	*batches = nb;
+
+	return repl_post_close(c, sent);
+}
+
+static int
+repl_connect(struct sockaddr *addr, struct repl_conn *c, unsigned int depth)
+{
+	struct repl_msg msg;
+
+	/* two WRITEs of the records and one of the tail a batch, and the
+	 * head READ */
+	c->id = rpp_client_connect_sig(addr, RPP_MODE_REPL, depth * 3 + 1,
+		2, 0);
+	if (c->id == NULL) {
+		return 1;
+	}
+	if (rpp_recv_msg(c->id, &c->info, sizeof(c->info)) != 0) {
+		return 1;
+	}
+	if (c->info.size < sizeof(struct repl_hdr) + RPP_REPL_LOG) {
+		fprintf(stderr, "repl: backup log too small\n");
+		return 1;
+	}
+	DEBUG_LOG("rdma_reg_msgs repl mirror\n");
+	c->mirror_mr = rdma_reg_msgs(c->id, mirror, RPP_REPL_LOG);
+	if (c->mirror_mr == NULL) {
+		perror("rdma_reg_msgs repl mirror");
+		return 1;
+	}
+	c->ctrl = (struct repl_ctrl *)calloc(1, sizeof(*c->ctrl));
+	if (c->ctrl == NULL) {
+		perror("calloc repl_ctrl");
+		return 1;
+	}
+	DEBUG_LOG("rdma_reg_msgs repl ctrl\n");
+	c->ctrl_mr = rdma_reg_msgs(c->id, c->ctrl, sizeof(*c->ctrl));
+	if (c->ctrl_mr == NULL) {
+		perror("rdma_reg_msgs repl ctrl");
+		return 1;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = REPL_OP_START;
+	msg.imm = c->imm;
+
+	return rpp_send_msg(c->id, &msg, sizeof(msg));
+}
+
+static void
+repl_close(struct repl_conn *c)
+{
+	if (c->id == NULL) {
+		return;
+	}
+	if (c->ctrl_mr != NULL) {
+		rdma_dereg_mr(c->ctrl_mr);
+	}
+	if (c->mirror_mr != NULL) {
+		rdma_dereg_mr(c->mirror_mr);
+	}
+	rpp_client_close(c->id);
+	free(c->ctrl);
+}
+
+int
+rpp_repl_client(struct sockaddr *addr)
+{
+	struct repl_conn c;
+	struct repl_producer *p;
+	struct repl_msg msg;
+	struct rpp_lat lat;
+	uint64_t start, end, batches = 0, records = 0;
+	unsigned int depth = opts.depth, i;
+	double sec;
+	int ret = 0;
+
+	memset(&c, 0, sizeof(c));
+	if (opts.op != NULL && strcmp(opts.op, "imm") == 0) {
+		c.imm = 1;
+	} else if (opts.op != NULL && strcmp(opts.op, "write") != 0) {
+		fprintf(stderr, "repl: -o write|imm\n");
+		return 1;
+	}
+	rec_len = opts.range > 1 ? opts.range : RPP_REPL_REC_DEF;
+	if (rec_len < sizeof(uint64_t) || rec_len > RPP_REPL_REC_MAX) {
+		fprintf(stderr, "repl: record size %u..%u\n",
+			(unsigned int)sizeof(uint64_t), RPP_REPL_REC_MAX);
+		return 1;
+	}
+	if (opts.threads == 0) {
+		fprintf(stderr, "repl: threads must be > 0\n");
+		return 1;
+	}
+	if (depth == 0 || depth > RPP_REPL_DEPTH) {
+		depth = depth ? RPP_REPL_DEPTH : 1;
+	}
+	/* NOTE: a WRITE_WITH_IMM takes a receive of the backup, do not go
+	 * beyond what the receive ring (-R) refills */
+	if (c.imm && depth > opts.recv_depth * 3 / 4) {
+		depth = opts.recv_depth * 3 / 4 ? opts.recv_depth * 3 / 4 : 1;
+	}
+
+	if (posix_memalign((void **)&mirror, 64, RPP_REPL_LOG) != 0) {
+		perror("posix_memalign repl mirror");
+		return 1;
+	}
+	memset(mirror, 0, RPP_REPL_LOG);
+	if (repl_connect(addr, &c, depth) != 0) {
+		ret = 1;
+		goto out;
+	}
+
+	p = (struct repl_producer *)calloc(opts.threads, sizeof(*p));
+	if (p == NULL) {
+		perror("calloc repl_producer");
+		ret = 1;
+		goto out;
+	}
+	for (i = 0; i < opts.threads; i++) {
+		p[i].index = i;
+		p[i].count = opts.count / opts.threads +
+			(i < opts.count % opts.threads);
+		p[i].ret = 1;
+		if (rpp_lat_init(&p[i].lat, p[i].count) != 0) {
+			break;
+		}
+		__atomic_add_fetch(&producing, 1, __ATOMIC_RELEASE);
+		if (pthread_create(&p[i].th, NULL, repl_producer,
+				&p[i]) != 0) {
+			perror("pthread_create");
+			__atomic_sub_fetch(&producing, 1, __ATOMIC_RELEASE);
+			rpp_lat_free(&p[i].lat);
+			break;
+		}
+	}
+	if (i < opts.threads) {
+		ret = 1;
+	}
+	opts.threads = i;
+
+	rpp_wait_until(&ready, opts.threads);
+	start = rpp_stat_now();
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+
+	if (repl_run(&c, depth, &batches) != 0) {
+		/* NOTE: the producers wait for commits which never come */
+		__atomic_store_n(&failed, 1, __ATOMIC_RELEASE);
+		ret = 1;
+	}
+	end = rpp_stat_now();
+
+	rpp_lat_init(&lat, 0);
+	for (i = 0; i < opts.threads; i++) {
+		pthread_join(p[i].th, NULL);
+		if (p[i].ret != 0) {
+			ret = 1;
+		}
+		records += p[i].count;
+		rpp_lat_merge(&lat, &p[i].lat);
+		rpp_lat_free(&p[i].lat);
+	}
+	free(p);
+	if (failed) {
+		rpp_lat_free(&lat);
+		goto out;
+	}
+
+	sec = (end - start) / 1e9;
+	printf("repl %s: producers %u, depth %u, record %u bytes: "
+		"%lu records in %.2f sec, %.1f Krecords/s, %.2f MB/s\n",
+		c.imm ? "imm" : "write", opts.threads, depth, rec_len,
+		records, sec, records / sec / 1e3,
+		records * (double)rec_len / sec / 1e6);
+	printf("%lu batches, %.1f records/batch\n", batches,
+		batches ? (double)records / batches : 0);
+	rpp_lat_report("commit", &lat);
+	rpp_lat_free(&lat);
+
+	if (rpp_recv_msg(c.id, &msg, sizeof(msg)) != 0 ||
+	    msg.op != REPL_OP_DONE) {
+		fprintf(stderr, "repl: no reply of the backup\n");
+		ret = 1;
+		goto out;
+	}
+	printf("backup: %lu records, %lu bytes applied, %lu errors\n",
+		msg.records, msg.bytes, msg.errors);
+	if (msg.records != records || msg.errors != 0) {
+		ret = 1;
+	}
+
+out:
+	repl_close(&c);
+	free(mirror);
+
+	return ret;
+}
@@ -0,0 +1,168 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rpp_h.h"
+
+/* receive ring: depth message slots of RPP_MSG_SIZE in one MR, all
+ * posted to the receive queue.
+ *
+ * with the single recv_msg, the buffer is posted again only after the
+ * message is handled, so a peer which sends a burst gets RNR NAKs and
+ * waits for the RNR timer. with the ring, depth messages can arrive
+ * before the receiver looks at any of them.
+ *
+ * the receive queue completes in the order of posting, so slots are
+ * consumed in order. consumed slots are posted again by one
+ * ibv_post_recv when 'batch' of them are there.
+ */
+
+struct rpp_recv_ring {
+	char *buf;
+	struct ibv_mr *mr;
+	struct ibv_recv_wr *wr;
+	struct ibv_sge *sge;
+	unsigned int depth;
+	unsigned int batch;
+	unsigned int next;	/* slot of the next completion */
+	unsigned int done;	/* consumed slots not posted yet */
+};
+
+static int
+ring_post(struct rdma_cm_id *id, struct rpp_recv_ring *r, unsigned int first,
+	unsigned int n)
+{
+	struct ibv_recv_wr *bad;
+	unsigned int i, slot;
+
+	for (i = 0; i < n; i++) {
+		slot = (first + i) % r->depth;
+		r->wr[slot].next = i + 1 < n ?
+			&r->wr[(slot + 1) % r->depth] : NULL;
+	}
+
+	DEBUG_LOG("ibv_post_recv %u\n", n);
+	if (ibv_post_recv(id->qp, &r->wr[first], &bad) != 0) {
+		perror("ibv_post_recv");
+		return 1;
+	}
+
+	return 0;
+}
+
+int
+rpp_recv_ring_create(struct rdma_cm_id *id, unsigned int depth)
+{
+	struct rpp_context *ct = id->context;
+	struct rpp_recv_ring *r;
+	unsigned int i;
+
+	r = (struct rpp_recv_ring *)calloc(1, sizeof(*r));
+	if (r == NULL) {
+		perror("calloc rpp_recv_ring");
+		return 1;
+	}
+	r->depth = depth;
+	r->batch = depth / 4 ? depth / 4 : 1;
+	ct->ring = r;
+
+	if (posix_memalign((void **)&r->buf, 64, depth * RPP_MSG_SIZE) != 0) {
+		perror("posix_memalign recv ring");
+		r->buf = NULL;
+		return 1;
+	}
+	r->wr = (struct ibv_recv_wr *)calloc(depth, sizeof(*r->wr));
+	r->sge = (struct ibv_sge *)calloc(depth, sizeof(*r->sge));
+	if (r->wr == NULL || r->sge == NULL) {
+		perror("calloc recv ring");
+		return 1;
+	}
+
+	DEBUG_LOG("rdma_reg_msgs recv ring\n");
+	r->mr = rdma_reg_msgs(id, r->buf, depth * RPP_MSG_SIZE);
+	if (r->mr == NULL) {
+		perror("rdma_reg_msgs recv ring");
+		return 1;
+	}
+	rpp_stat_mr(1);
+
+	for (i = 0; i < depth; i++) {
+		r->sge[i].addr = (uint64_t)(r->buf + i * RPP_MSG_SIZE);
+		r->sge[i].length = RPP_MSG_SIZE;
+		r->sge[i].lkey = r->mr->lkey;
+		r->wr[i].wr_id = i;
+		r->wr[i].sg_list = &r->sge[i];
+		r->wr[i].num_sge = 1;
+	}
+
+	return ring_post(id, r, 0, depth);
+}
+
+void
+rpp_recv_ring_destroy(struct rpp_context *ct)
+{
+	struct rpp_recv_ring *r = ct->ring;
+
+	if (r == NULL) {
+		return;
+	}
+	if (r->mr) {
+		DEBUG_LOG("rdma_dereg_mr recv ring\n");
+		if (rdma_dereg_mr(r->mr) != 0) {
+			perror("rdma_dereg_mr recv ring");
+		}
+		rpp_stat_mr(-1);
+	}
+	free(r->wr);
+	free(r->sge);
+	free(r->buf);
+	free(r);
+	ct->ring = NULL;
+}
+
+/* rpp_recv_msg for the ring. the caller has waited for wc. */
+int
+rpp_recv_ring_msg(struct rdma_cm_id *id, struct ibv_wc *wc, void *msg,
+	size_t len)
+{
+	struct rpp_context *ct = id->context;
+	struct rpp_recv_ring *r = ct->ring;
+	unsigned int first;
+
+	if (wc->status != IBV_WC_SUCCESS) {
+		fprintf(stderr, "recv ring: %s\n",
+			ibv_wc_status_str(wc->status));
+		return 1;
+	}
+	if (wc->wr_id != r->next) {
+		fprintf(stderr, "recv ring: slot %lu != %u(expected)\n",
+			wc->wr_id, r->next);
+		return 1;
+	}
+
+	if (msg != NULL) {
+		if (len > RPP_MSG_SIZE) {
+			len = RPP_MSG_SIZE;
+		}
+		memcpy(msg, r->buf + r->next * RPP_MSG_SIZE, len);
+	}
+	r->next = (r->next + 1) % r->depth;
+
+	if (++r->done < r->batch) {
+		return 0;
+	}
+	first = (r->next + r->depth - r->done) % r->depth;
+	if (ring_post(id, r, first, r->done) != 0) {
+		return 1;
+	}
+	r->done = 0;
+
+	return 0;
+}
@@ -0,0 +1,487 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "rpp_h.h"
+#include "rpp_bench.h"
+
+/* scale mode: throughput and latency against the number of sessions.
+ *
+ * the client ramps the number of live RC sessions (1, 16, 256, 1024,
+ * 4096, ... up to -k). at each step every session runs READ/WRITE of
+ * DATA_SIZE on the buffers of its server session, then the client asks
+ * the server for its RSS, registered MRs and sessions.
+ * 	server sends read/write buffer info on accept
+ * 	client: RDMA READ/WRITE ...
+ * 	client sends STAT, server replies (once per step, session 0 only)
+ * 	client sends DONE
+ *
+ * one line per step is printed, so the output can be compared between
+ * versions of the server.
+ * NOTE: each session uses some file descriptors on both sides. raise
+ * "ulimit -n" for thousands of sessions.
+ */
+
+#define SCALE_FIRST_STEPS	256	/* x16 until here, then x4 */
+
+struct scale_info {
+	uint64_t read_addr;
+	uint64_t write_addr;
+	uint32_t read_rkey;
+	uint32_t write_rkey;
+	uint32_t size;
+	uint32_t pad;
+};
+
+enum scale_op {
+	SCALE_OP_STAT = 1,
+	SCALE_OP_DONE,
+};
+
+struct scale_msg {
+	uint32_t op;
+	uint32_t pad;
+	uint64_t rss;		/* bytes */
+	uint64_t mrs;
+	uint64_t sessions;
+};
+
+static uint64_t
+scale_rss(void)
+{
+	unsigned long size, rss = 0;
+	FILE *fp;
+
+	fp = fopen("/proc/self/statm", "r");
+	if (fp == NULL) {
+		return 0;
+	}
+	if (fscanf(fp, "%lu %lu", &size, &rss) != 2) {
+		rss = 0;
+	}
+	fclose(fp);
+
+	return (uint64_t)rss * sysconf(_SC_PAGESIZE);
+}
+
+int
+rpp_scale_server(struct rdma_cm_id *id)
+{
+	struct rpp_context *ct = id->context;
+	struct scale_info info;
+	struct scale_msg msg;
+	int ret;
+
+	/* the session buffers are the target */
+	ret = rpp_ctx_data(id, DATA_SIZE);
+	if (ret != 0) {
+		return ret;
+	}
+	memset(&info, 0, sizeof(info));
+	info.read_addr = (uint64_t)ct->read_data;
+	info.read_rkey = ct->read_mr->rkey;
+	info.write_addr = (uint64_t)ct->write_data;
+	info.write_rkey = ct->write_mr->rkey;
+	info.size = DATA_SIZE;
+	ret = rpp_send_msg(id, &info, sizeof(info));
+	if (ret != 0) {
+		return ret;
+	}
+
+	for (;;) {
+		ret = rpp_recv_msg(id, &msg, sizeof(msg));
+		if (ret != 0) {
+			return ret;
+		}
+		if (msg.op != SCALE_OP_STAT) {
+			break;
+		}
+		msg.rss = scale_rss();
+		msg.mrs = rpp_stat_mrs();
+		msg.sessions = rpp_stat_sessions();
+		ret = rpp_send_msg(id, &msg, sizeof(msg));
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+struct scale_sess {
+	struct rdma_cm_id *id;
+	struct scale_info info;
+	struct rpp_lat lat;
+	uint64_t *posted;	/* post time, FIFO of depth */
+	unsigned int head;
+	unsigned int inflight;
+	uint64_t seq;
+	uint64_t p99;
+};
+
+struct scale_worker {
+	pthread_t th;
+	unsigned int index;
+	struct sockaddr *addr;
+	struct scale_sess *s;
+	unsigned int nsess;
+	unsigned int target;	/* sessions of this step */
+	uint64_t quota;		/* operations of this step */
+	uint64_t ops;
+	uint64_t bytes;
+	int ret;
+};
+
+/* steps. the main thread counts up 'gen' to let workers connect, then
+ * 'run' to let them run. workers count up 'connected' and 'done'. */
+static unsigned int gen;
+static unsigned int run;
+static unsigned int connected;
+static unsigned int done;
+static unsigned int stop;
+
+static int
+scale_connect(struct scale_worker *w)
+{
+	struct scale_sess *s = &w->s[w->nsess];
+
+	memset(s, 0, sizeof(*s));
+	s->posted = (uint64_t *)calloc(opts.depth, sizeof(uint64_t));
+	if (s->posted == NULL) {
+		perror("calloc scale");
+		return 1;
+	}
+	s->id = rpp_client_connect(w->addr, RPP_MODE_SCALE, opts.depth + 1,
+		2);
+	if (s->id == NULL) {
+		free(s->posted);
+		return 1;
+	}
+	w->nsess++;
+
+	if (rpp_recv_msg(s->id, &s->info, sizeof(s->info)) != 0) {
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+scale_close(struct scale_worker *w)
+{
+	struct scale_msg msg;
+	unsigned int i;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = SCALE_OP_DONE;
+	for (i = 0; i < w->nsess; i++) {
+		rpp_send_msg(w->s[i].id, &msg, sizeof(msg));
+		rpp_client_close(w->s[i].id);
+		rpp_lat_free(&w->s[i].lat);
+		free(w->s[i].posted);
+	}
+	w->nsess = 0;
+}
+
+static int
+scale_post(struct scale_sess *s)
+{
+	struct rpp_context *ct = s->id->context;
+	int ret;
+
+	/* -o read, write, or rw (alternately) */
+	if (opts.op[0] == 'r' &&
+	    (opts.op[1] == 'e' || (s->seq & 1) == 0)) {
+		ret = rdma_post_read(s->id, NULL, ct->read_data, DATA_SIZE,
+			ct->read_mr, 0, s->info.read_addr, s->info.read_rkey);
+	} else {
+		ret = rdma_post_write(s->id, NULL, ct->write_data, DATA_SIZE,
+			ct->write_mr, 0, s->info.write_addr,
+			s->info.write_rkey);
+	}
+	if (ret != 0) {
+		perror("rdma_post_read/write scale");
+		return 1;
+	}
+	s->posted[(s->head + s->inflight) % opts.depth] = rpp_stat_now();
+	s->inflight++;
+	s->seq++;
+
+	return 0;
+}
+
+static int
+scale_run(struct scale_worker *w)
+{
+	struct ibv_wc wc[16];
+	struct scale_sess *s;
+	uint64_t posted = 0;
+	uint64_t now;
+	size_t cap;
+	unsigned int i;
+	int j, n;
+
+	if (w->nsess == 0) {
+		return 0;
+	}
+	cap = w->quota / w->nsess * 2 + 64;
+	for (i = 0; i < w->nsess; i++) {
+		rpp_lat_free(&w->s[i].lat);
+		if (rpp_lat_init(&w->s[i].lat, cap) != 0) {
+			return 1;
+		}
+	}
+
+	w->ops = 0;
+	while (w->ops < w->quota) {
+		for (i = 0; i < w->nsess; i++) {
+			s = &w->s[i];
+			while (s->inflight < opts.depth &&
+			       posted < w->quota) {
+				if (scale_post(s) != 0) {
+					return 1;
+				}
+				posted++;
+			}
+
+			n = ibv_poll_cq(s->id->send_cq, 16, wc);
+			if (n < 0) {
+				perror("ibv_poll_cq");
+				return 1;
+			}
+			now = rpp_stat_now();
+			for (j = 0; j < n; j++) {
+				if (wc[j].status != IBV_WC_SUCCESS) {
+					fprintf(stderr, "scale: %s\n",
+						ibv_wc_status_str(
+							wc[j].status));
+					return 1;
+				}
+				/* RC completes in order of posting */
+				rpp_lat_add(&s->lat, now - s->posted[s->head]);
+				s->head = (s->head + 1) % opts.depth;
+				s->inflight--;
+				w->ops++;
+			}
+		}
+	}
+	w->bytes = w->ops * DATA_SIZE;
+
+	for (i = 0; i < w->nsess; i++) {
+		rpp_lat_sort(&w->s[i].lat);
+		w->s[i].p99 = rpp_lat_pct(&w->s[i].lat, 99);
+	}
+
+	return 0;
+}
+
+static void *
+scale_worker(void *arg)
+{
+	struct scale_worker *w = (struct scale_worker *)arg;
+	unsigned int step;
+
+	w->s = (struct scale_sess *)calloc(opts.range, sizeof(*w->s));
+	if (w->s == NULL) {
+		perror("calloc scale_sess");
+		w->ret = 1;
+	}
+
+	for (step = 1; ; step++) {
+		rpp_wait_until(&gen, step);
+		if (__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+		while (w->ret == 0 && w->nsess < w->target) {
+			if (scale_connect(w) != 0) {
+				w->ret = 1;
+			}
+		}
+		__atomic_add_fetch(&connected, 1, __ATOMIC_RELEASE);
+
+		rpp_wait_until(&run, step);
+		if (w->ret == 0 && !__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+			w->ret = scale_run(w);
+		}
+		__atomic_add_fetch(&done, 1, __ATOMIC_RELEASE);
+	}
+
+	if (w->s != NULL) {
+		scale_close(w);
+		free(w->s);
+	}
+
+	return NULL;
+}
+
+static int
+cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* server rss and sessions of the first step */
+static uint64_t base_rss;
+static uint64_t base_sessions;
+
+/* one line of the step */
+static int
+scale_report(struct scale_worker *w, unsigned int target, uint64_t ns)
+{
+	struct scale_msg msg;
+	uint64_t ops = 0, bytes = 0, per_sess = 0;
+	uint64_t *p99;
+	unsigned int i, j, n = 0;
+	double sec = ns / 1e9;
+
+	p99 = (uint64_t *)malloc(target * sizeof(uint64_t));
+	if (p99 == NULL) {
+		perror("malloc scale");
+		return 1;
+	}
+	for (i = 0; i < opts.threads; i++) {
+		ops += w[i].ops;
+		bytes += w[i].bytes;
+		for (j = 0; j < w[i].nsess && n < target; j++) {
+			p99[n++] = w[i].s[j].p99;
+		}
+	}
+	qsort(p99, n, sizeof(uint64_t), cmp_u64);
+
+	/* ask the server on the first session */
+	memset(&msg, 0, sizeof(msg));
+	msg.op = SCALE_OP_STAT;
+	if (rpp_send_msg(w[0].s[0].id, &msg, sizeof(msg)) != 0 ||
+	    rpp_recv_msg(w[0].s[0].id, &msg, sizeof(msg)) != 0) {
+		free(p99);
+		return 1;
+	}
+	/* NOTE: what a session costs the server, memory of the first step
+	 * (the process, the device and so on) aside */
+	if (base_sessions == 0) {
+		base_rss = msg.rss;
+		base_sessions = msg.sessions;
+	} else if (msg.sessions > base_sessions && msg.rss > base_rss) {
+		per_sess = (msg.rss - base_rss) / (msg.sessions - base_sessions);
+	}
+
+	printf("sessions %6u: %10.3f Kops/s %8.3f Gbit/s  "
+		"p99 %8.1f us (median session) %8.1f us (worst)  "
+		"server rss %lu MB (%lu bytes/session), mrs %lu, "
+		"sessions %lu\n",
+		target, sec > 0 ? ops / sec / 1e3 : 0,
+		sec > 0 ? bytes * 8 / sec / 1e9 : 0,
+		n ? p99[n / 2] / 1000.0 : 0, n ? p99[n - 1] / 1000.0 : 0,
+		msg.rss >> 20, per_sess, msg.mrs, msg.sessions);
+	fflush(stdout);
+	free(p99);
+
+	return 0;
+}
+
+int
+rpp_scale_client(struct sockaddr *addr)
+{
+	struct scale_worker *w;
+	unsigned int i, target, step = 0, nth;
+	uint64_t start;
+	int ret = 0;
+
+	if (opts.op == NULL) {
+		opts.op = "rw";
+	}
+	if (strcmp(opts.op, "read") != 0 && strcmp(opts.op, "write") != 0 &&
+	    strcmp(opts.op, "rw") != 0) {
+		fprintf(stderr, "scale: op must be read, write or rw\n");
+		return 1;
+	}
+	if (opts.threads == 0 || opts.depth == 0 || opts.range == 0) {
+		fprintf(stderr, "scale: threads, depth and sessions must be "
+			"> 0\n");
+		return 1;
+	}
+
+	w = (struct scale_worker *)calloc(opts.threads, sizeof(*w));
+	if (w == NULL) {
+		perror("calloc scale_worker");
+		return 1;
+	}
+	for (i = 0; i < opts.threads; i++) {
+		w[i].index = i;
+		w[i].addr = addr;
+		if (pthread_create(&w[i].th, NULL, scale_worker, &w[i]) != 0) {
+			perror("pthread_create");
+			ret = 1;
+			break;
+		}
+	}
+	nth = i;
+	opts.threads = nth;
+
+	printf("scale %s: threads %u, depth %u, %d bytes, %lu ops per step\n",
+		opts.op, nth, opts.depth, DATA_SIZE, opts.count);
+	for (target = 1; ret == 0 && nth > 0; ) {
+		step++;
+		for (i = 0; i < nth; i++) {
+			w[i].target = target / nth + (i < target % nth);
+			w[i].quota = opts.count * w[i].target / target;
+			w[i].ops = w[i].bytes = 0;
+		}
+		__atomic_store_n(&gen, step, __ATOMIC_RELEASE);
+		rpp_wait_until(&connected, step * nth);
+		for (i = 0; i < nth; i++) {
+			if (w[i].ret != 0) {
+				ret = 1;
+			}
+		}
+		if (ret != 0) {
+			fprintf(stderr, "scale: failed to connect %u sessions\n",
+				target);
+			__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+		}
+
+		start = rpp_stat_now();
+		__atomic_store_n(&run, step, __ATOMIC_RELEASE);
+		rpp_wait_until(&done, step * nth);
+		if (ret != 0) {
+			break;
+		}
+		for (i = 0; i < nth; i++) {
+			if (w[i].ret != 0) {
+				ret = 1;
+			}
+		}
+		if (ret == 0) {
+			ret = scale_report(w, target, rpp_stat_now() - start);
+		}
+
+		if (target >= opts.range) {
+			break;
+		}
+		target *= target < SCALE_FIRST_STEPS ? 16 : 4;
+		if (target > opts.range) {
+			target = opts.range;
+		}
+	}
+
+	/* let the workers close sessions and exit */
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&gen, step + 1, __ATOMIC_RELEASE);
+	for (i = 0; i < nth; i++) {
+		pthread_join(w[i].th, NULL);
+	}
+	free(w);
+
+	return ret;
+}
@@ -0,0 +1,481 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "rpp_h.h"
+#include "rpp_bench.h"
+#include "rpp_cpool.h"
+
+/* session mode: many requests on one session.
+ *
+ * ping mode connects, does one READ and one WRITE and disconnects, so
+ * every exchange pays for the connection setup (milliseconds) while the
+ * exchange itself takes microseconds. in session mode the client keeps
+ * the connection and sends requests until it sends CLOSE.
+ * 	client sends request {id, READ|WRITE, buffer addr/rkey/len}
+ * 	server does RDMA READ from / RDMA WRITE to the client buffer
+ * 	server replies {id, status}
+ * 	...
+ * 	client sends CLOSE
+ * the data of WRITE is "req <id>", so the client can check it got the
+ * data of its own request.
+ */
+
+enum session_op {
+	SESSION_OP_READ = 1,
+	SESSION_OP_WRITE,
+	SESSION_OP_CLOSE,
+};
+
+enum session_status {
+	SESSION_OK,
+	SESSION_INVAL,
+	SESSION_EIO,
+};
+
+struct rpp_session_msg {
+	uint32_t op;
+	uint32_t status;
+	uint64_t req_id;
+	uint64_t addr;
+	uint32_t rkey;
+	uint32_t len;
+};
+
+int
+rpp_session_server(struct rdma_cm_id *id)
+{
+	struct rpp_context *ct = id->context;
+	struct rpp_session_msg msg;
+	uint64_t nreq = 0;
+	int ret;
+
+	for (;;) {
+		ret = rpp_recv_msg(id, &msg, sizeof(msg));
+		if (ret != 0) {
+			return ret;
+		}
+		if (msg.op == SESSION_OP_CLOSE) {
+			break;
+		}
+
+		DEBUG_LOG("request %lu op %u\n", msg.req_id, msg.op);
+		ct->raddr = msg.addr;
+		ct->rkey = msg.rkey;
+		ct->rlen = msg.len;
+		msg.status = SESSION_OK;
+		if (msg.len > DATA_SIZE || rpp_ctx_data(id, msg.len) != 0) {
+			msg.status = SESSION_INVAL;
+		} else if (msg.op == SESSION_OP_READ) {
+			if (rpp_rdma_read(id) != 0) {
+				msg.status = SESSION_EIO;
+			}
+		} else if (msg.op == SESSION_OP_WRITE) {
+			snprintf(ct->write_data, msg.len, "req %lu",
+				msg.req_id);
+			if (rpp_rdma_write(id) != 0) {
+				msg.status = SESSION_EIO;
+			}
+		} else {
+			msg.status = SESSION_INVAL;
+		}
+
+		ret = rpp_send_msg(id, &msg, sizeof(msg));
+		if (ret != 0) {
+			return ret;
+		}
+		/* NOTE: a failed READ/WRITE breaks the QP */
+		if (msg.status == SESSION_EIO) {
+			return 1;
+		}
+		nreq++;
+	}
+	rpp_log("session closed after %lu requests\n", nreq);
+
+	return 0;
+}
+
+struct session_worker {
+	pthread_t th;
+	unsigned int index;
+	struct sockaddr *addr;
+	struct rpp_lat lat;
+	uint64_t connect_ns;
+	uint64_t reqs;
+	uint64_t bad;
+	uint64_t start;
+	uint64_t end;
+	int ret;
+};
+
+static unsigned int nstarted;
+static unsigned int ready;
+static unsigned int go;
+
+static int
+session_request(struct rdma_cm_id *id, struct rpp_session_msg *msg,
+	uint64_t req_id, int write)
+{
+	struct rpp_context *ct = id->context;
+
+	memset(msg, 0, sizeof(*msg));
+	msg->req_id = req_id;
+	msg->len = DATA_SIZE;
+	if (write) {
+		msg->op = SESSION_OP_WRITE;
+		msg->addr = (uint64_t)ct->write_data;
+		msg->rkey = ct->write_mr->rkey;
+		ct->write_data[0] = '\0';
+	} else {
+		msg->op = SESSION_OP_READ;
+		msg->addr = (uint64_t)ct->read_data;
+		msg->rkey = ct->read_mr->rkey;
+		snprintf(ct->read_data, DATA_SIZE, "req %lu", req_id);
+	}
+
+	if (rpp_send_msg(id, msg, sizeof(*msg)) != 0) {
+		return 1;
+	}
+	if (rpp_recv_msg(id, msg, sizeof(*msg)) != 0) {
+		return 1;
+	}
+	if (msg->req_id != req_id || msg->status != SESSION_OK) {
+		fprintf(stderr, "session: request %lu: reply %lu status %u\n",
+			req_id, msg->req_id, msg->status);
+		return 1;
+	}
+
+	return 0;
+}
+
+static void *
+session_worker(void *arg)
+{
+	struct session_worker *w = (struct session_worker *)arg;
+	struct rdma_cm_id *id;
+	struct rpp_context *ct;
+	struct rpp_session_msg msg;
+	char expect[32];
+	uint64_t req_id, t;
+	int write;
+
+	w->ret = 1;
+	t = rpp_stat_now();
+	id = rpp_client_connect(w->addr, RPP_MODE_SESSION, 2, 2);
+	w->connect_ns = rpp_stat_now() - t;
+	__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+	if (id == NULL) {
+		return NULL;
+	}
+	ct = id->context;
+	rpp_wait_until(&go, 1);
+
+	w->start = rpp_stat_now();
+	for (w->reqs = 0; w->reqs < opts.count; w->reqs++) {
+		req_id = (uint64_t)w->index << 48 | w->reqs;
+		write = opts.op[0] == 'w' ||
+			(opts.op[1] == 'w' && (w->reqs & 1));
+		t = rpp_stat_now();
+		if (session_request(id, &msg, req_id, write) != 0) {
+			goto close;
+		}
+		rpp_lat_add(&w->lat, rpp_stat_now() - t);
+		if (write) {
+			snprintf(expect, sizeof(expect), "req %lu", req_id);
+			if (strcmp(ct->write_data, expect) != 0) {
+				w->bad++;
+			}
+		}
+	}
+	w->end = rpp_stat_now();
+	w->ret = 0;
+
+close:
+	memset(&msg, 0, sizeof(msg));
+	msg.op = SESSION_OP_CLOSE;
+	if (rpp_send_msg(id, &msg, sizeof(msg)) != 0) {
+		w->ret = 1;
+	}
+	rpp_client_close(id);
+
+	return NULL;
+}
+
+int
+rpp_session_client(struct sockaddr *addr)
+{
+	struct session_worker *w;
+	struct rpp_lat lat;
+	uint64_t reqs = 0, bad = 0, connect_ns = 0;
+	double rate = 0;
+	unsigned int i;
+	int ret = 0;
+
+	if (opts.op == NULL) {
+		opts.op = "rw";
+	}
+	if (strcmp(opts.op, "read") != 0 && strcmp(opts.op, "write") != 0 &&
+	    strcmp(opts.op, "rw") != 0) {
+		fprintf(stderr, "session: op must be read, write or rw\n");
+		return 1;
+	}
+	if (opts.threads == 0) {
+		fprintf(stderr, "session: threads must be > 0\n");
+		return 1;
+	}
+
+	w = (struct session_worker *)calloc(opts.threads, sizeof(*w));
+	if (w == NULL) {
+		perror("calloc session_worker");
+		return 1;
+	}
+
+	for (i = 0; i < opts.threads; i++) {
+		w[i].index = i;
+		w[i].addr = addr;
+		if (rpp_lat_init(&w[i].lat, opts.count) != 0) {
+			ret = 1;
+			break;
+		}
+		if (pthread_create(&w[i].th, NULL, session_worker,
+				&w[i]) != 0) {
+			perror("pthread_create");
+			rpp_lat_free(&w[i].lat);
+			ret = 1;
+			break;
+		}
+	}
+	opts.threads = i;
+	nstarted = i;
+
+	rpp_wait_until(&ready, nstarted);
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+
+	rpp_lat_init(&lat, 0);
+	for (i = 0; i < opts.threads; i++) {
+		pthread_join(w[i].th, NULL);
+		if (w[i].ret != 0) {
+			ret = 1;
+		} else if (w[i].end > w[i].start) {
+			rate += w[i].reqs / ((w[i].end - w[i].start) / 1e9);
+		}
+		connect_ns += w[i].connect_ns;
+		reqs += w[i].reqs;
+		bad += w[i].bad;
+		rpp_lat_merge(&lat, &w[i].lat);
+		rpp_lat_free(&w[i].lat);
+	}
+
+	printf("session %s: threads %u, %d bytes: connect %.1f us (avg), "
+		"%lu requests, %.3f Kreq/s\n", opts.op, opts.threads,
+		DATA_SIZE, opts.threads ? connect_ns / 1e3 / opts.threads : 0,
+		reqs, rate / 1e3);
+	rpp_lat_report("request", &lat);
+	if (bad > 0) {
+		printf("bad data: %lu\n", bad);
+		ret = 1;
+	}
+
+	rpp_lat_free(&lat);
+	free(w);
+
+	return ret;
+}
+
+/* cpool mode: the same requests through rpp_cpool.
+ *
+ * -T threads share -k connections of the pool. a thread borrows a
+ * connection per request, so the request path has no rdma_cm call.
+ * a request which fails returns its connection as broken and is
+ * retried on another one. a thread gives up when no connection has
+ * been alive for RPP_CPOOL_DEAD msec.
+ */
+
+#define RPP_CPOOL_DEAD 1000	/* msec */
+
+struct cpool_worker {
+	pthread_t th;
+	unsigned int index;
+	struct rpp_cpool *pool;
+	struct rpp_lat lat;
+	uint64_t reqs;
+	uint64_t bad;
+	uint64_t retries;
+	uint64_t start;
+	uint64_t end;
+	int ret;
+};
+
+static void
+session_close(struct rdma_cm_id *id)
+{
+	struct rpp_session_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = SESSION_OP_CLOSE;
+	rpp_send_msg(id, &msg, sizeof(msg));
+}
+
+static void *
+cpool_worker(void *arg)
+{
+	struct cpool_worker *w = (struct cpool_worker *)arg;
+	struct rpp_cpool_conn *c;
+	struct rpp_session_msg msg;
+	char expect[32];
+	uint64_t req_id, t, dead = 0;
+	int write;
+
+	w->ret = 1;
+	__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+	rpp_wait_until(&go, 1);
+
+	w->start = rpp_stat_now();
+	while (w->reqs < opts.count) {
+		req_id = (uint64_t)w->index << 48 | w->reqs;
+		write = opts.op[0] == 'w' ||
+			(opts.op[1] == 'w' && (w->reqs & 1));
+		t = rpp_stat_now();
+		c = rpp_cpool_get(w->pool);
+		if (c == NULL) {
+			/* NOTE: all lent is busy waiting, all dead waits for
+			 * the background thread to reconnect */
+			if (rpp_cpool_live(w->pool) > 0) {
+				dead = 0;
+				continue;
+			}
+			if (dead == 0) {
+				dead = t;
+			} else if (t - dead > RPP_CPOOL_DEAD * 1000000ULL) {
+				fprintf(stderr, "cpool: no live connection\n");
+				return NULL;
+			}
+			usleep(1000);
+			continue;
+		}
+		dead = 0;
+		if (session_request(c->id, &msg, req_id, write) != 0) {
+			rpp_cpool_put(w->pool, c, 1);
+			/* NOTE: give up if the server seems gone */
+			if (++w->retries > opts.count) {
+				return NULL;
+			}
+			continue;
+		}
+		if (write) {
+			snprintf(expect, sizeof(expect), "req %lu", req_id);
+			if (strcmp(((struct rpp_context *)c->id->context)->
+					write_data, expect) != 0) {
+				w->bad++;
+			}
+		}
+		rpp_cpool_put(w->pool, c, 0);
+		rpp_lat_add(&w->lat, rpp_stat_now() - t);
+		w->reqs++;
+	}
+	w->end = rpp_stat_now();
+	w->ret = 0;
+
+	return NULL;
+}
+
+int
+rpp_cpool_client(struct sockaddr *addr)
+{
+	struct cpool_worker *w;
+	struct rpp_cpool *pool;
+	struct rpp_lat lat;
+	uint64_t reqs = 0, bad = 0, retries = 0, t;
+	double rate = 0;
+	unsigned int i;
+	int ret = 0;
+
+	if (opts.op == NULL) {
+		opts.op = "rw";
+	}
+	if (strcmp(opts.op, "read") != 0 && strcmp(opts.op, "write") != 0 &&
+	    strcmp(opts.op, "rw") != 0) {
+		fprintf(stderr, "cpool: op must be read, write or rw\n");
+		return 1;
+	}
+	if (opts.threads == 0 || opts.range == 0) {
+		fprintf(stderr, "cpool: threads and range must be > 0\n");
+		return 1;
+	}
+
+	t = rpp_stat_now();
+	pool = rpp_cpool_create(addr, RPP_MODE_SESSION, opts.range, 2, 2,
+		NULL, session_close);
+	if (pool == NULL) {
+		return 1;
+	}
+	t = rpp_stat_now() - t;
+
+	w = (struct cpool_worker *)calloc(opts.threads, sizeof(*w));
+	if (w == NULL) {
+		perror("calloc cpool_worker");
+		rpp_cpool_destroy(pool);
+		return 1;
+	}
+
+	for (i = 0; i < opts.threads; i++) {
+		w[i].index = i;
+		w[i].pool = pool;
+		if (rpp_lat_init(&w[i].lat, opts.count) != 0) {
+			ret = 1;
+			break;
+		}
+		if (pthread_create(&w[i].th, NULL, cpool_worker,
+				&w[i]) != 0) {
+			perror("pthread_create");
+			rpp_lat_free(&w[i].lat);
+			ret = 1;
+			break;
+		}
+	}
+	opts.threads = i;
+	nstarted = i;
+
+	rpp_wait_until(&ready, nstarted);
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+
+	rpp_lat_init(&lat, 0);
+	for (i = 0; i < opts.threads; i++) {
+		pthread_join(w[i].th, NULL);
+		if (w[i].ret != 0) {
+			ret = 1;
+		} else if (w[i].end > w[i].start) {
+			rate += w[i].reqs / ((w[i].end - w[i].start) / 1e9);
+		}
+		reqs += w[i].reqs;
+		bad += w[i].bad;
+		retries += w[i].retries;
+		rpp_lat_merge(&lat, &w[i].lat);
+		rpp_lat_free(&w[i].lat);
+	}
+
+	printf("cpool %s: threads %u, connections %u: warm-up %.1f ms, "
+		"%lu requests, %.3f Kreq/s\n", opts.op, opts.threads,
+		pool->n, t / 1e6, reqs, rate / 1e3);
+	printf("get misses %lu, retries %lu, reconnects %lu\n",
+		pool->misses, retries, pool->reconnects);
+	rpp_lat_report("request", &lat);
+	if (bad > 0) {
+		printf("bad data: %lu\n", bad);
+		ret = 1;
+	}
+
+	rpp_lat_free(&lat);
+	free(w);
+	rpp_cpool_destroy(pool);
+
+	return ret;
+}
@@ -0,0 +1,461 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "rpp_stat.h"
+
+const char *rpp_stat_ctr_name[RPP_ST_NR] = {
+	[RPP_ST_SESSIONS] = "sessions",
+	[RPP_ST_ACCEPT_FAIL] = "accept_failures",
+	[RPP_ST_SESSION_FAIL] = "session_failures",
+	[RPP_ST_READ_OPS] = "read_ops",
+	[RPP_ST_READ_BYTES] = "read_bytes",
+	[RPP_ST_WRITE_OPS] = "write_ops",
+	[RPP_ST_WRITE_BYTES] = "write_bytes",
+	[RPP_ST_SENDS] = "sends",
+	[RPP_ST_RECVS] = "recvs",
+	[RPP_ST_REJECTS] = "rejects",
+};
+
+const char *rpp_stat_lat_name[RPP_LT_NR] = {
+	[RPP_LT_ACCEPT] = "accept",
+	[RPP_LT_READ] = "read",
+	[RPP_LT_WRITE] = "write",
+	[RPP_LT_SEND] = "send",
+	[RPP_LT_RECV] = "recv",
+	[RPP_LT_SESSION] = "session",
+};
+
+static struct rpp_stat_shm *shm;
+static char shm_name[NAME_MAX];
+static char sock_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+static int serve_fd = -1;
+static pthread_t serve_th;
+static int serve_stop;
+/* kept also without the shared memory */
+static uint64_t session_count;
+static uint64_t mr_count;
+
+/* a thread takes a free slot on its first update and gives it back at
+ * exit. the counts stay in the slot, so the sums do not change. */
+static int slot_used[RPP_STAT_SLOTS];
+static uint32_t slot_next;	/* when no slot is free */
+static pthread_key_t slot_key;
+static __thread struct rpp_stat_slot *cur_slot;
+
+static void
+slot_release(void *arg)
+{
+	int *used = arg;
+
+	__atomic_store_n(used, 0, __ATOMIC_RELEASE);
+}
+
+int
+rpp_stat_create(const char *name)
+{
+	int fd;
+
+	if (pthread_key_create(&slot_key, slot_release) != 0) {
+		perror("pthread_key_create stat");
+		return 1;
+	}
+
+	fd = shm_open(name, O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("shm_open");
+		return 1;
+	}
+	if (ftruncate(fd, sizeof(*shm)) != 0) {
+		perror("ftruncate shm");
+		close(fd);
+		shm_unlink(name);
+		return 1;
+	}
+	shm = mmap(NULL, sizeof(*shm), PROT_READ | PROT_WRITE, MAP_SHARED,
+		fd, 0);
+	close(fd);
+	if (shm == MAP_FAILED) {
+		perror("mmap shm");
+		shm = NULL;
+		shm_unlink(name);
+		return 1;
+	}
+	snprintf(shm_name, sizeof(shm_name), "%s", name);
+
+	shm->version = RPP_STAT_VERSION;
+	shm->pid = getpid();
+	shm->nslots = RPP_STAT_SLOTS;
+	shm->start_time = time(NULL);
+	/* readers check magic last */
+	__atomic_store_n(&shm->magic, RPP_STAT_MAGIC, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/* NOTE: detached session threads may still update their slots, so the
+ * segment stays mapped until the process exits. only the names go. */
+void
+rpp_stat_destroy(void)
+{
+	if (serve_fd >= 0) {
+		/* wakes up accept in serve_thread */
+		__atomic_store_n(&serve_stop, 1, __ATOMIC_RELEASE);
+		shutdown(serve_fd, SHUT_RDWR);
+		pthread_join(serve_th, NULL);
+		close(serve_fd);
+		serve_fd = -1;
+		if (sock_path[0] != '\0') {
+			unlink(sock_path);
+		}
+	}
+	if (shm == NULL || shm_name[0] == '\0') {
+		return;
+	}
+	shm_unlink(shm_name);
+	shm_name[0] = '\0';
+}
+
+/* slot of the calling thread, NULL without the segment */
+struct rpp_stat_slot *
+rpp_stat_slot(void)
+{
+	int i, zero;
+
+	if (cur_slot != NULL) {
+		return cur_slot;
+	}
+	if (shm == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < RPP_STAT_SLOTS; i++) {
+		zero = 0;
+		if (__atomic_compare_exchange_n(&slot_used[i], &zero, 1, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			pthread_setspecific(slot_key, &slot_used[i]);
+			goto found;
+		}
+	}
+	/* NOTE: shared with other threads and never given back */
+	i = __atomic_fetch_add(&slot_next, 1, __ATOMIC_RELAXED) %
+		RPP_STAT_SLOTS;
+
+found:
+	cur_slot = &shm->slot[i];
+
+	return cur_slot;
+}
+
+void
+rpp_stat_session(int delta)
+{
+	__atomic_fetch_add(&session_count, (uint64_t)(int64_t)delta,
+		__ATOMIC_RELAXED);
+	if (shm == NULL) {
+		return;
+	}
+	__atomic_fetch_add(&shm->active, (uint64_t)(int64_t)delta,
+		__ATOMIC_RELAXED);
+}
+
+void
+rpp_stat_mr(int delta)
+{
+	__atomic_fetch_add(&mr_count, (uint64_t)(int64_t)delta,
+		__ATOMIC_RELAXED);
+	if (shm == NULL) {
+		return;
+	}
+	__atomic_fetch_add(&shm->mrs, (uint64_t)(int64_t)delta,
+		__ATOMIC_RELAXED);
+}
+
+uint64_t
+rpp_stat_sessions(void)
+{
+	return __atomic_load_n(&session_count, __ATOMIC_RELAXED);
+}
+
+uint64_t
+rpp_stat_mrs(void)
+{
+	return __atomic_load_n(&mr_count, __ATOMIC_RELAXED);
+}
+
+struct rpp_stat_shm *
+rpp_stat_open(const char *name)
+{
+	struct rpp_stat_shm *p;
+	int fd;
+
+	fd = shm_open(name, O_RDONLY, 0);
+	if (fd < 0) {
+		perror("shm_open");
+		return NULL;
+	}
+	p = mmap(NULL, sizeof(*p), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) {
+		perror("mmap shm");
+		return NULL;
+	}
+	if (__atomic_load_n(&p->magic, __ATOMIC_ACQUIRE) != RPP_STAT_MAGIC ||
+			p->version != RPP_STAT_VERSION) {
+		fprintf(stderr, "%s: not a rpp_h statistics segment "
+			"(or version mismatch)\n", name);
+		munmap(p, sizeof(*p));
+		return NULL;
+	}
+
+	return p;
+}
+
+void
+rpp_stat_sum(struct rpp_stat_shm *p, struct rpp_stat_sum *sum)
+{
+	struct rpp_stat_slot *s;
+	int i, j, b;
+
+	memset(sum, 0, sizeof(*sum));
+	sum->active = __atomic_load_n(&p->active, __ATOMIC_RELAXED);
+	sum->mrs = __atomic_load_n(&p->mrs, __ATOMIC_RELAXED);
+	for (i = 0; i < RPP_STAT_SLOTS; i++) {
+		s = &p->slot[i];
+		for (j = 0; j < RPP_ST_NR; j++) {
+			sum->ctr[j] += __atomic_load_n(&s->ctr[j],
+				__ATOMIC_RELAXED);
+		}
+		for (j = 0; j < RPP_LT_NR; j++) {
+			sum->lat_sum[j] += __atomic_load_n(&s->lat_sum[j],
+				__ATOMIC_RELAXED);
+			for (b = 0; b < RPP_STAT_BUCKETS; b++) {
+				sum->hist[j][b] += __atomic_load_n(
+					&s->hist[j][b], __ATOMIC_RELAXED);
+			}
+		}
+	}
+}
+
+/* returns the upper bound (nsec) of the bucket holding the pct-th
+ * percentile, 0 if there is no sample. */
+uint64_t
+rpp_stat_pct(const uint64_t *hist, double pct)
+{
+	uint64_t total = 0;
+	uint64_t cum = 0;
+	double target;
+	int b;
+
+	for (b = 0; b < RPP_STAT_BUCKETS; b++) {
+		total += hist[b];
+	}
+	if (total == 0) {
+		return 0;
+	}
+	target = total * pct / 100.0;
+	for (b = 0; b < RPP_STAT_BUCKETS; b++) {
+		cum += hist[b];
+		if (cum >= target) {
+			break;
+		}
+	}
+	if (b >= RPP_STAT_BUCKETS) {
+		b = RPP_STAT_BUCKETS - 1;
+	}
+
+	return 1ULL << (b + 1);
+}
+
+/* Prometheus text exposition format 0.0.4 */
+void
+rpp_stat_prom(struct rpp_stat_sum *sum, FILE *fp)
+{
+	uint64_t cum;
+	int i, b;
+
+	fprintf(fp, "# HELP rpp_h_sessions_active Sessions running now.\n");
+	fprintf(fp, "# TYPE rpp_h_sessions_active gauge\n");
+	fprintf(fp, "rpp_h_sessions_active %lu\n", sum->active);
+	fprintf(fp, "# HELP rpp_h_mrs Memory regions registered now.\n");
+	fprintf(fp, "# TYPE rpp_h_mrs gauge\n");
+	fprintf(fp, "rpp_h_mrs %lu\n", sum->mrs);
+
+	for (i = 0; i < RPP_ST_NR; i++) {
+		fprintf(fp, "# TYPE rpp_h_%s_total counter\n",
+			rpp_stat_ctr_name[i]);
+		fprintf(fp, "rpp_h_%s_total %lu\n", rpp_stat_ctr_name[i],
+			sum->ctr[i]);
+	}
+
+	fprintf(fp, "# HELP rpp_h_latency_seconds Latency of each phase.\n");
+	fprintf(fp, "# TYPE rpp_h_latency_seconds histogram\n");
+	for (i = 0; i < RPP_LT_NR; i++) {
+		cum = 0;
+		for (b = 0; b < RPP_STAT_BUCKETS; b++) {
+			cum += sum->hist[i][b];
+			if (b == RPP_STAT_BUCKETS - 1) {
+				break;
+			}
+			fprintf(fp, "rpp_h_latency_seconds_bucket"
+				"{phase=\"%s\",le=\"%.9g\"} %lu\n",
+				rpp_stat_lat_name[i],
+				(double)(1ULL << (b + 1)) / 1e9, cum);
+		}
+		fprintf(fp, "rpp_h_latency_seconds_bucket"
+			"{phase=\"%s\",le=\"+Inf\"} %lu\n",
+			rpp_stat_lat_name[i], cum);
+		fprintf(fp, "rpp_h_latency_seconds_sum{phase=\"%s\"} %.9f\n",
+			rpp_stat_lat_name[i], (double)sum->lat_sum[i] / 1e9);
+		fprintf(fp, "rpp_h_latency_seconds_count{phase=\"%s\"} %lu\n",
+			rpp_stat_lat_name[i], cum);
+	}
+}
+
+static void
+serve_one(int fd)
+{
+	struct rpp_stat_sum sum;
+	char req[1024];
+	char hdr[128];
+	char *body = NULL;
+	size_t len = 0;
+	FILE *fp;
+	int n;
+
+	/* any request gets the metrics page */
+	if (read(fd, req, sizeof(req)) < 0) {
+		return;
+	}
+
+	fp = open_memstream(&body, &len);
+	if (fp == NULL) {
+		return;
+	}
+	rpp_stat_sum(shm, &sum);
+	rpp_stat_prom(&sum, fp);
+	fclose(fp);
+
+	n = snprintf(hdr, sizeof(hdr), "HTTP/1.0 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %zu\r\n\r\n", len);
+	if (write(fd, hdr, n) == n) {
+		if (write(fd, body, len) < 0) {
+			/* peer went away */
+		}
+	}
+	free(body);
+}
+
+static void *
+serve_thread(void *arg)
+{
+	int fd;
+
+	for (;;) {
+		fd = accept(serve_fd, NULL, NULL);
+		if (fd < 0) {
+			if (__atomic_load_n(&serve_stop, __ATOMIC_ACQUIRE)) {
+				return NULL;
+			}
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("accept stat");
+			return NULL;
+		}
+		serve_one(fd);
+		close(fd);
+	}
+
+	return NULL;
+}
+
+/* endpoint is a TCP port on 127.0.0.1 if numeric, otherwise a path of
+ * a unix domain socket. */
+int
+rpp_stat_serve(const char *endpoint)
+{
+	struct sockaddr_un sun;
+	struct sockaddr_in sin;
+	struct sockaddr *sa;
+	socklen_t salen;
+	char *end;
+	long port;
+	int one = 1;
+
+	if (shm == NULL) {
+		fprintf(stderr, "stat endpoint needs the statistics segment\n");
+		return 1;
+	}
+
+	port = strtol(endpoint, &end, 10);
+	if (*end == '\0' && port > 0 && port < 65536) {
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(port);
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		sa = (struct sockaddr *)&sin;
+		salen = sizeof(sin);
+	} else {
+		if (strlen(endpoint) >= sizeof(sun.sun_path)) {
+			fprintf(stderr, "stat socket path too long\n");
+			return 1;
+		}
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, endpoint);
+		unlink(endpoint);
+		sa = (struct sockaddr *)&sun;
+		salen = sizeof(sun);
+	}
+
+	serve_fd = socket(sa->sa_family, SOCK_STREAM, 0);
+	if (serve_fd < 0) {
+		perror("socket stat");
+		return 1;
+	}
+	if (sa->sa_family == AF_INET) {
+		setsockopt(serve_fd, SOL_SOCKET, SO_REUSEADDR, &one,
+			sizeof(one));
+	}
+	if (bind(serve_fd, sa, salen) != 0) {
+		perror("bind stat");
+		goto err;
+	}
+	if (sa->sa_family == AF_UNIX) {
+		strcpy(sock_path, endpoint);
+	}
+	if (listen(serve_fd, 8) != 0) {
+		perror("listen stat");
+		goto err;
+	}
+
+	if (pthread_create(&serve_th, NULL, serve_thread, NULL) != 0) {
+		perror("pthread_create stat");
+		goto err;
+	}
+
+	return 0;
+
+err:
+	close(serve_fd);
+	serve_fd = -1;
+	return 1;
+}
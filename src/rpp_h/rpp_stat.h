@@ -0,0 +1,146 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#ifndef RPP_STAT_H
+#define RPP_STAT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+/* rpp_stat: statistics of the rpp_h server.
+ *
+ * counters and latency histograms live in a POSIX shared memory
+ * segment, so the rpp_stat tool can read them without talking to the
+ * server. each thread updates a slot of its own with relaxed atomic
+ * adds; a slot is a multiple of the cache line size, so threads do not
+ * share lines unless more than RPP_STAT_SLOTS threads update at the
+ * same time. readers sum the slots. the segment stays mapped until
+ * the server process exits.
+ *
+ * without the segment, e.g. on the client, a thread has no slot (NULL)
+ * and the hooks below do nothing, not even read the clock.
+ *
+ * latency bucket b counts samples in [2^b, 2^(b+1)) nsec.
+ */
+
+#define RPP_STAT_SHM		"/rpp_h_stat"
+#define RPP_STAT_MAGIC		0x72707073	/* "rpps" */
+#define RPP_STAT_VERSION	3
+#define RPP_STAT_SLOTS		256
+#define RPP_STAT_BUCKETS	32
+
+enum rpp_stat_ctr {
+	RPP_ST_SESSIONS,
+	RPP_ST_ACCEPT_FAIL,
+	RPP_ST_SESSION_FAIL,
+	RPP_ST_READ_OPS,
+	RPP_ST_READ_BYTES,
+	RPP_ST_WRITE_OPS,
+	RPP_ST_WRITE_BYTES,
+	RPP_ST_SENDS,
+	RPP_ST_RECVS,
+	RPP_ST_REJECTS,
+	RPP_ST_NR
+};
+
+enum rpp_stat_lat {
+	RPP_LT_ACCEPT,
+	RPP_LT_READ,
+	RPP_LT_WRITE,
+	RPP_LT_SEND,
+	RPP_LT_RECV,
+	RPP_LT_SESSION,
+	RPP_LT_NR
+};
+
+struct rpp_stat_slot {
+	uint64_t ctr[RPP_ST_NR];
+	uint64_t lat_sum[RPP_LT_NR];	/* nsec */
+	uint64_t hist[RPP_LT_NR][RPP_STAT_BUCKETS];
+} __attribute__((aligned(64)));
+
+struct rpp_stat_shm {
+	uint32_t magic;
+	uint32_t version;
+	int32_t pid;
+	uint32_t nslots;
+	uint64_t start_time;	/* time(2) of server start */
+	uint64_t active;	/* sessions running now */
+	uint64_t mrs;		/* memory regions registered now */
+	struct rpp_stat_slot slot[RPP_STAT_SLOTS] __attribute__((aligned(64)));
+};
+
+/* aggregated view */
+struct rpp_stat_sum {
+	uint64_t active;
+	uint64_t mrs;
+	uint64_t ctr[RPP_ST_NR];
+	uint64_t lat_sum[RPP_LT_NR];
+	uint64_t hist[RPP_LT_NR][RPP_STAT_BUCKETS];
+};
+
+extern const char *rpp_stat_ctr_name[RPP_ST_NR];
+extern const char *rpp_stat_lat_name[RPP_LT_NR];
+
+static inline uint64_t
+rpp_stat_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* start time of a latency sample of s */
+static inline uint64_t
+rpp_stat_start(struct rpp_stat_slot *s)
+{
+	return s != NULL ? rpp_stat_now() : 0;
+}
+
+static inline void
+rpp_stat_add(struct rpp_stat_slot *s, int c, uint64_t v)
+{
+	if (s == NULL) {
+		return;
+	}
+	__atomic_fetch_add(&s->ctr[c], v, __ATOMIC_RELAXED);
+}
+
+static inline void
+rpp_stat_lat(struct rpp_stat_slot *s, int l, uint64_t start)
+{
+	uint64_t ns;
+	int b;
+
+	if (s == NULL) {
+		return;
+	}
+	ns = rpp_stat_now() - start;
+	b = ns ? 63 - __builtin_clzll(ns) : 0;
+	if (b >= RPP_STAT_BUCKETS) {
+		b = RPP_STAT_BUCKETS - 1;
+	}
+	__atomic_fetch_add(&s->hist[l][b], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->lat_sum[l], ns, __ATOMIC_RELAXED);
+}
+
+/* server side */
+int rpp_stat_create(const char *name);
+void rpp_stat_destroy(void);
+struct rpp_stat_slot *rpp_stat_slot(void);
+void rpp_stat_session(int delta);
+void rpp_stat_mr(int delta);
+uint64_t rpp_stat_sessions(void);
+uint64_t rpp_stat_mrs(void);
+int rpp_stat_serve(const char *endpoint);
+
+/* reader side */
+struct rpp_stat_shm *rpp_stat_open(const char *name);
+void rpp_stat_sum(struct rpp_stat_shm *shm, struct rpp_stat_sum *sum);
+uint64_t rpp_stat_pct(const uint64_t *hist, double pct);
+void rpp_stat_prom(struct rpp_stat_sum *sum, FILE *fp);
+
+#endif /* RPP_STAT_H */
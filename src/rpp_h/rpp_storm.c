@@ -0,0 +1,192 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "rpp_h.h"
+#include "rpp_bench.h"
+
+/* storm mode: a connection storm. -T threads connect, send one message
+ * and disconnect -n times each, as fast as they can, as clients do when
+ * they all reconnect at once. the rate of completed connections is the
+ * accept rate of the server. run the server with -A and -l to see what
+ * sharded accept handling and the listen backlog do to it.
+ *
+ * with -k usec (> 1) a connection is held that long before the message,
+ * so the server has -T sessions of that length at a time. against a
+ * server with -M, -T twice the limit is a 2x overload: rejected
+ * connects wait for the retry hint of the server and try again, and
+ * the accepts/s is the goodput.
+ */
+
+struct storm_msg {
+	uint32_t op;
+	uint32_t pad;
+};
+
+int
+rpp_storm_server(struct rdma_cm_id *id)
+{
+	struct storm_msg msg;
+
+	return rpp_recv_msg(id, &msg, sizeof(msg));
+}
+
+struct storm_worker {
+	pthread_t th;
+	struct sockaddr *addr;
+	struct rpp_lat lat;	/* rpp_client_connect */
+	struct rpp_lat rej_lat;	/* rejected rpp_client_connect */
+	uint64_t conns;
+	uint64_t rejects;
+	uint64_t fails;
+	uint64_t start;
+	uint64_t end;
+	int ret;
+};
+
+static unsigned int nstarted;
+static unsigned int ready;
+static unsigned int go;
+
+static void *
+storm_worker(void *arg)
+{
+	struct storm_worker *w = (struct storm_worker *)arg;
+	struct rdma_cm_id *id;
+	struct storm_msg msg;
+	struct rpp_reject rej;
+	unsigned long i;
+	uint64_t t, seed = (uint64_t)(uintptr_t)w | 1;
+
+	w->ret = 0;
+	__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+	rpp_wait_until(&go, 1);
+
+	memset(&msg, 0, sizeof(msg));
+	w->start = rpp_stat_now();
+	for (i = 0; i < opts.count; i++) {
+		t = rpp_stat_now();
+		id = rpp_client_connect(w->addr, RPP_MODE_STORM, 2, 2);
+		if (id == NULL && rpp_client_rejected(&rej)) {
+			rpp_lat_add(&w->rej_lat, rpp_stat_now() - t);
+			w->rejects++;
+			/* NOTE: +-50% so that the rejected do not come back
+			 * all at once */
+			usleep(rej.retry_ms * 500 +
+				rpp_xorshift64(&seed) % (rej.retry_ms * 1000 + 1));
+			continue;
+		}
+		if (id == NULL) {
+			/* NOTE: timed out or so. a storm goes on. */
+			w->fails++;
+			continue;
+		}
+		rpp_lat_add(&w->lat, rpp_stat_now() - t);
+		if (opts.range > 1) {
+			usleep(opts.range);
+		}
+		if (rpp_send_msg(id, &msg, sizeof(msg)) != 0) {
+			w->fails++;
+		} else {
+			w->conns++;
+		}
+		rpp_client_close(id);
+	}
+	w->end = rpp_stat_now();
+
+	return NULL;
+}
+
+int
+rpp_storm_client(struct sockaddr *addr)
+{
+	struct storm_worker *w;
+	struct rpp_lat lat, rej_lat;
+	uint64_t conns = 0, rejects = 0, fails = 0, start = UINT64_MAX, end = 0;
+	unsigned int i;
+	int ret = 0;
+
+	if (opts.threads == 0) {
+		fprintf(stderr, "storm: threads must be > 0\n");
+		return 1;
+	}
+
+	w = (struct storm_worker *)calloc(opts.threads, sizeof(*w));
+	if (w == NULL) {
+		perror("calloc storm_worker");
+		return 1;
+	}
+
+	for (i = 0; i < opts.threads; i++) {
+		w[i].addr = addr;
+		if (rpp_lat_init(&w[i].lat, opts.count) != 0) {
+			ret = 1;
+			break;
+		}
+		if (rpp_lat_init(&w[i].rej_lat, opts.count) != 0) {
+			rpp_lat_free(&w[i].lat);
+			ret = 1;
+			break;
+		}
+		if (pthread_create(&w[i].th, NULL, storm_worker,
+				&w[i]) != 0) {
+			perror("pthread_create");
+			rpp_lat_free(&w[i].lat);
+			rpp_lat_free(&w[i].rej_lat);
+			ret = 1;
+			break;
+		}
+	}
+	opts.threads = i;
+	nstarted = i;
+
+	rpp_wait_until(&ready, nstarted);
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+
+	rpp_lat_init(&lat, 0);
+	rpp_lat_init(&rej_lat, 0);
+	for (i = 0; i < opts.threads; i++) {
+		pthread_join(w[i].th, NULL);
+		if (w[i].ret != 0) {
+			ret = 1;
+		}
+		if (w[i].start < start) {
+			start = w[i].start;
+		}
+		if (w[i].end > end) {
+			end = w[i].end;
+		}
+		conns += w[i].conns;
+		rejects += w[i].rejects;
+		fails += w[i].fails;
+		rpp_lat_merge(&lat, &w[i].lat);
+		rpp_lat_merge(&rej_lat, &w[i].rej_lat);
+		rpp_lat_free(&w[i].lat);
+		rpp_lat_free(&w[i].rej_lat);
+	}
+
+	printf("storm: threads %u: %lu connections, %lu rejected, "
+		"%lu failed, %.1f accepts/s\n", opts.threads, conns, rejects,
+		fails, end > start ? conns / ((end - start) / 1e9) : 0);
+	rpp_lat_report("connect", &lat);
+	if (rejects > 0) {
+		rpp_lat_report("reject", &rej_lat);
+	}
+	if (conns == 0) {
+		ret = 1;
+	}
+
+	rpp_lat_free(&lat);
+	rpp_lat_free(&rej_lat);
+	free(w);
+
+	return ret;
+}
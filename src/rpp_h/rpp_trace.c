@@ -0,0 +1,192 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#ifdef RPP_TRACE
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "rpp_trace.h"
+
+/* rings are never freed. a ring whose owner thread exited is
+ * handed to the next thread which calls rpp_trace_attach, so
+ * the number of rings is bounded by the number of concurrent
+ * threads, not by the number of sessions.
+ */
+static struct rpp_trace_ring *ring_list;
+static pthread_key_t ring_key;
+static int enabled;
+/* sids of threads and sessions, one sequence so they never collide */
+static uint32_t sid_seq;
+
+__thread struct rpp_trace_ring *rpp_trace_cur;
+
+static uint64_t base_tsc;
+static uint64_t base_ns;
+
+static const char *ev_name[RPP_TR_NR] = {
+	[RPP_TR_SESSION] = "session",
+	[RPP_TR_CONNECT] = "connect",
+	[RPP_TR_ACCEPT] = "accept",
+	[RPP_TR_READ] = "rdma_read",
+	[RPP_TR_WRITE] = "rdma_write",
+	[RPP_TR_SEND] = "send",
+	[RPP_TR_RECV] = "recv",
+};
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+ring_release(void *arg)
+{
+	struct rpp_trace_ring *r = arg;
+
+	__atomic_store_n(&r->in_use, 0, __ATOMIC_RELEASE);
+}
+
+void
+rpp_trace_init(void)
+{
+	base_ns = now_ns();
+	base_tsc = rpp_rdtsc();
+	if (pthread_key_create(&ring_key, ring_release) != 0) {
+		perror("pthread_key_create");
+		return;
+	}
+	enabled = 1;
+}
+
+struct rpp_trace_ring *
+rpp_trace_attach(void)
+{
+	struct rpp_trace_ring *r;
+	int zero;
+
+	/* nothing is recorded until rpp_trace_init is called */
+	if (!enabled) {
+		return NULL;
+	}
+
+	for (r = __atomic_load_n(&ring_list, __ATOMIC_ACQUIRE); r != NULL;
+			r = r->next) {
+		zero = 0;
+		if (__atomic_compare_exchange_n(&r->in_use, &zero, 1, 0,
+				__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			goto found;
+		}
+	}
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		return NULL;
+	}
+	r->in_use = 1;
+	r->next = __atomic_load_n(&ring_list, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&ring_list, &r->next, r, 0,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+
+found:
+	/* NOTE: events are grouped by sid in the dump, so threads must
+	 * not share one. e.g. the client worker threads never call
+	 * TRACE_SID. */
+	r->sid = rpp_trace_new_sid();
+	pthread_setspecific(ring_key, r);
+	rpp_trace_cur = r;
+
+	return r;
+}
+
+uint32_t
+rpp_trace_new_sid(void)
+{
+	return __atomic_add_fetch(&sid_seq, 1, __ATOMIC_RELAXED);
+}
+
+void
+rpp_trace_set_sid(uint32_t sid)
+{
+	struct rpp_trace_ring *r = rpp_trace_cur;
+
+	if (r == NULL) {
+		r = rpp_trace_attach();
+		if (r == NULL) {
+			return;
+		}
+	}
+	r->sid = sid;
+}
+
+int
+rpp_trace_dump(const char *path)
+{
+	FILE *fp;
+	struct rpp_trace_ring *r;
+	struct rpp_trace_rec *e;
+	uint64_t head, i, start, end_tsc, end_ns;
+	double ticks_per_us;
+	int pid = getpid();
+	int first = 1;
+
+	if (!enabled) {
+		return 1;
+	}
+	end_ns = now_ns();
+	end_tsc = rpp_rdtsc();
+	if (end_ns <= base_ns || end_tsc <= base_tsc) {
+		fprintf(stderr, "trace: clock did not advance\n");
+		return 1;
+	}
+	ticks_per_us = (double)(end_tsc - base_tsc) * 1000.0 /
+		(double)(end_ns - base_ns);
+
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		perror("fopen trace");
+		return 1;
+	}
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	for (r = __atomic_load_n(&ring_list, __ATOMIC_ACQUIRE); r != NULL;
+			r = r->next) {
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		start = head > RPP_TRACE_RING_SIZE ?
+			head - RPP_TRACE_RING_SIZE : 0;
+		for (i = start; i < head; i++) {
+			e = &r->rec[i & (RPP_TRACE_RING_SIZE - 1)];
+			if (e->tsc < base_tsc || e->ev >= RPP_TR_NR) {
+				continue;
+			}
+			fprintf(fp, "%s{\"name\":\"%s\",\"cat\":\"rpp\","
+				"\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,"
+				"\"tid\":%u}", first ? "" : ",\n",
+				ev_name[e->ev], e->ph,
+				(double)(e->tsc - base_tsc) / ticks_per_us,
+				pid, e->sid);
+			first = 0;
+		}
+	}
+	fprintf(fp, "\n]}\n");
+
+	if (fclose(fp) != 0) {
+		perror("fclose trace");
+		return 1;
+	}
+
+	return 0;
+}
+
+#endif /* RPP_TRACE */
@@ -0,0 +1,121 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#ifndef RPP_TRACE_H
+#define RPP_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* rpp_trace: per-thread timestamp tracing.
+ *
+ * TRACE_BEGIN/TRACE_END store a TSC timestamp into a ring owned by
+ * the calling thread. no lock and no system call is taken on the
+ * record path. rings are dumped as Chrome trace-event JSON
+ * (chrome://tracing, ui.perfetto.dev) by TRACE_DUMP, one track per sid.
+ * a thread gets a sid of its own, and a server session takes a new one
+ * with TRACE_NEW_SID. both come from one sequence.
+ *
+ * tracing is compiled in only with -DRPP_TRACE (make TRACE=1).
+ * otherwise every macro expands to nothing.
+ */
+
+enum rpp_trace_ev {
+	RPP_TR_SESSION,
+	RPP_TR_CONNECT,
+	RPP_TR_ACCEPT,
+	RPP_TR_READ,
+	RPP_TR_WRITE,
+	RPP_TR_SEND,
+	RPP_TR_RECV,
+	RPP_TR_NR
+};
+
+#ifdef RPP_TRACE
+
+#ifndef RPP_TRACE_RING_SIZE
+#define RPP_TRACE_RING_SIZE 4096	/* records per thread, power of 2 */
+#endif
+
+struct rpp_trace_rec {
+	uint64_t tsc;
+	uint32_t sid;
+	uint16_t ev;
+	uint16_t ph;	/* 'B' or 'E' */
+};
+
+struct rpp_trace_ring {
+	uint64_t head;	/* written by owner thread only */
+	uint32_t sid;
+	int in_use;
+	struct rpp_trace_ring *next;
+	struct rpp_trace_rec rec[RPP_TRACE_RING_SIZE];
+};
+
+extern __thread struct rpp_trace_ring *rpp_trace_cur;
+
+struct rpp_trace_ring *rpp_trace_attach(void);
+void rpp_trace_init(void);
+uint32_t rpp_trace_new_sid(void);
+void rpp_trace_set_sid(uint32_t sid);
+int rpp_trace_dump(const char *path);
+
+static inline uint64_t
+rpp_rdtsc(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+	uint64_t v;
+
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(v));
+	return v;
+#else
+#error "rpp_trace: no cycle counter for this architecture"
+#endif
+}
+
+static inline void
+rpp_trace(uint16_t ev, uint16_t ph)
+{
+	struct rpp_trace_ring *r = rpp_trace_cur;
+	struct rpp_trace_rec *e;
+	uint64_t h;
+
+	if (r == NULL) {
+		r = rpp_trace_attach();
+		if (r == NULL) {
+			return;
+		}
+	}
+	h = r->head;
+	e = &r->rec[h & (RPP_TRACE_RING_SIZE - 1)];
+	e->tsc = rpp_rdtsc();
+	e->sid = r->sid;
+	e->ev = ev;
+	e->ph = ph;
+	/* publish after the record is complete */
+	__atomic_store_n(&r->head, h + 1, __ATOMIC_RELEASE);
+}
+
+#define TRACE_INIT()		rpp_trace_init()
+#define TRACE_SID(sid)		rpp_trace_set_sid(sid)
+#define TRACE_NEW_SID()		rpp_trace_set_sid(rpp_trace_new_sid())
+#define TRACE_BEGIN(ev)		rpp_trace(ev, 'B')
+#define TRACE_END(ev)		rpp_trace(ev, 'E')
+#define TRACE_DUMP(path)	rpp_trace_dump(path)
+
+#else /* RPP_TRACE */
+
+#define TRACE_INIT()		do {} while (0)
+#define TRACE_SID(sid)		do {} while (0)
+#define TRACE_NEW_SID()		do {} while (0)
+#define TRACE_BEGIN(ev)		do {} while (0)
+#define TRACE_END(ev)		do {} while (0)
+#define TRACE_DUMP(path)	\
+	fprintf(stderr, "trace: not compiled in (make TRACE=1)\n")
+
+#endif /* RPP_TRACE */
+
+#endif /* RPP_TRACE_H */
@@ -0,0 +1,989 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "rpp_h.h"
+#include "rpp_bench.h"
+
+/* ud mode: request/response over Unreliable Datagram.
+ *
+ * an RC session needs one QP per client on the server, and the NIC
+ * runs out of its QP context cache at some thousands of clients. in ud
+ * mode the server has -T UD QPs (one thread each) and serves every
+ * client with them.
+ * 	client resolves the server QP by SIDR (rdma_connect on RDMA_PS_UDP)
+ * 	client sends a request of path MTU size
+ * 	server echoes it back, using a cached address handle of the client
+ * UD may drop messages, so the client sends a request again when no
+ * response comes in time. the server keeps no state of requests, so a
+ * duplicated request is just answered again.
+ *
+ * the server runs ud mode only: rpp_h -s -m ud.
+ * NOTE: a received message begins with the 40 bytes GRH.
+ */
+
+#define UD_GRH		40
+#define UD_MAGIC	0x72707075	/* "rppu" */
+#define UD_RECV_DEPTH	1024	/* server, per QP */
+#define UD_SEND_DEPTH	256	/* server, per QP */
+#define UD_AH_HASH	4096
+#define UD_CLI_RECV	2	/* client, per client QP */
+#define UD_TIMEOUT	1000000	/* nsec, first retransmission */
+#define UD_MAX_RETRY	10
+
+struct ud_hdr {
+	uint32_t magic;
+	uint32_t client;
+	uint64_t seq;
+};
+
+static size_t
+ud_mtu(struct ibv_context *verbs, uint8_t port)
+{
+	struct ibv_port_attr attr;
+
+	if (ibv_query_port(verbs, port, &attr) != 0) {
+		perror("ibv_query_port");
+		return 0;
+	}
+
+	return 128 << attr.active_mtu;
+}
+
+/*
+ * server
+ */
+
+struct ud_ah_ent {
+	struct ud_ah_ent *next;
+	uint32_t qpn;
+	uint16_t lid;
+	union ibv_gid gid;
+	struct ibv_ah *ah;
+};
+
+struct ud_server {
+	pthread_t th;
+	unsigned int index;
+	struct ibv_pd *pd;
+	uint8_t port;
+	struct ibv_comp_channel *ch;
+	struct ibv_cq *send_cq;
+	struct ibv_cq *recv_cq;
+	struct ibv_qp *qp;
+	size_t msg_size;
+	char *buf;		/* recv slots, then send slots */
+	struct ibv_mr *mr;
+	unsigned int send_free;
+	unsigned int send_next;
+	struct ud_ah_ent *ah_hash[UD_AH_HASH];
+	uint64_t nah;
+	struct rpp_stat_slot *st;
+};
+
+static volatile sig_atomic_t ud_terminate;
+
+static void
+ud_sigint(int sig)
+{
+	ud_terminate = 1;
+}
+
+static inline char *
+ud_recv_slot(struct ud_server *s, unsigned int i)
+{
+	return s->buf + (size_t)i * (UD_GRH + s->msg_size);
+}
+
+static inline char *
+ud_send_slot(struct ud_server *s, unsigned int i)
+{
+	return ud_recv_slot(s, UD_RECV_DEPTH) + (size_t)i * s->msg_size;
+}
+
+static int
+ud_post_recv(struct ibv_qp *qp, struct ibv_mr *mr, char *buf, size_t len,
+	uint64_t wr_id)
+{
+	struct ibv_sge sge;
+	struct ibv_recv_wr wr, *bad;
+
+	sge.addr = (uint64_t)buf;
+	sge.length = len;
+	sge.lkey = mr->lkey;
+	memset(&wr, 0, sizeof(wr));
+	wr.wr_id = wr_id;
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	if (ibv_post_recv(qp, &wr, &bad) != 0) {
+		perror("ibv_post_recv ud");
+		return 1;
+	}
+
+	return 0;
+}
+
+/* NOTE: rdma_cm uses RDMA_UDP_QKEY for the QPs of RDMA_PS_UDP, and
+ * SIDR tells it to the clients. */
+static int
+ud_server_qp(struct ud_server *s, struct ibv_context *verbs)
+{
+	struct ibv_qp_init_attr init_attr;
+	struct ibv_qp_attr attr;
+	size_t len;
+	unsigned int i;
+
+	s->ch = ibv_create_comp_channel(verbs);
+	if (s->ch == NULL) {
+		perror("ibv_create_comp_channel");
+		return 1;
+	}
+	s->send_cq = ibv_create_cq(verbs, UD_SEND_DEPTH, NULL, NULL, 0);
+	s->recv_cq = ibv_create_cq(verbs, UD_RECV_DEPTH, NULL, s->ch, 0);
+	if (s->send_cq == NULL || s->recv_cq == NULL) {
+		perror("ibv_create_cq");
+		return 1;
+	}
+
+	memset(&init_attr, 0, sizeof(init_attr));
+	init_attr.send_cq = s->send_cq;
+	init_attr.recv_cq = s->recv_cq;
+	init_attr.cap.max_send_wr = UD_SEND_DEPTH;
+	init_attr.cap.max_recv_wr = UD_RECV_DEPTH;
+	init_attr.cap.max_send_sge = 1;
+	init_attr.cap.max_recv_sge = 1;
+	init_attr.qp_type = IBV_QPT_UD;
+	init_attr.sq_sig_all = 1;
+	s->qp = ibv_create_qp(s->pd, &init_attr);
+	if (s->qp == NULL) {
+		perror("ibv_create_qp ud");
+		return 1;
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.qp_state = IBV_QPS_INIT;
+	attr.pkey_index = 0;
+	attr.port_num = s->port;
+	attr.qkey = RDMA_UDP_QKEY;
+	if (ibv_modify_qp(s->qp, &attr, IBV_QP_STATE | IBV_QP_PKEY_INDEX |
+			IBV_QP_PORT | IBV_QP_QKEY) != 0) {
+		perror("ibv_modify_qp INIT");
+		return 1;
+	}
+	attr.qp_state = IBV_QPS_RTR;
+	if (ibv_modify_qp(s->qp, &attr, IBV_QP_STATE) != 0) {
+		perror("ibv_modify_qp RTR");
+		return 1;
+	}
+	attr.qp_state = IBV_QPS_RTS;
+	attr.sq_psn = 0;
+	if (ibv_modify_qp(s->qp, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN) != 0) {
+		perror("ibv_modify_qp RTS");
+		return 1;
+	}
+
+	len = UD_RECV_DEPTH * (UD_GRH + s->msg_size) +
+		UD_SEND_DEPTH * s->msg_size;
+	if (posix_memalign((void **)&s->buf, 4096, len) != 0) {
+		perror("posix_memalign ud");
+		s->buf = NULL;
+		return 1;
+	}
+	s->mr = ibv_reg_mr(s->pd, s->buf, len, IBV_ACCESS_LOCAL_WRITE);
+	if (s->mr == NULL) {
+		perror("ibv_reg_mr ud");
+		return 1;
+	}
+	rpp_stat_mr(1);
+	for (i = 0; i < UD_RECV_DEPTH; i++) {
+		if (ud_post_recv(s->qp, s->mr, ud_recv_slot(s, i),
+				UD_GRH + s->msg_size, i) != 0) {
+			return 1;
+		}
+	}
+	s->send_free = UD_SEND_DEPTH;
+
+	return 0;
+}
+
+static void
+ud_server_free(struct ud_server *s)
+{
+	struct ud_ah_ent *e, *next;
+	int i;
+
+	for (i = 0; i < UD_AH_HASH; i++) {
+		for (e = s->ah_hash[i]; e != NULL; e = next) {
+			next = e->next;
+			ibv_destroy_ah(e->ah);
+			free(e);
+		}
+	}
+	if (s->qp) {
+		ibv_destroy_qp(s->qp);
+	}
+	if (s->mr) {
+		ibv_dereg_mr(s->mr);
+		rpp_stat_mr(-1);
+	}
+	free(s->buf);
+	if (s->send_cq) {
+		ibv_destroy_cq(s->send_cq);
+	}
+	if (s->recv_cq) {
+		ibv_destroy_cq(s->recv_cq);
+	}
+	if (s->ch) {
+		ibv_destroy_comp_channel(s->ch);
+	}
+}
+
+/* address handle of the sender of wc. created once per client. */
+static struct ibv_ah *
+ud_ah_get(struct ud_server *s, struct ibv_wc *wc, struct ibv_grh *grh)
+{
+	struct ud_ah_ent *e;
+	union ibv_gid gid;
+	unsigned int h;
+
+	memset(&gid, 0, sizeof(gid));
+	if (wc->wc_flags & IBV_WC_GRH) {
+		gid = grh->sgid;
+	}
+	h = (wc->src_qp * 2654435761U ^ wc->slid ^
+		gid.global.interface_id) % UD_AH_HASH;
+	for (e = s->ah_hash[h]; e != NULL; e = e->next) {
+		if (e->qpn == wc->src_qp && e->lid == wc->slid &&
+		    memcmp(&e->gid, &gid, sizeof(gid)) == 0) {
+			return e->ah;
+		}
+	}
+
+	e = (struct ud_ah_ent *)malloc(sizeof(*e));
+	if (e == NULL) {
+		perror("malloc ud_ah_ent");
+		return NULL;
+	}
+	e->ah = ibv_create_ah_from_wc(s->pd, wc, grh, s->port);
+	if (e->ah == NULL) {
+		perror("ibv_create_ah_from_wc");
+		free(e);
+		return NULL;
+	}
+	e->qpn = wc->src_qp;
+	e->lid = wc->slid;
+	e->gid = gid;
+	e->next = s->ah_hash[h];
+	s->ah_hash[h] = e;
+	s->nah++;
+	DEBUG_LOG("ud[%u]: new client qpn %x, %lu clients\n", s->index,
+		wc->src_qp, s->nah);
+
+	return e->ah;
+}
+
+static int
+ud_reap_send(struct ud_server *s)
+{
+	struct ibv_wc wc[16];
+	int i, n;
+
+	n = ibv_poll_cq(s->send_cq, 16, wc);
+	if (n < 0) {
+		perror("ibv_poll_cq ud send");
+		return 1;
+	}
+	for (i = 0; i < n; i++) {
+		if (wc[i].status != IBV_WC_SUCCESS) {
+			fprintf(stderr, "ud send: %s\n",
+				ibv_wc_status_str(wc[i].status));
+		}
+	}
+	s->send_free += n;
+
+	return 0;
+}
+
+static int
+ud_reply(struct ud_server *s, struct ibv_wc *wc)
+{
+	char *msg = ud_recv_slot(s, wc->wr_id);
+	struct ud_hdr *hdr = (struct ud_hdr *)(msg + UD_GRH);
+	struct ibv_sge sge;
+	struct ibv_send_wr wr, *bad;
+	struct ibv_ah *ah;
+	size_t len;
+	char *out;
+
+	if (wc->byte_len < UD_GRH + sizeof(*hdr) ||
+	    hdr->magic != UD_MAGIC) {
+		return 0;	/* not ours, drop */
+	}
+	len = wc->byte_len - UD_GRH;
+	ah = ud_ah_get(s, wc, (struct ibv_grh *)msg);
+	if (ah == NULL) {
+		return 0;	/* the client will send it again */
+	}
+
+	while (s->send_free == 0) {
+		if (ud_reap_send(s) != 0) {
+			return 1;
+		}
+	}
+	out = ud_send_slot(s, s->send_next);
+	s->send_next = (s->send_next + 1) % UD_SEND_DEPTH;
+	s->send_free--;
+	memcpy(out, hdr, len);
+
+	sge.addr = (uint64_t)out;
+	sge.length = len;
+	sge.lkey = s->mr->lkey;
+	memset(&wr, 0, sizeof(wr));
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.opcode = IBV_WR_SEND;
+	wr.wr.ud.ah = ah;
+	wr.wr.ud.remote_qpn = wc->src_qp;
+	wr.wr.ud.remote_qkey = RDMA_UDP_QKEY;
+	if (ibv_post_send(s->qp, &wr, &bad) != 0) {
+		perror("ibv_post_send ud");
+		return 1;
+	}
+	rpp_stat_add(s->st, RPP_ST_RECVS, 1);
+	rpp_stat_add(s->st, RPP_ST_SENDS, 1);
+
+	return 0;
+}
+
+static int
+ud_server_poll(struct ud_server *s)
+{
+	struct ibv_wc wc[16];
+	int i, n;
+
+	n = ibv_poll_cq(s->recv_cq, 16, wc);
+	if (n < 0) {
+		perror("ibv_poll_cq ud recv");
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if (wc[i].status != IBV_WC_SUCCESS) {
+			fprintf(stderr, "ud recv: %s\n",
+				ibv_wc_status_str(wc[i].status));
+		} else if (ud_reply(s, &wc[i]) != 0) {
+			return -1;
+		}
+		if (ud_post_recv(s->qp, s->mr, ud_recv_slot(s, wc[i].wr_id),
+				UD_GRH + s->msg_size, wc[i].wr_id) != 0) {
+			return -1;
+		}
+	}
+	if (ud_reap_send(s) != 0) {
+		return -1;
+	}
+
+	return n;
+}
+
+/* poll while busy, sleep on the completion channel when idle */
+static void *
+ud_server_thread(void *arg)
+{
+	struct ud_server *s = (struct ud_server *)arg;
+	struct ibv_cq *cq;
+	void *cq_ctx;
+	int n, idle = 0;
+
+	s->st = rpp_stat_slot();
+	while (!ud_terminate) {
+		n = ud_server_poll(s);
+		if (n < 0) {
+			break;
+		}
+		if (n > 0 || ++idle < 1000) {
+			if (n > 0) {
+				idle = 0;
+			}
+			continue;
+		}
+
+		/* arm, then poll again not to miss a completion */
+		idle = 0;
+		if (ibv_req_notify_cq(s->recv_cq, 0) != 0) {
+			perror("ibv_req_notify_cq");
+			break;
+		}
+		n = ud_server_poll(s);
+		if (n < 0) {
+			break;
+		} else if (n > 0) {
+			continue;
+		}
+		if (ibv_get_cq_event(s->ch, &cq, &cq_ctx) != 0) {
+			if (!ud_terminate) {
+				perror("ibv_get_cq_event");
+			}
+			break;
+		}
+		ibv_ack_cq_events(cq, 1);
+	}
+	rpp_log("ud[%u]: %lu clients\n", s->index, s->nah);
+
+	return NULL;
+}
+
+int
+rpp_ud_server(struct sockaddr *addr)
+{
+	struct rdma_event_channel *ch;
+	struct rdma_cm_id *listen_id;
+	struct rdma_cm_event *event;
+	struct rdma_conn_param param;
+	struct ud_server *s = NULL;
+	struct sigaction act;
+	struct timespec ts;
+	unsigned int i, nq = 0, next = 0;
+	size_t mtu;
+	int ret = 1;
+
+	if (opts.threads == 0) {
+		fprintf(stderr, "ud: threads must be > 0\n");
+		return 1;
+	}
+
+	DEBUG_LOG("rdma_create_event_channel\n");
+	ch = rdma_create_event_channel();
+	if (ch == NULL) {
+		perror("rdma_create_event_channel");
+		return 1;
+	}
+	DEBUG_LOG("rdma_create_id\n");
+	if (rdma_create_id(ch, &listen_id, NULL, RDMA_PS_UDP) != 0) {
+		perror("rdma_create_id");
+		rdma_destroy_event_channel(ch);
+		return 1;
+	}
+	DEBUG_LOG("rdma_bind_addr\n");
+	if (rdma_bind_addr(listen_id, addr) != 0) {
+		perror("rdma_bind_addr");
+		goto out;
+	}
+	/* the UD QPs are created on the device of the address */
+	if (listen_id->verbs == NULL || listen_id->pd == NULL) {
+		fprintf(stderr, "ud: address is not of an RDMA device\n");
+		goto out;
+	}
+	mtu = ud_mtu(listen_id->verbs, listen_id->port_num);
+	if (mtu == 0) {
+		goto out;
+	}
+
+	/* NOTE: no SA_RESTART, so SIGINT interrupts a thread sleeping in
+	 * ibv_get_cq_event. a signal sent before the thread sleeps is
+	 * lost; the shutdown below sends it until the thread exits. */
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = ud_sigint;
+	if (sigaction(SIGINT, &act, NULL) != 0) {
+		perror("sigaction");
+		goto out;
+	}
+
+	s = (struct ud_server *)calloc(opts.threads, sizeof(*s));
+	if (s == NULL) {
+		perror("calloc ud_server");
+		goto out;
+	}
+	for (nq = 0; nq < opts.threads; nq++) {
+		s[nq].index = nq;
+		s[nq].pd = listen_id->pd;
+		s[nq].port = listen_id->port_num;
+		s[nq].msg_size = mtu;
+		if (ud_server_qp(&s[nq], listen_id->verbs) != 0) {
+			ud_server_free(&s[nq]);
+			goto out;
+		}
+		if (pthread_create(&s[nq].th, NULL, ud_server_thread,
+				&s[nq]) != 0) {
+			perror("pthread_create");
+			ud_server_free(&s[nq]);
+			goto out;
+		}
+	}
+	rpp_log("ud: %u QPs, message %zu bytes\n", nq, mtu);
+
+	DEBUG_LOG("rdma_listen\n");
+	if (rdma_listen(listen_id, 128) != 0) {
+		perror("rdma_listen");
+		goto out;
+	}
+
+	/* SIDR: tell each client one of the UD QPs */
+	while (!ud_terminate) {
+		if (rdma_get_cm_event(ch, &event) != 0) {
+			perror("rdma_get_cm_event");
+			break;
+		}
+		if (event->event != RDMA_CM_EVENT_CONNECT_REQUEST) {
+			rdma_ack_cm_event(event);
+			continue;
+		}
+		memset(&param, 0, sizeof(param));
+		param.qp_num = s[next].qp->qp_num;
+		next = (next + 1) % nq;
+		if (rdma_accept(event->id, &param) != 0) {
+			perror("rdma_accept ud");
+			rpp_stat_add(rpp_stat_slot(), RPP_ST_ACCEPT_FAIL, 1);
+		} else {
+			rpp_stat_add(rpp_stat_slot(), RPP_ST_SESSIONS, 1);
+		}
+		/* NOTE: the id is not used after SIDR reply */
+		rdma_destroy_id(event->id);
+		rdma_ack_cm_event(event);
+	}
+	ret = 0;
+
+out:
+	ud_terminate = 1;
+	for (i = 0; i < nq; i++) {
+		for (;;) {
+			pthread_kill(s[i].th, SIGINT);
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_nsec += 100000000;
+			if (ts.tv_nsec >= 1000000000) {
+				ts.tv_sec++;
+				ts.tv_nsec -= 1000000000;
+			}
+			if (pthread_timedjoin_np(s[i].th, NULL, &ts) == 0) {
+				break;
+			}
+		}
+		ud_server_free(&s[i]);
+	}
+	free(s);
+	rdma_destroy_id(listen_id);
+	rdma_destroy_event_channel(ch);
+
+	return ret;
+}
+
+/*
+ * client
+ */
+
+struct ud_client {
+	struct rdma_cm_id *id;
+	struct ibv_ah *ah;
+	uint32_t rqpn;
+	uint64_t seq;
+	uint64_t first;		/* first send of seq */
+	uint64_t sent;		/* last (re)send */
+	int busy;
+	int retry;
+};
+
+struct ud_worker {
+	pthread_t th;
+	unsigned int index;
+	struct sockaddr *addr;
+	struct ud_client *c;
+	unsigned int nc;
+	struct ibv_cq *send_cq;
+	struct ibv_cq *recv_cq;
+	char *buf;
+	struct ibv_mr *mr;
+	size_t msg_size;
+	struct rpp_lat lat;
+	uint64_t ops;
+	uint64_t retrans;
+	uint64_t stale;
+	uint64_t start;
+	uint64_t end;
+	int ret;
+};
+
+static unsigned int nstarted;
+static unsigned int ready;
+static unsigned int go;
+
+/* slot 0 of a client is the send buffer, then UD_CLI_RECV recv */
+static inline char *
+ud_cli_slot(struct ud_worker *w, unsigned int c, unsigned int slot)
+{
+	return w->buf + ((size_t)c * (1 + UD_CLI_RECV) + slot) *
+		(UD_GRH + w->msg_size);
+}
+
+static int
+ud_cli_connect(struct ud_worker *w, unsigned int i)
+{
+	struct ud_client *c = &w->c[i];
+	struct ibv_qp_init_attr init_attr;
+	struct rdma_conn_param param;
+	struct rpp_hello hello;
+	struct rdma_ud_param *ud;
+	size_t len;
+	unsigned int j;
+
+	DEBUG_LOG("rdma_create_id ud\n");
+	if (rdma_create_id(NULL, &c->id, NULL, RDMA_PS_UDP) != 0) {
+		perror("rdma_create_id");
+		c->id = NULL;
+		return 1;
+	}
+	if (rdma_resolve_addr(c->id, NULL, w->addr, 2000) != 0) {
+		perror("rdma_resolve_addr");
+		return 1;
+	}
+	if (rdma_resolve_route(c->id, 2000) != 0) {
+		perror("rdma_resolve_route");
+		return 1;
+	}
+
+	/* the client QPs of a worker share CQs and one buffer */
+	if (w->send_cq == NULL) {
+		w->msg_size = ud_mtu(c->id->verbs, c->id->port_num);
+		if (w->msg_size == 0) {
+			return 1;
+		}
+		w->send_cq = ibv_create_cq(c->id->verbs, w->nc * 2, NULL,
+			NULL, 0);
+		w->recv_cq = ibv_create_cq(c->id->verbs,
+			w->nc * UD_CLI_RECV, NULL, NULL, 0);
+		if (w->send_cq == NULL || w->recv_cq == NULL) {
+			perror("ibv_create_cq");
+			return 1;
+		}
+		len = (size_t)w->nc * (1 + UD_CLI_RECV) *
+			(UD_GRH + w->msg_size);
+		if (posix_memalign((void **)&w->buf, 4096, len) != 0) {
+			perror("posix_memalign ud");
+			w->buf = NULL;
+			return 1;
+		}
+		w->mr = ibv_reg_mr(c->id->pd, w->buf, len,
+			IBV_ACCESS_LOCAL_WRITE);
+		if (w->mr == NULL) {
+			perror("ibv_reg_mr ud");
+			return 1;
+		}
+	}
+
+	memset(&init_attr, 0, sizeof(init_attr));
+	init_attr.send_cq = w->send_cq;
+	init_attr.recv_cq = w->recv_cq;
+	init_attr.cap.max_send_wr = 2;
+	init_attr.cap.max_recv_wr = UD_CLI_RECV;
+	init_attr.cap.max_send_sge = 1;
+	init_attr.cap.max_recv_sge = 1;
+	init_attr.qp_type = IBV_QPT_UD;
+	init_attr.sq_sig_all = 1;
+	if (rdma_create_qp(c->id, NULL, &init_attr) != 0) {
+		perror("rdma_create_qp ud");
+		return 1;
+	}
+	for (j = 1; j <= UD_CLI_RECV; j++) {
+		if (rdma_post_recv(c->id,
+				(void *)(uintptr_t)(i * UD_CLI_RECV + j - 1),
+				ud_cli_slot(w, i, j), UD_GRH + w->msg_size,
+				w->mr) != 0) {
+			perror("rdma_post_recv");
+			return 1;
+		}
+	}
+
+	/* NOTE: the UD server has no receive ring, so recv_depth is 0 */
+	memset(&hello, 0, sizeof(hello));
+	hello.magic = RPP_HELLO_MAGIC;
+	hello.mode = RPP_MODE_UD;
+	memset(&param, 0, sizeof(param));
+	param.private_data = &hello;
+	param.private_data_len = sizeof(hello);
+	DEBUG_LOG("rdma_connect ud\n");
+	if (rdma_connect(c->id, &param) != 0) {
+		perror("rdma_connect ud");
+		return 1;
+	}
+	/* NOTE: the SIDR reply stays in id->event of a synchronous id */
+	if (c->id->event == NULL ||
+	    c->id->event->event != RDMA_CM_EVENT_ESTABLISHED) {
+		fprintf(stderr, "ud: no SIDR reply\n");
+		return 1;
+	}
+	ud = &c->id->event->param.ud;
+	c->rqpn = ud->qp_num;
+	c->ah = ibv_create_ah(c->id->pd, &ud->ah_attr);
+	if (c->ah == NULL) {
+		perror("ibv_create_ah");
+		return 1;
+	}
+
+	return 0;
+}
+
+static void
+ud_cli_close(struct ud_worker *w)
+{
+	struct ud_client *c;
+	unsigned int i;
+
+	for (i = 0; i < w->nc; i++) {
+		c = &w->c[i];
+		if (c->ah) {
+			ibv_destroy_ah(c->ah);
+		}
+		if (c->id == NULL) {
+			continue;
+		}
+		if (c->id->qp) {
+			rdma_destroy_qp(c->id);
+		}
+		rdma_destroy_id(c->id);
+	}
+	if (w->mr) {
+		ibv_dereg_mr(w->mr);
+	}
+	free(w->buf);
+	if (w->send_cq) {
+		ibv_destroy_cq(w->send_cq);
+	}
+	if (w->recv_cq) {
+		ibv_destroy_cq(w->recv_cq);
+	}
+	free(w->c);
+}
+
+static int
+ud_cli_send(struct ud_worker *w, unsigned int i)
+{
+	struct ud_client *c = &w->c[i];
+	struct ud_hdr *hdr = (struct ud_hdr *)ud_cli_slot(w, i, 0);
+
+	hdr->magic = UD_MAGIC;
+	hdr->client = w->index << 20 | i;
+	hdr->seq = c->seq;
+	c->sent = rpp_stat_now();
+	if (rdma_post_ud_send(c->id, NULL, hdr, w->msg_size, w->mr, 0,
+			c->ah, c->rqpn) != 0) {
+		perror("rdma_post_ud_send");
+		return 1;
+	}
+
+	return 0;
+}
+
+static int
+ud_run(struct ud_worker *w)
+{
+	struct ibv_wc wc[16];
+	struct ud_client *c;
+	struct ud_hdr *hdr;
+	unsigned int depth = opts.depth < w->nc ? opts.depth : w->nc;
+	unsigned int inflight = 0, next = 0, i, ci;
+	uint64_t issued = 0, now, last_scan = 0;
+	int j, n;
+
+	w->start = rpp_stat_now();
+	while (w->ops < opts.count) {
+		while (inflight < depth && issued < opts.count) {
+			while (w->c[next].busy) {
+				next = (next + 1) % w->nc;
+			}
+			c = &w->c[next];
+			c->seq++;
+			c->busy = 1;
+			c->retry = 0;
+			if (ud_cli_send(w, next) != 0) {
+				return 1;
+			}
+			c->first = c->sent;
+			next = (next + 1) % w->nc;
+			inflight++;
+			issued++;
+		}
+
+		n = ibv_poll_cq(w->send_cq, 16, wc);
+		if (n < 0) {
+			perror("ibv_poll_cq");
+			return 1;
+		}
+		for (j = 0; j < n; j++) {
+			if (wc[j].status != IBV_WC_SUCCESS) {
+				fprintf(stderr, "ud send: %s\n",
+					ibv_wc_status_str(wc[j].status));
+				return 1;
+			}
+		}
+
+		n = ibv_poll_cq(w->recv_cq, 16, wc);
+		if (n < 0) {
+			perror("ibv_poll_cq");
+			return 1;
+		}
+		now = rpp_stat_now();
+		for (j = 0; j < n; j++) {
+			if (wc[j].status != IBV_WC_SUCCESS) {
+				fprintf(stderr, "ud recv: %s\n",
+					ibv_wc_status_str(wc[j].status));
+				return 1;
+			}
+			ci = wc[j].wr_id / UD_CLI_RECV;
+			c = &w->c[ci];
+			hdr = (struct ud_hdr *)(ud_cli_slot(w, ci,
+				1 + wc[j].wr_id % UD_CLI_RECV) + UD_GRH);
+			if (c->busy && hdr->magic == UD_MAGIC &&
+			    hdr->seq == c->seq) {
+				rpp_lat_add(&w->lat, now - c->first);
+				c->busy = 0;
+				inflight--;
+				w->ops++;
+			} else {
+				/* response to a retransmitted request */
+				w->stale++;
+			}
+			if (rdma_post_recv(c->id, (void *)(uintptr_t)wc[j].wr_id,
+					(char *)hdr - UD_GRH,
+					UD_GRH + w->msg_size, w->mr) != 0) {
+				perror("rdma_post_recv");
+				return 1;
+			}
+		}
+
+		if (now - last_scan < UD_TIMEOUT / 4) {
+			continue;
+		}
+		last_scan = now;
+		for (i = 0; i < w->nc; i++) {
+			c = &w->c[i];
+			if (!c->busy ||
+			    now - c->sent < (uint64_t)UD_TIMEOUT << c->retry) {
+				continue;
+			}
+			if (++c->retry > UD_MAX_RETRY) {
+				fprintf(stderr, "ud: client %u: no response\n",
+					i);
+				return 1;
+			}
+			w->retrans++;
+			if (ud_cli_send(w, i) != 0) {
+				return 1;
+			}
+		}
+	}
+	w->end = rpp_stat_now();
+
+	return 0;
+}
+
+static void *
+ud_worker(void *arg)
+{
+	struct ud_worker *w = (struct ud_worker *)arg;
+	unsigned int i;
+
+	w->ret = 1;
+	w->nc = opts.range;
+	w->c = (struct ud_client *)calloc(w->nc, sizeof(*w->c));
+	if (w->c == NULL) {
+		perror("calloc ud_client");
+		__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+		return NULL;
+	}
+	for (i = 0; i < w->nc; i++) {
+		if (ud_cli_connect(w, i) != 0) {
+			break;
+		}
+	}
+
+	__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+	if (i == w->nc) {
+		rpp_wait_until(&go, 1);
+		w->ret = ud_run(w);
+	}
+
+	ud_cli_close(w);
+
+	return NULL;
+}
+
+int
+rpp_ud_client(struct sockaddr *addr)
+{
+	struct ud_worker *w;
+	struct rpp_lat lat;
+	uint64_t ops = 0, retrans = 0, stale = 0;
+	double rate = 0;
+	size_t msg_size = 0;
+	unsigned int i;
+	int ret = 0;
+
+	if (opts.threads == 0 || opts.depth == 0 || opts.range == 0) {
+		fprintf(stderr, "ud: threads, depth and clients must be > 0\n");
+		return 1;
+	}
+
+	w = (struct ud_worker *)calloc(opts.threads, sizeof(*w));
+	if (w == NULL) {
+		perror("calloc ud_worker");
+		return 1;
+	}
+
+	for (i = 0; i < opts.threads; i++) {
+		w[i].index = i;
+		w[i].addr = addr;
+		if (rpp_lat_init(&w[i].lat, opts.count) != 0) {
+			ret = 1;
+			break;
+		}
+		if (pthread_create(&w[i].th, NULL, ud_worker, &w[i]) != 0) {
+			perror("pthread_create");
+			rpp_lat_free(&w[i].lat);
+			ret = 1;
+			break;
+		}
+	}
+	opts.threads = i;
+	nstarted = i;
+
+	rpp_wait_until(&ready, nstarted);
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+
+	rpp_lat_init(&lat, 0);
+	for (i = 0; i < opts.threads; i++) {
+		pthread_join(w[i].th, NULL);
+		if (w[i].ret != 0) {
+			ret = 1;
+		} else if (w[i].end > w[i].start) {
+			rate += w[i].ops / ((w[i].end - w[i].start) / 1e9);
+		}
+		if (w[i].msg_size > 0) {
+			msg_size = w[i].msg_size;
+		}
+		ops += w[i].ops;
+		retrans += w[i].retrans;
+		stale += w[i].stale;
+		rpp_lat_merge(&lat, &w[i].lat);
+		rpp_lat_free(&w[i].lat);
+	}
+
+	printf("ud: threads %u, clients %u, depth %u, %zu bytes: "
+		"%lu ops, %.3f Mops/s\n", opts.threads,
+		opts.threads * opts.range, opts.depth, msg_size, ops,
+		rate / 1e6);
+	rpp_lat_report("latency", &lat);
+	printf("retransmits: %lu, stale responses: %lu\n", retrans, stale);
+
+	rpp_lat_free(&lat);
+	free(w);
+
+	return ret;
+}
@@ -0,0 +1,679 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include "rpp_h.h"
+#include "rpp_bench.h"
+
+/* workload mode: traffic described by a file (-w).
+ *
+ * 	# op weight [size]	sizes in bytes
+ * 	read 50 uniform 64 4096
+ * 	write 30 fixed 4096
+ * 	send 10 exp 128
+ * 	faa 5
+ * 	cas 5
+ * 	think exp 20		usec between ops (closed loop)
+ * 	rate 100000		ops/s of all threads (open loop)
+ * 	duration 10		sec
+ *
+ * a size or think time is "fixed N", "uniform MIN MAX" or "exp MEAN".
+ * the server exports one region (RPP_WL_REGION) with remote read,
+ * write and atomic access, read/write/faa/cas go to random offsets of
+ * it; a send is a message the server echoes. each of -T threads has
+ * its own connection and one operation at a time. a thread stops after
+ * -n operations or the duration.
+ *
+ * without rate the loop is closed: the next operation starts when the
+ * last one (and the think time) is over. with rate the operations
+ * arrive in a Poisson process whether the last one is over or not. a
+ * thread behind its schedule issues at once, and the latency from the
+ * scheduled arrival is reported too ("corrected"): the latency of an
+ * operation waiting for a slow one is not omitted.
+ */
+
+#define RPP_WL_LINE 256
+
+enum wl_kind {
+	WL_READ,
+	WL_WRITE,
+	WL_SEND,
+	WL_FAA,
+	WL_CAS,
+	WL_NR
+};
+
+static const char *wl_name[WL_NR] = {
+	[WL_READ] = "read",
+	[WL_WRITE] = "write",
+	[WL_SEND] = "send",
+	[WL_FAA] = "faa",
+	[WL_CAS] = "cas",
+};
+
+enum wl_dist_type {
+	WL_D_FIXED,
+	WL_D_UNIFORM,
+	WL_D_EXP,
+};
+
+struct wl_dist {
+	int type;
+	double a;
+	double b;
+};
+
+struct wl_spec {
+	unsigned int weight[WL_NR];
+	unsigned int total;
+	struct wl_dist size[WL_NR];
+	struct wl_dist think;	/* usec */
+	double rate;		/* ops/s, 0: closed loop */
+	double duration;	/* sec, 0: -n only */
+};
+
+enum wl_op {
+	WL_OP_SEND = 1,
+	WL_OP_CLOSE,
+};
+
+struct wl_msg {
+	uint32_t op;
+	uint32_t len;
+	uint64_t seq;
+};
+
+static char *region;
+static struct ibv_mr *region_mr;
+static pthread_mutex_t region_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int
+wl_export(struct rdma_cm_id *id)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&region_lock);
+	if (region_mr != NULL) {
+		goto out;
+	}
+	if (posix_memalign((void **)&region, 64, RPP_WL_REGION) != 0) {
+		perror("posix_memalign workload region");
+		ret = 1;
+		goto out;
+	}
+	memset(region, 0, RPP_WL_REGION);
+
+	DEBUG_LOG("ibv_reg_mr workload region\n");
+	region_mr = ibv_reg_mr(id->pd, region, RPP_WL_REGION,
+		IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ |
+		IBV_ACCESS_REMOTE_WRITE | IBV_ACCESS_REMOTE_ATOMIC);
+	if (region_mr == NULL) {
+		perror("ibv_reg_mr workload region");
+		free(region);
+		region = NULL;
+		ret = 1;
+	} else {
+		rpp_stat_mr(1);
+	}
+out:
+	pthread_mutex_unlock(&region_lock);
+
+	return ret;
+}
+
+int
+rpp_workload_server(struct rdma_cm_id *id)
+{
+	struct rpp_context *ct = id->context;
+	struct wl_msg msg;
+	int ret;
+
+	ret = wl_export(id);
+	if (ret != 0) {
+		return ret;
+	}
+	/* NOTE: rdma_cm allocates one PD per device. */
+	if (region_mr->pd != id->pd) {
+		fprintf(stderr, "workload: region is on another device\n");
+		return 1;
+	}
+
+	ct->send_buf.buf = (uint64_t)region;
+	ct->send_buf.rkey = region_mr->rkey;
+	ct->send_buf.size = RPP_WL_REGION;
+	ret = rpp_rdma_send(id);
+	if (ret != 0) {
+		return ret;
+	}
+
+	/* echo sends until close */
+	for (;;) {
+		ret = rpp_recv_msg(id, &msg, sizeof(msg));
+		if (ret != 0) {
+			return ret;
+		}
+		if (msg.op != WL_OP_SEND) {
+			break;
+		}
+		ret = rpp_send_msg(id, &msg, sizeof(msg));
+		if (ret != 0) {
+			return ret;
+		}
+	}
+
+	return 0;
+}
+
+/* end the session of the workload server. autotune uses it too. */
+int
+rpp_workload_close(struct rdma_cm_id *id)
+{
+	struct wl_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.op = WL_OP_CLOSE;
+
+	return rpp_send_msg(id, &msg, sizeof(msg));
+}
+
+/* "fixed N", "uniform MIN MAX" or "exp MEAN", type is the first word */
+static int
+wl_parse_dist(char *type, char **save, struct wl_dist *d)
+{
+	char *a, *b = NULL;
+
+	a = strtok_r(NULL, " \t\n", save);
+	if (type == NULL || a == NULL) {
+		return 1;
+	}
+	if (strcmp(type, "fixed") == 0) {
+		d->type = WL_D_FIXED;
+	} else if (strcmp(type, "uniform") == 0) {
+		d->type = WL_D_UNIFORM;
+		b = strtok_r(NULL, " \t\n", save);
+		if (b == NULL) {
+			return 1;
+		}
+	} else if (strcmp(type, "exp") == 0) {
+		d->type = WL_D_EXP;
+	} else {
+		return 1;
+	}
+	d->a = strtod(a, NULL);
+	d->b = b ? strtod(b, NULL) : d->a;
+
+	return d->a < 0 || d->b < d->a;
+}
+
+static int
+wl_parse(const char *path, struct wl_spec *spec)
+{
+	char line[RPP_WL_LINE];
+	char *p, *key, *save;
+	FILE *fp;
+	int k, n = 0, ret = 0;
+
+	memset(spec, 0, sizeof(*spec));
+	for (k = 0; k < WL_NR; k++) {
+		spec->size[k].type = WL_D_FIXED;
+		spec->size[k].a = spec->size[k].b =
+			k >= WL_FAA ? sizeof(uint64_t) :
+			opts.size ? opts.size : DATA_SIZE;
+	}
+
+	fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror(path);
+		return 1;
+	}
+	while (ret == 0 && fgets(line, sizeof(line), fp) != NULL) {
+		n++;
+		p = strchr(line, '#');
+		if (p != NULL) {
+			*p = '\0';
+		}
+		key = strtok_r(line, " \t\n", &save);
+		if (key == NULL) {
+			continue;
+		}
+		for (k = 0; k < WL_NR; k++) {
+			if (strcmp(key, wl_name[k]) == 0) {
+				break;
+			}
+		}
+		if (k < WL_NR) {
+			p = strtok_r(NULL, " \t\n", &save);
+			if (p == NULL) {
+				ret = 1;
+				break;
+			}
+			spec->weight[k] = strtoul(p, NULL, 0);
+			p = strtok_r(NULL, " \t\n", &save);
+			/* NOTE: atomics are 8 bytes */
+			if (p != NULL) {
+				ret = k >= WL_FAA ||
+					wl_parse_dist(p, &save, &spec->size[k]);
+			}
+		} else if (strcmp(key, "think") == 0) {
+			p = strtok_r(NULL, " \t\n", &save);
+			ret = wl_parse_dist(p, &save, &spec->think);
+		} else if (strcmp(key, "rate") == 0 &&
+			   (p = strtok_r(NULL, " \t\n", &save)) != NULL) {
+			spec->rate = strtod(p, NULL);
+		} else if (strcmp(key, "duration") == 0 &&
+			   (p = strtok_r(NULL, " \t\n", &save)) != NULL) {
+			spec->duration = strtod(p, NULL);
+		} else {
+			ret = 1;
+		}
+	}
+	fclose(fp);
+	if (ret != 0) {
+		fprintf(stderr, "workload: %s:%d: bad line\n", path, n);
+		return 1;
+	}
+
+	for (k = 0; k < WL_NR; k++) {
+		spec->total += spec->weight[k];
+	}
+	if (spec->total == 0) {
+		fprintf(stderr, "workload: %s: no operations\n", path);
+		return 1;
+	}
+	if (spec->size[WL_READ].b > RPP_WL_REGION ||
+	    spec->size[WL_WRITE].b > RPP_WL_REGION) {
+		fprintf(stderr, "workload: read/write size > %lu\n",
+			RPP_WL_REGION);
+		return 1;
+	}
+
+	return 0;
+}
+
+/* uniform in [0, 1) */
+static inline double
+wl_rand(uint64_t *seed)
+{
+	return (rpp_xorshift64(seed) >> 11) * (1.0 / (1ULL << 53));
+}
+
+static double
+wl_sample(struct wl_dist *d, uint64_t *seed)
+{
+	switch (d->type) {
+	case WL_D_UNIFORM:
+		return d->a + (d->b - d->a) * wl_rand(seed);
+	case WL_D_EXP:
+		return -d->a * log(1.0 - wl_rand(seed));
+	default:
+		return d->a;
+	}
+}
+
+struct wl_worker {
+	pthread_t th;
+	unsigned int index;
+	struct sockaddr *addr;
+	struct rpp_lat lat[WL_NR];	/* service time */
+	struct rpp_lat corr;		/* from the scheduled arrival */
+	uint64_t ops[WL_NR];
+	uint64_t bytes[WL_NR];
+	uint64_t start;
+	uint64_t end;
+	int ret;
+};
+
+static struct wl_spec spec;
+static unsigned int nstarted;
+static unsigned int ready;
+static unsigned int go;
+
+/* one operation of kind k. waits for its completion. */
+static int
+wl_op(struct rdma_cm_id *id, struct ibv_mr *mr, char *local,
+	struct rpp_rdma_info *info, int k, uint32_t size, uint64_t off,
+	uint64_t seq)
+{
+	struct rpp_context *ct = id->context;
+	struct ibv_sge sge;
+	struct ibv_send_wr wr, *bad;
+	struct wl_msg *msg;
+
+	switch (k) {
+	case WL_READ:
+		if (rdma_post_read(id, NULL, local, size, mr, 0,
+				info->buf + off, info->rkey) != 0) {
+			perror("rdma_post_read");
+			return 1;
+		}
+		return rpp_poll_send_comp(id, 1);
+	case WL_WRITE:
+		if (rdma_post_write(id, NULL, local, size, mr, 0,
+				info->buf + off, info->rkey) != 0) {
+			perror("rdma_post_write");
+			return 1;
+		}
+		return rpp_poll_send_comp(id, 1);
+	case WL_SEND:
+		msg = (struct wl_msg *)ct->send_msg;
+		msg->op = WL_OP_SEND;
+		msg->len = size;
+		msg->seq = seq;
+		if (rpp_send_msg(id, NULL, size) != 0) {
+			return 1;
+		}
+		return rpp_recv_msg(id, NULL, 0);
+	}
+
+	/* NOTE: rdma_verbs.h has no helper for atomics */
+	sge.addr = (uint64_t)(uintptr_t)local;
+	sge.length = sizeof(uint64_t);
+	sge.lkey = mr->lkey;
+	memset(&wr, 0, sizeof(wr));
+	wr.sg_list = &sge;
+	wr.num_sge = 1;
+	wr.send_flags = IBV_SEND_SIGNALED;
+	wr.wr.atomic.remote_addr = info->buf + off;
+	wr.wr.atomic.rkey = info->rkey;
+	if (k == WL_CAS) {
+		wr.opcode = IBV_WR_ATOMIC_CMP_AND_SWP;
+		wr.wr.atomic.compare_add = *(uint64_t *)local;
+		wr.wr.atomic.swap = *(uint64_t *)local + 1;
+	} else {
+		wr.opcode = IBV_WR_ATOMIC_FETCH_AND_ADD;
+		wr.wr.atomic.compare_add = 1;
+	}
+	if (ibv_post_send(id->qp, &wr, &bad) != 0) {
+		perror("ibv_post_send atomic");
+		return 1;
+	}
+
+	return rpp_poll_send_comp(id, 1);
+}
+
+/* pick the kind of the next operation by the weights */
+static int
+wl_pick(uint64_t *seed)
+{
+	unsigned int r = rpp_xorshift64(seed) % spec.total;
+	int k;
+
+	for (k = 0; k < WL_NR - 1; k++) {
+		if (r < spec.weight[k]) {
+			break;
+		}
+		r -= spec.weight[k];
+	}
+
+	return k;
+}
+
+static uint32_t
+wl_size(int k, uint64_t *seed)
+{
+	double s;
+
+	if (k >= WL_FAA) {
+		return sizeof(uint64_t);
+	}
+	s = wl_sample(&spec.size[k], seed);
+	if (k == WL_SEND) {
+		if (s < sizeof(struct wl_msg)) {
+			s = sizeof(struct wl_msg);
+		} else if (s > RPP_MSG_SIZE) {
+			s = RPP_MSG_SIZE;
+		}
+	} else if (s < 1) {
+		s = 1;
+	} else if (s > RPP_WL_REGION) {
+		s = RPP_WL_REGION;
+	}
+
+	return (uint32_t)s;
+}
+
+static void
+wl_wait(uint64_t until)
+{
+	uint64_t now;
+
+	while ((now = rpp_stat_now()) < until) {
+		/* NOTE: sleep only for long waits, usleep overshoots */
+		if (until - now > 200000) {
+			usleep((until - now - 100000) / 1000);
+		}
+	}
+}
+
+static void *
+wl_worker(void *arg)
+{
+	struct wl_worker *w = (struct wl_worker *)arg;
+	struct rdma_cm_id *id;
+	struct rpp_rdma_info info;
+	struct ibv_mr *mr = NULL;
+	char *local = NULL;
+	uint64_t seed = 0x9e3779b97f4a7c15ULL * (w->index + 1);
+	uint64_t i, t, sched, deadline = UINT64_MAX, off;
+	double gap = 0;
+	uint32_t size;
+	int k;
+
+	w->ret = 1;
+	id = rpp_client_connect(w->addr, RPP_MODE_WORKLOAD, 2, 2);
+	if (id == NULL) {
+		goto out;
+	}
+	if (rpp_recv_msg(id, &info, sizeof(info)) != 0) {
+		goto close;
+	}
+	if (posix_memalign((void **)&local, 64, RPP_WL_REGION) != 0) {
+		perror("posix_memalign workload");
+		local = NULL;
+		goto close;
+	}
+	memset(local, 'w', RPP_WL_REGION);
+	DEBUG_LOG("rdma_reg_msgs workload local\n");
+	mr = rdma_reg_msgs(id, local, RPP_WL_REGION);
+	if (mr == NULL) {
+		perror("rdma_reg_msgs workload local");
+		goto close;
+	}
+
+	__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+	rpp_wait_until(&go, 1);
+
+	if (spec.rate > 0) {
+		/* nsec between arrivals of this thread */
+		gap = 1e9 * opts.threads / spec.rate;
+	}
+	w->start = sched = rpp_stat_now();
+	if (spec.duration > 0) {
+		deadline = w->start + (uint64_t)(spec.duration * 1e9);
+	}
+	for (i = 0; i < opts.count; i++) {
+		if (spec.rate > 0) {
+			sched += (uint64_t)(-gap * log(1.0 - wl_rand(&seed)));
+			wl_wait(sched);
+		} else if (spec.think.a > 0) {
+			wl_wait(rpp_stat_now() +
+				(uint64_t)(wl_sample(&spec.think, &seed) *
+					1000));
+		}
+		t = rpp_stat_now();
+		if (t >= deadline) {
+			break;
+		}
+		if (spec.rate == 0) {
+			sched = t;
+		}
+
+		k = wl_pick(&seed);
+		size = wl_size(k, &seed);
+		off = rpp_xorshift64(&seed) % (RPP_WL_REGION - size + 1);
+		off &= k >= WL_FAA ? ~(uint64_t)7 : ~(uint64_t)63;
+		if (wl_op(id, mr, local, &info, k, size, off, i) != 0) {
+			fprintf(stderr, "workload: %s failed\n", wl_name[k]);
+			goto close;
+		}
+		rpp_lat_add(&w->lat[k], rpp_stat_now() - t);
+		rpp_lat_add(&w->corr, rpp_stat_now() - sched);
+		w->ops[k]++;
+		w->bytes[k] += size;
+	}
+	w->end = rpp_stat_now();
+	w->ret = 0;
+
+close:
+	if (rpp_workload_close(id) != 0) {
+		w->ret = 1;
+	}
+	if (mr != NULL) {
+		rdma_dereg_mr(mr);
+	}
+	rpp_client_close(id);
+out:
+	if (w->start == 0) {
+		/* NOTE: not ready yet, do not hold the others */
+		__atomic_add_fetch(&ready, 1, __ATOMIC_RELEASE);
+	}
+	free(local);
+
+	return NULL;
+}
+
+static void
+wl_lat_free(struct wl_worker *w)
+{
+	int k;
+
+	for (k = 0; k < WL_NR; k++) {
+		rpp_lat_free(&w->lat[k]);
+	}
+	rpp_lat_free(&w->corr);
+}
+
+int
+rpp_workload_client(struct sockaddr *addr)
+{
+	struct wl_worker *w;
+	struct rpp_lat lat[WL_NR], corr;
+	uint64_t ops[WL_NR] = {0}, bytes[WL_NR] = {0}, total = 0;
+	uint64_t start = UINT64_MAX, end = 0;
+	double sec;
+	unsigned int i;
+	int k, ret = 0;
+
+	if (opts.workload == NULL) {
+		fprintf(stderr, "workload: -w workload-file is needed\n");
+		return 1;
+	}
+	if (opts.threads == 0) {
+		fprintf(stderr, "workload: threads must be > 0\n");
+		return 1;
+	}
+	if (wl_parse(opts.workload, &spec) != 0) {
+		return 1;
+	}
+
+	w = (struct wl_worker *)calloc(opts.threads, sizeof(*w));
+	if (w == NULL) {
+		perror("calloc wl_worker");
+		return 1;
+	}
+
+	for (i = 0; i < opts.threads; i++) {
+		w[i].index = i;
+		w[i].addr = addr;
+		for (k = 0; k < WL_NR; k++) {
+			if (spec.weight[k] > 0 &&
+			    rpp_lat_init(&w[i].lat[k], opts.count) != 0) {
+				break;
+			}
+		}
+		if (k < WL_NR || rpp_lat_init(&w[i].corr, opts.count) != 0) {
+			wl_lat_free(&w[i]);
+			ret = 1;
+			break;
+		}
+		if (pthread_create(&w[i].th, NULL, wl_worker, &w[i]) != 0) {
+			perror("pthread_create");
+			wl_lat_free(&w[i]);
+			ret = 1;
+			break;
+		}
+	}
+	opts.threads = i;
+	nstarted = i;
+
+	rpp_wait_until(&ready, nstarted);
+	__atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+
+	for (k = 0; k < WL_NR; k++) {
+		rpp_lat_init(&lat[k], 0);
+	}
+	rpp_lat_init(&corr, 0);
+	for (i = 0; i < opts.threads; i++) {
+		pthread_join(w[i].th, NULL);
+		if (w[i].ret != 0) {
+			ret = 1;
+			continue;
+		}
+		if (w[i].start < start) {
+			start = w[i].start;
+		}
+		if (w[i].end > end) {
+			end = w[i].end;
+		}
+		for (k = 0; k < WL_NR; k++) {
+			ops[k] += w[i].ops[k];
+			bytes[k] += w[i].bytes[k];
+			rpp_lat_merge(&lat[k], &w[i].lat[k]);
+		}
+		rpp_lat_merge(&corr, &w[i].corr);
+	}
+	for (i = 0; i < nstarted; i++) {
+		wl_lat_free(&w[i]);
+	}
+
+	sec = end > start ? (end - start) / 1e9 : 0;
+	for (k = 0; k < WL_NR; k++) {
+		total += ops[k];
+	}
+	printf("workload %s: threads %u, %s loop", opts.workload,
+		opts.threads, spec.rate > 0 ? "open" : "closed");
+	if (spec.rate > 0) {
+		printf(" %.0f ops/s", spec.rate);
+	}
+	printf(": %lu ops in %.2f sec, %.1f Kops/s\n", total, sec,
+		sec > 0 ? total / sec / 1e3 : 0);
+	for (k = 0; k < WL_NR; k++) {
+		if (ops[k] == 0) {
+			continue;
+		}
+		printf("%s: %lu ops, %.2f MB/s\n", wl_name[k], ops[k],
+			sec > 0 ? bytes[k] / sec / 1e6 : 0);
+		rpp_lat_report(wl_name[k], &lat[k]);
+	}
+	/* NOTE: the same as the service time in a closed loop */
+	if (spec.rate > 0) {
+		rpp_lat_report("corrected", &corr);
+	}
+
+	for (k = 0; k < WL_NR; k++) {
+		rpp_lat_free(&lat[k]);
+	}
+	rpp_lat_free(&corr);
+	free(w);
+
+	return ret;
+}
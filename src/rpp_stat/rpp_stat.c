@@ -0,0 +1,155 @@
+/* SPDX-License-Identifier: GPLv2
+ * Copyright(c) 2020 Itsuro Oda
+ */
+
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rpp_stat.h"
+
+/* rpp_stat: show statistics of a running rpp_h server.
+ *
+ * reads the shared memory segment created by rpp_h -s. it never
+ * writes to the segment, so polling does not disturb the server.
+ */
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: rpp_stat [-i interval] [-n count] [-p] "
+		"[shm-name]\n");
+}
+
+static double
+usec(uint64_t ns)
+{
+	return ns / 1000.0;
+}
+
+static void
+print_header(void)
+{
+	printf("%7s %7s %8s %8s %8s %8s %9s %9s %9s %9s %8s %8s %8s %8s "
+		"%8s\n",
+		"active", "mrs", "sess/s", "rej/s", "acc_err", "ses_err",
+		"rd_MB/s", "wr_MB/s",
+		"rd_op/s", "wr_op/s", "acc_p99", "rd_p50", "rd_p99",
+		"wr_p99", "ses_p99");
+}
+
+static void
+print_delta(struct rpp_stat_sum *cur, struct rpp_stat_sum *prev,
+	double sec)
+{
+	uint64_t d[RPP_ST_NR];
+	uint64_t h[RPP_LT_NR][RPP_STAT_BUCKETS];
+	int i, b;
+
+	for (i = 0; i < RPP_ST_NR; i++) {
+		d[i] = cur->ctr[i] - prev->ctr[i];
+	}
+	for (i = 0; i < RPP_LT_NR; i++) {
+		for (b = 0; b < RPP_STAT_BUCKETS; b++) {
+			h[i][b] = cur->hist[i][b] - prev->hist[i][b];
+		}
+	}
+
+	printf("%7lu %7lu %8.1f %8.1f %8lu %8lu %9.2f %9.2f %9.0f %9.0f "
+		"%8.1f %8.1f %8.1f %8.1f %8.1f\n",
+		cur->active,
+		cur->mrs,
+		d[RPP_ST_SESSIONS] / sec,
+		d[RPP_ST_REJECTS] / sec,
+		d[RPP_ST_ACCEPT_FAIL],
+		d[RPP_ST_SESSION_FAIL],
+		d[RPP_ST_READ_BYTES] / sec / 1e6,
+		d[RPP_ST_WRITE_BYTES] / sec / 1e6,
+		d[RPP_ST_READ_OPS] / sec,
+		d[RPP_ST_WRITE_OPS] / sec,
+		usec(rpp_stat_pct(h[RPP_LT_ACCEPT], 99)),
+		usec(rpp_stat_pct(h[RPP_LT_READ], 50)),
+		usec(rpp_stat_pct(h[RPP_LT_READ], 99)),
+		usec(rpp_stat_pct(h[RPP_LT_WRITE], 99)),
+		usec(rpp_stat_pct(h[RPP_LT_SESSION], 99)));
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+	const char *name = RPP_STAT_SHM;
+	struct rpp_stat_shm *shm;
+	struct rpp_stat_sum cur, prev;
+	unsigned int interval = 1;
+	long count = -1;
+	int prom = 0;
+	double sec;
+	int n;
+
+	while ((opt = getopt(argc, argv, "i:n:p")) != -1) {
+		switch (opt) {
+		case 'i':
+			interval = strtoul(optarg, NULL, 0);
+			if (interval == 0) {
+				interval = 1;
+			}
+			break;
+		case 'n':
+			count = strtol(optarg, NULL, 0);
+			break;
+		case 'p':
+			prom = 1;
+			break;
+		default:
+			usage();
+			return 1;
+		}
+	}
+
+	if (optind < argc - 1) {
+		usage();
+		return 1;
+	}
+	if (optind == argc - 1) {
+		name = argv[optind];
+	}
+
+	shm = rpp_stat_open(name);
+	if (shm == NULL) {
+		return 1;
+	}
+
+	rpp_stat_sum(shm, &cur);
+	if (prom) {
+		rpp_stat_prom(&cur, stdout);
+		return 0;
+	}
+
+	/* first line: average since the server started */
+	memset(&prev, 0, sizeof(prev));
+	sec = difftime(time(NULL), (time_t)shm->start_time);
+	if (sec < 1) {
+		sec = 1;
+	}
+	printf("rpp_h pid %d, %s\n", shm->pid, name);
+	print_header();
+	for (n = 0; count < 0 || n < count; n++) {
+		if (n > 0) {
+			sleep(interval);
+			prev = cur;
+			rpp_stat_sum(shm, &cur);
+			sec = interval;
+		}
+		if (n > 0 && n % 20 == 0) {
+			print_header();
+		}
+		print_delta(&cur, &prev, sec);
+	}
+
+	return 0;
+}